@@ -0,0 +1,647 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <malloc.h>
+#include <linux/kernel.h>
+#include <linux/log2.h>
+#include <monitor.h>
+#include <tep.h>
+
+/*
+ * bench: replay synthetic samples through a target profiler.
+ *
+ * The target is opened as a child device, so it builds its evlist, filters,
+ * order heap and output exactly as it would from the command line. Once it is
+ * enabled, its kernel events are disabled again, and bench generates samples
+ * that match the attr of each of its sampling evsels: sample_type layout, id,
+ * and the tracepoint raw layout from the tep format.
+ *
+ *   timer(10ms) -> ring 0..n -> [order_stream()] -> target->sample()
+ *
+ * Each instance owns a ring of fixed-size slots. With --order, the rings are
+ * registered as order streams, see order_register(). Otherwise, the rings are
+ * drained round-robin into perf_event_process_record(). Only the delivery is
+ * timed, the generation is not.
+ */
+
+#define BENCH_TICK_NS (10 * NSEC_PER_MSEC)
+#define BENCH_MAX_BATCH 8192
+#define BENCH_NR_KEYS 1024
+#define BENCH_STRING "bench"
+#define BENCH_SAMPLE_TYPE (PERF_SAMPLE_IDENTIFIER | PERF_SAMPLE_IP | PERF_SAMPLE_TID | PERF_SAMPLE_TIME | \
+                           PERF_SAMPLE_ADDR | PERF_SAMPLE_ID | PERF_SAMPLE_STREAM_ID | PERF_SAMPLE_CPU | \
+                           PERF_SAMPLE_PERIOD | PERF_SAMPLE_CALLCHAIN | PERF_SAMPLE_RAW)
+
+struct bench_field {
+    int offset;
+    int size;
+};
+
+struct bench_evsel {
+    struct perf_evsel *evsel;
+    u64 sample_type;
+    u64 period;
+    u64 *ids; // per instance
+    int size; // event size
+    // PERF_SAMPLE_RAW
+    u32 raw_size;
+    void *raw; // template
+    int pid_offset;
+    int nr_fields;
+    struct bench_field *fields; // randomized numeric fields
+};
+
+struct bench_ring {
+    char *buf;
+    u64 mask;
+    u64 head;
+    u64 tail;
+    u64 snap_head;
+    u32 consume; // The slot returned by read_event() is consumed on the next read.
+    u32 slot_size;
+    u64 last_time;
+    u64 counter;
+    bool registered;
+    int ins;
+    int cpu;
+    int tid;
+};
+
+struct bench_stat {
+    u64 events;
+    u64 ns;
+};
+
+struct bench_ctx {
+    struct prof_dev *dev;
+    struct prof_dev *target;
+    int nr_ins;
+    bool oncpu;
+    bool order;
+    int nr_cpus;
+    int nr_evsels;
+    struct bench_evsel *evsels;
+    struct bench_ring *rings;
+    u32 slot_size;
+    u64 nr_slots;
+    u64 period;
+    u64 jitter;
+    u64 time; // The nominal time of the next sample.
+    u64 seed;
+    struct timer timer;
+    struct bench_stat interval, total;
+    size_t heap_start;
+};
+
+static inline u64 bench_rand(struct bench_ctx *ctx)
+{
+    // xorshift64
+    u64 x = ctx->seed;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return ctx->seed = x;
+}
+
+static u64 bench_clock(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static size_t bench_heap(void)
+{
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2, 33)
+    return mallinfo2().uordblks;
+#else
+    return 0;
+#endif
+}
+
+static unsigned long bench_rss_kb(void)
+{
+    unsigned long size, rss = 0;
+    FILE *fp = fopen("/proc/self/statm", "r");
+
+    if (fp) {
+        if (fscanf(fp, "%lu %lu", &size, &rss) != 2)
+            rss = 0;
+        fclose(fp);
+    }
+    return rss * (sysconf(_SC_PAGE_SIZE) / 1024);
+}
+
+static int bench_raw_init(struct bench_ctx *ctx, struct bench_evsel *be, struct perf_event_attr *attr)
+{
+    struct tep_handle *tep;
+    struct tep_event *event;
+    struct tep_format_field **fields;
+    int size, dyn, nr = 0, i;
+    int err = -1;
+
+    if (attr->type != PERF_TYPE_TRACEPOINT) {
+        // Non-tracepoint events carry an empty raw.
+        be->raw_size = sizeof(u32);
+        be->raw = zalloc(be->raw_size);
+        be->pid_offset = -1;
+        return be->raw ? 0 : -1;
+    }
+
+    tep = tep__ref();
+    event = tep_find_event(tep, attr->config);
+    if (!event) {
+        fprintf(stderr, "bench: tracepoint %llu has no format\n", attr->config);
+        goto out;
+    }
+    fields = tep_event_fields(event);
+    if (!fields)
+        goto out;
+
+    size = tep__event_size(attr->config);
+    for (i = 0; fields[i]; i++)
+        if (fields[i]->flags & TEP_FIELD_IS_DYNAMIC)
+            nr++;
+    dyn = size;
+    size += nr * sizeof(BENCH_STRING);
+
+    be->raw_size = ALIGN(size + sizeof(u32), sizeof(u64)) - sizeof(u32);
+    be->raw = zalloc(be->raw_size);
+    be->fields = calloc(i, sizeof(*be->fields));
+    if (!be->raw || !be->fields)
+        goto free_fields;
+
+    *(u16 *)be->raw = attr->config; // common_type
+    be->pid_offset = -1;
+    for (i = 0; fields[i]; i++) {
+        struct tep_format_field *field = fields[i];
+        void *ptr = be->raw + field->offset;
+
+        if (field->flags & TEP_FIELD_IS_DYNAMIC) {
+            *(u32 *)ptr = (sizeof(BENCH_STRING) << 16) | dyn;
+            memcpy(be->raw + dyn, BENCH_STRING, sizeof(BENCH_STRING));
+            dyn += sizeof(BENCH_STRING);
+        } else if (field->flags & TEP_FIELD_IS_STRING)
+            strncpy(ptr, BENCH_STRING, field->size - 1);
+        else if (field->flags & TEP_FIELD_IS_ARRAY)
+            continue;
+        else if (!strcmp(field->name, "common_pid"))
+            be->pid_offset = field->offset;
+        else if (!strncmp(field->name, "common_", 7))
+            continue;
+        else if (field->size == 1 || field->size == 2 || field->size == 4 || field->size == 8) {
+            be->fields[be->nr_fields].offset = field->offset;
+            be->fields[be->nr_fields].size = field->size;
+            be->nr_fields++;
+        }
+    }
+    err = 0;
+
+free_fields:
+    free(fields);
+out:
+    tep__unref();
+    return err;
+}
+
+static int bench_evsel_init(struct bench_ctx *ctx, struct bench_evsel *be, struct perf_evsel *evsel)
+{
+    struct perf_event_attr *attr = perf_evsel__attr(evsel);
+    u64 sample_type = attr->sample_type;
+    int ins;
+
+    if (sample_type & ~BENCH_SAMPLE_TYPE) {
+        fprintf(stderr, "bench: sample_type %#lx is not supported\n", sample_type & ~BENCH_SAMPLE_TYPE);
+        return -1;
+    }
+
+    be->evsel = evsel;
+    be->sample_type = sample_type;
+    be->period = attr->freq ? 1 : attr->sample_period;
+    be->ids = calloc(ctx->nr_ins, sizeof(*be->ids));
+    if (!be->ids)
+        return -1;
+    for (ins = 0; ins < ctx->nr_ins; ins++)
+        be->ids[ins] = perf_evsel__get_id(evsel, ctx->oncpu ? ins : 0, ctx->oncpu ? 0 : ins);
+
+    if ((sample_type & PERF_SAMPLE_RAW) &&
+        bench_raw_init(ctx, be, attr) < 0)
+        return -1;
+
+    be->size = sizeof(struct perf_event_header);
+    be->size += __builtin_popcountll(sample_type & (PERF_SAMPLE_IDENTIFIER | PERF_SAMPLE_IP | PERF_SAMPLE_TID |
+                                         PERF_SAMPLE_TIME | PERF_SAMPLE_ADDR | PERF_SAMPLE_ID |
+                                         PERF_SAMPLE_STREAM_ID | PERF_SAMPLE_CPU | PERF_SAMPLE_PERIOD |
+                                         PERF_SAMPLE_CALLCHAIN)) * sizeof(u64);
+    if (sample_type & PERF_SAMPLE_RAW)
+        be->size += sizeof(u32) + be->raw_size;
+    return 0;
+}
+
+static void bench_sample(struct bench_ctx *ctx, struct bench_evsel *be, struct bench_ring *r,
+                         union perf_event *event, u64 time)
+{
+    u64 sample_type = be->sample_type;
+    __u64 *array = event->sample.array;
+    int ins = r->ins;
+    int tid = r->tid;
+    int i;
+
+    if (tid < 0)
+        tid = 1 + bench_rand(ctx) % BENCH_NR_KEYS;
+
+    event->header.type = PERF_RECORD_SAMPLE;
+    event->header.misc = PERF_RECORD_MISC_KERNEL;
+    event->header.size = be->size;
+
+    if (sample_type & PERF_SAMPLE_IDENTIFIER)
+        *array++ = be->ids[ins];
+    if (sample_type & PERF_SAMPLE_IP)
+        *array++ = 0;
+    if (sample_type & PERF_SAMPLE_TID) {
+        u32 *p = (void *)array++;
+        p[0] = tid;
+        p[1] = tid;
+    }
+    if (sample_type & PERF_SAMPLE_TIME)
+        *array++ = time;
+    if (sample_type & PERF_SAMPLE_ADDR)
+        *array++ = 0;
+    if (sample_type & PERF_SAMPLE_ID)
+        *array++ = be->ids[ins];
+    if (sample_type & PERF_SAMPLE_STREAM_ID)
+        *array++ = be->ids[ins];
+    if (sample_type & PERF_SAMPLE_CPU) {
+        u32 *p = (void *)array++;
+        p[0] = r->cpu >= 0 ? r->cpu : (int)(bench_rand(ctx) % ctx->nr_cpus);
+        p[1] = 0;
+    }
+    if (sample_type & PERF_SAMPLE_PERIOD)
+        *array++ = be->period;
+    if (sample_type & PERF_SAMPLE_CALLCHAIN)
+        *array++ = 0; // nr
+    if (sample_type & PERF_SAMPLE_RAW) {
+        u32 *p = (void *)array;
+        void *raw = (void *)(p + 1);
+
+        *p = be->raw_size;
+        memcpy(raw, be->raw, be->raw_size);
+        if (be->pid_offset >= 0)
+            *(int *)(raw + be->pid_offset) = tid;
+        for (i = 0; i < be->nr_fields; i++) {
+            void *ptr = raw + be->fields[i].offset;
+            u64 key = bench_rand(ctx) % BENCH_NR_KEYS;
+            switch (be->fields[i].size) {
+                case 1: *(u8 *)ptr = key; break;
+                case 2: *(u16 *)ptr = key; break;
+                case 4: *(u32 *)ptr = key; break;
+                case 8: *(u64 *)ptr = key; break;
+                default: break;
+            }
+        }
+    }
+}
+
+static union perf_event *bench_read_event(void *stream, bool init, int *ins, bool *writable, bool *converted)
+{
+    struct bench_ring *r = stream;
+    union perf_event *event = NULL;
+
+    r->tail += r->consume;
+    r->consume = 0;
+    if (init)
+        r->snap_head = r->head;
+
+    if (r->tail != r->snap_head) {
+        event = (void *)r->buf + (r->tail & r->mask) * r->slot_size;
+        r->consume = 1;
+        *ins = r->ins;
+        *writable = true;
+        *converted = false;
+    }
+    return event;
+}
+
+static void bench_generate(struct bench_ctx *ctx, u64 now)
+{
+    u64 n = (now - ctx->time) / ctx->period;
+    u64 k;
+    int ins;
+
+    n = min_t(u64, n, ctx->nr_slots / 2);
+    if (n == 0)
+        return;
+    // Fell behind, skip the samples that cannot be queued.
+    if (now - ctx->time > (n + 1) * ctx->period)
+        ctx->time = now - n * ctx->period;
+
+    for (ins = 0; ins < ctx->nr_ins; ins++) {
+        struct bench_ring *r = &ctx->rings[ins];
+        u64 space = ctx->nr_slots - (r->head - r->tail);
+        u64 nr = min_t(u64, n, space);
+
+        for (k = 0; k < nr; k++) {
+            struct bench_evsel *be = &ctx->evsels[(r->counter++) % ctx->nr_evsels];
+            union perf_event *event = (void *)r->buf + (r->head & r->mask) * ctx->slot_size;
+            u64 time = ctx->time + k * ctx->period;
+
+            if (ctx->jitter)
+                time += bench_rand(ctx) % ctx->jitter;
+            if (time < r->last_time)
+                time = r->last_time;
+            r->last_time = time;
+
+            bench_sample(ctx, be, r, event, time);
+            r->head++;
+        }
+    }
+    ctx->time += n * ctx->period;
+}
+
+static u64 bench_deliver(struct bench_ctx *ctx)
+{
+    struct prof_dev *target = ctx->target;
+    u64 events = 0;
+    bool more;
+    int ins;
+
+    if (ctx->order) {
+        for (ins = 0; ins < ctx->nr_ins; ins++)
+            events += ctx->rings[ins].head - ctx->rings[ins].tail;
+        order_stream(target);
+        // Events left in the rings, or still in the heap, are delivered later.
+        for (ins = 0; ins < ctx->nr_ins; ins++)
+            events -= ctx->rings[ins].head - ctx->rings[ins].tail;
+        return events;
+    }
+
+    do {
+        more = false;
+        for (ins = 0; ins < ctx->nr_ins; ins++) {
+            struct bench_ring *r = &ctx->rings[ins];
+            union perf_event *event;
+
+            if (r->tail == r->head)
+                continue;
+            event = (void *)r->buf + (r->tail & r->mask) * ctx->slot_size;
+            perf_event_process_record(target, event, ins, true, false);
+            r->tail++;
+            events++;
+            more = true;
+        }
+    } while (more && prof_dev_enabled(target));
+    return events;
+}
+
+static void bench_tick(struct timer *timer)
+{
+    struct bench_ctx *ctx = container_of(timer, struct bench_ctx, timer);
+    struct prof_dev *target = ctx->target;
+    u64 start, end, events;
+
+    // The target closed itself, e.g. -N.
+    if (target->state == PROF_DEV_STATE_EXIT) {
+        prof_dev_close(ctx->dev);
+        return;
+    }
+    if (!prof_dev_enabled(target))
+        return;
+
+    bench_generate(ctx, bench_clock());
+
+    start = bench_clock();
+    events = bench_deliver(ctx);
+    end = bench_clock();
+
+    ctx->interval.events += events;
+    ctx->interval.ns += end - start;
+}
+
+static void bench_print(struct bench_ctx *ctx, struct bench_stat *stat, const char *name)
+{
+    size_t heap = bench_heap();
+    s64 delta = (s64)heap - (s64)ctx->heap_start;
+
+    printf("%s: %lu events %.1f ns/event %.0f events/s heap %+ld bytes %.3f bytes/event rss %lu KB\n", name,
+        stat->events, stat->events ? (double)stat->ns / stat->events : 0.0,
+        stat->ns ? (double)stat->events * NSEC_PER_SEC / stat->ns : 0.0,
+        delta, stat->events ? (double)delta / stat->events : 0.0, bench_rss_kb());
+}
+
+static void bench_exit(struct prof_dev *dev);
+
+static int bench_target_open(struct prof_dev *dev)
+{
+    struct bench_ctx *ctx = dev->private;
+    struct env *env = dev->env, *e;
+    profiler *prof;
+    char *s, *name;
+    int len;
+
+    if (!env->event) {
+        fprintf(stderr, "bench: -e 'profiler [option...]' is required\n");
+        return -1;
+    }
+
+    s = strdup(env->event);
+    if (!s)
+        return -1;
+    len = strcspn(s, " ");
+    name = strndup(s, len);
+    prof = name ? monitor_find(name) : NULL;
+    if (!prof || prof == dev->prof) {
+        fprintf(stderr, "bench: profiler %s not found\n", name ? : s);
+        goto failed;
+    }
+
+    e = parse_string_options(s);
+    if (!e)
+        goto failed;
+    ctx->target = prof_dev_open_cpu_thread_map(prof, e, dev->cpus, dev->threads, dev);
+    if (!ctx->target)
+        goto failed;
+    prof_dev_get(ctx->target);
+
+    free(name);
+    free(s);
+    return 0;
+
+failed:
+    free(name);
+    free(s);
+    return -1;
+}
+
+static int bench_init(struct prof_dev *dev)
+{
+    struct env *env = dev->env;
+    struct bench_ctx *ctx;
+    struct perf_evsel *evsel;
+    u64 batch;
+    int ins, i;
+
+    ctx = zalloc(sizeof(*ctx));
+    if (!ctx)
+        return -1;
+    dev->private = ctx;
+    ctx->dev = dev;
+
+    if (bench_target_open(dev) < 0)
+        goto failed;
+
+    ctx->nr_ins = prof_dev_nr_ins(ctx->target);
+    ctx->oncpu = prof_dev_ins_oncpu(ctx->target);
+    ctx->order = using_order(ctx->target);
+    ctx->nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    ctx->period = env->sample_period ? : 10 * NSEC_PER_USEC;
+    ctx->jitter = env->jitter;
+    ctx->seed = bench_clock() | 1;
+
+    perf_evlist__for_each_evsel(ctx->target->evlist, evsel)
+        if (perf_evsel__attr(evsel)->sample_period)
+            ctx->nr_evsels++;
+    if (!ctx->nr_evsels) {
+        fprintf(stderr, "bench: %s has no sampling events\n", ctx->target->prof->name);
+        goto failed;
+    }
+    ctx->evsels = calloc(ctx->nr_evsels, sizeof(*ctx->evsels));
+    if (!ctx->evsels)
+        goto failed;
+    i = 0;
+    perf_evlist__for_each_evsel(ctx->target->evlist, evsel) {
+        if (!perf_evsel__attr(evsel)->sample_period)
+            continue;
+        if (bench_evsel_init(ctx, &ctx->evsels[i], evsel) < 0)
+            goto failed;
+        if (ctx->evsels[i].size > ctx->slot_size)
+            ctx->slot_size = ctx->evsels[i].size;
+        i++;
+    }
+    ctx->slot_size = ALIGN(ctx->slot_size, sizeof(u64));
+
+    batch = max(min_t(u64, BENCH_TICK_NS / ctx->period, BENCH_MAX_BATCH), 1UL);
+    ctx->nr_slots = roundup_pow_of_two(2 * batch);
+    ctx->rings = calloc(ctx->nr_ins, sizeof(*ctx->rings));
+    if (!ctx->rings)
+        goto failed;
+    for (ins = 0; ins < ctx->nr_ins; ins++) {
+        struct bench_ring *r = &ctx->rings[ins];
+
+        r->buf = malloc(ctx->nr_slots * ctx->slot_size);
+        if (!r->buf)
+            goto failed;
+        r->mask = ctx->nr_slots - 1;
+        r->slot_size = ctx->slot_size;
+        r->ins = ins;
+        r->cpu = ctx->oncpu ? prof_dev_ins_cpu(ctx->target, ins) : -1;
+        r->tid = ctx->oncpu ? -1 : prof_dev_ins_thread(ctx->target, ins);
+        if (ctx->order &&
+            order_register(ctx->target, bench_read_event, r) < 0)
+            goto failed;
+        r->registered = ctx->order;
+    }
+
+    if (timer_init(&ctx->timer, 1, bench_tick) < 0)
+        goto failed;
+    return 0;
+
+failed:
+    bench_exit(dev);
+    return -1;
+}
+
+static void bench_enabled(struct prof_dev *dev)
+{
+    struct bench_ctx *ctx = dev->private;
+    struct prof_dev *target = ctx->target;
+
+    // Only the synthetic samples reach the target.
+    perf_evlist__disable(target->evlist);
+
+    ctx->time = max(bench_clock(), (u64)target->time_ctx.enabled_after.clock + 1);
+    ctx->heap_start = bench_heap();
+    timer_start(&ctx->timer, BENCH_TICK_NS, false);
+}
+
+static void bench_interval(struct prof_dev *dev)
+{
+    struct bench_ctx *ctx = dev->private;
+
+    ctx->total.events += ctx->interval.events;
+    ctx->total.ns += ctx->interval.ns;
+    print_time(stdout);
+    bench_print(ctx, &ctx->interval, dev->prof->name);
+    memset(&ctx->interval, 0, sizeof(ctx->interval));
+}
+
+static void bench_exit(struct prof_dev *dev)
+{
+    struct bench_ctx *ctx = dev->private;
+    int ins, i;
+
+    if (ctx->timer.function)
+        timer_destroy(&ctx->timer);
+
+    if (ctx->time) {
+        ctx->total.events += ctx->interval.events;
+        ctx->total.ns += ctx->interval.ns;
+        bench_print(ctx, &ctx->total, "total");
+    }
+
+    // Normally already closed as a child. Flushing the target may still read the rings.
+    if (ctx->target)
+        prof_dev_close(ctx->target);
+
+    if (ctx->rings) {
+        for (ins = 0; ins < ctx->nr_ins; ins++) {
+            if (ctx->rings[ins].registered)
+                order_unregister(ctx->target, &ctx->rings[ins]);
+            free(ctx->rings[ins].buf);
+        }
+        free(ctx->rings);
+    }
+    if (ctx->evsels) {
+        for (i = 0; i < ctx->nr_evsels; i++) {
+            free(ctx->evsels[i].ids);
+            free(ctx->evsels[i].raw);
+            free(ctx->evsels[i].fields);
+        }
+        free(ctx->evsels);
+    }
+    if (ctx->target)
+        prof_dev_put(ctx->target);
+    free(ctx);
+}
+
+static const char *bench_desc[] = PROFILER_DESC("bench",
+    "[OPTION...] -e 'profiler [option...]' [--period ns] [--jitter ns]",
+    "Replay synthetic samples through a target profiler.",
+    "",
+    "SYNOPSIS",
+    "    The target profiler is opened as usual, then its kernel events are disabled.",
+    "    Every 10ms, bench generates samples for each of its sampling events, one",
+    "    every --period ns per instance, following the attr sample_type and the",
+    "    tracepoint format. Each timestamp is delayed by a random value in [0, jitter).",
+    "    Numeric fields and pids are random keys in [0, 1024).",
+    "",
+    "    Reports the time spent delivering the samples, the heap growth, and RSS.",
+    "    With --order on the target, the samples go through the order heap.",
+    "",
+    "EXAMPLES",
+    "    "PROGRAME" bench -e 'top -e sched:sched_wakeup -k pid' -C 0-3 -i 1000",
+    "    "PROGRAME" bench -e 'syscalls -e raw_syscalls:sys_enter -e raw_syscalls:sys_exit -k common_pid --order' --period 1us --jitter 5us -i 1000");
+static const char *bench_argv[] = PROFILER_ARGV("bench",
+    PROFILER_ARGV_OPTION,
+    PROFILER_ARGV_PROFILER, "event", "period", "jitter");
+static profiler bench = {
+    .name = "bench",
+    .desc = bench_desc,
+    .argv = bench_argv,
+    .pages = 0,
+    .init = bench_init,
+    .enabled = bench_enabled,
+    .deinit = bench_exit,
+    .interval = bench_interval,
+};
+PROFILER_REGISTER(bench);
@@ -0,0 +1,852 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <linux/kernel.h>
+#include <linux/rblist.h>
+#include <linux/zalloc.h>
+#include <monitor.h>
+#include <tep.h>
+
+/*
+ * --columnar file: columnar binary output.
+ *
+ * Instead of being formatted, the tracepoint fields are stored column by column,
+ * in batches of rows of the same tp. `perf-prof columnar file' converts them
+ * back to text.
+ *
+ *   file    := "PPCOLUMN" u32:version record*
+ *   record  := u32:type u32:size payload
+ *
+ *   COL_SCHEMA  u32:tp  str:sys  str:name  u32:nr_fields  field*
+ *     field     str:name u32:type u32:size u32:flags
+ *   COL_DICT    u32:idx  str:comm
+ *   COL_BATCH   u32:tp  u32:nr_rows  u64:base_time  column*
+ *     column    u32:len  data
+ *   COL_SYNC    empty, the batches before it cover the same time range.
+ *
+ * str is a varint length followed by the bytes. The columns of a batch are
+ * time, pid, tid, cpu, comm and then the fields of the tp:
+ *
+ *   time        varint, delta from the previous row, or from base_time.
+ *   pid/tid/cpu varint.
+ *   comm        varint, COL_DICT index.
+ *   COL_FIXED   size bytes per row, host byte order.
+ *   COL_BYTES   str per row, strings and __data_loc fields.
+ *
+ * A tp without a known format has a single "raw" COL_BYTES field.
+ *
+ * Rows are only in time order within a COL_SYNC window: each batch holds the
+ * rows of one tp, and the reader merges the batches of a window by time.
+ * Rows of different windows are never reordered.
+ *
+ * A row that cannot be buffered is dropped as a whole, and the error is
+ * reported at close.
+ *
+ * Only trace writes it. multi-trace --detail prints the events around each
+ * slow pair, the same event can be printed for several pairs and out of time
+ * order, which the time-delta batches cannot hold. The callchains are not
+ * stored, -g, --flame-graph and the stack attribute are rejected.
+ */
+
+#define COL_MAGIC "PPCOLUMN"
+#define COL_VERSION 1
+#define COL_ROWS 8192 // rows buffered before writing out the batches.
+#define COL_NR_HEAD 5 // time, pid, tid, cpu, comm
+
+enum {
+    COL_SCHEMA = 1,
+    COL_DICT,
+    COL_BATCH,
+    COL_SYNC,
+};
+
+enum {
+    COL_FIXED = 1,
+    COL_BYTES,
+};
+
+// field flags, same as tep_format_field.flags
+#define COL_F_SIGNED  TEP_FIELD_IS_SIGNED
+#define COL_F_STRING  TEP_FIELD_IS_STRING
+#define COL_F_ARRAY   TEP_FIELD_IS_ARRAY
+#define COL_F_DYNAMIC TEP_FIELD_IS_DYNAMIC
+#define COL_F_POINTER TEP_FIELD_IS_POINTER
+#define COL_F_MASK (COL_F_SIGNED | COL_F_STRING | COL_F_ARRAY | COL_F_DYNAMIC | COL_F_POINTER)
+
+struct col_buf {
+    unsigned char *data;
+    u32 len, cap;
+    u32 row; // len before the current row, see columnar_write().
+};
+
+struct col_field {
+    char *name;
+    int type;
+    int offset;
+    int size;
+    unsigned long flags;
+};
+
+struct col_table {
+    struct tp *tp;
+    bool raw; // no format, the whole raw data.
+    int nr_fields;
+    struct col_field *fields;
+    u32 nr_rows;
+    u64 base_time;
+    u64 last_time;
+    struct col_buf *cols; // COL_NR_HEAD + nr_fields
+};
+
+struct col_comm {
+    struct rb_node rbnode;
+    char comm[16];
+    u32 idx;
+};
+
+struct columnar {
+    FILE *fp;
+    struct col_table *tables;
+    int nr_tables;
+    struct rblist comms;
+    u32 nr_comms;
+    u32 nr_rows;
+    u64 rows;
+    u64 bytes;
+    bool error;
+};
+
+static int col_buf_reserve(struct col_buf *buf, u32 len)
+{
+    if (buf->len + len > buf->cap) {
+        u32 cap = max(buf->cap * 2, buf->len + len);
+        unsigned char *data = realloc(buf->data, cap);
+        if (!data)
+            return -1;
+        buf->data = data;
+        buf->cap = cap;
+    }
+    return 0;
+}
+
+static int col_buf_put(struct col_buf *buf, const void *data, u32 len)
+{
+    if (col_buf_reserve(buf, len) < 0)
+        return -1;
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+    return 0;
+}
+
+static int col_buf_varint(struct col_buf *buf, u64 v)
+{
+    if (col_buf_reserve(buf, 10) < 0)
+        return -1;
+    while (v >= 0x80) {
+        buf->data[buf->len++] = (unsigned char)(v | 0x80);
+        v >>= 7;
+    }
+    buf->data[buf->len++] = (unsigned char)v;
+    return 0;
+}
+
+static int col_buf_str(struct col_buf *buf, const void *str, u32 len)
+{
+    if (col_buf_varint(buf, len) < 0)
+        return -1;
+    return col_buf_put(buf, str, len);
+}
+
+static void col_write_record(struct columnar *col, u32 type, struct col_buf *payload, int nr)
+{
+    u32 hdr[2] = {type, 0};
+    int i;
+
+    for (i = 0; i < nr; i++)
+        hdr[1] += payload[i].len;
+    if (fwrite(hdr, sizeof(hdr), 1, col->fp) != 1)
+        col->error = true;
+    for (i = 0; i < nr; i++)
+        if (payload[i].len && fwrite(payload[i].data, payload[i].len, 1, col->fp) != 1)
+            col->error = true;
+    col->bytes += sizeof(hdr) + hdr[1];
+}
+
+static int col_comm_cmp(struct rb_node *rbn, const void *entry)
+{
+    struct col_comm *b = container_of(rbn, struct col_comm, rbnode);
+    const struct col_comm *e = entry;
+
+    return strncmp(b->comm, e->comm, sizeof(b->comm));
+}
+static struct rb_node *col_comm_new(struct rblist *rlist, const void *new_entry)
+{
+    struct columnar *col = container_of(rlist, struct columnar, comms);
+    const struct col_comm *e = new_entry;
+    struct col_comm *b = malloc(sizeof(*b));
+    if (b) {
+        memcpy(b->comm, e->comm, sizeof(b->comm));
+        b->idx = col->nr_comms++;
+        RB_CLEAR_NODE(&b->rbnode);
+        return &b->rbnode;
+    } else
+        return NULL;
+}
+static void col_comm_delete(struct rblist *rblist, struct rb_node *rb_node)
+{
+    struct col_comm *b = container_of(rb_node, struct col_comm, rbnode);
+    free(b);
+}
+
+static u32 col_comm_idx(struct columnar *col, int pid)
+{
+    struct col_comm find, *node;
+    struct rb_node *rbn;
+    u32 nr_comms = col->nr_comms;
+
+    memset(find.comm, 0, sizeof(find.comm));
+    strncpy(find.comm, tep__pid_to_comm(pid), sizeof(find.comm) - 1);
+    rbn = rblist__findnew(&col->comms, &find);
+    node = rb_entry_safe(rbn, struct col_comm, rbnode);
+    if (!node)
+        return 0;
+
+    if (col->nr_comms != nr_comms) {
+        struct col_buf buf = {NULL, 0, 0};
+        col_buf_put(&buf, &node->idx, sizeof(u32));
+        col_buf_str(&buf, node->comm, strlen(node->comm));
+        col_write_record(col, COL_DICT, &buf, 1);
+        free(buf.data);
+    }
+    return node->idx;
+}
+
+static int col_table_init(struct columnar *col, struct col_table *table, struct tp *tp, int idx)
+{
+    struct tep_handle *tep = tep__ref();
+    struct tep_event *event = NULL;
+    struct tep_format_field *field;
+    struct col_buf buf = {NULL, 0, 0};
+    u32 v;
+    int i;
+
+    if (tp->id > 0 && tp->id <= TRACE_EVENT_TYPE_MAX)
+        event = tep_find_event(tep, tp->id);
+
+    table->tp = tp;
+    if (event) {
+        for (field = event->format.fields; field; field = field->next)
+            table->nr_fields++;
+    } else
+        table->nr_fields = 1;
+
+    table->fields = calloc(table->nr_fields, sizeof(*table->fields));
+    table->cols = calloc(COL_NR_HEAD + table->nr_fields, sizeof(*table->cols));
+    if (!table->fields || !table->cols)
+        goto failed;
+
+    if (event) {
+        for (i = 0, field = event->format.fields; field; field = field->next, i++) {
+            struct col_field *f = &table->fields[i];
+            f->name = strdup(field->name);
+            f->offset = field->offset;
+            f->size = field->size;
+            f->flags = field->flags & COL_F_MASK;
+            if ((field->flags & TEP_FIELD_IS_DYNAMIC) ||
+                (field->flags & TEP_FIELD_IS_STRING))
+                f->type = COL_BYTES;
+            else
+                f->type = COL_FIXED;
+        }
+    } else {
+        table->raw = true;
+        table->fields[0].name = strdup("raw");
+        table->fields[0].type = COL_BYTES;
+    }
+
+    v = idx;
+    col_buf_put(&buf, &v, sizeof(v));
+    col_buf_str(&buf, tp->sys, strlen(tp->sys));
+    col_buf_str(&buf, tp->name, strlen(tp->name));
+    v = table->nr_fields;
+    col_buf_put(&buf, &v, sizeof(v));
+    for (i = 0; i < table->nr_fields; i++) {
+        struct col_field *f = &table->fields[i];
+        if (!f->name)
+            goto failed;
+        col_buf_str(&buf, f->name, strlen(f->name));
+        v = f->type;    col_buf_put(&buf, &v, sizeof(v));
+        v = f->size;    col_buf_put(&buf, &v, sizeof(v));
+        v = f->flags;   col_buf_put(&buf, &v, sizeof(v));
+    }
+    col_write_record(col, COL_SCHEMA, &buf, 1);
+    free(buf.data);
+    tep__unref();
+    return 0;
+
+failed:
+    free(buf.data);
+    tep__unref();
+    return -1;
+}
+
+static void col_table_free(struct col_table *table)
+{
+    int i;
+
+    if (table->fields)
+        for (i = 0; i < table->nr_fields; i++)
+            free(table->fields[i].name);
+    if (table->cols)
+        for (i = 0; i < COL_NR_HEAD + table->nr_fields; i++)
+            free(table->cols[i].data);
+    free(table->fields);
+    free(table->cols);
+}
+
+struct columnar *columnar_open(const char *path, struct tp_list *tp_list)
+{
+    struct columnar *col;
+    struct tp *tp;
+    u32 version = COL_VERSION;
+    int i;
+
+    for_each_dev_tp(tp_list, tp, i) {
+        fprintf(stderr, "--columnar does not support the profiler event '%s'\n", tp->name);
+        return NULL;
+    }
+    // Only the raw data is stored, the callchain would be silently dropped.
+    if (tp_list->nr_need_stack) {
+        fprintf(stderr, "--columnar does not support the stack attribute\n");
+        return NULL;
+    }
+
+    col = zalloc(sizeof(*col));
+    if (!col)
+        return NULL;
+
+    rblist__init(&col->comms);
+    col->comms.node_cmp = col_comm_cmp;
+    col->comms.node_new = col_comm_new;
+    col->comms.node_delete = col_comm_delete;
+
+    col->fp = fopen(path, "w");
+    if (!col->fp) {
+        fprintf(stderr, "Cannot open %s: %s\n", path, strerror(errno));
+        goto failed;
+    }
+    if (fwrite(COL_MAGIC, 8, 1, col->fp) != 1 ||
+        fwrite(&version, sizeof(version), 1, col->fp) != 1)
+        goto failed;
+
+    col->nr_tables = tp_list->nr_tp;
+    col->tables = calloc(col->nr_tables, sizeof(*col->tables));
+    if (!col->tables)
+        goto failed;
+
+    for_each_real_tp(tp_list, tp, i) {
+        if (col_table_init(col, &col->tables[i], tp, i) < 0)
+            goto failed;
+    }
+    return col;
+
+failed:
+    columnar_close(col);
+    return NULL;
+}
+
+void columnar_write(struct columnar *col, struct tp *tp, u64 time, u32 pid, u32 tid, u32 cpu, void *raw, int size)
+{
+    struct col_table *table = NULL;
+    struct col_buf *cols;
+    int nr_cols, err = 0;
+    int i;
+
+    for (i = 0; i < col->nr_tables; i++)
+        if (col->tables[i].tp == tp) {
+            table = &col->tables[i];
+            break;
+        }
+    if (!table)
+        return;
+
+    cols = table->cols;
+    nr_cols = COL_NR_HEAD + table->nr_fields;
+    for (i = 0; i < nr_cols; i++)
+        cols[i].row = cols[i].len;
+
+    if (table->nr_rows == 0)
+        table->base_time = table->last_time = time;
+    err |= col_buf_varint(&cols[0], time - table->last_time);
+    err |= col_buf_varint(&cols[1], pid);
+    err |= col_buf_varint(&cols[2], tid);
+    err |= col_buf_varint(&cols[3], cpu);
+    err |= col_buf_varint(&cols[4], col_comm_idx(col, tid));
+
+    for (i = 0; i < table->nr_fields && !err; i++) {
+        struct col_field *f = &table->fields[i];
+        struct col_buf *buf = &cols[COL_NR_HEAD + i];
+        int offset = f->offset;
+        int len = f->size;
+
+        if (f->type == COL_BYTES) {
+            if (f->flags & COL_F_DYNAMIC) {
+                if (offset + 4 <= size) {
+                    u32 data_loc = *(u32 *)(raw + offset);
+                    offset = data_loc & 0xffff;
+                    len = data_loc >> 16;
+                } else
+                    len = 0;
+            } else if (table->raw) {
+                offset = 0;
+                len = size;
+            }
+            if (offset + len > size)
+                len = 0;
+            if (f->flags & COL_F_STRING)
+                len = strnlen(raw + offset, len);
+            err |= col_buf_str(buf, raw + offset, len);
+        } else {
+            if (unlikely(offset + len > size)) {
+                if (col_buf_reserve(buf, len) == 0) {
+                    memset(buf->data + buf->len, 0, len);
+                    buf->len += len;
+                } else
+                    err = -1;
+            } else
+                err |= col_buf_put(buf, raw + offset, len);
+        }
+    }
+
+    // Drop the whole row, keep the columns of the batch in sync.
+    if (unlikely(err)) {
+        for (i = 0; i < nr_cols; i++)
+            cols[i].len = cols[i].row;
+        col->error = true;
+        return;
+    }
+
+    table->last_time = time;
+    table->nr_rows++;
+    col->rows++;
+    if (++col->nr_rows >= COL_ROWS)
+        columnar_flush(col);
+}
+
+void columnar_flush(struct columnar *col)
+{
+    int i, j;
+
+    if (!col || !col->nr_rows)
+        return;
+
+    for (i = 0; i < col->nr_tables; i++) {
+        struct col_table *table = &col->tables[i];
+        int nr_cols = COL_NR_HEAD + table->nr_fields;
+        struct col_buf *payload;
+        struct col_buf head = {NULL, 0, 0};
+        u32 v;
+
+        if (!table->nr_rows)
+            continue;
+
+        // head, {column length, column data} ...
+        payload = calloc(1 + nr_cols * 2, sizeof(*payload));
+        if (!payload)
+            continue;
+
+        v = i;              col_buf_put(&head, &v, sizeof(v));
+        v = table->nr_rows; col_buf_put(&head, &v, sizeof(v));
+        col_buf_put(&head, &table->base_time, sizeof(table->base_time));
+        payload[0] = head;
+        for (j = 0; j < nr_cols; j++) {
+            col_buf_put(&payload[1 + j * 2], &table->cols[j].len, sizeof(u32));
+            payload[2 + j * 2] = table->cols[j];
+        }
+        col_write_record(col, COL_BATCH, payload, 1 + nr_cols * 2);
+
+        free(head.data);
+        for (j = 0; j < nr_cols; j++) {
+            free(payload[1 + j * 2].data);
+            table->cols[j].len = 0;
+        }
+        free(payload);
+        table->nr_rows = 0;
+    }
+    col_write_record(col, COL_SYNC, NULL, 0);
+    col->nr_rows = 0;
+    fflush(col->fp);
+}
+
+void columnar_close(struct columnar *col)
+{
+    int i;
+
+    if (!col)
+        return;
+
+    if (col->fp) {
+        if (col->tables)
+            columnar_flush(col);
+        if (col->error)
+            fprintf(stderr, "columnar: write error, %lu rows %lu bytes\n", col->rows, col->bytes);
+        fclose(col->fp);
+    }
+    if (col->tables) {
+        for (i = 0; i < col->nr_tables; i++)
+            col_table_free(&col->tables[i]);
+        free(col->tables);
+    }
+    rblist__exit(&col->comms);
+    free(col);
+}
+
+
+/*
+ * perf-prof columnar file
+ *
+ * The batches between two COL_SYNC records are merged by time.
+ */
+struct col_schema {
+    char *sys, *name;
+    int nr_fields;
+    struct col_field *fields;
+};
+
+struct col_cursor {
+    struct col_schema *schema;
+    u32 nr_rows, row;
+    u64 time;
+    unsigned char *record;
+    unsigned char **pos; // COL_NR_HEAD + nr_fields
+    unsigned char **end;
+};
+
+struct col_reader {
+    FILE *fp;
+    struct col_schema *schemas;
+    int nr_schemas;
+    char (*dict)[16];
+    u32 nr_dict;
+    struct col_cursor *cursors;
+    int nr_cursors;
+};
+
+static u64 col_get_varint(unsigned char **p, unsigned char *end)
+{
+    u64 v = 0;
+    int shift = 0;
+
+    while (*p < end && shift < 64) {
+        unsigned char c = *(*p)++;
+        v |= (u64)(c & 0x7f) << shift;
+        if (!(c & 0x80))
+            break;
+        shift += 7;
+    }
+    return v;
+}
+
+static u32 col_get_u32(unsigned char **p, unsigned char *end)
+{
+    u32 v = 0;
+    if (*p + sizeof(v) <= end)
+        memcpy(&v, *p, sizeof(v));
+    *p += sizeof(v);
+    return v;
+}
+
+static char *col_get_str(unsigned char **p, unsigned char *end)
+{
+    u64 len = col_get_varint(p, end);
+    char *str;
+
+    if (*p + len > end)
+        return NULL;
+    str = strndup((char *)*p, len);
+    *p += len;
+    return str;
+}
+
+static int col_read_schema(struct col_reader *r, unsigned char *p, unsigned char *end)
+{
+    u32 idx = col_get_u32(&p, end);
+    struct col_schema *s;
+    int i;
+
+    if (idx >= (u32)r->nr_schemas) {
+        struct col_schema *schemas = realloc(r->schemas, (idx + 1) * sizeof(*schemas));
+        if (!schemas)
+            return -1;
+        memset(schemas + r->nr_schemas, 0, (idx + 1 - r->nr_schemas) * sizeof(*schemas));
+        r->schemas = schemas;
+        r->nr_schemas = idx + 1;
+    }
+    s = &r->schemas[idx];
+    s->sys = col_get_str(&p, end);
+    s->name = col_get_str(&p, end);
+    s->nr_fields = col_get_u32(&p, end);
+    if (!s->sys || !s->name || p > end)
+        return -1;
+    s->fields = calloc(s->nr_fields, sizeof(*s->fields));
+    if (!s->fields)
+        return -1;
+    for (i = 0; i < s->nr_fields; i++) {
+        struct col_field *f = &s->fields[i];
+        f->name = col_get_str(&p, end);
+        f->type = col_get_u32(&p, end);
+        f->size = col_get_u32(&p, end);
+        f->flags = col_get_u32(&p, end);
+        if (!f->name || p > end)
+            return -1;
+    }
+    return 0;
+}
+
+static int col_read_dict(struct col_reader *r, unsigned char *p, unsigned char *end)
+{
+    u32 idx = col_get_u32(&p, end);
+    char *comm = col_get_str(&p, end);
+
+    if (!comm)
+        return -1;
+    if (idx >= r->nr_dict) {
+        char (*dict)[16] = realloc(r->dict, (idx + 1) * sizeof(*dict));
+        if (!dict) {
+            free(comm);
+            return -1;
+        }
+        memset(dict + r->nr_dict, 0, (idx + 1 - r->nr_dict) * sizeof(*dict));
+        r->dict = dict;
+        r->nr_dict = idx + 1;
+    }
+    strncpy(r->dict[idx], comm, sizeof(r->dict[idx]) - 1);
+    free(comm);
+    return 0;
+}
+
+static int col_read_batch(struct col_reader *r, unsigned char *record, unsigned char *end)
+{
+    unsigned char *p = record;
+    struct col_cursor *c, *cursors;
+    u32 idx = col_get_u32(&p, end);
+    int i, nr_cols;
+
+    if (idx >= (u32)r->nr_schemas || !r->schemas[idx].fields)
+        return -1;
+
+    cursors = realloc(r->cursors, (r->nr_cursors + 1) * sizeof(*cursors));
+    if (!cursors)
+        return -1;
+    r->cursors = cursors;
+    c = &cursors[r->nr_cursors];
+    memset(c, 0, sizeof(*c));
+    c->schema = &r->schemas[idx];
+    c->nr_rows = col_get_u32(&p, end);
+    if (p + sizeof(u64) > end)
+        return -1;
+    memcpy(&c->time, p, sizeof(u64));
+    p += sizeof(u64);
+
+    nr_cols = COL_NR_HEAD + c->schema->nr_fields;
+    c->pos = calloc(nr_cols, sizeof(*c->pos));
+    c->end = calloc(nr_cols, sizeof(*c->end));
+    if (!c->pos || !c->end)
+        goto failed;
+    for (i = 0; i < nr_cols; i++) {
+        u32 len = col_get_u32(&p, end);
+        if (p + len > end)
+            goto failed;
+        c->pos[i] = p;
+        c->end[i] = p + len;
+        p += len;
+    }
+    c->record = record;
+    if (c->nr_rows)
+        c->time += col_get_varint(&c->pos[0], c->end[0]);
+    r->nr_cursors++;
+    return 0;
+
+failed:
+    free(c->pos);
+    free(c->end);
+    return -1;
+}
+
+static void col_print_row(struct col_reader *r, struct col_cursor *c)
+{
+    struct col_schema *s = c->schema;
+    u32 tid, comm;
+    int cpu;
+    u64 us = (c->time + 500) / 1000;
+    int i, j;
+
+    col_get_varint(&c->pos[1], c->end[1]); // pid
+    tid = col_get_varint(&c->pos[2], c->end[2]);
+    cpu = (int)col_get_varint(&c->pos[3], c->end[3]);
+    comm = col_get_varint(&c->pos[4], c->end[4]);
+
+    printf("%16s %6u [%03d] %lu.%06lu: %s:%s:", comm < r->nr_dict ? r->dict[comm] : "<...>", tid,
+            cpu, us / USEC_PER_SEC, us % USEC_PER_SEC, s->sys, s->name);
+
+    for (i = 0; i < s->nr_fields; i++) {
+        struct col_field *f = &s->fields[i];
+        unsigned char **p = &c->pos[COL_NR_HEAD + i];
+        unsigned char *end = c->end[COL_NR_HEAD + i];
+        unsigned char *data;
+        u64 len;
+
+        if (f->type == COL_BYTES) {
+            len = col_get_varint(p, end);
+            data = *p;
+        } else {
+            len = f->size;
+            data = *p;
+        }
+        if (data + len > end)
+            break;
+        *p += len;
+
+        printf(" %s=", f->name);
+        if (f->flags & COL_F_STRING)
+            printf("%.*s", (int)len, data);
+        else if (f->type == COL_FIXED && !(f->flags & COL_F_ARRAY) &&
+                 (len == 1 || len == 2 || len == 4 || len == 8)) {
+            u64 v = 0;
+            s64 sv;
+            memcpy(&v, data, len);
+            if (f->flags & COL_F_SIGNED) {
+                sv = len == 8 ? (s64)v : (s64)(v << (64 - len * 8)) >> (64 - len * 8);
+                printf("%ld", sv);
+            } else if (f->flags & COL_F_POINTER)
+                printf("0x%lx", v);
+            else
+                printf("%lu", v);
+        } else {
+            for (j = 0; j < (int)len; j++)
+                printf("%02x", data[j]);
+        }
+    }
+    printf("\n");
+
+    if (++c->row < c->nr_rows)
+        c->time += col_get_varint(&c->pos[0], c->end[0]);
+}
+
+static void col_print_batches(struct col_reader *r)
+{
+    int i;
+
+    while (1) {
+        struct col_cursor *min = NULL;
+        for (i = 0; i < r->nr_cursors; i++) {
+            struct col_cursor *c = &r->cursors[i];
+            if (c->row < c->nr_rows && (!min || c->time < min->time))
+                min = c;
+        }
+        if (!min)
+            break;
+        col_print_row(r, min);
+    }
+    for (i = 0; i < r->nr_cursors; i++) {
+        free(r->cursors[i].record);
+        free(r->cursors[i].pos);
+        free(r->cursors[i].end);
+    }
+    r->nr_cursors = 0;
+}
+
+static int columnar_print(const char *path)
+{
+    struct col_reader r;
+    char magic[8];
+    u32 version, hdr[2];
+    int i, j, err = -1;
+
+    memset(&r, 0, sizeof(r));
+    r.fp = fopen(path, "r");
+    if (!r.fp) {
+        fprintf(stderr, "Cannot open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    if (fread(magic, sizeof(magic), 1, r.fp) != 1 || memcmp(magic, COL_MAGIC, sizeof(magic)) ||
+        fread(&version, sizeof(version), 1, r.fp) != 1 || version != COL_VERSION) {
+        fprintf(stderr, "%s: not a columnar file\n", path);
+        goto out;
+    }
+
+    while (fread(hdr, sizeof(hdr), 1, r.fp) == 1) {
+        unsigned char *record = hdr[1] ? malloc(hdr[1]) : NULL;
+        int ret = 0;
+
+        if (hdr[1] && (!record || fread(record, hdr[1], 1, r.fp) != 1)) {
+            free(record);
+            fprintf(stderr, "%s: truncated\n", path);
+            break;
+        }
+        switch (hdr[0]) {
+            case COL_SCHEMA: ret = col_read_schema(&r, record, record + hdr[1]); break;
+            case COL_DICT: ret = col_read_dict(&r, record, record + hdr[1]); break;
+            case COL_BATCH:
+                ret = col_read_batch(&r, record, record + hdr[1]);
+                if (ret == 0)
+                    record = NULL; // owned by the cursor.
+                break;
+            case COL_SYNC: col_print_batches(&r); break;
+            default: break;
+        }
+        free(record);
+        if (ret < 0) {
+            fprintf(stderr, "%s: corrupted record type %u\n", path, hdr[0]);
+            break;
+        }
+    }
+    col_print_batches(&r);
+    err = 0;
+
+out:
+    for (i = 0; i < r.nr_schemas; i++) {
+        struct col_schema *s = &r.schemas[i];
+        free(s->sys);
+        free(s->name);
+        if (s->fields)
+            for (j = 0; j < s->nr_fields; j++)
+                free(s->fields[j].name);
+        free(s->fields);
+    }
+    free(r.schemas);
+    free(r.dict);
+    free(r.cursors);
+    fclose(r.fp);
+    return err;
+}
+
+static int columnar_argc_init(int argc, char *argv[])
+{
+    if (argc != 1) {
+        fprintf(stderr, "Usage: "PROGRAME" columnar file\n");
+        exit(1);
+    }
+    exit(columnar_print(argv[0]) < 0 ? 1 : 0);
+}
+
+static const char *columnar_desc[] = PROFILER_DESC("columnar",
+    "[OPTION...] file",
+    "Convert the columnar file written by --columnar to text.",
+    "",
+    "EXAMPLES",
+    "    "PROGRAME" trace -e sched:sched_wakeup --columnar wakeup.col",
+    "    "PROGRAME" columnar wakeup.col");
+static const char *columnar_argv[] = PROFILER_ARGV("columnar",
+    "OPTION:",
+    "version", "verbose", "quiet", "help"
+);
+static profiler columnar = {
+    .name = "columnar",
+    .desc = columnar_desc,
+    .argv = columnar_argv,
+    .pages = 0,
+    .argc_init = columnar_argc_init,
+};
+PROFILER_REGISTER(columnar);
@@ -19,6 +19,7 @@ struct pid_comm_node {
     struct rb_node rbnode;
     u64 update_time;
     bool flush;
+    bool negative; // not found, comm[] is empty.
     int pid;
     char comm[TASK_COMM_LEN];
     struct rb_node exit_node;
@@ -31,6 +32,7 @@ struct comm_ctx {
     struct rblist exited;
     int task_newtask, task_rename;
     int sched_process_free;
+    u64 nr_hit, nr_flush, nr_negative;
 };
 static struct comm_ctx *global_comm_ctx = NULL;
 static struct list_head global_comm_notify_list = LIST_HEAD_INIT(global_comm_notify_list);
@@ -50,6 +52,7 @@ static struct rb_node *pid_comm_node_new(struct rblist *rlist, const void *new_e
     if (b) {
         b->pid = e->pid;
         b->flush = false;
+        b->negative = false;
         b->update_time = 0;
         RB_CLEAR_NODE(&b->rbnode);
         RB_CLEAR_NODE(&b->exit_node);
@@ -86,7 +89,7 @@ static void pid_comm_exit_delete(struct rblist *rblist, struct rb_node *rb_node)
     struct pid_comm_node *b = container_of(rb_node, struct pid_comm_node, exit_node);
 
     // notify
-    if (!list_empty(&global_comm_notify_list)) {
+    if (!b->negative && !list_empty(&global_comm_notify_list)) {
         struct comm_notify *node;
         list_for_each_entry(node, &global_comm_notify_list, link) {
             node->notify(node, b->pid, NOTIFY_COMM_DELETE, b->update_time);
@@ -196,6 +199,7 @@ static void comm_update(struct prof_dev *dev, u64 time, bool exit, int pid, char
             }
             node->update_time = time;
             node->flush = false;
+            node->negative = false;
             *(u64 *)(node->comm) = *(u64 *)(comm);
             *(u64 *)(node->comm+8) = *(u64 *)(comm+8);
         }
@@ -292,6 +296,13 @@ static void comm_interval(struct prof_dev *dev)
     comm_gc(dev, time_before);
 }
 
+static void comm_print_dev(struct prof_dev *dev, int indent)
+{
+    struct comm_ctx *ctx = dev->private;
+    dev_printf("pid_comm: %u nodes, hit %lu flush %lu negative %lu\n", rblist__nr_entries(&ctx->pid_comm),
+                ctx->nr_hit, ctx->nr_flush, ctx->nr_negative);
+}
+
 static void comm_sample(struct prof_dev *dev, union perf_event *event, int instance)
 {
     struct comm_ctx *ctx = dev->private;
@@ -326,6 +337,7 @@ static profiler comm = {
     .enabled = comm_enabled,
     .deinit = comm_deinit,
     .interval = comm_interval,
+    .print_dev = comm_print_dev,
     .sample = comm_sample,
 };
 
@@ -353,25 +365,52 @@ void global_comm_unref(void)
         prof_dev_close(global_comm_ctx->comm_dev);
 }
 
+/*
+ * The pid is looked up in the cache built from /proc at startup and kept up to date
+ * by task_newtask, task_rename and sched_process_free. On a miss, the comm ringbuffer
+ * is flushed once. If the pid is still unknown, a negative node is added so that the
+ * next lookups do not flush again. It is replaced by the next comm event of that pid,
+ * or removed by comm_gc() at the next interval.
+ */
 char *global_comm_get(int pid)
 {
+    struct comm_ctx *ctx = global_comm_ctx;
     struct pid_comm_node find, *node;
     struct rb_node *rbn;
 
-    if (!global_comm_ctx)
+    if (!ctx)
         return NULL;
 
     find.pid = pid;
-    rbn = rblist__find(&global_comm_ctx->pid_comm, &find);
+    rbn = rblist__find(&ctx->pid_comm, &find);
     node = rb_entry_safe(rbn, struct pid_comm_node, rbnode);
 
-    if (!node || node->flush) {
-        prof_dev_flush(global_comm_ctx->comm_dev, PROF_DEV_FLUSH_NORMAL);
-        rbn = rblist__find(&global_comm_ctx->pid_comm, &find);
-        node = rb_entry_safe(rbn, struct pid_comm_node, rbnode);
+    if (node && !node->flush) {
+        if (likely(!node->negative)) {
+            ctx->nr_hit++;
+            return node->comm;
+        }
+        ctx->nr_negative++;
+        return NULL;
+    }
+
+    ctx->nr_flush++;
+    prof_dev_flush(ctx->comm_dev, PROF_DEV_FLUSH_NORMAL);
+    rbn = rblist__findnew(&ctx->pid_comm, &find);
+    node = rb_entry_safe(rbn, struct pid_comm_node, rbnode);
+    if (!node)
+        return NULL;
+
+    if (node->update_time == 0 && !node->negative) {
+        // Newly added.
+        node->negative = true;
+        node->comm[0] = '\0';
+        rblist__add_node(&ctx->exited, node);
     }
+    // node->flush is only cleared by comm_update(), global_comm_flush() waits for
+    // the next comm event of the pid, e.g. task_rename after exec.
 
-    return node ? node->comm : NULL;
+    return node->negative ? NULL : node->comm;
 }
 
 void global_comm_flush(int pid)
@@ -592,10 +592,13 @@ int perf_event_convert_init(struct prof_dev *dev)
         } else
             dev->convert.need_conv = CONVERT_ADD_OFFSET;
 
-        dev->convert.event_copy = malloc(PERF_SAMPLE_MAX_SIZE);
-        if (!dev->convert.event_copy) {
-            fprintf(stderr, "Could not alloc event_copy.\n");
-            return -1;
+        // Only the read-only overwrite ringbuffer needs a copy, see perf_event_convert().
+        if (env->overwrite) {
+            dev->convert.event_copy = malloc(PERF_SAMPLE_MAX_SIZE);
+            if (!dev->convert.event_copy) {
+                fprintf(stderr, "Could not alloc event_copy.\n");
+                return -1;
+            }
         }
     } else {
         env->tsc = false;
@@ -637,7 +640,13 @@ union perf_event *perf_event_convert(struct prof_dev *dev, union perf_event *eve
     if (likely(!dev->convert.need_conv))
         return event;
 
-    if (likely(!writable)) {
+    /*
+     * In non-overwrite mode, the ringbuffer is mapped PROT_WRITE and the events
+     * between tail and head belong to us until perf_mmap__consume(), each one
+     * is read only once. Rewrite the timestamp in place, no need to copy the
+     * sample. The overwrite ringbuffer is mapped read-only.
+     */
+    if (unlikely(!writable && dev->convert.event_copy)) {
         memcpy(dev->convert.event_copy, event, event->header.size);
         event = (union perf_event *)dev->convert.event_copy;
     }
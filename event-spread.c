@@ -8,6 +8,7 @@
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <sys/eventfd.h>
 #include <sys/signalfd.h>
 #include <linux/kernel.h>
@@ -17,6 +18,7 @@
 #include <monitor.h>
 #include <tep.h>
 #include <net.h>
+#include <lz_helpers.h>
 
 static struct prof_dev *perf_clock_dev = NULL;
 static profiler perf_clock;
@@ -43,6 +45,73 @@ static void perf_clock_unref(void)
 
 #define BUF_LEN (1 << 16)
 
+/*
+ * push=file, pull=file[@START-END]
+ *
+ * File layout:
+ *   PERF_RECORD_TP sys name
+ *   PERF_RECORD_FILE_CHUNK events...   <- chunk 0
+ *   PERF_RECORD_FILE_CHUNK events...   <- chunk 1
+ *   ...
+ *   struct file_chunk_index[nr_chunks]
+ *   struct file_trailer
+ *
+ * Chunks are written with one large write() each. The chunk index and trailer
+ * are appended when the file is closed; without them (killed writer, files
+ * written by older versions) the file is still read sequentially, the chunk
+ * records themselves carry the time range of their events.
+ *
+ * The reader mmaps the file, binary searches the chunk index for the START of
+ * the time window and passes events to the profiler without copying.
+ */
+#define FILE_CHUNK_SIZE (1 << 20)
+#define FILE_READ_BATCH 1024
+#define FILE_TRAILER_MAGIC "PPCHUNK1"
+
+struct file_chunk_index {
+    u64 offset;
+    u64 start_time;
+    u64 end_time;
+};
+
+struct file_trailer {
+    char magic[8];
+    u64 index_offset;
+    u64 nr_chunks;
+};
+
+/*
+ * zip: push=[IP:]PORT, push=chardev
+ *
+ * Pushed events are batched into PERF_RECORD_FRAME records of at most
+ * FRAME_RAW_LEN bytes, flushed when full and by the 10ms perf-clock timer.
+ * The sample headers are delta encoded against the previous sample and the
+ * batch is lz-compressed. Each frame is self-contained, a tcp client that
+ * connects later starts at the next frame.
+ *
+ * perf_record_tp.flags tells the pull side that frames follow, it decodes
+ * them with the sample_type of its own tp, which must match the pushed one.
+ */
+#define FRAME_RAW_LEN (1 << 15)
+
+struct event_zip {
+    // sample fields to delta encode, offset in sample.array, -1 if absent.
+    int tid_pos, time_pos, cpu_pos;
+    int min_size;
+    u64 prev_tid, prev_time, prev_cpu;
+    // broadcast: the batch being built; receive: the decoded frame.
+    char *raw;
+    int raw_len;
+    int raw_pos;
+    int nr_events;
+    struct perf_record_frame *frame; // broadcast
+    // stats
+    u64 nr_frames;
+    u64 raw_bytes;
+    u64 zip_bytes;
+    u64 nr_errors;
+};
+
 enum block_type {
     TYPE_TCP,
     TYPE_CDEV,
@@ -80,15 +149,31 @@ struct event_block {
         } tcp;
         struct cdev_block cdev;
         struct file_block {
-            FILE *file; // broadcast or receive
+            int fd; // broadcast or receive
             size_t pos;
             const char *filename;
             int notifyfd;
+            // broadcast, chunk writer
+            struct perf_record_file_chunk *chunk; // FILE_CHUNK_SIZE
+            struct file_chunk_index *index;
+            u64 nr_index;
+            // receive, mmap reader
+            void *map;
+            size_t map_size;
+            size_t cur, end, seek;
+            u64 start_time, end_time;
+            bool window;
+            bool eof;
+            int batch;
         } file;
     } u;
     // order
     char *event_buf, *event;
     int size;
+    // zip
+    struct event_zip *zip;
+    u64 nr_events;
+    u64 nr_lost;
     // receive
     int remote_id;
     int pid_pos;
@@ -113,6 +198,8 @@ struct list_head broadcast_block_list = LIST_HEAD_INIT(broadcast_block_list);
 
 static inline void block_free(struct event_block *block);
 static inline void block_broadcast(struct event_block *block, const void *buf, size_t len, int flags);
+static int block_write(struct event_block *block, const void *buf, size_t len, int flags);
+static int block_process_event(struct event_block *block, union perf_event *event);
 static void handle_cdev_event(int fd, unsigned int revents, void *ptr);
 
 
@@ -268,6 +355,246 @@ static int block_event_convert(struct event_block *block, union perf_event *even
     return oncpu ? cpuidx : threadidx;
 }
 
+static struct event_zip *block_zip(struct event_block *block)
+{
+    struct tp *tp = block->eb_list->tp;
+    struct event_zip *zip;
+    u64 sample_type;
+    int pos = 0;
+
+    if (likely(block->zip))
+        return block->zip;
+    if (!tp->evsel)
+        return NULL;
+
+    zip = zalloc(sizeof(*zip));
+    if (!zip)
+        return NULL;
+    zip->raw = malloc(FRAME_RAW_LEN);
+    if (block->eb_list->broadcast)
+        zip->frame = malloc(sizeof(*zip->frame) + lz_compress_bound(FRAME_RAW_LEN));
+    if (!zip->raw || (block->eb_list->broadcast && !zip->frame)) {
+        free(zip->raw);
+        free(zip->frame);
+        free(zip);
+        return NULL;
+    }
+
+    zip->tid_pos = -1;
+    zip->time_pos = -1;
+    zip->cpu_pos = -1;
+    sample_type = perf_evsel__attr(tp->evsel)->sample_type;
+    if (sample_type & PERF_SAMPLE_IDENTIFIER)
+        pos += sizeof(u64);
+    if (sample_type & PERF_SAMPLE_IP)
+        pos += sizeof(u64);
+    if (sample_type & PERF_SAMPLE_TID) {
+        zip->tid_pos = pos;
+        pos += sizeof(u64);
+    }
+    if (sample_type & PERF_SAMPLE_TIME) {
+        zip->time_pos = pos;
+        pos += sizeof(u64);
+    }
+    if (sample_type & PERF_SAMPLE_ADDR)
+        pos += sizeof(u64);
+    if (sample_type & PERF_SAMPLE_ID)
+        pos += sizeof(u64);
+    if (sample_type & PERF_SAMPLE_STREAM_ID)
+        pos += sizeof(u64);
+    if (sample_type & PERF_SAMPLE_CPU) {
+        zip->cpu_pos = pos;
+        pos += sizeof(u64);
+    }
+    zip->min_size = sizeof(struct perf_event_header) + pos;
+
+    block->zip = zip;
+    return zip;
+}
+
+static void zip_reset(struct event_zip *zip)
+{
+    zip->raw_len = 0;
+    zip->raw_pos = 0;
+    zip->nr_events = 0;
+    zip->prev_tid = 0;
+    zip->prev_time = 0;
+    zip->prev_cpu = 0;
+}
+
+/*
+ * time: delta to the previous sample.
+ * pid/tid, cpu: xor with the previous sample, 0 for the same task and cpu.
+ */
+static void zip_delta(struct event_zip *zip, union perf_event *event, bool encode)
+{
+    void *data = (void *)event->sample.array;
+    u64 *p, v;
+
+    if (event->header.size < zip->min_size)
+        return;
+
+    if (zip->time_pos >= 0) {
+        p = data + zip->time_pos;
+        v = *p;
+        *p = encode ? v - zip->prev_time : v + zip->prev_time;
+        zip->prev_time = encode ? v : *p;
+    }
+    if (zip->tid_pos >= 0) {
+        p = data + zip->tid_pos;
+        v = *p;
+        *p = v ^ zip->prev_tid;
+        zip->prev_tid = encode ? v : *p;
+    }
+    if (zip->cpu_pos >= 0) {
+        p = data + zip->cpu_pos;
+        v = *p;
+        *p = v ^ zip->prev_cpu;
+        zip->prev_cpu = encode ? v : *p;
+    }
+}
+
+static void block_zip_flush(struct event_block *block)
+{
+    struct event_zip *zip = block->zip;
+    struct perf_record_frame *frame;
+    int len;
+
+    if (!zip || !zip->raw_len)
+        return;
+
+    frame = zip->frame;
+    len = lz_compress(zip->raw, zip->raw_len, frame + 1, lz_compress_bound(FRAME_RAW_LEN));
+    if (len > 0 && len < zip->raw_len)
+        frame->codec = FRAME_CODEC_LZ;
+    else {
+        memcpy(frame + 1, zip->raw, zip->raw_len);
+        len = zip->raw_len;
+        frame->codec = FRAME_CODEC_NONE;
+    }
+    frame->header.type = PERF_RECORD_FRAME;
+    frame->header.misc = 0;
+    frame->header.size = sizeof(*frame) + len;
+    frame->raw_size = zip->raw_len;
+    frame->nr_events = zip->nr_events;
+    frame->unused = 0;
+
+    if (block_write(block, frame, frame->header.size, 0))
+        block->nr_lost += zip->nr_events;
+
+    zip->nr_frames++;
+    zip->raw_bytes += zip->raw_len;
+    zip->zip_bytes += frame->header.size;
+    zip_reset(zip);
+}
+
+static void block_zip_add(struct event_block *block, struct event_zip *zip, const void *buf, size_t len)
+{
+    union perf_event *event;
+
+    if (zip->raw_len + len > FRAME_RAW_LEN)
+        block_zip_flush(block);
+
+    event = (void *)zip->raw + zip->raw_len;
+    memcpy(event, buf, len);
+    if (event->header.type == PERF_RECORD_SAMPLE && event->header.size == len)
+        zip_delta(zip, event, true);
+    zip->raw_len += len;
+    zip->nr_events++;
+}
+
+static int block_frame_decode(struct event_block *block, union perf_event *event)
+{
+    struct perf_record_frame *frame = (void *)event;
+    struct event_zip *zip = block_zip(block);
+    union perf_event *e;
+    int len, pos;
+
+    if (!zip || frame->header.size < sizeof(*frame) ||
+        frame->raw_size > FRAME_RAW_LEN)
+        goto failed;
+
+    zip_reset(zip);
+    len = frame->header.size - sizeof(*frame);
+    switch (frame->codec) {
+        case FRAME_CODEC_NONE:
+            if (len != frame->raw_size)
+                goto failed;
+            memcpy(zip->raw, frame + 1, len);
+            break;
+        case FRAME_CODEC_LZ:
+            len = lz_decompress(frame + 1, len, zip->raw, frame->raw_size);
+            if (len != frame->raw_size)
+                goto failed;
+            break;
+        default:
+            goto failed;
+    }
+
+    for (pos = 0; pos < len; pos += e->header.size) {
+        e = (void *)zip->raw + pos;
+        if (len - pos < (int)sizeof(struct perf_event_header) ||
+            e->header.size < sizeof(struct perf_event_header) ||
+            e->header.size > len - pos ||
+            e->header.type == PERF_RECORD_FRAME)
+            goto failed;
+        if (e->header.type == PERF_RECORD_SAMPLE)
+            zip_delta(zip, e, false);
+    }
+
+    zip->raw_len = len;
+    zip->nr_frames++;
+    zip->raw_bytes += len;
+    zip->zip_bytes += frame->header.size;
+    return 0;
+
+failed:
+    if (zip) {
+        zip_reset(zip);
+        zip->nr_errors++;
+    }
+    return -1;
+}
+
+static int block_frame_process(struct event_block *block, union perf_event *event)
+{
+    struct event_zip *zip;
+    union perf_event *e;
+
+    // Drop the corrupted frame.
+    if (block_frame_decode(block, event) < 0)
+        return 0;
+
+    zip = block->zip;
+    while (zip->raw_pos < zip->raw_len) {
+        e = (void *)zip->raw + zip->raw_pos;
+        zip->raw_pos += e->header.size;
+        if (block_process_event(block, e) < 0)
+            return -1;
+    }
+    zip_reset(zip);
+    return 0;
+}
+
+static void block_zip_free(struct event_block *block)
+{
+    struct event_zip *zip = block->zip;
+
+    if (!zip)
+        return;
+
+    if (block->eb_list->broadcast)
+        block_zip_flush(block);
+    if (zip->nr_frames || zip->nr_errors)
+        printf("%s %s: %lu frames, %lu => %lu bytes, lost %lu, errors %lu\n",
+                block->eb_list->broadcast ? "Push" : "Pull", block->block_def,
+                zip->nr_frames, zip->raw_bytes, zip->zip_bytes, block->nr_lost, zip->nr_errors);
+    free(zip->raw);
+    free(zip->frame);
+    free(zip);
+    block->zip = NULL;
+}
+
 static int block_process_event(struct event_block *block, union perf_event *event)
 {
     struct tp *tp = block->eb_list->tp;
@@ -319,6 +646,8 @@ static int block_process_event(struct event_block *block, union perf_event *even
             ins = block_event_convert(block, event);
             if (ins < 0) return 0;
             else break;
+        case PERF_RECORD_FRAME:
+            return block_frame_process(block, event);
         default:
             if (!prof_dev_enabled(tp->dev))
                 return 0;
@@ -343,6 +672,18 @@ static union perf_event *block_read_event(void *stream, bool init,
     int ret;
 
 tcp_retry:
+    // Read out the decoded frame first, then consume its PERF_RECORD_FRAME.
+    if (block->zip && block->zip->raw_len) {
+        struct event_zip *zip = block->zip;
+        if (zip->raw_pos < zip->raw_len) {
+            event = (void *)zip->raw + zip->raw_pos;
+            zip->raw_pos += event->header.size;
+            goto process;
+        }
+        zip_reset(zip);
+        event = (void *)block->event;
+    }
+
     // consume
     if (block->size > sizeof(struct perf_event_header) &&
         block->size >= event->header.size) {
@@ -367,6 +708,11 @@ tcp_retry:
     // read event
     if (block->size > sizeof(struct perf_event_header) &&
         block->size >= event->header.size) {
+        if (unlikely(event->header.type == PERF_RECORD_FRAME)) {
+            block_frame_decode(block, event);
+            goto tcp_retry;
+        }
+process:
         if (unlikely(event->header.type == PERF_RECORD_TP)) {
             if (block_process_event(block, event) < 0)
                 return NULL;
@@ -465,7 +811,7 @@ static int perf_record_tp_init(struct tp *tp, struct perf_record_tp *record)
     record->sample_period = attr->sample_period;
     record->sample_type = attr->sample_type;
     record->event_size = tep__event_size(tp->id);
-    record->unused = 0;
+    record->flags = 0;
 
     return 0;
 }
@@ -484,6 +830,8 @@ static int tcp_new_client(struct tcp_socket_ops *ops)
     tp = block->eb_list->tp;
     if (perf_record_tp_init(tp, &record) < 0)
         goto err;
+    if (tp->zip)
+        record.flags |= PERF_RECORD_TP_ZIP;
 
     if (tcp_send(ops->client, &record, sizeof(record), MSG_MORE) == 0 &&
         tcp_send(ops->client, tp->sys, strlen(tp->sys)+1, MSG_MORE) == 0 &&
@@ -525,10 +873,15 @@ static int cdev_write_header(struct event_block *block)
 
     if (perf_record_tp_init(tp, &record) < 0)
         return -1;
+    if (tp->zip)
+        record.flags |= PERF_RECORD_TP_ZIP;
 
-    block_broadcast(block, &record, sizeof(record), 0);
-    block_broadcast(block, tp->sys, strlen(tp->sys)+1, 0);
-    block_broadcast(block, tp->name, strlen(tp->name)+1, 0);
+    // The header is never compressed, drop the events batched before connecting.
+    if (block->zip)
+        zip_reset(block->zip);
+    block_write(block, &record, sizeof(record), 0);
+    block_write(block, tp->sys, strlen(tp->sys)+1, 0);
+    block_write(block, tp->name, strlen(tp->name)+1, 0);
 
     prof_dev_flush(tp->dev, PROF_DEV_FLUSH_NORMAL);
     return 0;
@@ -587,6 +940,8 @@ static void handle_cdev_event(int fd, unsigned int revents, void *ptr)
         cdev->tail = 0;
         memset(&cdev->lost_event, 0, sizeof(struct perf_record_lost));
         cdev->read = 0;
+        if (block->zip)
+            zip_reset(block->zip);
 
         // reopen.
         // There may be some dirty data in cdev, which can be refreshed by reopening.
@@ -627,53 +982,354 @@ static void handle_cdev_event(int fd, unsigned int revents, void *ptr)
         }
         cdev->tail = (cdev->tail + wr) & (BUF_LEN-1);
         if (cdev->lost_event.lost > 0 && wr >= sizeof(struct perf_record_lost)) {
-            block_broadcast(block, &cdev->lost_event, sizeof(struct perf_record_lost), 0);
+            block_write(block, &cdev->lost_event, sizeof(struct perf_record_lost), 0);
             cdev->lost_event.lost = 0;
         }
         goto retry;
     }
 }
 
+static int file_write(struct file_block *file, const void *buf, size_t len)
+{
+    ssize_t wr;
+
+    while (len) {
+        wr = write(file->fd, buf, len);
+        if (wr < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "Unable write to %s: %s\n", file->filename, strerror(errno));
+            return -1;
+        }
+        buf += wr;
+        len -= wr;
+        file->pos += wr;
+    }
+    return 0;
+}
+
 static int file_write_header(struct event_block *block)
 {
     struct tp *tp = block->eb_list->tp;
+    struct file_block *file = &block->u.file;
     struct perf_record_tp record;
-    FILE *file = block->u.file.file;
-    size_t pos = 0;
 
     if (perf_record_tp_init(tp, &record) < 0)
         return -1;
 
-    pos += fwrite(&record, 1, sizeof(record), file);
-    pos += fwrite(tp->sys, 1, strlen(tp->sys)+1, file);
-    pos += fwrite(tp->name, 1, strlen(tp->name)+1, file);
-    block->u.file.pos = pos;
-    fflush(file);
+    if (file_write(file, &record, sizeof(record)) < 0 ||
+        file_write(file, tp->sys, strlen(tp->sys)+1) < 0 ||
+        file_write(file, tp->name, strlen(tp->name)+1) < 0)
+        return -1;
+    return 0;
+}
+
+static void file_chunk_reset(struct perf_record_file_chunk *chunk)
+{
+    chunk->header.type = PERF_RECORD_FILE_CHUNK;
+    chunk->header.misc = 0;
+    chunk->header.size = sizeof(*chunk);
+    chunk->nr_events = 0;
+    chunk->size = 0;
+    chunk->start_time = 0;
+    chunk->end_time = 0;
+}
+
+/*
+ * The chunk is indexed only after it is completely written. On failure, the
+ * partially written chunk is truncated and kept in memory for the next flush.
+ */
+static int file_chunk_flush(struct file_block *file)
+{
+    struct perf_record_file_chunk *chunk = file->chunk;
+    struct file_chunk_index *idx;
+    size_t pos = file->pos;
+
+    if (!chunk->size)
+        return 0;
+
+    if ((file->nr_index & (file->nr_index - 1)) == 0) {
+        idx = realloc(file->index, (file->nr_index ? file->nr_index * 2 : 64) * sizeof(*idx));
+        if (!idx)
+            return -1;
+        file->index = idx;
+    }
+
+    if (file_write(file, chunk, sizeof(*chunk) + chunk->size) < 0) {
+        if (file->pos != pos &&
+            ftruncate(file->fd, pos) == 0 &&
+            lseek(file->fd, pos, SEEK_SET) == (off_t)pos)
+            file->pos = pos;
+        return -1;
+    }
+
+    idx = &file->index[file->nr_index++];
+    idx->offset = pos;
+    idx->start_time = chunk->start_time;
+    idx->end_time = chunk->end_time;
+    file_chunk_reset(chunk);
+    return 0;
+}
+
+/*
+ * Returns nonzero if the event is dropped, the full chunk cannot be flushed.
+ */
+static int file_chunk_add(struct event_block *block, const void *buf, size_t len)
+{
+    struct file_block *file = &block->u.file;
+    struct perf_record_file_chunk *chunk = file->chunk;
+    const struct perf_event_header *header = buf;
+
+    if (sizeof(*chunk) + chunk->size + len > FILE_CHUNK_SIZE &&
+        file_chunk_flush(file) < 0)
+        return 1;
+    if (sizeof(*chunk) + len > FILE_CHUNK_SIZE)
+        return 1;
+
+    memcpy((void *)(chunk + 1) + chunk->size, buf, len);
+    chunk->size += len;
+
+    if (header->type == PERF_RECORD_SAMPLE && len == header->size) {
+        u64 time = block->eb_list->last_event_time;
+        if (chunk->nr_events++ == 0)
+            chunk->start_time = time;
+        if (time > chunk->end_time)
+            chunk->end_time = time;
+    }
+    return 0;
+}
+
+static void file_close_archive(struct file_block *file)
+{
+    struct file_trailer trailer;
+
+    if (file->pos && file_chunk_flush(file) == 0) {
+        memcpy(trailer.magic, FILE_TRAILER_MAGIC, sizeof(trailer.magic));
+        trailer.index_offset = file->pos;
+        trailer.nr_chunks = file->nr_index;
+        if (file->nr_index)
+            file_write(file, file->index, file->nr_index * sizeof(*file->index));
+        file_write(file, &trailer, sizeof(trailer));
+    }
+    free(file->chunk);
+    free(file->index);
+}
+
+/*
+ * START-END, in seconds, same as the time printed by perf-prof.
+ * Either of them can be omitted.
+ */
+static u64 file_time_parse(const char *s, char **end)
+{
+    u64 sec = strtoull(s, end, 10);
+    u64 ns = 0, scale = 100000000;
+
+    if (**end == '.') {
+        s = *end + 1;
+        while (*s >= '0' && *s <= '9') {
+            ns += (*s - '0') * scale;
+            scale /= 10;
+            s++;
+        }
+        *end = (char *)s;
+    }
+    return sec * NSEC_PER_SEC + ns;
+}
+
+static int file_window_parse(struct file_block *file, char *window)
+{
+    char *end;
+
+    file->start_time = 0;
+    file->end_time = ULLONG_MAX;
+    if (*window != '-') {
+        file->start_time = file_time_parse(window, &end);
+        if (end == window || *end != '-')
+            return -1;
+        window = end;
+    }
+    window++;
+    if (*window) {
+        file->end_time = file_time_parse(window, &end);
+        if (end == window || *end)
+            return -1;
+    }
+    file->window = true;
+    return 0;
+}
+
+static int file_map(struct file_block *file)
+{
+    struct file_trailer *trailer;
+    struct file_chunk_index *idx;
+    struct stat st;
+
+    if (fstat(file->fd, &st) < 0)
+        return -1;
+
+    file->map_size = st.st_size;
+    file->cur = 0;
+    file->end = st.st_size;
+    file->seek = 0;
+    file->eof = false;
+    if (!file->map_size)
+        return 0;
+
+    /*
+     * MAP_PRIVATE: block_event_convert() modifies the events in place, only the
+     * touched pages are copied.
+     */
+    file->map = mmap(NULL, file->map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, file->fd, 0);
+    if (file->map == MAP_FAILED) {
+        file->map = NULL;
+        return -1;
+    }
+    madvise(file->map, file->map_size, MADV_SEQUENTIAL);
+
+    if (file->map_size < sizeof(*trailer))
+        return 0;
+    trailer = file->map + file->map_size - sizeof(*trailer);
+    if (memcmp(trailer->magic, FILE_TRAILER_MAGIC, sizeof(trailer->magic)) ||
+        trailer->index_offset + trailer->nr_chunks * sizeof(*idx) + sizeof(*trailer) != file->map_size)
+        return 0;
+
+    file->end = trailer->index_offset;
+    if (file->window && trailer->nr_chunks) {
+        int l = 0, h = trailer->nr_chunks, m;
+
+        // the first chunk with end_time >= start_time
+        idx = file->map + trailer->index_offset;
+        while (l < h) {
+            m = l + (h - l) / 2;
+            if (idx[m].end_time < file->start_time)
+                l = m + 1;
+            else
+                h = m;
+        }
+        file->seek = l < trailer->nr_chunks ? idx[l].offset : file->end;
+    }
     return 0;
 }
 
+static union perf_event *file_next_event(struct event_block *block)
+{
+    struct file_block *file = &block->u.file;
+    struct event_block_list *eb_list = block->eb_list;
+    union perf_event *event;
+    u64 time;
+
+    while (file->cur + sizeof(struct perf_event_header) <= file->end) {
+        event = file->map + file->cur;
+        if (event->header.size < sizeof(struct perf_event_header) ||
+            file->cur + event->header.size > file->end)
+            break;
+        file->cur += event->header.size;
+
+        switch (event->header.type) {
+            case PERF_RECORD_TP:
+                // Jump to the time window after the header.
+                if (file->seek > file->cur)
+                    file->cur = file->seek;
+                return event;
+            case PERF_RECORD_FILE_CHUNK: {
+                struct perf_record_file_chunk *chunk = (void *)event;
+                if (!file->window || !chunk->nr_events)
+                    continue;
+                if (chunk->end_time < file->start_time) {
+                    file->cur += chunk->size;
+                    continue;
+                }
+                if (chunk->start_time > file->end_time)
+                    goto eof;
+                continue;
+                }
+            case PERF_RECORD_SAMPLE:
+                if (!file->window)
+                    return event;
+                if (unlikely(eb_list->time_pos == -1))
+                    eb_list->time_pos = eb_list->tp->dev->pos.time_pos;
+                time = *(u64 *)((void *)event->sample.array + eb_list->time_pos);
+                if (time < file->start_time)
+                    continue;
+                if (time > file->end_time)
+                    goto eof;
+                return event;
+            default:
+                return event;
+        }
+    }
+eof:
+    file->eof = true;
+    return NULL;
+}
+
+static union perf_event *file_read_event(void *stream, bool init, int *ins, bool *writable, bool *converted)
+{
+    struct event_block *block = stream;
+    struct file_block *file = &block->u.file;
+    union perf_event *event;
+
+    // Like the other streams, only read a batch of events at init.
+    if (init)
+        file->batch = 0;
+
+    while (file->batch < FILE_READ_BATCH &&
+           (event = file_next_event(block)) != NULL) {
+        file->batch++;
+        if (unlikely(event->header.type == PERF_RECORD_TP)) {
+            if (block_process_event(block, event) < 0)
+                return NULL;
+            continue;
+        }
+
+        if (!prof_dev_enabled(block->eb_list->tp->dev))
+            continue;
+
+        if (event->header.type == PERF_RECORD_SAMPLE) {
+            *ins = block_event_convert(block, event);
+            if (*ins < 0)
+                continue;
+        } else
+            *ins = 0;
+
+        *writable = 1;
+        *converted = 1;
+        return event;
+    }
+    return NULL;
+}
+
 static void handle_file_event(int fd, unsigned int revents, void *ptr)
 {
     struct event_block *block = ptr;
-    FILE *file = block->u.file.file;
-    char event_copy[PERF_SAMPLE_MAX_SIZE];
-    union perf_event *event = (void *)event_copy;
-    int len, i;
-
-    for (i = 0; i < 64; i++) {
-        len = fread(event_copy, 1, sizeof(struct perf_event_header), file);
-        if (len == sizeof(struct perf_event_header))
-            len += fread(event_copy+len, 1, event->header.size-len, file);
-        if (len != event->header.size)
-            goto err;
-        if (block_process_event(block, event) < 0)
-            break;
+    struct prof_dev *dev = block->eb_list->tp->dev;
+    union perf_event *event;
+    int i;
+
+    /*
+     * -N closes the dev within block_process_event(), which frees the block and
+     * unmaps the file. Hold the dev until the loop stops.
+     */
+    prof_dev_get(dev);
+    if (using_order(dev)) {
+        order_stream(dev);
+        if (dev->state != PROF_DEV_STATE_EXIT && block->u.file.eof)
+            block_free(block);
+        goto put;
     }
-    return ;
 
-err:
-    block_free(block);
-    return;
+    for (i = 0; i < FILE_READ_BATCH; i++) {
+        event = file_next_event(block);
+        if (!event) {
+            block_free(block);
+            break;
+        }
+        if (block_process_event(block, event) < 0 ||
+            dev->state == PROF_DEV_STATE_EXIT)
+            break;
+    }
+put:
+    prof_dev_put(dev);
 }
 
 static int block_new(struct event_block_list *eb_list, char *value)
@@ -682,7 +1338,8 @@ static int block_new(struct event_block_list *eb_list, char *value)
     struct event_block *block = NULL;
     char *ip = NULL;
     char *port;
-    FILE *file = NULL;
+    char *window = NULL;
+    int fd = -1;
     struct stat st;
 
     port = strchr(value, ':');
@@ -767,26 +1424,50 @@ static int block_new(struct event_block_list *eb_list, char *value)
     /*
      * Check if it is a file.
      */
-    if ((file = fopen(port, eb_list->broadcast ? "w+" : "r"))) {
-        block->u.file.file = file;
-        block->u.file.pos = 0;
-        block->u.file.filename = port;
+    if (!eb_list->broadcast && (window = strrchr(port, '@')) != NULL)
+        *window++ = '\0';
+    fd = eb_list->broadcast ? open(port, O_RDWR | O_CREAT | O_TRUNC, 0644) : open(port, O_RDONLY);
+    if (fd >= 0) {
+        struct file_block *file = &block->u.file;
+
+        // The union still holds the tcp fields of the failed detection.
+        memset(file, 0, sizeof(*file));
+        file->fd = fd;
+        file->pos = 0;
+        file->filename = port;
+        file->notifyfd = -1;
         block->type = TYPE_FILE;
         if (!eb_list->broadcast) {
-            block->u.file.notifyfd = eventfd(1, EFD_NONBLOCK);
-            if (block->u.file.notifyfd < 0)
+            if (window && file_window_parse(file, window) < 0)
                 goto failed;
-            main_epoll_add(block->u.file.notifyfd, EPOLLIN, block, handle_file_event);
-        } else
-            block->u.file.notifyfd = -1;
-        printf("Open file %s\n", block->u.file.filename);
+            if (file_map(file) < 0)
+                goto failed;
+            file->notifyfd = eventfd(1, EFD_NONBLOCK);
+            if (file->notifyfd < 0)
+                goto failed_unmap;
+            if (using_order(dev) &&
+                order_register(dev, file_read_event, block) < 0) {
+                close(file->notifyfd);
+                goto failed_unmap;
+            }
+            main_epoll_add(file->notifyfd, EPOLLIN, block, handle_file_event);
+        } else {
+            if (posix_memalign((void **)&file->chunk, 4096, FILE_CHUNK_SIZE))
+                goto failed;
+            file_chunk_reset(file->chunk);
+        }
+        printf("Open file %s\n", file->filename);
         return 0;
     }
+    goto failed;
 
+failed_unmap:
+    if (block->u.file.map)
+        munmap(block->u.file.map, block->u.file.map_size);
 failed:
     // failed
     list_del(&block->link);
-    if (file) fclose(file);
+    if (fd >= 0) close(fd);
     free(block);
 err_return:
     fprintf(stderr, "The pull=%s attribute is incorrect.\n", value);
@@ -798,6 +1479,7 @@ static void block_free(struct event_block *block)
     struct event_block_list *eb_list = block->eb_list;
     struct prof_dev *dev = eb_list->tp->dev;
 
+    block_zip_free(block);
     switch (block->type) {
         case TYPE_TCP:
             tcp_close(block->u.tcp.tcp);
@@ -817,9 +1499,19 @@ static void block_free(struct event_block *block)
             printf("Close cdev %s\n", block->u.cdev.filename);
             break;
         case TYPE_FILE:
-            if (block->u.file.notifyfd >= 0)
-                main_epoll_del(block->u.file.notifyfd);
-            fclose(block->u.file.file);
+            if (eb_list->broadcast)
+                file_close_archive(&block->u.file);
+            else {
+                if (using_order(dev))
+                    order_unregister(dev, block);
+                if (block->u.file.notifyfd >= 0) {
+                    main_epoll_del(block->u.file.notifyfd);
+                    close(block->u.file.notifyfd);
+                }
+                if (block->u.file.map)
+                    munmap(block->u.file.map, block->u.file.map_size);
+            }
+            close(block->u.file.fd);
             printf("Close file %s\n", block->u.file.filename);
             break;
         default:
@@ -840,11 +1532,17 @@ static void block_free(struct event_block *block)
     }
 }
 
-static inline void block_broadcast(struct event_block *block, const void *buf, size_t len, int flags)
+/*
+ * Write to the transport directly.
+ * Returns nonzero if the buffer is dropped by the tcp clients or the cdev.
+ */
+static int block_write(struct event_block *block, const void *buf, size_t len, int flags)
 {
+    int lost = 0;
+
     switch (block->type) {
         case TYPE_TCP:
-            tcp_server_broadcast(block->u.tcp.tcp, buf, len, flags);
+            lost = tcp_server_broadcast(block->u.tcp.tcp, buf, len, flags);
             break;
         case TYPE_CDEV: {
             struct cdev_block *cdev = &block->u.cdev;
@@ -871,17 +1569,35 @@ static inline void block_broadcast(struct event_block *block, const void *buf, s
                     cdev->lost_event.header.misc = 0;
                     cdev->lost_event.id          = 0;
                     cdev->lost_event.lost        ++ ;
+                    lost = 1;
                 }
             }
             } break;
         case TYPE_FILE:
             if (block->u.file.pos == 0)
                 file_write_header(block);
-            block->u.file.pos += fwrite(buf, 1, len, block->u.file.file);
+            lost = file_chunk_add(block, buf, len);
             break;
         default:
             break;
     }
+    return lost;
+}
+
+static inline void block_broadcast(struct event_block *block, const void *buf, size_t len, int flags)
+{
+    struct event_zip *zip;
+
+    block->nr_events++;
+    if (block->eb_list->tp->zip && block->type != TYPE_FILE &&
+        len <= FRAME_RAW_LEN && (zip = block_zip(block)) != NULL) {
+        block_zip_add(block, zip, buf, len);
+        return;
+    }
+    // Keep the order with the batched events.
+    block_zip_flush(block);
+    if (block_write(block, buf, len, flags))
+        block->nr_lost++;
 }
 
 static void block_list_free(struct tp *tp, bool broadcast)
@@ -971,6 +1687,9 @@ int tp_broadcast_event(struct tp *tp, union perf_event *event)
     if (!eb_list)
         return 0;
 
+    // The receiver gets a flat perf_record_dev.
+    event = perf_event_materialize(event);
+
     if (event->header.type == PERF_RECORD_SAMPLE) {
         if (unlikely(eb_list->time_pos == -1))
             eb_list->time_pos = eb_list->tp->dev->pos.time_pos;
@@ -993,6 +1712,26 @@ void tp_receive_free(struct tp *tp)
     block_list_free(tp, false);
 }
 
+void event_spread_print(struct prof_dev *dev, int indent)
+{
+    struct event_block_list *eb_list;
+    struct event_block *block;
+
+    list_for_each_entry(eb_list, &broadcast_block_list, link_to) {
+        if (eb_list->tp->dev != dev)
+            continue;
+        list_for_each_entry(block, &eb_list->block_list, link) {
+            struct event_zip *zip = block->zip;
+            dev_printf("push %s:%s %s: events %lu lost %lu", eb_list->tp->sys, eb_list->tp->name,
+                        block->block_def, block->nr_events, block->nr_lost);
+            if (zip && zip->raw_bytes)
+                printf(" frames %lu bytes %lu => %lu ratio %.2f", zip->nr_frames, zip->raw_bytes,
+                        zip->zip_bytes, (double)zip->raw_bytes / zip->zip_bytes);
+            printf("\n");
+        }
+    }
+}
+
 
 static struct timer push_timer;
 static void perf_clock_timer(struct timer *t)
@@ -1058,6 +1797,7 @@ static void perf_clock_sample(struct prof_dev *dev, union perf_event *event, int
 {
     struct prof_dev *main_dev;
     struct event_block_list *eb_list;
+    struct event_block *block;
     union {
         union perf_event event;
         struct perf_record_order_time o;
@@ -1099,6 +1839,8 @@ restart:
             order_time.o.order_time = perfclock_to_evclock(dev, timer->time).clock;
             tp_broadcast_event(eb_list->tp, (void *)&order_time);
         }
+        list_for_each_entry(block, &eb_list->block_list, link)
+            block_zip_flush(block);
     }
 }
 
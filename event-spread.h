@@ -9,4 +9,6 @@ int tp_broadcast_event(struct tp *tp, union perf_event *event);
 int tp_receive_new(struct tp *tp, char *s);
 void tp_receive_free(struct tp *tp);
 
+void event_spread_print(struct prof_dev *dev, int indent);
+
 #endif
@@ -42,6 +42,12 @@
  * PRTF        PRTF a, [sp]       #case PRTF: t = sp + pc[1]; a = printf((char *)t[-1], t[-2], ...); break;
  * KSYM        KSYM a, [sp]       #case KSYM: a = ksymbol(*sp); break;
  *                                #case EXIT: return a;
+ *
+ * Optimized instructions, only emitted by expr_optimize().
+ * LIG imm64 imm64 LIG a, [imm64]     #case LIG: a = *(size *)pc[0]; pc += 2; break;                       // IMM addr; LI size
+ * ORI imm64   ORI a, imm64       #case ORI: a = a |  *pc++; break;                                      // PSH; IMM imm64; OR
+ * ...                            #
+ * MODI imm64  MODI a, imm64      #case MODI: a = a % *pc++; break;                                      // PSH; IMM imm64; MOD
 **/
 
 #include <stdio.h>
@@ -49,6 +55,8 @@
 #include <memory.h>
 #include <unistd.h>
 #include <setjmp.h>
+#include <limits.h>
+#include <sys/mman.h>
 #include <arpa/inet.h>
 
 #include <monitor.h>
@@ -83,14 +91,21 @@ enum {
 // opcodes
 enum { LEA ,IMM ,JMP ,JSR ,BZ  ,BNZ ,ENT ,ADJ ,LI  ,SI  ,LEV ,PSH ,
        OR  ,XOR ,AND ,EQ  ,NE  ,LT  ,GT  ,LE  ,GE  ,SHL ,SHR ,ADD ,SUB ,MUL ,DIV ,MOD ,
-       PRTF, KSYM, NTHL, NTHS, STRNCMP, EXIT };
+       PRTF, KSYM, NTHL, NTHS, STRNCMP, EXIT,
+       LIG ,ORI ,XORI,ANDI,EQI ,NEI ,LTI ,GTI ,LEI ,GEI ,SHLI,SHRI,ADDI,SUBI,MULI,DIVI,MODI };
 
 // types
 enum { CHAR, SHORT, INT, LONG, ARRAY, PTR = 0x8 };
 
 #define INSN "LEA ,IMM ,JMP ,JSR ,BZ  ,BNZ ,ENT ,ADJ ,LI  ,SI  ,LEV ,PSH ," \
              "OR  ,XOR ,AND ,EQ  ,NE  ,LT  ,GT  ,LE  ,GE  ,SHL ,SHR ,ADD ,SUB ,MUL ,DIV ,MOD ," \
-             "PRTF,KSYM,NTHL,NTHS,SCMP,EXIT,"
+             "PRTF,KSYM,NTHL,NTHS,SCMP,EXIT," \
+             "LIG ,ORI ,XORI,ANDI,EQI ,NEI ,LTI ,GTI ,LEI ,GEI ,SHLI,SHRI,ADDI,SUBI,MULI,DIVI,MODI,"
+
+// number of operands
+#define NR_OPS(i) ((i) <= SI || (i) >= ORI ? 1 : (i) == LIG ? 2 : 0)
+// OR..MOD <=> ORI..MODI
+#define ALU_IMM(i) ((i) + ORI - OR)
 
 #define ADD_KEY(name, _token, _type) \
     { p = (char *)name; { next(); id->token = _token; id->class = 0; id->type = _type; id->value = 0; } }
@@ -352,6 +367,545 @@ static const char *ksymbol(unsigned long func)
     return name ? : "Unknown";
 }
 
+/*
+ * Peephole optimizer.
+ *
+ * The instructions are decoded into a list, rewritten until nothing changes,
+ * and encoded again with the branch targets relocated.
+ *
+ *   IMM a; PSH; IMM b; OP          =>  IMM a OP b        constant folding
+ *   IMM a; OPI b                   =>  IMM a OP b
+ *   PSH; IMM b; OP                 =>  OPI b             immediate operand
+ *   IMM addr; LI size              =>  LIG addr, size    fused load
+ *   ADDI 0, ORI 0, MULI 1, ...     =>                    nop
+ *   IMM a; BZ/BNZ t                =>  IMM a; JMP t, or IMM a
+ *   IMM a; IMM b                   =>  IMM b             dead store
+ *   JMP next                       =>
+ *   JMP t; ...unreachable...       =>  JMP t             dead code
+ *
+ * Instructions covered by a rewrite must not be branch targets.
+**/
+struct opt_insn {
+    long op;
+    long arg[2];
+    int target; // index of the branch target
+    bool is_target;
+    bool dead;
+};
+
+static bool alu_fold(long op, long a, long b, long *r)
+{
+    switch (op) {
+        case OR:  *r = a |  b; break;
+        case XOR: *r = a ^  b; break;
+        case AND: *r = a &  b; break;
+        case EQ:  *r = a == b; break;
+        case NE:  *r = a != b; break;
+        case LT:  *r = a <  b; break;
+        case GT:  *r = a >  b; break;
+        case LE:  *r = a <= b; break;
+        case GE:  *r = a >= b; break;
+        // Wrap around as the interpreter does, in unsigned long to avoid UB.
+        case SHL: if (b < 0 || b >= 64) return false; *r = (long)((unsigned long)a << b); break;
+        case SHR: if (b < 0 || b >= 64) return false; *r = a >> b; break;
+        case ADD: *r = (long)((unsigned long)a + (unsigned long)b); break;
+        case SUB: *r = (long)((unsigned long)a - (unsigned long)b); break;
+        case MUL: *r = (long)((unsigned long)a * (unsigned long)b); break;
+        case DIV: if (b == 0 || (b == -1 && a == LONG_MIN)) return false; *r = a / b; break;
+        case MOD: if (b == 0 || (b == -1 && a == LONG_MIN)) return false; *r = a % b; break;
+        default: return false;
+    }
+    return true;
+}
+
+static bool alu_nop(long op, long b)
+{
+    switch (op) {
+        case ORI: case XORI: case SHLI: case SHRI: case ADDI: case SUBI: return b == 0;
+        case ANDI: return b == -1;
+        case MULI: case DIVI: return b == 1;
+        default: return false;
+    }
+}
+
+// next live instruction after i
+static int opt_next(struct opt_insn *list, int n, int i)
+{
+    while (++i < n && list[i].dead) ;
+    return i;
+}
+
+static void expr_optimize(struct expr_prog *prog)
+{
+    long *insn = prog->insn, *pc, *end = insn + prog->nr_insn;
+    struct opt_insn *list;
+    int *index, *offset;
+    int n = 0, i, j, k, l, nr_insn;
+    bool changed;
+
+    list = calloc(prog->nr_insn, sizeof(*list));
+    index = calloc(prog->nr_insn + 1, sizeof(*index));
+    offset = calloc(prog->nr_insn + 1, sizeof(*offset));
+    if (!list || !index || !offset)
+        goto out;
+
+    // decode
+    for (pc = insn + 1; pc < end; n++) {
+        index[pc - insn] = n;
+        list[n].op = *pc++;
+        list[n].target = -1;
+        for (i = 0; i < NR_OPS(list[n].op); i++)
+            list[n].arg[i] = *pc++;
+        if (list[n].op == JSR || list[n].op == ENT || list[n].op == LEA || list[n].op == LEV)
+            goto out;
+    }
+    index[pc - insn] = n;
+    for (i = 0; i < n; i++)
+        if (list[i].op == JMP || list[i].op == BZ || list[i].op == BNZ)
+            list[i].target = index[(long *)list[i].arg[0] - insn];
+
+    do {
+        changed = false;
+        for (i = 0; i < n; i++)
+            list[i].is_target = false;
+        for (i = 0; i < n; i++) {
+            if (!list[i].dead && list[i].target >= 0) {
+                // a removed target falls through to the next live instruction
+                while (list[i].target < n && list[list[i].target].dead)
+                    list[i].target++;
+                if (list[i].target < n)
+                    list[list[i].target].is_target = true;
+            }
+        }
+
+        for (i = 0; i < n; i = opt_next(list, n, i)) {
+            struct opt_insn *a = &list[i], *b, *c, *d;
+            long r;
+
+            if (a->dead) continue;
+            j = opt_next(list, n, i); b = j < n ? &list[j] : NULL;
+            k = opt_next(list, n, j); c = k < n ? &list[k] : NULL;
+            l = opt_next(list, n, k); d = l < n ? &list[l] : NULL;
+
+            if (a->op == IMM && b && !b->is_target) {
+                if (c && d && b->op == PSH && c->op == IMM && !c->is_target && !d->is_target &&
+                    alu_fold(d->op, a->arg[0], c->arg[0], &r)) {
+                    a->arg[0] = r;
+                    b->dead = c->dead = d->dead = true;
+                    changed = true; continue;
+                }
+                if (b->op >= ORI && alu_fold(b->op - ORI + OR, a->arg[0], b->arg[0], &r)) {
+                    a->arg[0] = r;
+                    b->dead = true;
+                    changed = true; continue;
+                }
+                if (b->op == LI) {
+                    a->op = LIG;
+                    a->arg[1] = b->arg[0];
+                    b->dead = true;
+                    changed = true; continue;
+                }
+                if (b->op == BZ || b->op == BNZ) {
+                    if (!!a->arg[0] == (b->op == BNZ)) b->op = JMP;
+                    else b->dead = true;
+                    changed = true; continue;
+                }
+                if (b->op == IMM || b->op == LIG) {
+                    a->dead = true;
+                    changed = true; continue;
+                }
+            }
+            if (a->op == PSH && b && c && b->op == IMM && !b->is_target && !c->is_target &&
+                c->op >= OR && c->op <= MOD) {
+                a->op = ALU_IMM(c->op);
+                a->arg[0] = b->arg[0];
+                b->dead = c->dead = true;
+                changed = true; continue;
+            }
+            if (a->op >= ORI && alu_nop(a->op, a->arg[0])) {
+                a->dead = true;
+                changed = true; continue;
+            }
+            if (a->op == JMP && a->target == j) {
+                a->dead = true;
+                changed = true; continue;
+            }
+            if (a->op == JMP || a->op == EXIT) {
+                for (; j < n && !list[j].is_target; j = opt_next(list, n, j)) {
+                    list[j].dead = true;
+                    changed = true;
+                }
+            }
+        }
+    } while (changed);
+
+    // encode
+    nr_insn = 1;
+    for (i = 0; i < n; i++) {
+        offset[i] = nr_insn;
+        if (!list[i].dead)
+            nr_insn += 1 + NR_OPS(list[i].op);
+    }
+    offset[n] = nr_insn;
+    pc = insn;
+    for (i = 0; i < n; i++) {
+        if (list[i].dead) continue;
+        *++pc = list[i].op;
+        if (list[i].target >= 0)
+            list[i].arg[0] = (long)(insn + offset[list[i].target]);
+        for (j = 0; j < NR_OPS(list[i].op); j++)
+            *++pc = list[i].arg[j];
+    }
+
+    prog->nr_insn = nr_insn;
+    for (i = 0; i < n; i++)
+        prog->nr_opt_insn += !list[i].dead;
+    prog->nr_raw_insn = n;
+
+out:
+    if (list) free(list);
+    if (index) free(index);
+    if (offset) free(offset);
+}
+
+/*
+ * Program shapes run by expr_run_data() directly on the record, without
+ * expr_load_data().
+ *
+ *   LIG field; EXIT               SHAPE_FIELD
+ *   LIG field; EQI..GEI imm; EXIT SHAPE_FIELD_CMP
+ *   LIG field; ANDI imm; EXIT     SHAPE_FIELD_AND
+**/
+enum { SHAPE_NONE, SHAPE_FIELD, SHAPE_FIELD_CMP, SHAPE_FIELD_AND };
+
+static void expr_shape(struct expr_prog *prog)
+{
+    long *insn = prog->insn + 1;
+    long off;
+
+    prog->shape = SHAPE_NONE;
+    if (insn[0] != LIG || !prog->data)
+        return;
+    off = insn[1] - (long)prog->data;
+    if (off < 0 || off + insn[2] > prog->datasize)
+        return;
+
+    prog->shape_off = off;
+    prog->shape_size = insn[2];
+    if (prog->nr_insn == 5 && insn[3] == EXIT)
+        prog->shape = SHAPE_FIELD;
+    else if (prog->nr_insn == 7 && insn[5] == EXIT && insn[3] >= EQI && insn[3] <= GEI) {
+        prog->shape = SHAPE_FIELD_CMP;
+        prog->shape_op = insn[3];
+        prog->shape_imm = insn[4];
+    } else if (prog->nr_insn == 7 && insn[5] == EXIT && insn[3] == ANDI) {
+        prog->shape = SHAPE_FIELD_AND;
+        prog->shape_imm = insn[4];
+    }
+}
+
+/*
+ * JIT compiler.
+ *
+ * Translate the instructions into native code. The vm registers are mapped to
+ * machine registers, and the vm stack is the machine stack:
+ *
+ *   a  : rax
+ *   sp : rsp
+ *   rbx: saved rsp, rsp is aligned to 16 bytes before calling library functions.
+ *
+ * Expressions are interpreted by default, the JIT is only used with --expr-jit.
+ *
+ * LEA, JSR, ENT and LEV are never emitted, because the expression does not
+ * support functions and local variables. If they appear, or the executable
+ * memory cannot be allocated, prog->jit is NULL and expr_run() interprets.
+**/
+bool expr_jit = false;
+
+#if defined(__x86_64__)
+struct jit_ctx {
+    unsigned char *image, *ip;
+    int *offset; // native offset of each instruction
+    struct { int at; int target; } *fixup;
+    int nr_fixup;
+    bool *is_target;
+    unsigned char cc; // setcc of the last compare, its flags are still valid
+};
+
+static const unsigned char setcc[] = {
+    [EQ-EQ] = 0x94, [NE-EQ] = 0x95, [LT-EQ] = 0x9C, [GT-EQ] = 0x9F, [LE-EQ] = 0x9E, [GE-EQ] = 0x9D };
+
+#define EMIT(...) do { unsigned char __c[] = { __VA_ARGS__ }; memcpy(ctx->ip, __c, sizeof(__c)); ctx->ip += sizeof(__c); } while (0)
+#define EMIT32(v) do { int __v = (int)(v); memcpy(ctx->ip, &__v, 4); ctx->ip += 4; } while (0)
+#define EMIT64(v) do { long __v = (long)(v); memcpy(ctx->ip, &__v, 8); ctx->ip += 8; } while (0)
+#define JIT_MAX_INSN_SIZE 96
+
+// mov reg, t[-i], t = sp + n
+static void jit_load_arg(struct jit_ctx *ctx, int reg, long n, int i)
+{
+    if (reg < 8) EMIT(0x48, 0x8B, 0x84 | (reg << 3), 0x24);
+    else EMIT(0x4C, 0x8B, 0x84 | ((reg - 8) << 3), 0x24);
+    EMIT32((n - i) * sizeof(long));
+}
+
+static void jit_call(struct jit_ctx *ctx, void *func, long n, bool varargs)
+{
+    // rdi, rsi, rdx, rcx, r8, r9
+    static const int regs[] = {7, 6, 2, 1, 8, 9};
+    int i;
+
+    for (i = 1; i <= n && i <= 6; i++)
+        jit_load_arg(ctx, regs[i-1], n, i);
+    EMIT(0x48, 0x89, 0xE3);                     // mov rbx, rsp
+    EMIT(0x48, 0x83, 0xE4, 0xF0);               // and rsp, -16
+    if (n == 7) {
+        EMIT(0x48, 0x83, 0xEC, 0x08);           // sub rsp, 8
+        EMIT(0xFF, 0xB3); EMIT32(0);            // push qword [rbx], t[-7]
+    }
+    if (varargs)
+        EMIT(0x31, 0xC0);                       // xor eax, eax
+    EMIT(0x49, 0xBB); EMIT64(func);             // mov r11, func
+    EMIT(0x41, 0xFF, 0xD3);                     // call r11
+    EMIT(0x48, 0x89, 0xDC);                     // mov rsp, rbx
+}
+
+static int jit_emit(struct jit_ctx *ctx, long *insn, int nr_insn)
+{
+    long *pc = insn + 1, *end = insn + nr_insn;
+    long i, n;
+
+    EMIT(0x55);                                 // push rbp
+    EMIT(0x48, 0x89, 0xE5);                     // mov rbp, rsp
+    EMIT(0x53);                                 // push rbx
+    EMIT(0x31, 0xC0);                           // xor eax, eax
+
+    while (pc < end) {
+        // compare-and-branch fusion: BZ/BNZ use the flags of the compare.
+        unsigned char cc = ctx->is_target[pc - insn] ? 0 : ctx->cc;
+
+        ctx->cc = 0;
+        ctx->offset[pc - insn] = ctx->ip - ctx->image;
+        i = *pc++;
+        switch (i) {
+            case IMM:
+                n = *pc++;
+                if (n == (int)n) { EMIT(0x48, 0xC7, 0xC0); EMIT32(n); }      // mov rax, imm32
+                else { EMIT(0x48, 0xB8); EMIT64(n); }                       // mov rax, imm64
+                break;
+            case JMP:
+            case BZ:
+            case BNZ:
+                n = (long *)*pc++ - insn;
+                if (n <= 0 || n >= nr_insn) return -1;
+                if (i == JMP) EMIT(0xE9);                                   // jmp rel32
+                else if (cc) {
+                    if (i == BZ) EMIT(0x0F, (cc - 0x10) ^ 1);               // jncc rel32
+                    else EMIT(0x0F, cc - 0x10);                             // jcc rel32
+                } else {
+                    EMIT(0x48, 0x85, 0xC0);                                 // test rax, rax
+                    if (i == BZ) EMIT(0x0F, 0x84);                          // jz rel32
+                    else EMIT(0x0F, 0x85);                                  // jnz rel32
+                }
+                ctx->fixup[ctx->nr_fixup].at = ctx->ip - ctx->image;
+                ctx->fixup[ctx->nr_fixup].target = n;
+                ctx->nr_fixup++;
+                EMIT32(0);
+                break;
+            case ADJ: EMIT(0x48, 0x81, 0xC4); EMIT32(*pc++ * sizeof(long)); break; // add rsp, imm32
+            case LI:
+                switch (*pc++) {
+                    case sizeof(char): EMIT(0x48, 0x0F, 0xBE, 0x00); break;  // movsx rax, byte [rax]
+                    case sizeof(short): EMIT(0x48, 0x0F, 0xBF, 0x00); break; // movsx rax, word [rax]
+                    case sizeof(int): EMIT(0x48, 0x63, 0x00); break;         // movsxd rax, dword [rax]
+                    case sizeof(long): EMIT(0x48, 0x8B, 0x00); break;        // mov rax, [rax]
+                    default: return -1;
+                }
+                break;
+            case SI:
+                EMIT(0x59);                                                 // pop rcx
+                switch (*pc++) {
+                    case sizeof(char): EMIT(0x88, 0x01); break;             // mov [rcx], al
+                    case sizeof(short): EMIT(0x66, 0x89, 0x01); break;      // mov [rcx], ax
+                    case sizeof(int): EMIT(0x89, 0x01); break;              // mov [rcx], eax
+                    case sizeof(long): EMIT(0x48, 0x89, 0x01); break;       // mov [rcx], rax
+                    default: return -1;
+                }
+                break;
+            case PSH: EMIT(0x50); break;                                    // push rax
+
+            // a = *sp++ op a: pop rcx; rax = rcx op rax
+            case OR:  EMIT(0x59, 0x48, 0x09, 0xC8); break;                  // or rax, rcx
+            case XOR: EMIT(0x59, 0x48, 0x31, 0xC8); break;                  // xor rax, rcx
+            case AND: EMIT(0x59, 0x48, 0x21, 0xC8); break;                  // and rax, rcx
+            case ADD: EMIT(0x59, 0x48, 0x01, 0xC8); break;                  // add rax, rcx
+            case SUB: EMIT(0x59, 0x48, 0x29, 0xC1, 0x48, 0x89, 0xC8); break; // sub rcx, rax; mov rax, rcx
+            case MUL: EMIT(0x59, 0x48, 0x0F, 0xAF, 0xC1); break;            // imul rax, rcx
+            case EQ: case NE: case LT: case GT: case LE: case GE:
+                EMIT(0x59, 0x48, 0x39, 0xC1);                               // cmp rcx, rax
+                EMIT(0x0F, setcc[i-EQ], 0xC0);                              // setcc al
+                EMIT(0x0F, 0xB6, 0xC0);                                     // movzx eax, al
+                ctx->cc = setcc[i-EQ];
+                break;
+            case SHL: EMIT(0x59, 0x48, 0x91, 0x48, 0xD3, 0xE0); break;      // xchg rax, rcx; shl rax, cl
+            case SHR: EMIT(0x59, 0x48, 0x91, 0x48, 0xD3, 0xF8); break;      // xchg rax, rcx; sar rax, cl
+            case DIV: EMIT(0x59, 0x48, 0x91, 0x48, 0x99, 0x48, 0xF7, 0xF9); break; // xchg rax, rcx; cqo; idiv rcx
+            case MOD: EMIT(0x59, 0x48, 0x91, 0x48, 0x99, 0x48, 0xF7, 0xF9,
+                           0x48, 0x89, 0xD0); break;                        // ...; mov rax, rdx
+
+            // The next instruction is `ADJ n`.
+            case PRTF:
+                if (pc >= end || *pc != ADJ || pc[1] > 7) return -1;
+                jit_call(ctx, printf, pc[1], true);
+                EMIT(0x48, 0x63, 0xC0);                                     // movsxd rax, eax
+                break;
+            case KSYM:
+                EMIT(0x48, 0x8B, 0x3C, 0x24);                               // mov rdi, [rsp]
+                jit_call(ctx, ksymbol, 0, false);
+                break;
+            case NTHL:
+                EMIT(0x8B, 0x04, 0x24);                                     // mov eax, [rsp]
+                EMIT(0x0F, 0xC8);                                           // bswap eax
+                EMIT(0x48, 0x63, 0xC0);                                     // movsxd rax, eax
+                break;
+            case NTHS:
+                EMIT(0x0F, 0xB7, 0x04, 0x24);                               // movzx eax, word [rsp]
+                EMIT(0x66, 0xC1, 0xC0, 0x08);                               // rol ax, 8
+                EMIT(0x48, 0x0F, 0xBF, 0xC0);                               // movsx rax, ax
+                break;
+            case STRNCMP:
+                if (pc >= end || *pc != ADJ || pc[1] > 6) return -1;
+                jit_call(ctx, strncmp, pc[1], false);
+                EMIT(0x48, 0x63, 0xC0);                                     // movsxd rax, eax
+                break;
+
+            case LIG:
+                n = *pc++;
+                if (n == (int)n) { EMIT(0x48, 0xC7, 0xC0); EMIT32(n); }      // mov rax, imm32
+                else { EMIT(0x48, 0xB8); EMIT64(n); }                       // mov rax, imm64
+                switch (*pc++) {
+                    case sizeof(char): EMIT(0x48, 0x0F, 0xBE, 0x00); break;  // movsx rax, byte [rax]
+                    case sizeof(short): EMIT(0x48, 0x0F, 0xBF, 0x00); break; // movsx rax, word [rax]
+                    case sizeof(int): EMIT(0x48, 0x63, 0x00); break;         // movsxd rax, dword [rax]
+                    case sizeof(long): EMIT(0x48, 0x8B, 0x00); break;        // mov rax, [rax]
+                    default: return -1;
+                }
+                break;
+
+            // a = a op imm
+            case SHLI: EMIT(0x48, 0xC1, 0xE0, *pc++ & 63); break;          // shl rax, imm8
+            case SHRI: EMIT(0x48, 0xC1, 0xF8, *pc++ & 63); break;          // sar rax, imm8
+            case ORI: case XORI: case ANDI: case ADDI: case SUBI: case MULI:
+            case EQI: case NEI: case LTI: case GTI: case LEI: case GEI:
+                n = *pc++;
+                if (n == (int)n) {
+                    switch (i) {
+                        case ORI:  EMIT(0x48, 0x0D); break;                 // or rax, imm32
+                        case XORI: EMIT(0x48, 0x35); break;                 // xor rax, imm32
+                        case ANDI: EMIT(0x48, 0x25); break;                 // and rax, imm32
+                        case ADDI: EMIT(0x48, 0x05); break;                 // add rax, imm32
+                        case SUBI: EMIT(0x48, 0x2D); break;                 // sub rax, imm32
+                        case MULI: EMIT(0x48, 0x69, 0xC0); break;           // imul rax, rax, imm32
+                        default:   EMIT(0x48, 0x3D); break;                 // cmp rax, imm32
+                    }
+                    EMIT32(n);
+                } else {
+                    EMIT(0x48, 0xB9); EMIT64(n);                            // mov rcx, imm64
+                    switch (i) {
+                        case ORI:  EMIT(0x48, 0x09, 0xC8); break;           // or rax, rcx
+                        case XORI: EMIT(0x48, 0x31, 0xC8); break;           // xor rax, rcx
+                        case ANDI: EMIT(0x48, 0x21, 0xC8); break;           // and rax, rcx
+                        case ADDI: EMIT(0x48, 0x01, 0xC8); break;           // add rax, rcx
+                        case SUBI: EMIT(0x48, 0x29, 0xC8); break;           // sub rax, rcx
+                        case MULI: EMIT(0x48, 0x0F, 0xAF, 0xC1); break;     // imul rax, rcx
+                        default:   EMIT(0x48, 0x39, 0xC8); break;           // cmp rax, rcx
+                    }
+                }
+                if (i >= EQI && i <= GEI) {
+                    EMIT(0x0F, setcc[i-EQI], 0xC0);                         // setcc al
+                    EMIT(0x0F, 0xB6, 0xC0);                                 // movzx eax, al
+                    ctx->cc = setcc[i-EQI];
+                }
+                break;
+            case DIVI:
+            case MODI:
+                EMIT(0x48, 0xB9); EMIT64(*pc++);                            // mov rcx, imm64
+                EMIT(0x48, 0x99, 0x48, 0xF7, 0xF9);                         // cqo; idiv rcx
+                if (i == MODI) EMIT(0x48, 0x89, 0xD0);                      // mov rax, rdx
+                break;
+
+            case EXIT:
+                EMIT(0x48, 0x8D, 0x65, 0xF8);                               // lea rsp, [rbp-8]
+                EMIT(0x5B);                                                 // pop rbx
+                EMIT(0x5D);                                                 // pop rbp
+                EMIT(0xC3);                                                 // ret
+                break;
+            default:
+                return -1;
+        }
+    }
+    ctx->offset[pc - insn] = ctx->ip - ctx->image;
+
+    for (i = 0; i < ctx->nr_fixup; i++) {
+        int at = ctx->fixup[i].at;
+        int rel = ctx->offset[ctx->fixup[i].target] - (at + 4);
+        memcpy(ctx->image + at, &rel, 4);
+    }
+    return 0;
+}
+
+static void expr_jit_compile(struct expr_prog *prog)
+{
+    struct jit_ctx jit = {};
+    struct jit_ctx *ctx = &jit;
+    long *pc, *end = prog->insn + prog->nr_insn;
+    long page_size = sysconf(_SC_PAGESIZE);
+    int size = (prog->nr_insn * JIT_MAX_INSN_SIZE + page_size - 1) & ~(page_size - 1);
+    void *image;
+
+    image = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (image == MAP_FAILED)
+        return;
+
+    ctx->image = ctx->ip = image;
+    ctx->offset = calloc(prog->nr_insn + 1, sizeof(*ctx->offset));
+    ctx->fixup = calloc(prog->nr_insn, sizeof(*ctx->fixup));
+    ctx->is_target = calloc(prog->nr_insn + 1, sizeof(*ctx->is_target));
+    if (!ctx->offset || !ctx->fixup || !ctx->is_target)
+        goto err;
+
+    for (pc = prog->insn + 1; pc < end; pc += 1 + NR_OPS(*pc)) {
+        if (*pc == JMP || *pc == BZ || *pc == BNZ) {
+            long target = (long *)pc[1] - prog->insn;
+            if (target <= 0 || target >= prog->nr_insn)
+                goto err;
+            ctx->is_target[target] = true;
+        }
+    }
+
+    if (jit_emit(ctx, prog->insn, prog->nr_insn) < 0)
+        goto err;
+    if (mprotect(image, size, PROT_READ | PROT_EXEC) < 0)
+        goto err;
+
+    prog->jit = image;
+    prog->jit_size = ctx->ip - ctx->image;
+    prog->jit_mapsize = size;
+    free(ctx->offset);
+    free(ctx->fixup);
+    free(ctx->is_target);
+    return;
+
+err:
+    free(ctx->offset);
+    free(ctx->fixup);
+    free(ctx->is_target);
+    munmap(image, size);
+}
+#else
+static void expr_jit_compile(struct expr_prog *prog) {}
+#endif
+
+
 struct expr_prog *expr_compile(char *expr_str, struct global_var_declare *declare)
 {
     int i, err;
@@ -463,6 +1017,10 @@ struct expr_prog *expr_compile(char *expr_str, struct global_var_declare *declar
             function_resolver_ref();
     }
 
+    expr_optimize(prog);
+    expr_shape(prog);
+    if (expr_jit)
+        expr_jit_compile(prog);
     return prog;
 
 err_return:
@@ -480,6 +1038,10 @@ long expr_run(struct expr_prog *prog)
     long i, *t; // temps
     long stack[512];
 
+    // Debug output needs the interpreter.
+    if (prog->jit && !prog->debug)
+        return prog->jit();
+
     pc = prog->insn + 1;
     bp = sp = stack + 512;
     a = 0;
@@ -491,7 +1053,7 @@ long expr_run(struct expr_prog *prog)
         if (prog->debug) {
             if (cycle > 1) printf("; a: 0x%lx\n", a);
             printf("%ld> %.4s", cycle, &INSN[i * 5]);
-            if (i <= SI) printf(" 0x%-16lx", *pc); else printf(" %-18s", "");
+            if (NR_OPS(i)) printf(" 0x%-16lx", *pc); else printf(" %-18s", "");
         }
         switch (i) {
             case LEA: a = (long)(bp + *pc++); break;                              // load local address
@@ -542,12 +1104,95 @@ long expr_run(struct expr_prog *prog)
             case NTHL: a = (int)ntohl((int)*sp); break;
             case NTHS: a = (short)ntohs((short)*sp); break;
             case STRNCMP: t = sp + pc[1]; a = strncmp((const char *)t[-1], (const char *)t[-2], (long)t[-3]); break;
+
+            case LIG: switch(pc[1]) {                                            // load global
+                          case sizeof(char): a = *(char *)pc[0]; break;
+                          case sizeof(short): a = *(short *)pc[0]; break;
+                          case sizeof(int): a = *(int *)pc[0]; break;
+                          case sizeof(long): a = *(long *)pc[0]; break;
+                          default: printf("wrong instruction\n"); return -1;
+                      } pc += 2; break;
+            case ORI:  a = a |  *pc++; break;
+            case XORI: a = a ^  *pc++; break;
+            case ANDI: a = a &  *pc++; break;
+            case EQI:  a = a == *pc++; break;
+            case NEI:  a = a != *pc++; break;
+            case LTI:  a = a <  *pc++; break;
+            case GTI:  a = a >  *pc++; break;
+            case LEI:  a = a <= *pc++; break;
+            case GEI:  a = a >= *pc++; break;
+            case SHLI: a = a << *pc++; break;
+            case SHRI: a = a >> *pc++; break;
+            case ADDI: a = a +  *pc++; break;
+            case SUBI: a = a -  *pc++; break;
+            case MULI: a = a *  *pc++; break;
+            case DIVI: a = a /  *pc++; break;
+            case MODI: a = a %  *pc++; break;
+
             case EXIT: if (prog->debug) printf("exit(0x%lx) cycle = %ld\n", a, cycle); return a;
             default: printf("unknown instruction = %ld! cycle = %ld\n", i, cycle); return -1;
         }
     }
 }
 
+static inline long shape_load(struct expr_prog *prog, void *data)
+{
+    data += prog->shape_off;
+    switch (prog->shape_size) {
+        case sizeof(char): return *(char *)data;
+        case sizeof(short): return *(short *)data;
+        case sizeof(int): return *(int *)data;
+        default: return *(long *)data;
+    }
+}
+
+/*
+ * Returns 1 if the program has a shape and the record holds the field, the
+ * result is in *out.
+ */
+static int expr_run_shape(struct expr_prog *prog, void *data, int size, long *out)
+{
+    long v;
+
+    if (prog->shape == SHAPE_NONE ||
+        unlikely(prog->shape_off + prog->shape_size > size))
+        return 0;
+
+    v = shape_load(prog, data);
+    switch (prog->shape) {
+        case SHAPE_FIELD: *out = v; break;
+        case SHAPE_FIELD_AND: *out = v & prog->shape_imm; break;
+        case SHAPE_FIELD_CMP:
+            switch (prog->shape_op) {
+                case EQI: *out = v == prog->shape_imm; break;
+                case NEI: *out = v != prog->shape_imm; break;
+                case LTI: *out = v <  prog->shape_imm; break;
+                case GTI: *out = v >  prog->shape_imm; break;
+                case LEI: *out = v <= prog->shape_imm; break;
+                case GEI: *out = v >= prog->shape_imm; break;
+                default: return 0;
+            }
+            break;
+        default:
+            return 0;
+    }
+    return 1;
+}
+
+/*
+ * Run the program on one record. The shapes are evaluated directly, the others
+ * are loaded and run. Returns -1 if the record cannot be loaded.
+ */
+int expr_run_data(struct expr_prog *prog, void *data, int size, long *out)
+{
+    if (!prog->debug && expr_run_shape(prog, data, size, out))
+        return 0;
+    if (expr_load_data(prog, data, size) != 0)
+        return -1;
+    *out = expr_run(prog);
+    return 0;
+}
+
 int expr_load_glo(struct expr_prog *prog, const char *name, long value)
 {
     int i;
@@ -593,6 +1238,7 @@ void expr_destroy(struct expr_prog *prog)
     if (prog->data) free(prog->data);
     if (prog->str) free(prog->str);
     if (prog->insn) free(prog->insn);
+    if (prog->jit) munmap(prog->jit, prog->jit_mapsize);
     free(prog);
 }
 
@@ -607,9 +1253,20 @@ void expr_dump(struct expr_prog *prog)
 
     printf("Instruction:\n");
     while (insn < insn_end) {
-        printf("%8.4s", &INSN[*++insn * 5]);
-        if (*insn <= SI) printf(" 0x%lx\n", *++insn); else printf("\n");
+        long op = *++insn;
+        printf("%8.4s", &INSN[op * 5]);
+        if (op == LIG) { printf(" 0x%lx %ld\n", insn[1], insn[2]); insn += 2; }
+        else if (NR_OPS(op)) printf(" 0x%lx\n", *++insn); else printf("\n");
     }
+    if (prog->nr_raw_insn)
+        printf("Optimized: %d -> %d instructions\n", prog->nr_raw_insn, prog->nr_opt_insn);
+    if (prog->shape != SHAPE_NONE)
+        printf("Shape: %s, offset %d size %d\n", prog->shape == SHAPE_FIELD ? "field" :
+               prog->shape == SHAPE_FIELD_CMP ? "field compare" : "field and", prog->shape_off, prog->shape_size);
+    if (prog->jit)
+        printf("JIT: %d bytes at %p\n", prog->jit_size, prog->jit);
+    else
+        printf("JIT: not compiled, interpreted\n");
 
     if (prog->data) {
         printf("Global variable:\n");
@@ -791,9 +1448,24 @@ static void expr_sample(struct prof_dev *dev, union perf_event *event, int insta
     tp_print_marker(&info->tp_list->tp[0]);
     tep__print_event(raw->time, raw->cpu_entry.cpu, raw->raw.data, raw->raw.size);
 
-    expr_load_data(info->prog, raw->raw.data, raw->raw.size);
-    result = expr_run(info->prog);
+    if (expr_run_data(info->prog, raw->raw.data, raw->raw.size, &result) < 0)
+        return;
     printf("result: 0x%lx\n", result);
+
+    // -v: the interpreter has been run, compare with the shape.
+    if (info->prog->debug) {
+        long shape_result;
+        if (expr_run_shape(info->prog, raw->raw.data, raw->raw.size, &shape_result))
+            printf("shape result: 0x%lx%s\n", shape_result, shape_result != result ? " MISMATCH" : "");
+    }
+
+    // -v: the interpreter has been run, compare with the native code.
+    if (info->prog->debug && info->prog->jit) {
+        long jit_result;
+        expr_load_data(info->prog, raw->raw.data, raw->raw.size);
+        jit_result = info->prog->jit();
+        printf("jit result: 0x%lx%s\n", jit_result, jit_result != result ? " MISMATCH" : "");
+    }
 }
 
 static void expr_help(struct help_ctx *hctx)
@@ -818,6 +1490,10 @@ static const char *expr_desc[] = PROFILER_DESC("expr",
     "    simulated and executed multiple times. Expressions can use global variables,",
     "    which come from tracepoint fields.",
     "",
+    "    With --expr-jit on x86_64, the instructions are also compiled into native",
+    "    code, which is executed instead of the simulator. With -v, both are executed",
+    "    and compared.",
+    "",
     "SYNTAX",
     "    Supports 4 integer types: char, short, int, long. and pointer types.",
     "    Most operators are supported. See Operators.",
@@ -875,7 +1551,7 @@ static const char *expr_desc[] = PROFILER_DESC("expr",
 static const char *expr_argv[] = PROFILER_ARGV("expr",
     "OPTION:",
     "cpus", "pids", "tids", "output", "mmap-pages", "exit-N",
-    "version", "verbose", "quiet", "help",
+    "expr-jit", "version", "verbose", "quiet", "help",
     PROFILER_ARGV_PROFILER, "event"
 );
 static profiler _expr = {
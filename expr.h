@@ -20,7 +20,13 @@ struct expr_prog {
     char *str;
     long *insn;
     int nr_insn;
+    int nr_raw_insn, nr_opt_insn; // before/after expr_optimize()
     int debug;
+    int shape, shape_size, shape_off; // expr_run_data() fast path
+    long shape_op, shape_imm;
+    long (*jit)(void); // native code, NULL if not compiled
+    int jit_size;
+    int jit_mapsize;
 };
 
 struct global_var_declare {
@@ -30,8 +36,10 @@ struct global_var_declare {
     int elementsize;
 };
 
+extern bool expr_jit; // --expr-jit
 struct expr_prog *expr_compile(char *expr_str, struct global_var_declare *declare);
 long expr_run(struct expr_prog *prog);
+int expr_run_data(struct expr_prog *prog, void *data, int size, long *out);
 int expr_load_glo(struct expr_prog *prog, const char *name, long value);
 int expr_load_data(struct expr_prog *prog, void *d, int size);
 void expr_destroy(struct expr_prog *prog);
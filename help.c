@@ -82,7 +82,7 @@ static void prinf_kprobe_uprobe_format(struct tp *tp)
 static void print_events_format(struct help_ctx *ctx)
 {
     int i, j;
-    int ret;
+    size_t ret;
     char path[256];
     char *format;
     size_t size;
@@ -93,9 +93,9 @@ static void print_events_format(struct help_ctx *ctx)
             printf("%s:%s\n", tp->sys, tp->name);
             snprintf(path, sizeof(path), "kernel/debug/tracing/events/%s/%s/format", tp->sys, tp->name);
             if (sysfs__read_str(path, &format, &size) == 0) {
-                ret = write(STDOUT_FILENO, format, size);
+                ret = fwrite(format, 1, size, stdout);
                 free(format);
-                if (ret == -1)
+                if (ret != size)
                     return;
             } else
                 prinf_kprobe_uprobe_format(tp);
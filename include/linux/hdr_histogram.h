@@ -0,0 +1,61 @@
+#ifndef __HDR_HISTOGRAM_H
+#define __HDR_HISTOGRAM_H
+
+#include <linux/types.h>
+#include <linux/compiler.h>
+
+/*
+ * hdr_histogram
+ *
+ * Log-linear bucketed histogram, in the spirit of HdrHistogram.
+ * Values below 2^sub_bits have their own bucket. Above that, each power of
+ * two is split into 2^sub_bits linear buckets, so the relative error of a
+ * value is at most 2^-sub_bits. Recording is O(1) integer work, and two
+ * histograms with the same sub_bits can be merged exactly.
+ *
+ * The counts array only grows up to the bucket of the largest value seen.
+ */
+
+struct hdr_histogram {
+    int sub_bits;
+    int nr;        // nr of counts
+    u64 total;
+    u64 min, max;
+    u64 *counts;
+};
+
+struct hdr_histogram *hdr_histogram_new(int sub_bits);
+
+void hdr_histogram_free(struct hdr_histogram *h);
+
+int hdr_histogram_grow(struct hdr_histogram *h, int index);
+
+// If q is not in [0, 1] or h is empty, NAN will be returned.
+double hdr_histogram_quantile(struct hdr_histogram *h, double q);
+
+static inline int hdr_histogram_index(int sub_bits, u64 value)
+{
+    int shift;
+
+    if (value < (1ULL << sub_bits))
+        return (int)value;
+    shift = 63 - __builtin_clzll(value) - sub_bits;
+    return ((shift + 1) << sub_bits) + (int)((value >> shift) - (1ULL << sub_bits));
+}
+
+static inline void hdr_histogram_add(struct hdr_histogram *h, u64 value, u64 count)
+{
+    int index = hdr_histogram_index(h->sub_bits, value);
+
+    if (unlikely(index >= h->nr) && hdr_histogram_grow(h, index) < 0)
+        return;
+
+    h->counts[index] += count;
+    h->total += count;
+    if (value < h->min)
+        h->min = value;
+    if (value > h->max)
+        h->max = value;
+}
+
+#endif
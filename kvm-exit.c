@@ -154,7 +154,8 @@ static int monitor_ctx_init(struct prof_dev *dev)
     if (!ctx->perins_kvm_exit || !ctx->perins_kvm_exit_valid)
         goto failed;
 
-    ctx->lat_dist = latency_dist_new_quantile(env->perins, true, sizeof(u64));
+    ctx->lat_dist = env->hdr ? latency_dist_new_hdr(env->perins, true, sizeof(u64)) :
+                               latency_dist_new_quantile(env->perins, true, sizeof(u64));
     if (!ctx->lat_dist)
         goto failed;
 
@@ -239,7 +240,7 @@ static void print_latency_node(void *opaque, struct latency_node *node)
     struct kvmexit_ctx *ctx = dev->private;
     unsigned int exit_reason = node->key & 0xffffffff;
     u32 isa = node->key >> 32;
-    double p99 = tdigest_quantile(node->td, 0.99);
+    double p99 = latency_node_quantile(node, 0.99);
 
     if (ctx->print_header) {
         ctx->print_header = false;
@@ -447,7 +448,7 @@ static void kvm_exit_sample(struct prof_dev *dev, union perf_event *event, int i
 }
 
 static const char *kvm_exit_desc[] = PROFILER_DESC("kvm-exit",
-    "[OPTION...] [--perins] [--than ns] [--heatmap file] [--filter filter]",
+    "[OPTION...] [--perins] [--hdr] [--than ns] [--heatmap file] [--filter filter]",
     "Count the delay from kvm_exit to kvm_entry.", "",
     "TRACEPOINT",
     "    kvm:kvm_exit, kvm:kvm_entry", "",
@@ -456,7 +457,7 @@ static const char *kvm_exit_desc[] = PROFILER_DESC("kvm-exit",
     "    "PROGRAME" kvm-exit -C 1-4 -i 1000 --perins");
 static const char *kvm_exit_argv[] = PROFILER_ARGV("kvm-exit",
     PROFILER_ARGV_OPTION,
-    PROFILER_ARGV_PROFILER, "perins", "than", "heatmap", "filter");
+    PROFILER_ARGV_PROFILER, "perins", "hdr", "than", "heatmap", "filter");
 struct monitor kvm_exit = {
     .name = "kvm-exit",
     .desc = kvm_exit_desc,
@@ -7,16 +7,64 @@
 #include <linux/const.h>
 #include <linux/refcount.h>
 #include <linux/rblist.h>
+#include <linux/hash.h>
 #include <monitor.h>
 #include <latency_helpers.h>
 
+// At most 1/128 relative error.
+#define LATENCY_HDR_SUB_BITS 7
+
 struct latency_dist {
     struct rblist lat;
     refcount_t ref;
     bool perins;
     bool perkey;
     bool quantile;
+    bool hdr;
     int extra_size;
+    /*
+     * Open-addressed index of the nodes in lat, so latency_dist_input() does
+     * not walk the rbtree for every sample. Nodes are only removed from lat
+     * all at once, the index is cleared at the same time.
+     */
+    struct latency_node **index;
+    unsigned int index_size; // power of 2
+    unsigned int index_nr;
+    /*
+     * Windowed quantiles, see latency_dist_set_window(). One latency_window
+     * per (instance, key) outlives the nodes, it keeps the hdr histogram of
+     * the last nr_slices prints as sparse slices.
+     */
+    struct rblist windows;
+    int nr_slices;
+    u64 seq;
+    u64 gen; // the nodes in lat are dropped
+    struct hdr_histogram *scratch;
+};
+
+/*
+ * The non-zero buckets of one interval, (index << 48 | count).
+ */
+struct latency_slice {
+    int nr;
+    u64 *buckets;
+};
+
+#define SLICE_COUNT_MASK ((1ULL << 48) - 1)
+
+struct latency_window {
+    struct rb_node rbnode;
+    u64 instance;
+    u64 key;
+    u64 last_seq;
+    /*
+     * The node outlived a skipped interval: the buckets already put in
+     * the slices, the next slice only gets the rest. Valid if pending_gen
+     * is dist->gen.
+     */
+    struct latency_slice pending;
+    u64 pending_gen;
+    struct latency_slice slices[0];
 };
 
 struct letency_entry {
@@ -59,6 +107,12 @@ static struct rb_node *latency_stat_node_new(struct rblist *rlist, const void *n
             if (!n->td) goto _err;
         } else
             n->td = NULL;
+        if (dist->hdr) {
+            n->hdr = hdr_histogram_new(LATENCY_HDR_SUB_BITS);
+            if (!n->hdr) goto _err;
+        } else
+            n->hdr = NULL;
+        n->window = NULL;
 
         RB_CLEAR_NODE(&n->rbnode);
         n->instance = e->instance;
@@ -71,7 +125,10 @@ static struct rb_node *latency_stat_node_new(struct rblist *rlist, const void *n
     }
 
 _err:
-    if (n) free(n);
+    if (n) {
+        if (n->td) tdigest_free(n->td);
+        free(n);
+    }
     return NULL;
 }
 
@@ -79,6 +136,7 @@ static void latency_stat_node_delete(struct rblist *rblist, struct rb_node *rb_n
 {
     struct latency_node *n = rb_entry(rb_node, struct latency_node, rbnode);
     if (n->td) tdigest_free(n->td);
+    if (n->hdr) hdr_histogram_free(n->hdr);
     free(n);
 }
 
@@ -86,6 +144,206 @@ static void empty(struct rblist *rblist, struct rb_node *rb_node)
 {
 }
 
+static int latency_window_node_cmp(struct rb_node *rbn, const void *entry)
+{
+    struct latency_window *w = rb_entry(rbn, struct latency_window, rbnode);
+    const struct letency_entry *e = entry;
+
+    if (w->instance > e->instance)
+        return 1;
+    else if (w->instance < e->instance)
+        return -1;
+    if (w->key > e->key)
+        return 1;
+    else if (w->key < e->key)
+        return -1;
+    return 0;
+}
+
+static struct rb_node *latency_window_node_new(struct rblist *rlist, const void *new_entry)
+{
+    struct latency_dist *dist = container_of(rlist, struct latency_dist, windows);
+    const struct letency_entry *e = new_entry;
+    struct latency_window *w = calloc(1, sizeof(*w) + dist->nr_slices * sizeof(struct latency_slice));
+
+    if (w) {
+        RB_CLEAR_NODE(&w->rbnode);
+        w->instance = e->instance;
+        w->key = e->key;
+        return &w->rbnode;
+    }
+    return NULL;
+}
+
+static void latency_window_node_delete(struct rblist *rblist, struct rb_node *rb_node)
+{
+    struct latency_dist *dist = container_of(rblist, struct latency_dist, windows);
+    struct latency_window *w = rb_entry(rb_node, struct latency_window, rbnode);
+    int i;
+
+    for (i = 0; i < dist->nr_slices; i++)
+        free(w->slices[i].buckets);
+    free(w->pending.buckets);
+    free(w);
+}
+
+/*
+ * hdr minus base. base is sorted by index and only has buckets of hdr, an
+ * earlier snapshot of it.
+ */
+static void latency_slice_set(struct latency_slice *slice, struct hdr_histogram *hdr, struct latency_slice *base)
+{
+    u64 *buckets, count;
+    int i, j, nr = 0;
+
+    slice->nr = 0;
+    if (!hdr || !hdr->total)
+        return;
+
+    for (i = 0; i < hdr->nr; i++)
+        if (hdr->counts[i])
+            nr ++;
+    buckets = realloc(slice->buckets, nr * sizeof(*buckets));
+    if (!buckets)
+        return;
+    slice->buckets = buckets;
+    for (i = 0, j = 0; i < hdr->nr; i++) {
+        if (!hdr->counts[i])
+            continue;
+        count = min_t(u64, hdr->counts[i], SLICE_COUNT_MASK);
+        if (base && j < base->nr && (int)(base->buckets[j] >> 48) == i)
+            count -= base->buckets[j++] & SLICE_COUNT_MASK;
+        if (count)
+            buckets[slice->nr++] = ((u64)i << 48) | count;
+    }
+}
+
+/*
+ * Called before the nodes are printed: the hdr histogram of each node
+ * becomes the newest slice of its window, the other windows get an empty
+ * slice. A window with nothing left in any slice is freed.
+ *
+ * With `keep', the nodes are not printed and keep accumulating, only what
+ * they got since the last advance goes into the slice, see
+ * latency_dist_window_skip().
+ */
+static void latency_window_advance(struct latency_dist *dist, bool keep)
+{
+    struct rb_node *node, *next, *rbn;
+    struct latency_node *ln;
+    struct latency_window *w;
+    struct letency_entry e = {dist, NULL, 0, 0};
+    int slot;
+
+    dist->seq ++;
+    slot = dist->seq % dist->nr_slices;
+
+    for (node = rb_first_cached(&dist->lat.entries); node; node = rb_next(node)) {
+        ln = rb_entry(node, struct latency_node, rbnode);
+        e.instance = dist->perins ? ln->instance : 0;
+        e.key = dist->perkey ? ln->key : 0;
+        rbn = rblist__findnew(&dist->windows, &e);
+        if (!rbn) {
+            ln->window = NULL;
+            continue;
+        }
+        w = rb_entry(rbn, struct latency_window, rbnode);
+        latency_slice_set(&w->slices[slot], ln->hdr, w->pending_gen == dist->gen ? &w->pending : NULL);
+        if (keep) {
+            latency_slice_set(&w->pending, ln->hdr, NULL);
+            w->pending_gen = dist->gen;
+        }
+        w->last_seq = dist->seq;
+        ln->window = w;
+    }
+    if (!keep)
+        dist->gen ++;
+
+    for (node = rb_first_cached(&dist->windows.entries); node; node = next) {
+        next = rb_next(node);
+        w = rb_entry(node, struct latency_window, rbnode);
+        if (w->last_seq == dist->seq)
+            continue;
+        if (dist->seq - w->last_seq >= dist->nr_slices)
+            rblist__remove_node(&dist->windows, node);
+        else
+            w->slices[slot].nr = 0;
+    }
+}
+
+/*
+ * Keep the quantiles of the last nr_slices intervals. Each interval calls
+ * either latency_dist_print*() or latency_dist_window_skip(). Only for
+ * latency_dist_new_hdr().
+ */
+int latency_dist_set_window(struct latency_dist *dist, int nr_slices)
+{
+    if (!dist || !dist->hdr || nr_slices <= 0 || dist->nr_slices)
+        return -1;
+
+    dist->scratch = hdr_histogram_new(LATENCY_HDR_SUB_BITS);
+    if (!dist->scratch)
+        return -1;
+
+    rblist__init(&dist->windows);
+    dist->windows.node_cmp = latency_window_node_cmp;
+    dist->windows.node_new = latency_window_node_new;
+    dist->windows.node_delete = latency_window_node_delete;
+    dist->nr_slices = nr_slices;
+    dist->seq = 0;
+    return 0;
+}
+
+/*
+ * An interval without latency_dist_print*(), e.g. nothing happened or
+ * nothing is over the threshold. The windows still move forward, the
+ * samples of the interval go into its own slice although the nodes are
+ * kept for the next print.
+ */
+void latency_dist_window_skip(struct latency_dist *dist)
+{
+    if (dist && dist->nr_slices)
+        latency_window_advance(dist, true);
+}
+
+/*
+ * The q quantile over the last nr slices of the node's window, merged in
+ * O(buckets). Only valid in print_node.
+ */
+double latency_node_window_quantile(struct latency_dist *dist, struct latency_node *node, int nr, double q)
+{
+    struct latency_window *w = node->window;
+    struct hdr_histogram *h = dist->scratch;
+    struct latency_slice *slice;
+    int i, j, index;
+
+    if (!w || !h)
+        return latency_node_quantile(node, q);
+
+    if (h->nr)
+        memset(h->counts, 0, h->nr * sizeof(*h->counts));
+    h->total = 0;
+    // The bucket is exact, no need to clamp.
+    h->min = 0;
+    h->max = ~0ULL;
+
+    if (nr > dist->nr_slices)
+        nr = dist->nr_slices;
+    if (nr > dist->seq)
+        nr = dist->seq;
+    for (i = 0; i < nr; i++) {
+        slice = &w->slices[(dist->seq - i) % dist->nr_slices];
+        for (j = 0; j < slice->nr; j++) {
+            index = slice->buckets[j] >> 48;
+            if (index >= h->nr && hdr_histogram_grow(h, index) < 0)
+                continue;
+            h->counts[index] += slice->buckets[j] & SLICE_COUNT_MASK;
+            h->total += slice->buckets[j] & SLICE_COUNT_MASK;
+        }
+    }
+    return hdr_histogram_quantile(h, q);
+}
+
 static int latency_stat__sorted_node_cmp(struct rb_node *rbn, const void *entry)
 {
     struct latency_node *n = rb_entry(rbn, struct latency_node, rbnode);
@@ -125,6 +383,73 @@ static struct rb_node *latency_stat__sorted_node_new(struct rblist *rlist, const
 }
 
 
+static inline unsigned int latency_index_hash(struct latency_dist *dist, u64 instance, u64 key)
+{
+    return hash_64((dist->perins ? instance : 0) * GOLDEN_RATIO_64 ^
+                   (dist->perkey ? key : 0), 32);
+}
+
+static inline bool latency_index_match(struct latency_dist *dist, struct latency_node *n, u64 instance, u64 key)
+{
+    return (!dist->perins || n->instance == instance) &&
+           (!dist->perkey || n->key == key);
+}
+
+static struct latency_node *latency_index_find(struct latency_dist *dist, u64 instance, u64 key)
+{
+    struct latency_node *n;
+    unsigned int i, mask = dist->index_size - 1;
+
+    if (!dist->index_nr)
+        return NULL;
+
+    for (i = latency_index_hash(dist, instance, key) & mask; (n = dist->index[i]); i = (i + 1) & mask)
+        if (latency_index_match(dist, n, instance, key))
+            return n;
+    return NULL;
+}
+
+static void __latency_index_add(struct latency_node **index, unsigned int size, unsigned int hash,
+                                struct latency_node *n)
+{
+    unsigned int i;
+
+    for (i = hash & (size - 1); index[i]; i = (i + 1) & (size - 1));
+    index[i] = n;
+}
+
+static void latency_index_add(struct latency_dist *dist, struct latency_node *n)
+{
+    // Keep the load factor below 1/2.
+    if ((dist->index_nr + 1) * 2 > dist->index_size) {
+        unsigned int size = dist->index_size ? dist->index_size * 2 : 64;
+        struct latency_node **index = calloc(size, sizeof(*index));
+        unsigned int i;
+
+        // Not indexed, still found through the rbtree.
+        if (!index)
+            return;
+        for (i = 0; i < dist->index_size; i++)
+            if (dist->index[i])
+                __latency_index_add(index, size,
+                        latency_index_hash(dist, dist->index[i]->instance, dist->index[i]->key),
+                        dist->index[i]);
+        free(dist->index);
+        dist->index = index;
+        dist->index_size = size;
+    }
+    __latency_index_add(dist->index, dist->index_size, latency_index_hash(dist, n->instance, n->key), n);
+    dist->index_nr ++;
+}
+
+static void latency_index_clear(struct latency_dist *dist)
+{
+    if (dist->index_nr) {
+        memset(dist->index, 0, dist->index_size * sizeof(*dist->index));
+        dist->index_nr = 0;
+    }
+}
+
 struct latency_dist *latency_dist_new(bool perins, bool perkey, int extra_size)
 {
     struct latency_dist *dist;
@@ -143,7 +468,13 @@ struct latency_dist *latency_dist_new(bool perins, bool perkey, int extra_size)
     dist->perins = perins;
     dist->perkey = perkey;
     dist->quantile = false;
+    dist->hdr = false;
+    dist->nr_slices = 0;
+    dist->scratch = NULL;
     dist->extra_size = extra_size;
+    dist->index = NULL;
+    dist->index_size = 0;
+    dist->index_nr = 0;
     return dist;
 }
 
@@ -157,6 +488,20 @@ struct latency_dist *latency_dist_new_quantile(bool perins, bool perkey, int ext
     return dist;
 }
 
+/*
+ * Same as latency_dist_new_quantile(), but the quantiles come from a
+ * log-linear histogram: integer recording, bounded relative error.
+ */
+struct latency_dist *latency_dist_new_hdr(bool perins, bool perkey, int extra_size)
+{
+    struct latency_dist *dist = latency_dist_new(perins, perkey, extra_size);
+
+    if (dist)
+        dist->hdr = true;
+
+    return dist;
+}
+
 struct latency_dist *latency_dist_ref(struct latency_dist *dist)
 {
     if (!dist)
@@ -170,6 +515,11 @@ void latency_dist_free(struct latency_dist *dist)
 {
     if (dist  && refcount_dec_and_test(&dist->ref)) {
         rblist__exit(&dist->lat);
+        if (dist->nr_slices) {
+            rblist__exit(&dist->windows);
+            hdr_histogram_free(dist->scratch);
+        }
+        free(dist->index);
         free(dist);
     }
 }
@@ -183,12 +533,20 @@ struct latency_node *latency_dist_input(struct latency_dist *dist, u64 instance,
     if (!dist)
         return NULL;
 
-    rbn = rblist__findnew(&dist->lat, &e);
-    if (rbn) {
-        ln = rb_entry(rbn, struct latency_node, rbnode);
+    ln = latency_index_find(dist, instance, key);
+    if (!ln) {
+        rbn = rblist__findnew(&dist->lat, &e);
+        if (rbn) {
+            ln = rb_entry(rbn, struct latency_node, rbnode);
+            latency_index_add(dist, ln);
+        }
+    }
+    if (ln) {
 
         if (dist->quantile)
             tdigest_add(ln->td, lat, 1);
+        else if (dist->hdr)
+            hdr_histogram_add(ln->hdr, lat, 1);
 
         if (lat < ln->min)
             ln->min = lat;
@@ -234,6 +592,9 @@ void latency_dist_print(struct latency_dist *dist, print_node printnode, void *o
     if (rblist__empty(&dist->lat))
         return;
 
+    latency_index_clear(dist);
+    if (dist->nr_slices)
+        latency_window_advance(dist, false);
     for (node = rb_first_cached(&dist->lat.entries); node;
         node = next) {
         next = rb_next(node);
@@ -256,6 +617,9 @@ void latency_dist_print_sorted(struct latency_dist *dist, print_node printnode,
     if (rblist__empty(&dist->lat))
         return;
 
+    latency_index_clear(dist);
+    if (dist->nr_slices)
+        latency_window_advance(dist, false);
     rblist__init(&sorted);
     sorted.node_cmp = latency_stat__sorted_node_cmp;
     sorted.node_new = latency_stat__sorted_node_new;
@@ -291,6 +655,10 @@ struct latency_node *latency_dist_find(struct latency_dist *dist, u64 instance,
     if (!dist)
         return NULL;
 
+    ln = latency_index_find(dist, instance, key);
+    if (ln)
+        return ln;
+
     rbn = rblist__find(&dist->lat, &e);
     if (rbn) {
         ln = rb_entry(rbn, struct latency_node, rbnode);
@@ -310,7 +678,16 @@ void latency_dist_reset(struct latency_dist *dist)
 {
     if (!dist)
         return ;
+    latency_index_clear(dist);
     rblist__exit(&dist->lat);
+    dist->gen ++;
 }
 
-
+double latency_node_quantile(struct latency_node *node, double q)
+{
+    if (node->td)
+        return tdigest_quantile(node->td, q);
+    if (node->hdr)
+        return hdr_histogram_quantile(node->hdr, q);
+    return 0;
+}
@@ -2,10 +2,13 @@
 #define __LATENCY_HELPERS
 
 #include <linux/tdigest.h>
+#include <linux/hdr_histogram.h>
 
 struct latency_node {
     struct rb_node rbnode;
     struct tdigest *td;
+    struct hdr_histogram *hdr;
+    struct latency_window *window; // valid in print_node, see latency_dist_set_window()
     u64 instance;
     u64 key;
 
@@ -18,8 +21,10 @@ struct latency_node {
 };
 
 struct latency_dist;
+struct latency_window;
 struct latency_dist *latency_dist_new(bool perins, bool perkey, int extra_size);
 struct latency_dist *latency_dist_new_quantile(bool perins, bool perkey, int extra_size);
+struct latency_dist *latency_dist_new_hdr(bool perins, bool perkey, int extra_size);
 struct latency_dist *latency_dist_ref(struct latency_dist *dist);
 void latency_dist_free(struct latency_dist *dist);
 struct latency_node *latency_dist_input(struct latency_dist *dist, u64 instance, u64 key, u64 lat, unsigned long than);
@@ -30,6 +35,10 @@ void latency_dist_print_sorted(struct latency_dist *dist, print_node printnode,
 struct latency_node *latency_dist_find(struct latency_dist *dist, u64 instance, u64 key);
 bool latency_dist_empty(struct latency_dist *dist);
 void latency_dist_reset(struct latency_dist *dist);
+double latency_node_quantile(struct latency_node *node, double q);
+int latency_dist_set_window(struct latency_dist *dist, int nr_slices);
+void latency_dist_window_skip(struct latency_dist *dist);
+double latency_node_window_quantile(struct latency_dist *dist, struct latency_node *node, int nr, double q);
 
 #endif
 
@@ -0,0 +1,86 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <linux/kernel.h>
+#include <linux/hdr_histogram.h>
+
+struct hdr_histogram *hdr_histogram_new(int sub_bits)
+{
+    struct hdr_histogram *h;
+
+    if (sub_bits < 1 || sub_bits > 16)
+        return NULL;
+
+    h = calloc(1, sizeof(*h));
+    if (!h)
+        return NULL;
+
+    h->sub_bits = sub_bits;
+    h->min = ~0ULL;
+    return h;
+}
+
+void hdr_histogram_free(struct hdr_histogram *h)
+{
+    if (h) {
+        free(h->counts);
+        free(h);
+    }
+}
+
+int hdr_histogram_grow(struct hdr_histogram *h, int index)
+{
+    // Grow by a whole power of two, at least.
+    int nr = (index | ((1 << h->sub_bits) - 1)) + 1;
+    u64 *counts;
+
+    if (nr <= h->nr)
+        return 0;
+
+    counts = realloc(h->counts, nr * sizeof(*counts));
+    if (!counts)
+        return -1;
+
+    memset(counts + h->nr, 0, (nr - h->nr) * sizeof(*counts));
+    h->counts = counts;
+    h->nr = nr;
+    return 0;
+}
+
+/*
+ * The highest value that falls in the bucket.
+ */
+static u64 bucket_highest(int sub_bits, int index)
+{
+    int sub_count = 1 << sub_bits;
+    int shift;
+
+    if (index < sub_count)
+        return index;
+    shift = (index >> sub_bits) - 1;
+    return ((u64)((index & (sub_count - 1)) + sub_count) << shift) + ((1ULL << shift) - 1);
+}
+
+double hdr_histogram_quantile(struct hdr_histogram *h, double q)
+{
+    double r = q * h->total;
+    u64 rank, count = 0;
+    int i;
+
+    if (q < 0 || q > 1 || h->total == 0)
+        return NAN;
+
+    // rank = ceil(q * total), at least 1.
+    rank = (u64)r;
+    if (rank < r)
+        rank ++;
+    if (rank == 0)
+        rank = 1;
+
+    for (i = 0; i < h->nr; i++) {
+        count += h->counts[i];
+        if (count >= rank)
+            return (double)max(h->min, min(bucket_highest(h->sub_bits, i), h->max));
+    }
+    return (double)h->max;
+}
@@ -15,6 +15,7 @@
 #include <internal/lib.h>
 #include <linux/zalloc.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <errno.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -129,6 +130,7 @@ void perf_evlist__exit(struct perf_evlist *evlist)
 	evlist->cpus = NULL;
 	evlist->all_cpus = NULL;
 	evlist->threads = NULL;
+	zfree(&evlist->id_table);
 }
 
 void perf_evlist__delete(struct perf_evlist *evlist)
@@ -255,6 +257,7 @@ static void perf_evlist__id_hash(struct perf_evlist *evlist,
 	sid->evsel = evsel;
 	hash = hash_64(sid->id, PERF_EVLIST__HLIST_BITS);
 	hlist_add_head(&sid->node, &evlist->heads[hash]);
+	evlist->id_table_stale = true;
 }
 
 void perf_evlist__reset_id_hash(struct perf_evlist *evlist)
@@ -263,6 +266,39 @@ void perf_evlist__reset_id_hash(struct perf_evlist *evlist)
 
 	for (i = 0; i < PERF_EVLIST__HLIST_SIZE; ++i)
 		INIT_HLIST_HEAD(&evlist->heads[i]);
+	zfree(&evlist->id_table);
+	evlist->id_range = 0;
+	evlist->id_table_stale = false;
+}
+
+static void perf_evlist__id_table_build(struct perf_evlist *evlist)
+{
+	struct perf_sample_id *sid;
+	u64 min = ULLONG_MAX, max = 0;
+	int i;
+
+	evlist->id_table_stale = false;
+	zfree(&evlist->id_table);
+	evlist->id_range = 0;
+
+	for (i = 0; i < PERF_EVLIST__HLIST_SIZE; ++i) {
+		hlist_for_each_entry(sid, &evlist->heads[i], node) {
+			if (sid->id < min) min = sid->id;
+			if (sid->id > max) max = sid->id;
+		}
+	}
+	if (min > max || max - min >= PERF_EVLIST__ID_TABLE_MAX)
+		return;
+
+	evlist->id_table = calloc(max - min + 1, sizeof(*evlist->id_table));
+	if (!evlist->id_table)
+		return;
+	evlist->id_base = min;
+	evlist->id_range = max - min + 1;
+	for (i = 0; i < PERF_EVLIST__HLIST_SIZE; ++i) {
+		hlist_for_each_entry(sid, &evlist->heads[i], node)
+			evlist->id_table[sid->id - min] = sid;
+	}
 }
 
 void perf_evlist__id_add(struct perf_evlist *evlist,
@@ -320,6 +356,18 @@ struct perf_evsel *perf_evlist__id_to_evsel(struct perf_evlist *evlist,
     int hash;
     struct perf_sample_id *sid;
 
+	if (unlikely(evlist->id_table_stale))
+		perf_evlist__id_table_build(evlist);
+	if (likely(evlist->id_table)) {
+		// All ids are in the table.
+		if (id - evlist->id_base >= evlist->id_range ||
+		    !(sid = evlist->id_table[id - evlist->id_base]))
+			return NULL;
+		if (pcpu)
+			*pcpu = sid->cpu;
+		return sid->evsel;
+	}
+
 	hash = hash_64(id, PERF_EVLIST__HLIST_BITS);
     hlist_for_each_entry(sid, &evlist->heads[hash], node) {
         if (sid->id == id) {
@@ -781,6 +829,67 @@ void perf_evlist__munmap(struct perf_evlist *evlist)
     
 }
 
+/*
+ * Replace the ring buffer of @map with one of @pages data pages. @map must be
+ * drained first, unread events are dropped. While it is being replaced, the
+ * kernel has nowhere to write, so a few events may be dropped without a
+ * PERF_RECORD_LOST.
+ */
+int perf_evlist__mmap_resize(struct perf_evlist *evlist, struct perf_mmap *map, int pages)
+{
+	struct perf_mmap_param mp;
+	struct perf_evsel *evsel;
+	bool per_cpu = !perf_cpu_map__empty(evlist->cpus);
+	int evlist_cpu = perf_cpu_map__cpu(evlist->cpus, per_cpu ? map->idx : 0);
+	int nr_threads = perf_thread_map__nr(evlist->threads);
+	int output = map->fd;
+	int old_mask = map->mask;
+	int thread, cpu, fd;
+	int err = 0;
+
+	if (!map->base || map->overwrite || pages <= 0)
+		return -EINVAL;
+
+	mp.prot = PROT_READ | PROT_WRITE;
+	mp.mask = pages * page_size - 1;
+
+	/*
+	 * The last munmap() detaches the ring buffer from all the events that
+	 * were redirected to it with PERF_EVENT_IOC_SET_OUTPUT.
+	 */
+	munmap(map->base, perf_mmap__mmap_len(map));
+	map->base = NULL;
+	if (perf_mmap__mmap(map, &mp, output, map->cpu) < 0) {
+		err = -errno;
+		mp.mask = old_mask;
+		if (perf_mmap__mmap(map, &mp, output, map->cpu) < 0) {
+			err = -errno;
+			refcount_set(&map->refcnt, 0);
+			return err;
+		}
+	}
+
+	for (thread = per_cpu ? 0 : map->idx;
+	     thread < (per_cpu ? nr_threads : map->idx + 1); thread++) {
+		perf_evlist__for_each_entry(evlist, evsel) {
+			if (evsel->attr.write_backward)
+				continue;
+			if (evsel->system_wide && thread)
+				continue;
+
+			cpu = perf_cpu_map__idx(evsel->cpus, evlist_cpu);
+			if (cpu == -1)
+				continue;
+
+			fd = FD(evsel, cpu, thread);
+			if (fd != output &&
+			    ioctl(fd, PERF_EVENT_IOC_SET_OUTPUT, output) != 0)
+				err = -errno;
+		}
+	}
+	return err;
+}
+
 struct perf_mmap*
 perf_evlist__next_mmap(struct perf_evlist *evlist, struct perf_mmap *map,
 		       bool overwrite)
@@ -437,6 +437,16 @@ void perf_evsel__keep_disable(struct perf_evsel *evsel, bool keep_disable)
 	evsel->keep_disable = keep_disable;
 }
 
+void perf_evsel__set_priv(struct perf_evsel *evsel, void *priv)
+{
+	evsel->priv = priv;
+}
+
+void *perf_evsel__priv(struct perf_evsel *evsel)
+{
+	return evsel->priv;
+}
+
 int perf_evsel__apply_filter_cpu(struct perf_evsel *evsel, const char *filter, int cpu)
 {
 	return perf_evsel__run_ioctl(evsel, PERF_EVENT_IOC_SET_FILTER, (void *)filter, cpu);
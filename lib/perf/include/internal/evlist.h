@@ -8,6 +8,11 @@
 
 #define PERF_EVLIST__HLIST_BITS 8
 #define PERF_EVLIST__HLIST_SIZE (1 << PERF_EVLIST__HLIST_BITS)
+/*
+ * The kernel allocates event ids from a global counter, the ids of one evlist
+ * usually fall in a small range. Index them directly when the range fits.
+ */
+#define PERF_EVLIST__ID_TABLE_MAX (1 << 16)
 
 struct perf_cpu_map;
 struct perf_thread_map;
@@ -40,6 +45,11 @@ struct perf_evlist {
 	size_t			 mmap_len;
 	struct perf_evlist_poll epoll;
 	struct hlist_head	 heads[PERF_EVLIST__HLIST_SIZE];
+	/* id_table[id - id_base], built on first lookup after the ids change. */
+	struct perf_sample_id	**id_table;
+	u64			 id_base;
+	u64			 id_range;
+	bool			 id_table_stale;
 	struct perf_mmap	*mmap;
 	struct perf_mmap	*mmap_ovw;
 	struct perf_mmap	*mmap_first;
@@ -44,6 +44,7 @@ LIBPERF_API struct perf_evsel *perf_evlist__id_to_evsel(struct perf_evlist *evli
                                uint64_t id, int *pcpu);
 LIBPERF_API int perf_evlist__mmap(struct perf_evlist *evlist, int pages);
 LIBPERF_API void perf_evlist__munmap(struct perf_evlist *evlist);
+LIBPERF_API int perf_evlist__mmap_resize(struct perf_evlist *evlist, struct perf_mmap *map, int pages);
 
 LIBPERF_API struct perf_mmap *perf_evlist__next_mmap(struct perf_evlist *evlist,
 						     struct perf_mmap *map,
@@ -0,0 +1,170 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <linux/kernel.h>
+#include <lz_helpers.h>
+
+#define LZ_MIN_MATCH 4
+#define LZ_LAST_LITERALS 5 // the block always ends with literals
+#define LZ_MAX_OFFSET 65535
+#define LZ_HASH_BITS 12
+
+static inline u32 lz_read32(const u8 *p)
+{
+    u32 v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline u32 lz_hash(u32 v)
+{
+    return (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+static u8 *lz_put_len(u8 *op, u8 *oend, int len)
+{
+    while (len >= 255) {
+        if (op >= oend) return NULL;
+        *op++ = 255;
+        len -= 255;
+    }
+    if (op >= oend) return NULL;
+    *op++ = len;
+    return op;
+}
+
+static u8 *lz_put_seq(u8 *op, u8 *oend, const u8 *lit, int nr_lit, int offset, int match)
+{
+    u8 *token = op++;
+
+    if (token >= oend) return NULL;
+    *token = min(nr_lit, 15) << 4;
+    if (nr_lit >= 15 && !(op = lz_put_len(op, oend, nr_lit - 15)))
+        return NULL;
+    if (nr_lit > oend - op) return NULL;
+    memcpy(op, lit, nr_lit);
+    op += nr_lit;
+
+    if (match) {
+        if (oend - op < 2) return NULL;
+        op[0] = offset;
+        op[1] = offset >> 8;
+        op += 2;
+        match -= LZ_MIN_MATCH;
+        *token |= min(match, 15);
+        if (match >= 15 && !(op = lz_put_len(op, oend, match - 15)))
+            return NULL;
+    }
+    return op;
+}
+
+int lz_compress(const void *src, int len, void *dst, int dst_len)
+{
+    u16 table[1 << LZ_HASH_BITS];
+    const u8 *base = src, *ip = src, *anchor = src;
+    const u8 *iend = base + len;
+    const u8 *mlimit = iend - LZ_LAST_LITERALS;
+    const u8 *ref, *m, *r;
+    u8 *op = dst, *oend = op + dst_len;
+    u32 seq, h;
+
+    if (len > LZ_MAX_BLOCK)
+        return 0;
+
+    memset(table, 0, sizeof(table));
+    while (len >= LZ_MIN_MATCH + LZ_LAST_LITERALS &&
+           ip + LZ_MIN_MATCH <= mlimit) {
+        seq = lz_read32(ip);
+        h = lz_hash(seq);
+        ref = base + table[h];
+        table[h] = ip - base;
+        if (ref >= ip || ip - ref > LZ_MAX_OFFSET || lz_read32(ref) != seq) {
+            ip++;
+            continue;
+        }
+
+        m = ip + LZ_MIN_MATCH;
+        r = ref + LZ_MIN_MATCH;
+        while (m < mlimit && *m == *r) {
+            m++;
+            r++;
+        }
+        while (ip > anchor && ref > base && ip[-1] == ref[-1]) {
+            ip--;
+            ref--;
+        }
+
+        op = lz_put_seq(op, oend, anchor, ip - anchor, ip - ref, m - ip);
+        if (!op)
+            return 0;
+        ip = anchor = m;
+    }
+
+    op = lz_put_seq(op, oend, anchor, iend - anchor, 0, 0);
+    return op ? op - (u8 *)dst : 0;
+}
+
+static inline int lz_get_len(const u8 **pip, const u8 *iend, int len)
+{
+    const u8 *ip = *pip;
+    u8 b;
+
+    do {
+        if (ip >= iend) return -1;
+        b = *ip++;
+        len += b;
+    } while (b == 255);
+    *pip = ip;
+    return len;
+}
+
+int lz_decompress(const void *src, int len, void *dst, int dst_len)
+{
+    const u8 *ip = src, *iend = ip + len;
+    u8 *op = dst, *oend = op + dst_len;
+    const u8 *ref;
+    int token, nr, offset;
+
+    while (ip < iend) {
+        token = *ip++;
+
+        nr = token >> 4;
+        if (nr == 15 && (nr = lz_get_len(&ip, iend, nr)) < 0)
+            return -1;
+        if (nr > iend - ip || nr > oend - op)
+            return -1;
+        memcpy(op, ip, nr);
+        op += nr;
+        ip += nr;
+
+        // last sequence
+        if (ip == iend)
+            break;
+
+        if (iend - ip < 2)
+            return -1;
+        offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > op - (u8 *)dst)
+            return -1;
+
+        nr = token & 15;
+        if (nr == 15 && (nr = lz_get_len(&ip, iend, nr)) < 0)
+            return -1;
+        nr += LZ_MIN_MATCH;
+        if (nr > oend - op)
+            return -1;
+
+        ref = op - offset;
+        if (offset >= nr)
+            memcpy(op, ref, nr);
+        else {
+            // overlapping, repeat the pattern
+            int i;
+            for (i = 0; i < nr; i++)
+                op[i] = ref[i];
+        }
+        op += nr;
+    }
+    return op - (u8 *)dst;
+}
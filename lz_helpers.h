@@ -0,0 +1,23 @@
+#ifndef __LZ_HELPERS
+#define __LZ_HELPERS
+
+/*
+ * A small LZ77 block codec in the style of LZ4, no external dependency.
+ *
+ * Sequence: token(literals:4 | match-4:4), [literals-15 as 255-runs],
+ * literals, u16 offset, [match-19 as 255-runs]. The last sequence has
+ * literals only. Blocks are limited to 64KB.
+ */
+#define LZ_MAX_BLOCK (1 << 16)
+
+static inline int lz_compress_bound(int len)
+{
+    return len + len / 255 + 16;
+}
+
+/* Returns the compressed size, 0 if it does not fit in dst_len. */
+int lz_compress(const void *src, int len, void *dst, int dst_len);
+/* Returns the decompressed size, -1 on corrupt input or dst overflow. */
+int lz_decompress(const void *src, int len, void *dst, int dst_len);
+
+#endif
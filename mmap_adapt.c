@@ -0,0 +1,229 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <linux/kernel.h>
+#include <linux/refcount.h>
+#include <monitor.h>
+#include <trace_helpers.h>
+#include <internal/mmap.h>
+
+/*
+ * --mmap-budget: adaptive ringbuffer size.
+ *
+ * Every perf_mmap starts with --mmap-pages. Each time a perf_mmap is drained,
+ * its fill level and PERF_RECORD_LOST events are checked:
+ *
+ *   lost, or filled over 3/4   ->  double it, if the device stays within budget.
+ *   filled under 1/8 for
+ *   MMAP_ADAPT_IDLE periods    ->  halve it, not below --mmap-pages.
+ *
+ * A perf_mmap is only replaced when it is empty, and not while the order heap
+ * is processing, see perf_evlist__mmap_resize(). The wakeup watermark is in
+ * bytes, so it stays valid as the ringbuffer grows.
+ */
+
+#define MMAP_ADAPT_PERIOD_NS NSEC_PER_SEC
+#define MMAP_ADAPT_IDLE 10
+#define MMAP_ADAPT_LOG 8
+
+struct mmap_adapt_map {
+    u64 peak; // bytes, the highest fill seen in this period.
+    u64 lost;
+    u64 next; // ns, end of this period.
+    int idle;
+    int pages;
+    bool capped;
+};
+
+struct mmap_adapt_log {
+    u64 time;
+    int idx;
+    int from, to;
+    const char *reason;
+};
+
+struct mmap_adapt {
+    u64 budget; // bytes
+    u64 total; // bytes, all perf_mmaps of the device.
+    int min_pages;
+    int max_pages;
+    int nr_maps;
+    u64 nr_grow;
+    u64 nr_shrink;
+    u64 nr_capped;
+    u64 nr_failed;
+    int nr_log;
+    struct mmap_adapt_log log[MMAP_ADAPT_LOG];
+    struct mmap_adapt_map maps[];
+};
+
+int mmap_adapt_init(struct prof_dev *dev)
+{
+    struct env *env = dev->env;
+    struct mmap_adapt *adapt;
+    struct perf_mmap *map;
+    int nr_maps = 0;
+    u64 now;
+
+    if (!env->mmap_budget || !dev->pages)
+        return 0;
+    if (env->overwrite || env->order_threads) {
+        fprintf(stderr, "--mmap-budget is ignored with --overwrite or --order-threads\n");
+        return 0;
+    }
+
+    perf_evlist__for_each_mmap(dev->evlist, map, false)
+        nr_maps = max(nr_maps, perf_mmap__idx(map) + 1);
+
+    adapt = zalloc(sizeof(*adapt) + nr_maps * sizeof(struct mmap_adapt_map));
+    if (!adapt)
+        return -1;
+
+    now = get_ktime_ns();
+    adapt->budget = (u64)env->mmap_budget << 20;
+    adapt->min_pages = dev->pages;
+    adapt->max_pages = dev->pages;
+    adapt->nr_maps = nr_maps;
+    perf_evlist__for_each_mmap(dev->evlist, map, false) {
+        struct mmap_adapt_map *m = &adapt->maps[perf_mmap__idx(map)];
+        m->pages = dev->pages;
+        m->next = now + MMAP_ADAPT_PERIOD_NS;
+        adapt->total += map->mask + 1;
+    }
+    if (adapt->total > adapt->budget)
+        fprintf(stderr, "--mmap-budget %dM is less than the %luM already mapped\n",
+                env->mmap_budget, adapt->total >> 20);
+
+    dev->mmap_adapt = adapt;
+    return 0;
+}
+
+void mmap_adapt_deinit(struct prof_dev *dev)
+{
+    if (dev->mmap_adapt) {
+        free(dev->mmap_adapt);
+        dev->mmap_adapt = NULL;
+    }
+}
+
+void __mmap_adapt_read(struct prof_dev *dev, struct perf_mmap *map)
+{
+    struct mmap_adapt_map *m = &dev->mmap_adapt->maps[perf_mmap__idx(map)];
+    u64 fill = map->end - map->start;
+
+    if (fill > m->peak)
+        m->peak = fill;
+}
+
+void __mmap_adapt_lost(struct prof_dev *dev, struct perf_mmap *map)
+{
+    dev->mmap_adapt->maps[perf_mmap__idx(map)].lost++;
+}
+
+static void mmap_adapt_resize(struct prof_dev *dev, struct perf_mmap *map, int pages, const char *reason)
+{
+    struct mmap_adapt *adapt = dev->mmap_adapt;
+    int idx = perf_mmap__idx(map);
+    struct mmap_adapt_map *m = &adapt->maps[idx];
+    struct mmap_adapt_log *log;
+    u64 old = map->mask + 1;
+    int err;
+
+    err = perf_evlist__mmap_resize(dev->evlist, map, pages);
+    if (!map->base) {
+        // Neither size can be mapped, the events of this perf_mmap are gone.
+        fprintf(stderr, "%s: failed to remap ringbuffer #%d, %s\n", dev->prof->name, idx, strerror(-err));
+        adapt->total -= old;
+        adapt->nr_failed++;
+        return;
+    }
+    if (err)
+        adapt->nr_failed++;
+    if (map->mask + 1 == old)
+        return;
+
+    adapt->total += (map->mask + 1) - old;
+    order_mmap_reset(dev, map);
+
+    log = &adapt->log[adapt->nr_log++ % MMAP_ADAPT_LOG];
+    log->time = get_ktime_ns();
+    log->idx = idx;
+    log->from = m->pages;
+    log->to = pages;
+    log->reason = reason;
+
+    if (pages > m->pages)
+        adapt->nr_grow++;
+    else
+        adapt->nr_shrink++;
+    m->pages = pages;
+    if (pages > adapt->max_pages)
+        adapt->max_pages = pages;
+}
+
+void mmap_adapt_check(struct prof_dev *dev, struct perf_mmap *map)
+{
+    struct mmap_adapt *adapt = dev->mmap_adapt;
+    struct mmap_adapt_map *m;
+    u64 size, now;
+
+    if (!adapt || !map->base ||
+        refcount_read(&map->refcnt) <= 1 || // POLLHUP, the last events are being consumed.
+        (using_order(dev) && order_main_dev(dev)->order.inprocess) ||
+        !perf_mmap__empty(map))
+        return;
+
+    m = &adapt->maps[perf_mmap__idx(map)];
+    size = map->mask + 1;
+
+    if (m->lost || m->peak > size / 4 * 3) {
+        if (adapt->total + size <= adapt->budget)
+            mmap_adapt_resize(dev, map, m->pages * 2, m->lost ? "lost" : "full");
+        else if (!m->capped) {
+            m->capped = true;
+            adapt->nr_capped++;
+        }
+        m->lost = 0;
+        m->peak = 0;
+        m->idle = 0;
+        return;
+    }
+
+    now = get_ktime_ns();
+    if (now < m->next)
+        return;
+
+    if (m->peak < size / 8 && m->pages > adapt->min_pages) {
+        if (++m->idle >= MMAP_ADAPT_IDLE) {
+            mmap_adapt_resize(dev, map, m->pages / 2, "idle");
+            m->idle = 0;
+            m->capped = false;
+        }
+    } else
+        m->idle = 0;
+    m->peak = 0;
+    m->next = now + MMAP_ADAPT_PERIOD_NS;
+}
+
+void mmap_adapt_print(struct prof_dev *dev, int indent)
+{
+    struct mmap_adapt *adapt = dev->mmap_adapt;
+    int i, n;
+
+    if (!adapt)
+        return;
+
+    dev_printf("mmap_adapt: budget %lu total %lu pages %d-%d\n", adapt->budget, adapt->total,
+                adapt->min_pages, adapt->max_pages);
+    dev_printf("mmap_adapt: grow %lu shrink %lu capped %lu failed %lu\n", adapt->nr_grow,
+                adapt->nr_shrink, adapt->nr_capped, adapt->nr_failed);
+
+    n = min(adapt->nr_log, MMAP_ADAPT_LOG);
+    for (i = adapt->nr_log - n; i < adapt->nr_log; i++) {
+        struct mmap_adapt_log *log = &adapt->log[i % MMAP_ADAPT_LOG];
+        dev_printf("mmap_adapt: %lu.%06lu #%d %d -> %d pages, %s\n",
+                    log->time / NSEC_PER_SEC, (log->time % NSEC_PER_SEC) / NSEC_PER_USEC,
+                    log->idx, log->from, log->to, log->reason);
+    }
+}
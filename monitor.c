@@ -34,6 +34,7 @@
 
 static int daylight_active;
 static unsigned int page_size;
+static bool output_buffered = false;
 
 struct event_poll *main_epoll = NULL;
 
@@ -120,6 +121,7 @@ enum {
     LONG_OPT_lower,
     LONG_OPT_detail,
     LONG_OPT_period,
+    LONG_OPT_jitter,
 };
 
 static int workload_prepare(struct workload *workload, char *argv[]);
@@ -221,6 +223,9 @@ static int parse_arg(int key, char *arg)
     case LONG_OPT_period:
         env.sample_period = nsparse(arg, NULL);
         break;
+    case LONG_OPT_jitter:
+        env.jitter = nsparse(arg, NULL);
+        break;
     case 'V':
         printf("%s\n", main_program_version);
         exit(0);
@@ -431,13 +436,16 @@ struct option main_options[] = {
     OPT_INT_NONEG   ('i',    "interval", &env.interval,   "ms",            "Interval, Unit: ms"),
     OPT_STRDUP_NONEG('o',      "output", &env.output,     "file",          "Output file name"),
     OPT_BOOL_NONEG  ( 0 ,       "order", &env.order,                       "Order events by timestamp."),
+    OPT_INT_NONEG   ( 0 ,"order-threads", &env.order_threads, "N",         "Drain ringbuffers with N threads, then order events."),
     OPT_INT_NONEG   ('m',  "mmap-pages", &env.mmap_pages, "pages",         "Number of mmap data pages and AUX area tracing mmap pages"),
+    OPT_INT_NONEG   ( 0 , "mmap-budget", &env.mmap_budget, "MB",           "Adapt each ringbuffer to its load, up to MB in total"),
     OPT_LONG_NONEG  ('N',      "exit-N", &env.exit_n, "N",                 "Exit after N events have been sampled."),
     OPT_BOOL_NONEG  ( 0 ,         "tsc", &env.tsc,                         "Convert perf clock to tsc."),
     OPT_STRDUP_NONEG( 0 ,    "kvmclock", &env.kvmclock,    "uuid",         "Convert perf clock to Guest's kvmclock."),
     OPT_U64_NONEG   ( 0 ,"clock-offset", &env.clock_offset, NULL,          "Sum with clock-offset to get the final clock."),
     OPT_BOOL_NONEG  ( 0 ,   "monotonic", &env.monotonic,                   "Use CLOCK_MONOTONIC as perf clock."),
     OPT_INT_NONEG   ( 0 ,  "usage-self", &env.usage_self,  "ms",           "Periodically output the CPU usage of perf-prof itself, Unit: ms"),
+    OPT_BOOL_NONEG  ( 0 ,    "expr-jit", &env.expr_jit,                    "Compile EXPR to native code, Dflt: interpreted."),
     OPT_INT_NONEG   ( 0 ,"sampling-limit", &env.sampling_limit, "N",       "Limit the number of samples per second per instance."),
     OPT_STRDUP_NONEG( 0 , "perfeval-cpus", &env.perfeval_cpus, "cpu",      "Performance evaluation cpu list."),
     OPT_STRDUP_NONEG( 0 , "perfeval-pids", &env.perfeval_pids, "pid",      "Performance evaluation pid list."),
@@ -486,9 +494,10 @@ struct option main_options[] = {
                                                                 "      push=[IP:]PORT: push events to the local broadcast server IP:PORT\n"
                                                                 "      push=chardev: push events to chardev, e.g., /dev/virtio-ports/*\n"
                                                                 "      push=file: push events to file\n"
+                                                                "      zip: push compressed events to IP:PORT or chardev\n"
                                                                 "      pull=[IP:]PORT: pull events from server IP:PORT\n"
                                                                 "      pull=chardev: pull events from chardev\n"
-                                                                "      pull=file: pull events from file\n"
+                                                                "      pull=file[@START-END]: pull events from file, only those in the time window, Unit: s\n"
                                                                 "  EXPR:\n"
                                                                 "      C expression. See `"PROGRAME" expr -h` for more information."
                                                                 ),
@@ -496,6 +505,7 @@ struct option main_options[] = {
     OPT_STRDUP_NONEG('k',             "key", &env.key,                  "str",  "Key for series events"),
     OPT_STRDUP_NONEG( 0 ,          "filter", &env.filter,            "filter",  "Event filter/comm filter"),
     OPT_PARSE_NONEG (LONG_OPT_period, "period", &env.sample_period,      "ns",   "Sample period, Unit: s/ms/us/*ns"),
+    OPT_PARSE_NONEG (LONG_OPT_jitter, "jitter", &env.jitter,             "ns",   "Random delay added to each synthetic sample, Unit: s/ms/us/*ns"),
     OPT_STRDUP_NONEG(0, "impl", &env.impl,    "impl",       "Implementation of two-event analysis class. Dflt: delay.\n"
                                                                 "    delay: latency distribution between two events\n"
                                                                 "    pair: determine if two events are paired\n"
@@ -512,9 +522,12 @@ struct option main_options[] = {
     OPT_STRDUP_NONEG( 0 ,            "free", &env.tp_free,            "EVENT",  "Memory free tracepoint/kprobe/uprobe"),
     OPT_BOOL_NONEG  ( 0 ,        "syscalls", &env.syscalls,                     "Trace syscalls"),
     OPT_BOOL_NONEG  ( 0 ,          "perins", &env.perins,                       "Print per instance stat"),
+    OPT_BOOL_NONEG  ( 0 ,             "hdr", &env.hdr,                          "Quantiles from a log-linear histogram instead of t-digest"),
+    OPT_STRDUP_NONEG( 0 ,          "window", &env.window,            "N,...",  "Also print p99 over the last N intervals, implies --hdr"),
     OPT_BOOL_NONEG  ('g',      "call-graph", &env.callchain,                    "Enable call-graph recording"),
     OPT_STRDUP_NONEG( 0 ,     "flame-graph", &env.flame_graph,         "file",  "Specify the folded stack file."),
     OPT_STRDUP_NONEG( 0 ,         "heatmap", &env.heatmap,             "file",  "Specify the output latency file."),
+    OPT_STRDUP_NONEG( 0 ,        "columnar", &env.columnar,            "file",  "Write events to file in columnar binary format."),
     OPT_PARSE_OPTARG( LONG_OPT_detail, "detail", NULL, "-N,+N,hide<N,same*",
                                                        "More detailed information output.\n"
                                                        "For multi-trace profiler:\n"
@@ -567,6 +580,8 @@ static void free_env(struct env *e)
     if (e->tp_free) free(e->tp_free);
     if (e->flame_graph) free(e->flame_graph);
     if (e->heatmap) free(e->heatmap);
+    if (e->columnar) free(e->columnar);
+    if (e->window) free(e->window);
     if (e->symbols) free(e->symbols);
     if (e->device) free(e->device);
     if (e->kvmclock) free(e->kvmclock);
@@ -616,6 +631,8 @@ struct env *clone_env(struct env *p)
     CLONE (tp_free);
     CLONE (flame_graph);
     CLONE (heatmap);
+    CLONE (columnar);
+    CLONE (window);
     CLONE (symbols);
     CLONE (device);
     CLONE (kvmclock);
@@ -1007,11 +1024,21 @@ static void print_dev(struct prof_dev *dev, int indent)
         dev_printf("order: lost %lu maybe %lu pause %lu pause_time %lu\n",
                     dev->order.nr_lost, dev->order.nr_maybe_lost,
                     dev->order.nr_maybe_lost_pause, dev->order.maybe_lost_pause_time);
+        dev_printf("order: sift %lu events %lu events/sift %.2f\n", dev->order.nr_sift,
+                    dev->order.nr_sift_events,
+                    dev->order.nr_sift ? (double)dev->order.nr_sift_events / dev->order.nr_sift : 0.0);
         if (dev->order.nr_streams)
             dev_printf("order: stream pause %lu pause_time %lu\n",
                     dev->order.nr_stream_pause, dev->order.stream_pause_time);
+        if (using_order_worker(dev))
+            order_worker_print(dev, indent);
     }
+    mmap_adapt_print(dev, indent);
+    if (dev->forward.target && dev->forward.nr_forward)
+        dev_printf("forward: %lu events, %lu bytes copied, %lu bytes/event\n", dev->forward.nr_forward,
+                    dev->forward.copied_bytes, dev->forward.copied_bytes / dev->forward.nr_forward);
     ptrace_print(dev, indent);
+    event_spread_print(dev, indent);
     if (dev->prof->print_dev)
         dev->prof->print_dev(dev, indent);
 
@@ -1043,6 +1070,7 @@ static void print_devtree(void)
     list_for_each_entry_safe(dev, next, &prof_dev_list, dev_link)
         if (prof_dev_at_top(dev))
             print_dev(dev, 4);
+    global_syms_stat(stdout);
 }
 
 static void sigusr2_handler(int sig)
@@ -1478,6 +1506,7 @@ static int workload_prepare(struct workload *workload, char *argv[])
         goto out_close_ready_pipe;
     }
 
+    fflush(stdout);
     workload->pid = fork();
     if (workload->pid < 0) {
         perror("failed to fork");
@@ -1584,6 +1613,22 @@ static int workload_start(struct workload *workload)
     return 0;
 }
 
+/*
+ * A terminal is line buffered. Files and pipes are written in large blocks and
+ * flushed before the main loop waits for events, see main(). stderr stays line
+ * buffered. Write to stdout only through stdio, a raw write(STDOUT_FILENO) goes
+ * ahead of the buffered lines.
+ */
+static void output_setbuf(void)
+{
+    static char output_buff[1 << 20];
+
+    output_buffered = !isatty(STDOUT_FILENO) &&
+                      setvbuf(stdout, output_buff, _IOFBF, sizeof(output_buff)) == 0;
+    if (!output_buffered)
+        setlinebuf(stdout);
+}
+
 void print_time(FILE *fp)
 {
     char timebuff[64];
@@ -1677,16 +1722,26 @@ perf_event_forward(struct prof_dev *dev, union perf_event *event, int *instance,
     struct perf_record_dev *event_dev = (void *)dev->forward.event_dev;
     void *data;
 
+    /*
+     * Only a descriptor is forwarded, the sample stays where it is. In non-overwrite
+     * mode the timestamp is converted in place, otherwise perf_event_convert() makes
+     * a copy.
+     */
+    if (!converted) {
+        union perf_event *conv = perf_event_convert(dev, event, writable);
+        if (conv != event)
+            dev->forward.copied_bytes += event->header.size;
+        event = conv;
+    }
+
     memset(event_dev, 0, offsetof(struct perf_record_dev, event));
-    event_dev->header.size = offsetof(struct perf_record_dev, event) + event->header.size;
+    event_dev->header.size = offsetof(struct perf_record_dev, event) + sizeof(event_dev->ref);
     event_dev->header.type = PERF_RECORD_DEV;
-
-    memcpy(&event_dev->event, event, event->header.size);
-    if (!converted)
-        perf_event_convert(dev, &event_dev->event, true);
+    event_dev->header.misc = PERF_RECORD_DEV_REF;
+    event_dev->ref = event;
 
     // Build perf_event with sample_type, PERF_SAMPLE_TID | PERF_SAMPLE_TIME | PERF_SAMPLE_ID | PERF_SAMPLE_CPU.
-    data = (void *)event_dev->event.sample.array;
+    data = (void *)event->sample.array;
     event_dev->pid = *(u32 *)(data + dev->pos.tid_pos);
     event_dev->tid = *(u32 *)(data + dev->pos.tid_pos + sizeof(u32));
     event_dev->time = *(u64 *)(data + dev->pos.time_pos);
@@ -1696,12 +1751,53 @@ perf_event_forward(struct prof_dev *dev, union perf_event *event, int *instance,
     event_dev->instance = *instance;
     event_dev->dev = dev;
 
+    dev->forward.nr_forward++;
     if (dev->forward.ins_reset)
         *instance = 0;
 
     return (union perf_event *)event_dev;
 }
 
+void perf_event_copy(void *buf, union perf_event *event)
+{
+    struct perf_record_dev *event_dev = (void *)event;
+    struct perf_record_dev *copy = buf;
+    union perf_event *sample;
+
+    if (event->header.type != PERF_RECORD_DEV || !(event->header.misc & PERF_RECORD_DEV_REF)) {
+        memcpy(buf, event, event->header.size);
+        return;
+    }
+
+    sample = event_dev->ref;
+    memcpy(copy, event_dev, offsetof(struct perf_record_dev, event));
+    memcpy(&copy->event, sample, sample->header.size);
+    copy->header.size = offsetof(struct perf_record_dev, event) + sample->header.size;
+    copy->header.misc &= ~PERF_RECORD_DEV_REF;
+    event_dev->dev->forward.copied_bytes += sample->header.size;
+}
+
+/*
+ * Turn the descriptor into a flat perf_record_dev in place, for consumers that
+ * need the whole event in one buffer. The descriptor is always the source's
+ * forward.event_dev, which has room for PERF_SAMPLE_MAX_SIZE.
+ */
+union perf_event *perf_event_materialize(union perf_event *event)
+{
+    struct perf_record_dev *event_dev = (void *)event;
+    union perf_event *sample;
+
+    if (event->header.type != PERF_RECORD_DEV || !(event->header.misc & PERF_RECORD_DEV_REF))
+        return event;
+
+    sample = event_dev->ref;
+    memcpy(&event_dev->event, sample, sample->header.size);
+    event_dev->header.size = offsetof(struct perf_record_dev, event) + sample->header.size;
+    event_dev->header.misc &= ~PERF_RECORD_DEV_REF;
+    event_dev->dev->forward.copied_bytes += sample->header.size;
+    return event;
+}
+
 int perf_event_process_record(struct prof_dev *dev, union perf_event *event, int instance, bool writable, bool converted)
 {
     profiler *prof;
@@ -1727,7 +1823,7 @@ int perf_event_process_record(struct prof_dev *dev, union perf_event *event, int
     } else if (event->header.type == PERF_RECORD_DEV) {
         // Return down.
         struct perf_record_dev *event_dev = (void *)event;
-        event = &event_dev->event;
+        event = perf_record_dev_event(event_dev);
         dev = event_dev->dev;
         instance = event_dev->instance;
         converted = true;
@@ -1831,21 +1927,30 @@ static void perf_event_handle_mmap(struct prof_dev *dev, struct perf_mmap *map)
     int idx;
 
     if (dev->order.enabled) {
-        order_mmap(dev, map);
+        if (using_order_worker(dev))
+            order_worker_mmap(dev, map);
+        else {
+            order_mmap(dev, map);
+            mmap_adapt_check(dev, map);
+        }
         return;
     }
 
     if (perf_mmap__read_init(map) < 0)
         return;
+    mmap_adapt_read(dev, map);
 
     idx = perf_mmap__idx(map);
     perf_event_convert_read_tsc_conversion(dev, map);
     while ((event = perf_mmap__read_event(map, &writable)) != NULL) {
+        if (unlikely(event->header.type == PERF_RECORD_LOST))
+            mmap_adapt_lost(dev, map);
         /* process event */
         perf_event_process_record(dev, event, idx, writable, false);
         perf_mmap__consume(map);
     }
     perf_mmap__read_done(map);
+    mmap_adapt_check(dev, map);
 }
 
 static void perf_event_handle(int fd, unsigned int revents, void *ptr)
@@ -2006,7 +2111,9 @@ struct prof_dev *prof_dev_open_internal(profiler *prof, struct env *env,
             goto out_free;
         dup2(STDOUT_FILENO, STDERR_FILENO);
         setlinebuf(stdin);
+        // stderr shares the file, keep both line buffered so the lines stay in order.
         setlinebuf(stdout);
+        output_buffered = false;
         setlinebuf(stderr);
     }
 
@@ -2115,6 +2222,8 @@ reinit:
             fprintf(stderr, "monitor(%s) mmap failed\n", prof->name);
             goto out_close;
         }
+        if (mmap_adapt_init(dev) < 0)
+            goto out_munmap;
         if (env->order || prof->order)
             if (order_init(dev) < 0)
                 goto out_munmap;
@@ -2176,8 +2285,10 @@ out_del_timer:
 out_order_deinit:
     order_deinit(dev);
 out_munmap:
-    if (dev->pages)
+    if (dev->pages) {
+        mmap_adapt_deinit(dev);
         perf_evlist__munmap(evlist);
+    }
 out_close:
     perf_evlist__close(evlist);
 out_deinit:
@@ -2374,7 +2485,8 @@ int prof_dev_enable(struct prof_dev *dev)
 
     perf_timespec_init(dev);
 
-    err = perf_evlist_poll__foreach_fd(evlist, __addfn);
+    // --order-threads, the ringbuffers are polled by the order workers.
+    err = using_order_worker(dev) ? 0 : perf_evlist_poll__foreach_fd(evlist, __addfn);
     if (err) {
         fprintf(stderr, "monitor(%s) poll failed\n", prof->name);
         return -1;
@@ -2398,6 +2510,9 @@ int prof_dev_enable(struct prof_dev *dev)
                   (after_enable.tv_nsec - before_enable.tv_nsec);
     prof_dev_atomic_enable(dev, enable_cost);
 
+    if (using_order_worker(dev))
+        order_worker_start(dev);
+
     if (env->interval)
         timer_start(&dev->timer, env->interval * 1000000UL, false);
 
@@ -2442,7 +2557,9 @@ int prof_dev_disable(struct prof_dev *dev)
     perf_evlist__disable(evlist);
 
     // Disable subsequent perf_event_handle() calls.
-    if (dev->pages)
+    if (using_order_worker(dev))
+        order_worker_stop(dev);
+    else if (dev->pages)
         perf_evlist_poll__foreach_fd(evlist, __delfn);
 
     if (dev->pages) {
@@ -2553,6 +2670,7 @@ static void prof_dev_free(struct prof_dev *dev)
 
     if (dev->pages) {
         order_deinit(dev);
+        mmap_adapt_deinit(dev);
         perf_evlist__munmap(evlist);
     }
 
@@ -2709,13 +2827,17 @@ void prof_dev_close(struct prof_dev *dev)
     // prof_dev_close() can only be called once, so dev->inclose will not be set to false.
 }
 
+/*
+ * The date and time are formatted once per second, only the microseconds change
+ * between events.
+ */
 void prof_dev_print_time(struct prof_dev *dev, u64 evtime, FILE *fp)
 {
+    static time_t cached_sec = -1;
+    static char timebuff[64];
     u64 ns;
     s64 off_ns;
-    char timebuff[64];
     struct timeval tv;
-    struct tm *result;
 
     if (likely(dev->time_ctx.base_evtime > 0 && evtime > 0)) {
         off_ns = evclock_to_real_ns(dev, (evclock_t)evtime) - dev->time_ctx.base_evtime;
@@ -2727,8 +2849,12 @@ void prof_dev_print_time(struct prof_dev *dev, u64 evtime, FILE *fp)
     } else
         gettimeofday(&tv, NULL);
 
-    result = localtime(&tv.tv_sec);
-    strftime(timebuff, sizeof(timebuff), "%Y-%m-%d %H:%M:%S", result);
+    if (unlikely(tv.tv_sec != cached_sec)) {
+        struct tm result;
+        localtime_r(&tv.tv_sec, &result);
+        strftime(timebuff, sizeof(timebuff), "%Y-%m-%d %H:%M:%S", &result);
+        cached_sec = tv.tv_sec;
+    }
     fprintf(fp, "%s.%06u ", timebuff, (unsigned int)tv.tv_usec);
 }
 
@@ -2759,7 +2885,8 @@ static perfclock_t prof_dev_minevtime(struct prof_dev *dev)
     // Therefore, ringbuffer is judged only when minevtime == ULLONG_MAX.
     if (minevtime == ULLONG_MAX &&
         dev->pos.time_pos >= 0 &&
-        dev->pages && !dev->env->overwrite) {
+        dev->pages && !dev->env->overwrite &&
+        !using_order_worker(dev)) {
         struct perf_mmap *map;
 
         perf_evlist__for_each_mmap(dev->evlist, map, dev->env->overwrite) {
@@ -2862,7 +2989,7 @@ int main(int argc, char *argv[])
 
     sigusr2_handler(0);
     setlinebuf(stdin);
-    setlinebuf(stdout);
+    output_setbuf();
     setlinebuf(stderr);
     libperf_init(libperf_print);
     page_size = sysconf(_SC_PAGE_SIZE);
@@ -2874,6 +3001,7 @@ int main(int argc, char *argv[])
 
     main_prof = parse_main_options(argc, argv);
     if (!main_prof) return err;
+    expr_jit = env.expr_jit;
     main_env = zalloc(sizeof(*main_env));
     if (!main_env) return err;
     *main_env = env;
@@ -2892,7 +3020,12 @@ int main(int argc, char *argv[])
         return -1;
 
     while (running > 0) {
-        int fds = event_poll__poll(main_epoll, -1);
+        int fds = event_poll__poll(main_epoll, output_buffered ? 0 : -1);
+
+        if (fds == 0) {
+            fflush(stdout);
+            fds = event_poll__poll(main_epoll, -1);
+        }
 
         // -ENOENT means there are no file descriptors in event_poll.
         if (fds == -ENOENT)
@@ -20,7 +20,7 @@
 #include <linux/zalloc.h>
 #include <linux/time64.h>
 #include <linux/refcount.h>
-#include <linux/min_heap.h>
+#include <linux/string.h>
 
 /* perf sample has 16 bits size limit */
 #define PERF_SAMPLE_MAX_SIZE (1 << 16)
@@ -130,6 +130,7 @@ struct env {
     unsigned long lower_than; // unit: ns
     bool callchain;
     int mmap_pages;
+    int mmap_budget;
     bool exclude_user;
     bool exclude_kernel;
     bool exclude_guest;
@@ -150,8 +151,11 @@ struct env {
     char *symbols;
     char *flame_graph;
     char *heatmap;
+    char *columnar;
     bool syscalls;
     bool perins;
+    bool hdr;
+    char *window;
     bool test;
     bool detail;
     // detail_arg
@@ -166,6 +170,7 @@ struct env {
     int ldlat;
     bool overwrite;
     unsigned long sample_period;
+    unsigned long jitter;
     bool only_comm;
     bool cycle;
     bool monotonic;
@@ -173,6 +178,7 @@ struct env {
     char *kvmclock;
     u64  clock_offset;
     int usage_self;
+    bool expr_jit;
     bool using_ptrace;
 
     /* performance evaluation */
@@ -189,6 +195,7 @@ struct env {
 
     /* order */
     bool order;
+    int order_threads;
 
     /* help */
     struct monitor *help_monitor;
@@ -337,6 +344,7 @@ struct prof_dev {
     enum prof_dev_state state; // It can be set off and active again by calling prof_dev_enable.
     bool inflush, inclose;
     int pages;
+    struct mmap_adapt *mmap_adapt; // --mmap-budget
     int nr_pollfd;
     bool ftrace_filter;
     bool clone; // prof_dev is cloned
@@ -369,11 +377,20 @@ struct prof_dev {
         char *event_copy; //[PERF_SAMPLE_MAX_SIZE];
     } convert;
     struct order_ctx {
-        DEFINE_MIN_HEAP(void *, heapsort) heapsort;
+        struct order_tree { // loser tree, see order.c
+            int nr; // number of leaves in data[]
+            int active; // leaves not yet removed
+            int leaves; // power of 2, >= nr
+            int capacity;
+            int *loser; // loser[0] is the winner
+            heapclock_t *key;
+            heapclock_t runner_up;
+        } tree;
         struct list_head heap_event_list; // link all heap_event
         int heap_size, nr_mmaps, nr_streams;
-        void **data; // used in heapsort;
+        void **data; // leaves of the tree
         void *permap_event; // struct perf_mmap_event
+        struct order_worker_ctx *worker; // --order-threads
         u64 wakeup_watermark;
         heapclock_t prev_lost_time;
         heapclock_t heap_popped_time;
@@ -390,6 +407,8 @@ struct prof_dev {
         u64 maybe_lost_pause_time; // ns
         u64 nr_stream_pause;
         u64 stream_pause_time;
+        u64 nr_sift;
+        u64 nr_sift_events; // Events merged by the tree.
     } order;
     struct tty_ctx {
         bool istty;
@@ -416,6 +435,8 @@ struct prof_dev {
         struct perf_record_dev *event_dev; // PERF_SAMPLE_MAX_SIZE
         short forwarded_time_pos; // perf_record_dev.time
         bool ins_reset;
+        u64 nr_forward;
+        u64 copied_bytes; // samples materialized from PERF_RECORD_DEV_REF.
     } forward;
     struct performance_evaluation { // env->sampling_limit
         struct hlist_head *hashmap; // cpu/tid => samples
@@ -516,6 +537,27 @@ static inline bool prof_dev_enabled(struct prof_dev *dev)
 {
     return dev->state == PROF_DEV_STATE_ACTIVE;
 }
+
+/*
+ * Forwarded events are PERF_RECORD_DEV_REF descriptors, the sample is copied only
+ * when the event is retained. Use perf_event_size() and perf_event_copy() instead
+ * of header.size and memcpy() to back up an event, the copy is a flat
+ * perf_record_dev.
+ */
+static inline union perf_event *perf_record_dev_event(struct perf_record_dev *event_dev)
+{
+    return event_dev->header.misc & PERF_RECORD_DEV_REF ? event_dev->ref : &event_dev->event;
+}
+static inline unsigned int perf_event_size(union perf_event *event)
+{
+    struct perf_record_dev *event_dev = (void *)event;
+    if (event->header.type == PERF_RECORD_DEV && (event->header.misc & PERF_RECORD_DEV_REF))
+        return offsetof(struct perf_record_dev, event) + event_dev->ref->header.size;
+    return event->header.size;
+}
+void perf_event_copy(void *buf, union perf_event *event);
+union perf_event *perf_event_materialize(union perf_event *event);
+
 static inline union perf_event *perf_event_get(union perf_event *event)
 {
     if (event->header.type == PERF_RECORD_DEV) {
@@ -558,8 +600,8 @@ perfclock_t prof_dev_list_minevtime(void);
 #define PROFILER_ARGV_OPTION \
     "OPTION:", \
     "cpus", "pids", "tids", "cgroups", "watermark", \
-    "interval", "output", "order", "mmap-pages", "exit-N", "tsc", "kvmclock", "clock-offset", "monotonic", \
-    "usage-self", "sampling-limit", "perfeval-cpus", "perfeval-pids", "version", "verbose", "quiet", "help"
+    "interval", "output", "order", "order-threads", "mmap-pages", "mmap-budget", "exit-N", "tsc", "kvmclock", "clock-offset", "monotonic", \
+    "usage-self", "expr-jit", "sampling-limit", "perfeval-cpus", "perfeval-pids", "version", "verbose", "quiet", "help"
 #define PROFILER_ARGV_FILTER \
     "FILTER OPTION:", \
     "exclude-host", "exclude-guest", "exclude-user", "exclude-kernel", \
@@ -576,6 +618,7 @@ void order_deinit(struct prof_dev *dev);
 typedef union perf_event *read_event(void *stream, bool init, int *ins, bool *writable, bool *converted);
 int order_register(struct prof_dev *dev, read_event *read_event, void *stream);
 void order_unregister(struct prof_dev *dev, void *stream);
+void order_mmap_reset(struct prof_dev *dev, struct perf_mmap *map);
 void order_process(struct prof_dev *dev, struct perf_mmap *target_map, perfclock_t target_tm);
 static inline void order_mmap(struct prof_dev *dev, struct perf_mmap *map) { order_process(dev, map, 0); }
 static inline void order_stream(struct prof_dev *dev) { order_process(dev, NULL, 0); }
@@ -607,6 +650,31 @@ u64 heapclock_to_perfclock(struct prof_dev *dev, heapclock_t time);
 void reduce_wakeup_times(struct prof_dev *dev, struct perf_event_attr *attr);
 void prof_dev_env2attr(struct prof_dev *dev, struct perf_event_attr *attr);
 
+// order_worker.c
+int order_worker_init(struct prof_dev *dev);
+void order_worker_deinit(struct prof_dev *dev);
+int order_worker_start(struct prof_dev *dev);
+void order_worker_stop(struct prof_dev *dev);
+void order_worker_mmap(struct prof_dev *dev, struct perf_mmap *map);
+void order_worker_print(struct prof_dev *dev, int indent);
+static inline bool using_order_worker(struct prof_dev *dev) {
+    return !!dev->order.worker;
+}
+
+// mmap_adapt.c
+int mmap_adapt_init(struct prof_dev *dev);
+void mmap_adapt_deinit(struct prof_dev *dev);
+void __mmap_adapt_read(struct prof_dev *dev, struct perf_mmap *map);
+void __mmap_adapt_lost(struct prof_dev *dev, struct perf_mmap *map);
+void mmap_adapt_check(struct prof_dev *dev, struct perf_mmap *map);
+void mmap_adapt_print(struct prof_dev *dev, int indent);
+static inline void mmap_adapt_read(struct prof_dev *dev, struct perf_mmap *map) {
+    if (unlikely(dev->mmap_adapt)) __mmap_adapt_read(dev, map);
+}
+static inline void mmap_adapt_lost(struct prof_dev *dev, struct perf_mmap *map) {
+    if (unlikely(dev->mmap_adapt)) __mmap_adapt_lost(dev, map);
+}
+
 
 //help.c
 void common_help(struct help_ctx *ctx, bool enabled, bool cpus, bool pids, bool interval, bool order, bool pages, bool verbose);
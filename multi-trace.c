@@ -5,6 +5,7 @@
 #include <sys/stat.h>
 #include <errno.h>
 #include <linux/list.h>
+#include <linux/hashtable.h>
 #include <linux/string.h>
 #include <linux/zalloc.h>
 #include <linux/strlist.h>
@@ -12,6 +13,7 @@
 #include <tep.h>
 #include <trace_helpers.h>
 #include <stack_helpers.h>
+#include <slab_helpers.h>
 #include <two-event.h>
 #include <tp_struct.h>
 
@@ -22,7 +24,7 @@ struct multi_trace_ctx;
 struct timeline_node {
     struct rb_node timeline_node;
     u64    time;
-    struct rb_node key_node;
+    struct hlist_node key_node;
     u64    key;
     struct tp *tp;
     struct tp *tp1; // nested-trace, -e A,A_ret, A's tp.
@@ -56,6 +58,23 @@ struct __backup_stat {
     u64 mem_bytes;
 };
 
+/*
+ * Backed-up events, hashed by key.
+ *
+ * Nodes with the same key are adjacent in a bucket and ordered by cmp(),
+ * nested-trace keeps several nodes per key, the newest first. The table
+ * doubles when the average chain length exceeds 2.
+ */
+struct backup_index {
+    struct hlist_head *table;
+    unsigned int bits;
+    unsigned int nr_entries;
+    int (*cmp)(const struct timeline_node *b, const struct timeline_node *e);
+};
+
+#define BACKUP_INIT_BITS 10
+#define NODE_POOL_MAX 4096
+
 enum lost_affect {
     LOST_AFFECT_ALL_EVENT,
     LOST_AFFECT_INS_EVENT,
@@ -78,8 +97,11 @@ struct multi_trace_ctx {
     struct tp_list **tp_list;
     struct two_event_impl *impl;
     struct two_event_class *class;
-    struct rblist backup;
+    struct backup_index backup;
     struct rblist timeline;
+    struct list_head node_pool; // free timeline_node
+    struct event_slab *slab; // copied events
+    unsigned int nr_pool;
     struct list_head *perins_list;
     struct list_head needed_list; // need_timeline
     struct list_head pending_list; // need_timeline
@@ -111,49 +133,62 @@ struct multi_trace_ctx {
 
 static struct timeline_node *multi_trace_first_pending(struct prof_dev *dev, struct timeline_node *tail);
 
-static int perf_event_backup_node_cmp(struct rb_node *rbn, const void *entry)
+static struct timeline_node *timeline_node_alloc(struct multi_trace_ctx *ctx)
 {
-    struct timeline_node *b = container_of(rbn, struct timeline_node, key_node);
-    const struct timeline_node *e = entry;
+    struct timeline_node *b;
+
+    if (list_empty(&ctx->node_pool))
+        return malloc(sizeof(*b));
+    b = list_first_entry(&ctx->node_pool, struct timeline_node, needed);
+    list_del(&b->needed);
+    ctx->nr_pool --;
+    return b;
+}
 
-    if (b->key > e->key)
-        return 1;
-    else if (b->key < e->key)
-        return -1;
-    else
-        return 0;
+static void timeline_node_free(struct multi_trace_ctx *ctx, struct timeline_node *b)
+{
+    if (ctx->nr_pool < NODE_POOL_MAX) {
+        list_add(&b->needed, &ctx->node_pool);
+        ctx->nr_pool ++;
+    } else
+        free(b);
 }
 
-static int perf_event_backup_node_find(const void *entry, const struct rb_node *rbn)
+static void timeline_node_pool_free(struct multi_trace_ctx *ctx)
 {
-    struct timeline_node *b = container_of(rbn, struct timeline_node, key_node);
-    const struct timeline_node *e = entry;
+    struct timeline_node *b, *next;
+
+    list_for_each_entry_safe(b, next, &ctx->node_pool, needed)
+        free(b);
+    INIT_LIST_HEAD(&ctx->node_pool);
+    ctx->nr_pool = 0;
+}
 
+static int perf_event_backup_node_cmp(const struct timeline_node *b, const struct timeline_node *e)
+{
     if (b->key > e->key)
-        return -1;
-    else if (b->key < e->key)
         return 1;
+    else if (b->key < e->key)
+        return -1;
     else
         return 0;
 }
 
-static struct rb_node *perf_event_backup_node_new(struct rblist *rlist, const void *new_entry)
+static struct timeline_node *perf_event_backup_node_new(struct multi_trace_ctx *ctx, struct timeline_node *e)
 {
-    struct multi_trace_ctx *ctx = container_of(rlist, struct multi_trace_ctx, backup);
     if (ctx->need_timeline) {
-        struct timeline_node *b = (void *)new_entry;
+        struct timeline_node *b = e;
         /*
          * With --order enabled, events are backed up in chronological order. Therefore, it
          * can be directly added to the end of the queue `needed_list' without reordering.
         **/
         list_add_tail(&b->needed, &ctx->needed_list);
-        RB_CLEAR_NODE(&b->key_node);
-        return &b->key_node;
+        INIT_HLIST_NODE(&b->key_node);
+        return b;
     } else {
-        const struct timeline_node *e = new_entry;
         union perf_event *event = e->event;
-        union perf_event *new_event = memdup(event, event->header.size);
-        struct timeline_node *b = malloc(sizeof(*b));
+        union perf_event *new_event = event_slab_dup(ctx->slab, event);
+        struct timeline_node *b = timeline_node_alloc(ctx);
         if (b && new_event) {
             b->time = e->time;
             b->key = e->key;
@@ -168,7 +203,7 @@ static struct rb_node *perf_event_backup_node_new(struct rblist *rlist, const vo
             b->seq = e->seq;
             b->event = perf_event_get(new_event);
             RB_CLEAR_NODE(&b->timeline_node);
-            RB_CLEAR_NODE(&b->key_node);
+            INIT_HLIST_NODE(&b->key_node);
             INIT_LIST_HEAD(&b->needed);
             /*
              * The events for each instance are time-ordered. Therefore, it can be directly added
@@ -177,20 +212,18 @@ static struct rb_node *perf_event_backup_node_new(struct rblist *rlist, const vo
             list_add_tail(&b->needed, &ctx->perins_list[b->ins]);
 
             ctx->backup_stat.new ++;
-            ctx->backup_stat.mem_bytes += event->header.size;
-            return &b->key_node;
+            ctx->backup_stat.mem_bytes += new_event->header.size;
+            return b;
         } else {
-            if (b) free(b);
-            if (new_event && new_event != event) free(new_event);
+            if (b) timeline_node_free(ctx, b);
+            if (new_event) event_slab_free(ctx->slab, new_event);
             return NULL;
         }
     }
 }
 
-static void perf_event_backup_node_delete(struct rblist *rblist, struct rb_node *rb_node)
+static void perf_event_backup_node_delete(struct multi_trace_ctx *ctx, struct timeline_node *b)
 {
-    struct multi_trace_ctx *ctx = container_of(rblist, struct multi_trace_ctx, backup);
-    struct timeline_node *b = container_of(rb_node, struct timeline_node, key_node);
     if (ctx->need_timeline) {
         b->unneeded = 1;
         list_del_init(&b->needed);
@@ -201,11 +234,195 @@ static void perf_event_backup_node_delete(struct rblist *rblist, struct rb_node
         ctx->backup_stat.delete ++;
         ctx->backup_stat.mem_bytes -= b->event->header.size;
         perf_event_put(b->event);
-        free(b->event);
-        free(b);
+        event_slab_free(ctx->slab, b->event);
+        timeline_node_free(ctx, b);
     }
 }
 
+static int backup_init(struct multi_trace_ctx *ctx)
+{
+    struct backup_index *idx = &ctx->backup;
+
+    idx->bits = BACKUP_INIT_BITS;
+    idx->nr_entries = 0;
+    idx->table = malloc(sizeof(*idx->table) << idx->bits);
+    if (!idx->table)
+        return -1;
+    __hash_init(idx->table, 1U << idx->bits);
+    return 0;
+}
+
+static inline struct hlist_head *backup_bucket(struct backup_index *idx, u64 key)
+{
+    return &idx->table[hash_64(key, idx->bits)];
+}
+
+static void backup_grow(struct backup_index *idx)
+{
+    unsigned int bits = idx->bits + 1;
+    struct hlist_head *table = malloc(sizeof(*table) << bits);
+    struct timeline_node **stack = NULL;
+    int size = 0, n, i;
+    unsigned int bkt;
+
+    if (!table)
+        return;
+    __hash_init(table, 1U << bits);
+
+    for (bkt = 0; bkt < (1U << idx->bits); bkt++) {
+        struct timeline_node *b;
+        struct hlist_node *tmp;
+
+        n = 0;
+        hlist_for_each_entry_safe(b, tmp, &idx->table[bkt], key_node) {
+            if (n == size) {
+                struct timeline_node **new = realloc(stack, (size + 16) * sizeof(*stack));
+                if (!new) {
+                    free(stack);
+                    free(table);
+                    return;
+                }
+                stack = new;
+                size += 16;
+            }
+            stack[n++] = b;
+        }
+        // Adding to the head in reverse order keeps the order of the same key.
+        for (i = n - 1; i >= 0; i--) {
+            hlist_del(&stack[i]->key_node);
+            hlist_add_head(&stack[i]->key_node, &table[hash_64(stack[i]->key, bits)]);
+        }
+    }
+    free(stack);
+    free(idx->table);
+    idx->table = table;
+    idx->bits = bits;
+}
+
+// The first node with the same key as e.
+static struct timeline_node *backup_find_first(struct multi_trace_ctx *ctx, u64 key)
+{
+    struct timeline_node *b;
+
+    hlist_for_each_entry(b, backup_bucket(&ctx->backup, key), key_node)
+        if (b->key == key)
+            return b;
+    return NULL;
+}
+
+static inline struct timeline_node *backup_next_same(struct timeline_node *b)
+{
+    struct timeline_node *next = hlist_entry_safe(b->key_node.next, struct timeline_node, key_node);
+    return next && next->key == b->key ? next : NULL;
+}
+
+#define backup_for_each_key(ctx, b, key) \
+    for (b = backup_find_first(ctx, key); b; b = backup_next_same(b))
+
+/*
+ * Like rblist__findnew(): return the node equal to e, or add a new node.
+ * *exist is set if the node already exists.
+ */
+static struct timeline_node *backup_findnew(struct multi_trace_ctx *ctx, struct timeline_node *e, bool *exist)
+{
+    struct backup_index *idx = &ctx->backup;
+    struct timeline_node *b, *prev = NULL, *new;
+    int cmp;
+
+    *exist = false;
+    backup_for_each_key(ctx, b, e->key) {
+        cmp = idx->cmp(b, e);
+        if (cmp == 0) {
+            *exist = true;
+            return b;
+        }
+        if (cmp > 0)
+            break;
+        prev = b;
+    }
+
+    new = perf_event_backup_node_new(ctx, e);
+    if (!new)
+        return NULL;
+
+    if (b)
+        hlist_add_before(&new->key_node, &b->key_node);
+    else if (prev)
+        hlist_add_behind(&new->key_node, &prev->key_node);
+    else
+        hlist_add_head(&new->key_node, backup_bucket(idx, e->key));
+
+    if (++idx->nr_entries > (2U << idx->bits))
+        backup_grow(idx);
+    return new;
+}
+
+static void backup_remove(struct multi_trace_ctx *ctx, struct timeline_node *b)
+{
+    hlist_del_init(&b->key_node);
+    ctx->backup.nr_entries --;
+    perf_event_backup_node_delete(ctx, b);
+}
+
+static void backup_exit(struct multi_trace_ctx *ctx)
+{
+    struct backup_index *idx = &ctx->backup;
+    struct timeline_node *b;
+    struct hlist_node *tmp;
+    unsigned int bkt;
+
+    if (!idx->table)
+        return;
+    for (bkt = 0; bkt < (1U << idx->bits) && idx->nr_entries; bkt++)
+        hlist_for_each_entry_safe(b, tmp, &idx->table[bkt], key_node)
+            backup_remove(ctx, b);
+}
+
+struct backup_sort {
+    u64 key;
+    unsigned int idx;
+    struct timeline_node *node;
+};
+
+static int backup_sort_cmp(const void *a, const void *b)
+{
+    const struct backup_sort *x = a, *y = b;
+
+    if (x->key != y->key)
+        return x->key > y->key ? 1 : -1;
+    return x->idx > y->idx ? 1 : -1;
+}
+
+/*
+ * All backed-up nodes in the order of rblist: by key, then by cmp(). The
+ * caller frees the array.
+ */
+static struct backup_sort *backup_sorted(struct multi_trace_ctx *ctx, unsigned int *nr)
+{
+    struct backup_index *idx = &ctx->backup;
+    struct backup_sort *array;
+    struct timeline_node *b;
+    unsigned int bkt, n = 0;
+
+    *nr = 0;
+    if (!idx->nr_entries)
+        return NULL;
+    array = malloc(idx->nr_entries * sizeof(*array));
+    if (!array)
+        return NULL;
+
+    for (bkt = 0; bkt < (1U << idx->bits); bkt++)
+        hlist_for_each_entry(b, &idx->table[bkt], key_node) {
+            array[n].key = b->key;
+            array[n].idx = n;
+            array[n].node = b;
+            n++;
+        }
+    qsort(array, n, sizeof(*array), backup_sort_cmp);
+    *nr = n;
+    return array;
+}
+
 static int timeline_node_cmp(struct rb_node *rbn, const void *entry)
 {
     struct timeline_node *b = container_of(rbn, struct timeline_node, timeline_node);
@@ -235,8 +452,8 @@ static struct rb_node *timeline_node_new(struct rblist *rlist, const void *new_e
     struct multi_trace_ctx *ctx = container_of(rlist, struct multi_trace_ctx, timeline);
     const struct timeline_node *e = new_entry;
     union perf_event *event = e->event;
-    union perf_event *new_event = memdup(event, event->header.size);
-    struct timeline_node *b = malloc(sizeof(*b));
+    union perf_event *new_event = event_slab_dup(ctx->slab, event);
+    struct timeline_node *b = timeline_node_alloc(ctx);
     if (b && new_event) {
         b->time = e->time;
         b->key = e->key;
@@ -251,7 +468,7 @@ static struct rb_node *timeline_node_new(struct rblist *rlist, const void *new_e
         b->seq = e->seq;
         b->event = perf_event_get(new_event);
         RB_CLEAR_NODE(&b->timeline_node);
-        RB_CLEAR_NODE(&b->key_node);
+        INIT_HLIST_NODE(&b->key_node);
         INIT_LIST_HEAD(&b->pending);
         if (!b->tp->untraced) {
             /*
@@ -261,20 +478,20 @@ static struct rb_node *timeline_node_new(struct rblist *rlist, const void *new_e
             list_add_tail(&b->pending, &ctx->pending_list);
             b->unneeded = 0;
             ctx->tl_stat.pending ++;
-            ctx->tl_stat.pending_bytes += event->header.size;
+            ctx->tl_stat.pending_bytes += new_event->header.size;
         }
 
         ctx->tl_stat.new ++;
         if (b->unneeded) {
             ctx->tl_stat.unneeded ++;
-            ctx->tl_stat.unneeded_bytes += event->header.size;
+            ctx->tl_stat.unneeded_bytes += new_event->header.size;
         }
-        ctx->tl_stat.mem_bytes += event->header.size;
+        ctx->tl_stat.mem_bytes += new_event->header.size;
 
         return &b->timeline_node;
     } else {
-        if (b) free(b);
-        if (new_event && new_event != event) free(new_event);
+        if (b) timeline_node_free(ctx, b);
+        if (new_event) event_slab_free(ctx->slab, new_event);
         return NULL;
     }
 }
@@ -294,8 +511,8 @@ static void timeline_node_delete(struct rblist *rblist, struct rb_node *rb_node)
         ctx->tl_stat.unneeded_bytes -= b->event->header.size;
     }
     perf_event_put(b->event);
-    free(b->event);
-    free(b);
+    event_slab_free(ctx->slab, b->event);
+    timeline_node_free(ctx, b);
 }
 
 static void timeline_free_unneeded(struct prof_dev *dev)
@@ -334,10 +551,10 @@ static void timeline_free_unneeded(struct prof_dev *dev)
              * Do a safety check here.
             **/
             if (unlikely(tl->unneeded == 0)) {
-                if (RB_EMPTY_NODE(&tl->key_node)) {
-                    fprintf(stderr, "BUG: rb key_node is empty\n");
+                if (hlist_unhashed(&tl->key_node)) {
+                    fprintf(stderr, "BUG: key_node is unhashed\n");
                 } else
-                    rblist__remove_node(&ctx->backup, &tl->key_node);
+                    backup_remove(ctx, tl);
                 backup ++;
             } else
                 unneeded ++;
@@ -349,6 +566,9 @@ static void timeline_free_unneeded(struct prof_dev *dev)
         next = rb_first_cached(&ctx->timeline.entries);
     }
 
+    if (unneeded || backup)
+        event_slab_shrink(ctx->slab, false);
+
     if (unlikely(backup)) {
         print_time(stderr);
         fprintf(stderr, "free unneeded %lu, backup %lu\n", unneeded, backup);
@@ -369,7 +589,7 @@ static void timeline_stat(struct multi_trace_ctx *ctx)
            "  nr_entries = %u\n",
            ctx->tl_stat.new, ctx->tl_stat.delete, ctx->tl_stat.unneeded, ctx->tl_stat.pending,
            ctx->tl_stat.mem_bytes, ctx->tl_stat.unneeded_bytes, ctx->tl_stat.pending_bytes,
-           rblist__nr_entries(&ctx->backup));
+           ctx->backup.nr_entries);
 }
 
 static void monitor_ctx_exit(struct prof_dev *dev);
@@ -383,6 +603,7 @@ static int monitor_ctx_init(struct prof_dev *dev)
     struct two_event_options options = {
         .keyname = oncpu ? "CPU" : "THREAD",
         .perins = env->perins,
+        .hdr = env->hdr,
         .comm = ctx->comm,
         .rundelay = strcmp(dev->prof->name, "rundelay") == 0,
         .only_print_greater_than = env->only_print_greater_than,
@@ -390,6 +611,7 @@ static int monitor_ctx_init(struct prof_dev *dev)
         .lower_than = env->lower_than,
         .hide_than = env->hide_than,
         .heatmap = env->heatmap,
+        .window = env->window,
         .first_n = 10,
         .sort_print = ctx->nested ? false : true,
         .env = env,
@@ -406,6 +628,7 @@ static int monitor_ctx_init(struct prof_dev *dev)
     INIT_LIST_HEAD(&ctx->needed_list);
     INIT_LIST_HEAD(&ctx->pending_list);
     INIT_LIST_HEAD(&ctx->timeline_lost_list);
+    INIT_LIST_HEAD(&ctx->node_pool);
 
     tep = tep__ref();
 
@@ -521,11 +744,15 @@ static int monitor_ctx_init(struct prof_dev *dev)
         goto failed;
     }
     ctx->class = ctx->impl->class_new(ctx->impl, &options);
+    if (!ctx->class)
+        goto failed;
 
-    rblist__init(&ctx->backup);
-    ctx->backup.node_cmp = perf_event_backup_node_cmp;
-    ctx->backup.node_new = perf_event_backup_node_new;
-    ctx->backup.node_delete = perf_event_backup_node_delete;
+    ctx->slab = event_slab_new();
+    if (!ctx->slab)
+        goto failed;
+    if (backup_init(ctx) < 0)
+        goto failed;
+    ctx->backup.cmp = perf_event_backup_node_cmp;
 
     rblist__init(&ctx->timeline);
     ctx->timeline.node_cmp = timeline_node_cmp;
@@ -580,8 +807,12 @@ static void monitor_ctx_exit(struct prof_dev *dev)
 
     perf_thread_map__put(ctx->thread_map);
 
-    rblist__exit(&ctx->backup);
+    backup_exit(ctx);
+    free(ctx->backup.table);
+    ctx->backup.table = NULL;
     rblist__exit(&ctx->timeline);
+    timeline_node_pool_free(ctx);
+    event_slab_delete(ctx->slab);
 
     if (ctx->perins_lost_list) {
         for (i = 0; i < ctx->nr_ins; i++)
@@ -794,15 +1025,15 @@ static int multi_trace_call_remaining(struct prof_dev *dev, struct timeline_node
 static void multi_trace_handle_remaining(struct prof_dev *dev, remaining_reason rr)
 {
     struct multi_trace_ctx *ctx = dev->private;
-    struct rb_node *next = rb_first_cached(&ctx->backup.entries);
-    struct timeline_node *left;
+    struct backup_sort *array;
+    unsigned int i, nr;
 
-    while (next) {
-        left = rb_entry(next, struct timeline_node, key_node);
-        if (multi_trace_call_remaining(dev, left, rr) == REMAINING_BREAK)
+    array = backup_sorted(ctx, &nr);
+    for (i = 0; i < nr; i++) {
+        if (multi_trace_call_remaining(dev, array[i].node, rr) == REMAINING_BREAK)
             break;
-        next = rb_next(next);
     }
+    free(array);
 }
 
 static void multi_trace_interval(struct prof_dev *dev)
@@ -852,8 +1083,9 @@ static void multi_trace_flush(struct prof_dev *dev, enum profdev_flush how)
         multi_trace_handle_remaining(dev, REMAINING_EXIT);
 
         while (multi_trace_first_pending(dev, NULL)) ;
-        rblist__exit(&ctx->backup);
+        backup_exit(ctx);
         rblist__exit(&ctx->timeline);
+        event_slab_shrink(ctx->slab, true);
     }
 }
 
@@ -909,9 +1141,10 @@ static void multi_trace_sigusr(struct prof_dev *dev, int signum)
                "  delete = %lu\n"
                "  nr_entries = %u\n"
                "  mem_bytes = %lu\n",
-               ctx->backup_stat.new, ctx->backup_stat.delete, rblist__nr_entries(&ctx->backup),
+               ctx->backup_stat.new, ctx->backup_stat.delete, ctx->backup.nr_entries,
                ctx->backup_stat.mem_bytes);
     }
+    event_slab_print(ctx->slab, 0);
     printf("SPECIAL EVENT:\n");
     printf("  sched:sched_wakeup unnecessary %lu\n", ctx->sched_wakeup_unnecessary);
 }
@@ -919,22 +1152,17 @@ static void multi_trace_sigusr(struct prof_dev *dev, int signum)
 static inline void reclaim(struct prof_dev *dev, u64 key, remaining_reason rr)
 {
     struct multi_trace_ctx *ctx = dev->private;
-    struct rb_node *node, *next;
-    struct timeline_node backup = {
-        .key = key,
-    };
+    struct timeline_node *left, *next;
     int remaining = REMAINING_CONTINUE;
 
     // Remove all events with the same key.
-    node = rb_find_first(&backup, &ctx->backup.entries.rb_root, perf_event_backup_node_find);
-    while (node) {
-        next = rb_next_match(&backup, node, perf_event_backup_node_find);
-        if (remaining == REMAINING_CONTINUE) {
-            struct timeline_node *left = rb_entry(node, struct timeline_node, key_node);
+    left = backup_find_first(ctx, key);
+    while (left) {
+        next = backup_next_same(left);
+        if (remaining == REMAINING_CONTINUE)
             remaining = multi_trace_call_remaining(dev, left, rr);
-        }
-        rblist__remove_node(&ctx->backup, node);
-        node = next;
+        backup_remove(ctx, left);
+        left = next;
     }
 }
 
@@ -947,7 +1175,7 @@ static inline void lost_reclaim(struct prof_dev *dev, int ins)
         reclaim(dev, key, REMAINING_LOST);
     } else {
         multi_trace_handle_remaining(dev, REMAINING_LOST);
-        rblist__exit(&ctx->backup);
+        backup_exit(ctx);
     }
 }
 
@@ -1298,19 +1526,14 @@ int event_iter_cmd(struct event_iter *iter, enum event_iter_cmd cmd)
     return 1;
 }
 
-static struct rb_node *multi_trace_find_prev(struct prof_dev *dev, struct timeline_node *backup)
+static struct timeline_node *multi_trace_find_prev(struct prof_dev *dev, struct timeline_node *backup)
 {
     struct multi_trace_ctx *ctx = dev->private;
-    struct rb_node *rbn;
-    rb_for_each(rbn, backup, &ctx->backup.entries.rb_root, perf_event_backup_node_find) {
-        if (!backup->tp)
-            return rbn;
-        else {
-            struct timeline_node *prev;
-            prev = container_of(rbn, struct timeline_node, key_node);
-            if (prev->tp == backup->tp)
-                return rbn;
-        }
+    struct timeline_node *prev;
+
+    backup_for_each_key(ctx, prev, backup->key) {
+        if (!backup->tp || prev->tp == backup->tp)
+            return prev;
     }
     return NULL;
 }
@@ -1333,10 +1556,8 @@ static void multi_trace_tryto_call_two(struct prof_dev *dev, struct timeline_nod
             .tp = tp1,
         };
         struct two_event *two;
-        struct rb_node *rbn = multi_trace_find_prev(dev, &backup);
-        if (rbn) {
-            struct timeline_node *prev;
-            prev = container_of(rbn, struct timeline_node, key_node);
+        struct timeline_node *prev = multi_trace_find_prev(dev, &backup);
+        if (prev) {
             prev->maybe_unpaired = 0;
             two = ctx->impl->object_find(ctx->class, prev->tp, tp);
             if (two && prev->time < tl_event->time/* Out of order */) {
@@ -1363,7 +1584,7 @@ static void multi_trace_tryto_call_two(struct prof_dev *dev, struct timeline_nod
             }
 
             if (need_remove_from_backup) {
-                rblist__remove_node(&ctx->backup, rbn);
+                backup_remove(ctx, prev);
 
                 // ctx->backup no longer references an event, prev.unneeded = 1,
                 // releasing unneeded events on the timeline in time.
@@ -1388,19 +1609,16 @@ static int multi_trace_tryto_backup(struct prof_dev *dev, struct timeline_node *
     struct env *env = dev->env;
     struct multi_trace_ctx *ctx = dev->private;
     bool need_backup = tl_event->need_backup;
-    unsigned int nr_entries;
-    struct rb_node *rbn;
+    struct timeline_node *exist;
+    bool is_exist;
     int ret = -1;
 
     // backup events, exclude untraced events.
     if (need_backup) {
     retry:
-        nr_entries = rblist__nr_entries(&ctx->backup);
-        rbn = rblist__findnew(&ctx->backup, tl_event);
-        if (rbn) {
-            if (nr_entries == rblist__nr_entries(&ctx->backup)) {
-                struct timeline_node *exist;
-                exist = rb_entry(rbn, struct timeline_node, key_node);
+        exist = backup_findnew(ctx, tl_event, &is_exist);
+        if (exist) {
+            if (is_exist) {
                 // Out of order
                 if (unlikely(tl_event->time < exist->time))
                     goto unneeded;
@@ -1410,7 +1628,7 @@ static int multi_trace_tryto_backup(struct prof_dev *dev, struct timeline_node *
                 **/
                 if (env->verbose > VERBOSE_NOTICE)
                     multi_trace_print_title(exist->event, exist->tp, "EEXIST");
-                rblist__remove_node(&ctx->backup, rbn);
+                backup_remove(ctx, exist);
                 *need_free = true;
 
                 /*
@@ -1554,7 +1772,7 @@ static long multi_trace_ftrace_filter(struct prof_dev *dev, union perf_event *ev
     struct multi_trace_type_header *hdr = (void *)event->sample.array;
     struct perf_evsel *evsel;
     struct tp *tp;
-    int i, j;
+    int i;
     void *raw;
     int size;
 
@@ -1563,13 +1781,12 @@ static long multi_trace_ftrace_filter(struct prof_dev *dev, union perf_event *ev
 
     evsel = perf_evlist__id_to_evsel(dev->evlist, hdr->id, NULL);
     for (i = 0; i < ctx->nr_list; i++) {
-        for_each_real_tp(ctx->tp_list[i], tp, j) {
-            if (tp->evsel == evsel) {
-                if (!tp->ftrace_filter)
-                    return 1;
-                multi_trace_raw_size(event, &raw, &size, tp);
-                return tp_prog_run(tp, tp->ftrace_filter, raw, size);
-            }
+        tp = tp_list_evsel_tp(ctx->tp_list[i], evsel);
+        if (tp) {
+            if (!tp->ftrace_filter)
+                return 1;
+            multi_trace_raw_size(event, &raw, &size, tp);
+            return tp_prog_run(tp, tp->ftrace_filter, raw, size);
         }
     }
     return 0;
@@ -1602,13 +1819,30 @@ static void multi_trace_sample(struct prof_dev *dev, union perf_event *event, in
     if (!evsel)
         goto not_found;
 
-    for (i = 0; i < ctx->nr_list; i++) {
-        tp1 = NULL;
-        for_each_tp(ctx->tp_list[i], tp, j) {
-            if (tp->evsel == evsel)
+    if (!event_dev) {
+        for (i = 0; i < ctx->nr_list; i++) {
+            tp = tp_list_evsel_tp(ctx->tp_list[i], evsel);
+            if (tp) {
+                // tp1: the previous traced tp.
+                tp1 = NULL;
+                for (j = tp - ctx->tp_list[i]->tp - 1; j >= 0; j--) {
+                    if (!ctx->tp_list[i]->tp[j].untraced) {
+                        tp1 = &ctx->tp_list[i]->tp[j];
+                        break;
+                    }
+                }
                 goto found;
-            if (!tp->untraced)
-                tp1 = tp;
+            }
+        }
+    } else {
+        for (i = 0; i < ctx->nr_list; i++) {
+            tp1 = NULL;
+            for_each_tp(ctx->tp_list[i], tp, j) {
+                if (tp->evsel == evsel)
+                    goto found;
+                if (!tp->untraced)
+                    tp1 = tp;
+            }
         }
     }
 
@@ -1751,15 +1985,17 @@ static void multi_trace_print_dev(struct prof_dev *dev, int indent)
     if (ctx->need_timeline) {
         dev_printf("TIMELINE:\n");
         dev_printf("    entries: %u\n", rblist__nr_entries(&ctx->timeline));
-        dev_printf("    backup: %u\n", rblist__nr_entries(&ctx->backup));
+        dev_printf("    backup: %u\n", ctx->backup.nr_entries);
         dev_printf("    unneeded: %lu\n", ctx->tl_stat.unneeded);
         dev_printf("    pending: %lu\n", ctx->tl_stat.pending);
         dev_printf("    mem_bytes: %lu\n", ctx->tl_stat.mem_bytes);
     } else {
         dev_printf("BACKUP:\n");
-        dev_printf("    entries: %u\n", rblist__nr_entries(&ctx->backup));
+        dev_printf("    entries: %u\n", ctx->backup.nr_entries);
+        dev_printf("    hash buckets: %u\n", 1U << ctx->backup.bits);
         dev_printf("    mem_bytes: %lu\n", ctx->backup_stat.mem_bytes);
     }
+    event_slab_print(ctx->slab, indent);
     if (ctx->sched_wakeup_unnecessary) {
         dev_printf("sched:sched_wakeup unnecessary: %lu\n", ctx->sched_wakeup_unnecessary);
     }
@@ -1911,7 +2147,7 @@ static void multi_trece_help(struct help_ctx *hctx)
 }
 
 static const char *multi_trace_desc[] = PROFILER_DESC("multi-trace",
-    "[OPTION...] -e EVENT [-e ...] [-k key] [--impl impl] [--than|--only-than ns] [--detail] [--perins] [--heatmap file] [--cycle]",
+    "[OPTION...] -e EVENT [-e ...] [-k key] [--impl impl] [--than|--only-than ns] [--detail] [--perins] [--hdr] [--window N,...] [--heatmap file] [--cycle]",
     "Multipurpose trace: delay, pair, kmemprof, syscalls.", "",
     "SYNOPSIS",
     "    Multiple events are associated by key and finally converted into two-event analysis.",
@@ -1934,7 +2170,7 @@ static const char *multi_trace_desc[] = PROFILER_DESC("multi-trace",
 static const char *multi_trace_argv[] = PROFILER_ARGV("multi-trace",
     PROFILER_ARGV_OPTION,
     PROFILER_ARGV_CALLCHAIN_FILTER,
-    PROFILER_ARGV_PROFILER, "event", "key", "impl", "than", "only-than", "lower", "detail", "perins", "heatmap", "cycle");
+    PROFILER_ARGV_PROFILER, "event", "key", "impl", "than", "only-than", "lower", "detail", "perins", "hdr", "window", "heatmap", "cycle");
 static profiler multi_trace = {
     .name = "multi-trace",
     .desc = multi_trace_desc,
@@ -2084,7 +2320,7 @@ static void syscalls_help(struct help_ctx *hctx)
 }
 
 static const char *syscalls_desc[] = PROFILER_DESC("syscalls",
-    "[OPTION...] -e raw_syscalls:sys_enter -e raw_syscalls:sys_exit [-k common_pid] [--than ns] [--perins] [--heatmap file]",
+    "[OPTION...] -e raw_syscalls:sys_enter -e raw_syscalls:sys_exit [-k common_pid] [--than ns] [--perins] [--hdr] [--window N,...] [--heatmap file]",
     "Syscalls latency analysis.", "",
     "SYNOPSIS",
     "    Based on multi-trace. See '"PROGRAME" multi-trace -h' for more information.", "",
@@ -2094,7 +2330,7 @@ static const char *syscalls_desc[] = PROFILER_DESC("syscalls",
 static const char *syscalls_argv[] = PROFILER_ARGV("syscalls",
     PROFILER_ARGV_OPTION,
     PROFILER_ARGV_CALLCHAIN_FILTER,
-    PROFILER_ARGV_PROFILER, "event", "key", "than", "perins", "heatmap");
+    PROFILER_ARGV_PROFILER, "event", "key", "than", "perins", "hdr", "window", "heatmap");
 static profiler syscalls = {
     .name = "syscalls",
     .desc = syscalls_desc,
@@ -2139,11 +2375,8 @@ PROFILER_REGISTER(syscalls);
  *     two(B, B_ret), then remove B.   B return, get the execution time of B.
  *     two(A, A_ret), last remove A.   A return, get the execution time of A.
 **/
-static int nested_perf_event_backup_node_cmp(struct rb_node *rbn, const void *entry)
+static int nested_perf_event_backup_node_cmp(const struct timeline_node *b, const struct timeline_node *e)
 {
-    struct timeline_node *b = container_of(rbn, struct timeline_node, key_node);
-    const struct timeline_node *e = entry;
-
     if (b->key > e->key)
         return 1;
     else if (b->key < e->key)
@@ -2172,7 +2405,7 @@ static int nested_trace_init(struct prof_dev *dev)
     if (__multi_trace_init(dev) < 0)
         return -1;
 
-    ctx->backup.node_cmp = nested_perf_event_backup_node_cmp;
+    ctx->backup.cmp = nested_perf_event_backup_node_cmp;
 
     for (k = 0; k < ctx->nr_list; k++) {
         struct tp *tp1 = NULL;
@@ -2259,7 +2492,7 @@ static void nested_trace_help(struct help_ctx *hctx)
 }
 
 static const char *nested_trace_desc[] = PROFILER_DESC("nested-trace",
-    "[OPTION...] -e E,E_ret [-e ...] [-k str] [--impl impl] [--than ns] [--detail] [--perins] [--heatmap file]",
+    "[OPTION...] -e E,E_ret [-e ...] [-k str] [--impl impl] [--than ns] [--detail] [--perins] [--hdr] [--window N,...] [--heatmap file]",
     "Nested-event trace: delay, call, call-delay.", "",
     "SYNOPSIS", "",
     "    Function calls, interrupts, etc. are possible nested events.",
@@ -2276,7 +2509,7 @@ static const char *nested_trace_desc[] = PROFILER_DESC("nested-trace",
 static const char *nested_trace_argv[] = PROFILER_ARGV("nested-trace",
     PROFILER_ARGV_OPTION,
     PROFILER_ARGV_CALLCHAIN_FILTER,
-    PROFILER_ARGV_PROFILER, "event", "key", "impl", "than", "detail", "perins", "heatmap");
+    PROFILER_ARGV_PROFILER, "event", "key", "impl", "than", "detail", "perins", "hdr", "window", "heatmap");
 static profiler nested_trace = {
     .name = "nested-trace",
     .desc = nested_trace_desc,
@@ -2402,7 +2635,7 @@ static void rundelay_help(struct help_ctx *hctx)
 
 static const char *rundelay_desc[] = PROFILER_DESC("rundelay",
     "[OPTION...] -e sched:sched_wakeup,sched:sched_wakeup_new,sched:sched_switch//key=prev_pid/ \\\n"
-    "        -e sched:sched_switch//key=next_pid/ -k pid [--filter comm] [--than ns] [--detail] [--perins] [--heatmap file]",
+    "        -e sched:sched_switch//key=next_pid/ -k pid [--filter comm] [--than ns] [--detail] [--perins] [--hdr] [--window N,...] [--heatmap file]",
     "Schedule rundelay.",
     "",
     "SYNOPSIS",
@@ -2418,7 +2651,7 @@ static const char *rundelay_desc[] = PROFILER_DESC("rundelay",
 static const char *rundelay_argv[] = PROFILER_ARGV("rundelay",
     PROFILER_ARGV_OPTION,
     PROFILER_ARGV_CALLCHAIN_FILTER,
-    PROFILER_ARGV_PROFILER, "event", "key", "than", "detail", "perins", "heatmap", "filter");
+    PROFILER_ARGV_PROFILER, "event", "key", "than", "detail", "perins", "hdr", "window", "heatmap", "filter");
 static profiler rundelay = {
     .name = "rundelay",
     .desc = rundelay_desc,
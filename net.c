@@ -480,6 +480,7 @@ int tcp_send(void *cli, const void *buf, size_t len, int flags)
         client->lost_event.header.misc = 0;
         client->lost_event.id          = 0;
         client->lost_event.lost        ++ ;
+        return 1;
     }
 
     return 0;
@@ -511,16 +512,17 @@ int tcp_server_broadcast(void *server, const void *buf, size_t len, int flags)
     struct tcp_server_socket *srv = server;
     struct tcp_client_socket *client, *next;
 
+    int lost = 0;
+
     // Non-tcp server, tcp_send directly.
-    if (unlikely(srv->header.type != LISTEN_SERVER)) {
-        tcp_send(srv, buf, len, flags);
-        return 0;
-    }
+    if (unlikely(srv->header.type != LISTEN_SERVER))
+        return tcp_send(srv, buf, len, flags) > 0;
 
     list_for_each_entry_safe(client, next, &srv->clilist, srvlink) {
-        tcp_send(client, buf, len, flags);
+        if (tcp_send(client, buf, len, flags) > 0)
+            lost++;
     }
-    return 0;
+    return lost;
 }
 
 static void handle_connect(int fd, unsigned int revents, void *ptr)
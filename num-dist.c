@@ -87,7 +87,8 @@ static int monitor_ctx_init(struct prof_dev *dev)
 
     ctx->nr_points = ctx->tp_list->nr_tp;
 
-    ctx->dist = latency_dist_new_quantile(env->perins, true, 0);
+    ctx->dist = env->hdr ? latency_dist_new_hdr(env->perins, true, 0) :
+                           latency_dist_new_quantile(env->perins, true, 0);
     if (!ctx->dist)
         goto failed;
 
@@ -206,7 +207,7 @@ static void print_num_node(void *opaque, struct latency_node *node)
     struct num_dist_ctx *ctx = dev->private;
     int oncpu = prof_dev_ins_oncpu(dev);
     struct tp *tp = &ctx->tp_list->tp[node->key];
-    double p99 = tdigest_quantile(node->td, 0.99);
+    double p99 = latency_node_quantile(node, 0.99);
     int i;
 
     if (ctx->print_header) {
@@ -302,17 +303,13 @@ static void num_dist_sample(struct prof_dev *dev, union perf_event *event, int i
     __u64 delta;
 
     evsel = perf_evlist__id_to_evsel(dev->evlist, hdr->id, NULL);
-    if (!evsel)
+    tp = tp_list_evsel_tp(ctx->tp_list, evsel);
+    if (!tp)
         return;
 
-    for_each_real_tp(ctx->tp_list, tp, i) {
-        if (tp->evsel == evsel)
-            break;
-    }
-    if (i == ctx->nr_points)
+    i = tp - ctx->tp_list->tp;
+    if (i >= ctx->nr_points)
         return ;
-
-    tp = &ctx->tp_list->tp[i];
     callchain = tp->stack || env->callchain;
     __raw_size(event, &raw, &size, callchain);
 
@@ -372,7 +369,7 @@ static void num_dist_help(struct help_ctx *hctx)
 
 
 static const char *num_dist_desc[] = PROFILER_DESC("num-dist",
-    "[OPTION...] -e EVENT [--perins] [--than ns] [--heatmap file] [-g]",
+    "[OPTION...] -e EVENT [--perins] [--hdr] [--than ns] [--heatmap file] [-g]",
     "Numerical distribution. Get 'num' data from the event itself.", "",
     "EXAMPLES",
     "    "PROGRAME" num-dist -e sched:sched_stat_runtime help",
@@ -381,7 +378,7 @@ static const char *num_dist_desc[] = PROFILER_DESC("num-dist",
 static const char *num_dist_argv[] = PROFILER_ARGV("num-dist",
     PROFILER_ARGV_OPTION,
     PROFILER_ARGV_CALLCHAIN_FILTER,
-    PROFILER_ARGV_PROFILER, "event", "perins", "than", "heatmap", "call-graph");
+    PROFILER_ARGV_PROFILER, "event", "perins", "hdr", "than", "heatmap", "call-graph");
 static profiler num_dist = {
     .name = "num-dist",
     .desc = num_dist_desc,
@@ -4,6 +4,7 @@
 #include <linux/kernel.h>
 #include <linux/circ_buf.h>
 #include <linux/bitops.h>
+#include <linux/log2.h>
 #include <monitor.h>
 #include <api/fs/fs.h>
 #include <internal/mmap.h>
@@ -75,17 +76,124 @@ struct stream_event {
     bool empty_pause;
 } __attribute__((aligned(ALIGN_SIZE)));
 
-static __always_inline bool less_than(const void *lhs, const void *rhs, void __maybe_unused *args)
+/*
+ * k-way merge with a loser tree.
+ *
+ * Each internal node keeps the loser of the match between its two subtrees,
+ * and loser[0] keeps the overall winner. When the winner's head changes, only
+ * the matches on its path to the root are replayed: log2(k) compares against
+ * keys stored contiguously in key[], instead of chasing heap_event pointers.
+ *
+ * The runner-up is the smallest loser on the winner's path. While the winner's
+ * next event is earlier than the runner-up, it is still the winner and the tree
+ * is not touched at all. Runs of events from the same ringbuffer are merged
+ * without any sift.
+ */
+#define ORDER_TREE_EMPTY ((heapclock_t)-1)
+
+static int order_tree_build(struct prof_dev *main_dev)
 {
-    struct heap_event *a = *(struct heap_event **)lhs;
-    struct heap_event *b = *(struct heap_event **)rhs;
-    return a->time < b->time;
+    struct order_tree *tree = &main_dev->order.tree;
+    struct heap_event **data = (void *)main_dev->order.data;
+    int nr = tree->nr;
+    int leaves = nr > 1 ? roundup_pow_of_two(nr) : 1;
+    int *winner;
+    int i, p;
+
+    if (leaves > tree->capacity) {
+        int *loser = realloc(tree->loser, 2 * leaves * sizeof(*tree->loser));
+        heapclock_t *key;
+        if (!loser)
+            return -1;
+        tree->loser = loser;
+        key = realloc(tree->key, leaves * sizeof(*tree->key));
+        if (!key)
+            return -1;
+        tree->key = key;
+        tree->capacity = leaves;
+    }
+
+    tree->leaves = leaves;
+    tree->active = nr;
+    for (i = 0; i < leaves; i++)
+        tree->key[i] = i < nr ? data[i]->time : ORDER_TREE_EMPTY;
+
+    // Play all the matches bottom-up. Leaf i is node i+leaves.
+    winner = tree->loser + leaves;
+    for (p = leaves - 1; p >= 1; p--) {
+        int l = 2 * p, r = 2 * p + 1;
+        int a = l >= leaves ? l - leaves : winner[l];
+        int b = r >= leaves ? r - leaves : winner[r];
+        if (tree->key[b] < tree->key[a]) {
+            winner[p] = b;
+            tree->loser[p] = a;
+        } else {
+            winner[p] = a;
+            tree->loser[p] = b;
+        }
+    }
+    tree->loser[0] = leaves > 1 ? winner[1] : 0;
+
+    tree->runner_up = ORDER_TREE_EMPTY;
+    for (p = (tree->loser[0] + leaves) >> 1; p; p >>= 1)
+        if (tree->key[tree->loser[p]] < tree->runner_up)
+            tree->runner_up = tree->key[tree->loser[p]];
+    return 0;
 }
-static __always_inline void swap_ptr(void *lhs, void *rhs, void __maybe_unused *args)
+
+static __always_inline struct heap_event *order_tree_winner(struct prof_dev *main_dev)
 {
-    struct heap_event *a = *(struct heap_event **)lhs;
-    *(struct heap_event **)lhs = *(struct heap_event **)rhs;
-    *(struct heap_event **)rhs = a;
+    struct order_tree *tree = &main_dev->order.tree;
+
+    if (unlikely(!tree->active))
+        return NULL;
+    return main_dev->order.data[tree->loser[0]];
+}
+
+static void order_tree_replay(struct prof_dev *main_dev)
+{
+    struct order_tree *tree = &main_dev->order.tree;
+    int w = tree->loser[0];
+    int p;
+
+    for (p = (w + tree->leaves) >> 1; p; p >>= 1) {
+        int l = tree->loser[p];
+        if (tree->key[l] < tree->key[w]) {
+            tree->loser[p] = w;
+            w = l;
+        }
+    }
+    tree->loser[0] = w;
+
+    tree->runner_up = ORDER_TREE_EMPTY;
+    for (p = (w + tree->leaves) >> 1; p; p >>= 1)
+        if (tree->key[tree->loser[p]] < tree->runner_up)
+            tree->runner_up = tree->key[tree->loser[p]];
+
+    main_dev->order.nr_sift++;
+}
+
+// The winner's head has changed to `time'.
+static __always_inline void order_tree_update(struct prof_dev *main_dev, heapclock_t time)
+{
+    struct order_tree *tree = &main_dev->order.tree;
+
+    tree->key[tree->loser[0]] = time;
+    if (time < tree->runner_up)
+        return;
+    order_tree_replay(main_dev);
+}
+
+// The winner has no more events.
+static __always_inline void order_tree_pop(struct prof_dev *main_dev)
+{
+    struct order_tree *tree = &main_dev->order.tree;
+    int w = tree->loser[0];
+
+    main_dev->order.data[w] = NULL;
+    tree->key[w] = ORDER_TREE_EMPTY;
+    tree->active--;
+    order_tree_replay(main_dev);
 }
 
 static int perf_sample_max_size(struct perf_evsel *evsel)
@@ -217,8 +325,13 @@ int order_init(struct prof_dev *dev)
         heap_size += source->order.nr_mmaps;
     }
 
-    perf_evlist__for_each_mmap(dev->evlist, map, dev->env->overwrite)
-        nr_mmaps++;
+    // --order-threads, perf_mmaps are registered as streams.
+    if (order_worker_init(dev) < 0)
+        return -1;
+
+    if (!using_order_worker(dev))
+        perf_evlist__for_each_mmap(dev->evlist, map, dev->env->overwrite)
+            nr_mmaps++;
     heap_size += nr_mmaps;
     heap_size += dev->order.nr_streams;
 
@@ -226,10 +339,9 @@ int order_init(struct prof_dev *dev)
     dev->order.data = calloc(heap_size, sizeof(*dev->order.data));
     if (!dev->order.data)
         return -1;
-    min_heap_init(&dev->order.heapsort, dev->order.data, heap_size);
 
     dev->order.nr_mmaps = nr_mmaps;
-    ret = posix_memalign(&dev->order.permap_event, ALIGN_SIZE, nr_mmaps * sizeof(struct perf_mmap_event));
+    ret = posix_memalign(&dev->order.permap_event, ALIGN_SIZE, (nr_mmaps ?: 1) * sizeof(struct perf_mmap_event));
     dev->order.heap_popped_time = 0;
     dev->order.wakeup_watermark = perf_sample_watermark(dev);
 
@@ -241,6 +353,8 @@ int order_init(struct prof_dev *dev)
         int idx = perf_mmap__idx(map);
         if (idx == 0)
             perf_event_convert_read_tsc_conversion(dev, map);
+        if (using_order_worker(dev))
+            break;
 
         mmap_event = (struct perf_mmap_event *)dev->order.permap_event + idx;
         mmap_event->base.dev = dev;
@@ -269,6 +383,8 @@ void order_deinit(struct prof_dev *dev)
     struct perf_mmap_event *mmap_event;
     int i;
 
+    order_worker_deinit(dev);
+
     for (i = 0; i < dev->order.nr_mmaps; i++) {
         mmap_event = (struct perf_mmap_event *)dev->order.permap_event + i;
         list_del(&mmap_event->base.link);
@@ -281,10 +397,29 @@ void order_deinit(struct prof_dev *dev)
 
     if (dev->order.data)
         free(dev->order.data);
+    if (dev->order.tree.loser)
+        free(dev->order.tree.loser);
+    if (dev->order.tree.key)
+        free(dev->order.tree.key);
     if (dev->order.permap_event)
         free(dev->order.permap_event);
 }
 
+/*
+ * The ringbuffer of @map has been replaced, see mmap_adapt.c. Its positions
+ * restart from 0, forget the predicted lost_start.
+ */
+void order_mmap_reset(struct prof_dev *dev, struct perf_mmap *map)
+{
+    struct perf_mmap_event *mmap_event;
+
+    if (!dev->order.enabled || using_order_worker(dev))
+        return;
+
+    mmap_event = (struct perf_mmap_event *)dev->order.permap_event + perf_mmap__idx(map);
+    mmap_event->maybe_lost_end = 0;
+}
+
 int order_register(struct prof_dev *dev, read_event *read_event, void *stream)
 {
     struct prof_dev *main_dev = order_main_dev(dev);
@@ -310,7 +445,6 @@ int order_register(struct prof_dev *dev, read_event *read_event, void *stream)
         free(main_dev->order.data);
         main_dev->order.heap_size = heap_size;
         main_dev->order.data = data;
-        min_heap_init(&main_dev->order.heapsort, data, heap_size);
     }
     main_dev->order.nr_streams++;
     list_add(&stream_event->base.link, &main_dev->order.heap_event_list);
@@ -391,7 +525,8 @@ perf_mmap_fix_out_of_order(struct prof_dev *main_dev, struct prof_dev *dev,
         printf("%s: fix out-of-order event %lu(%d) < %lu(%d)\n", dev->prof->name,
                     heap_event->time, heap_event->ins, popped_time, popped_ins);
 
-    if (!heap_event->writable) {
+    // Same as perf_event_convert(), only the overwrite ringbuffer is read-only.
+    if (!heap_event->writable && dev->env->overwrite) {
         struct perf_mmap *map = ((struct perf_mmap_event *)heap_event)->map;
         memcpy(map->event_copy, event, event->header.size);
         event = (union perf_event *)map->event_copy;
@@ -426,6 +561,7 @@ static int perf_mmap_event_init(struct heap_event *heap_event, struct prof_dev *
 
     if (perf_mmap__read_init(map) < 0)
         return -1;
+    mmap_adapt_read(dev, map);
 
     lost.lost = 0;
 retry:
@@ -446,8 +582,10 @@ retry:
          */
         /* Only the PERF_RECORD_SAMPLE event can sample time. */
         if (unlikely(event->header.type != PERF_RECORD_SAMPLE)) {
-            if (event->header.type == PERF_RECORD_LOST)
+            if (event->header.type == PERF_RECORD_LOST) {
                 dev->order.nr_lost++;
+                mmap_adapt_lost(dev, map);
+            }
             if (event->header.type == PERF_RECORD_LOST && dev->prof->lost) {
                 lost.id = event->lost.id;
                 lost.lost = event->lost.lost;
@@ -615,12 +753,10 @@ static int stream_event_process(struct prof_dev *main_dev, struct heap_event *he
 
 static int order_heap_init(struct prof_dev *main_dev, struct prof_dev *dev)
 {
-    DEFINE_MIN_HEAP(struct heap_event *, ) *heap;
+    struct order_tree *tree = &main_dev->order.tree;
     struct heap_event *heap_event;
     struct prof_dev *child, *tmp;
 
-    heap = (void *)&main_dev->order.heapsort;
-
     list_for_each_entry(heap_event, &dev->order.heap_event_list, link) {
         if (heap_event->type == PERF_MMAP_EVENT) {
             if (perf_mmap_event_init(heap_event, main_dev) < 0)
@@ -632,18 +768,16 @@ static int order_heap_init(struct prof_dev *main_dev, struct prof_dev *dev)
             }
         }
 
-        if (heap->nr == heap->size) {
+        if (tree->nr == main_dev->order.heap_size) {
             // expand
-            int heap_size = heap->size + dev->order.heap_size;
-            void *data = realloc(heap->data, heap_size * sizeof(*heap->data));
+            int heap_size = main_dev->order.heap_size + dev->order.heap_size;
+            void *data = realloc(main_dev->order.data, heap_size * sizeof(*main_dev->order.data));
             if (!data)
                 return -1;
-            heap->size = heap_size;
-            heap->data = data;
             main_dev->order.heap_size = heap_size;
             main_dev->order.data = data;
         }
-        heap->data[heap->nr++] = heap_event;
+        main_dev->order.data[tree->nr++] = heap_event;
         prof_dev_get(heap_event->dev);
     }
 
@@ -682,11 +816,8 @@ void order_process(struct prof_dev *dev, struct perf_mmap *target_map, perfclock
     // heap sort
     struct perf_mmap_event *mmap_event;
     struct heap_event *heap_event;
-    DEFINE_MIN_HEAP(struct heap_event *, ) *heap;
-    struct min_heap_callbacks funcs = {
-        .less = less_than,
-        .swp = swap_ptr,
-    };
+    struct order_tree *tree;
+    int i;
 
 
     if (main_dev->order.inprocess)
@@ -711,32 +842,32 @@ void order_process(struct prof_dev *dev, struct perf_mmap *target_map, perfclock
     target_time = target_tm ? heapclock(main_dev, target_tm) : -1UL;
 
     lost.lost = 0;
-    heap = (void *)&main_dev->order.heapsort;
-    heap->nr = 0;
+    tree = &main_dev->order.tree;
+    tree->nr = 0;
 
     if (order_heap_init(main_dev, main_dev) != 0)
         goto stream_stop;
 
 
     // heap sort start
-    min_heapify_all(heap, &funcs, NULL);
+    if (order_tree_build(main_dev) < 0)
+        goto stream_stop;
     while (1) {
-        struct heap_event **data = min_heap_peek(heap);
         bool need_break = 0;
 
-        if (!data) {
+        heap_event = order_tree_winner(main_dev);
+        if (!heap_event) {
             main_dev->order.break_reason = ORDER_BREAK_EMPTY;
             break;
         }
-
-        heap_event = data[0];
+        main_dev->order.nr_sift_events++;
 
         if (unlikely(heap_event->type == STREAM_EVENT)) {
             if (stream_event_process(main_dev, heap_event) == 0) {
-                min_heap_sift_down(heap, 0, &funcs, NULL);
+                order_tree_update(main_dev, heap_event->time);
                 continue;
             } else {
-                min_heap_pop(heap, &funcs, NULL);
+                order_tree_pop(main_dev);
                 prof_dev_put(heap_event->dev);
                 main_dev->order.break_reason = ORDER_BREAK_STREAM_STOP;
                 break;
@@ -881,6 +1012,7 @@ void order_process(struct prof_dev *dev, struct perf_mmap *target_map, perfclock
             if (unlikely(event->header.type != PERF_RECORD_SAMPLE)) {
                 if (event->header.type == PERF_RECORD_LOST) {
                     dev->order.nr_lost++;
+                    mmap_adapt_lost(dev, map);
                     if (dev->prof->lost) {
                         lost.id = event->lost.id;
                         lost.lost = event->lost.lost;
@@ -893,7 +1025,7 @@ void order_process(struct prof_dev *dev, struct perf_mmap *target_map, perfclock
             heap_event->event = event;
             heap_event->time = heapclock(main_dev, *(u64 *)((void *)event->sample.array + dev->pos.time_pos));
             heap_event->writable = writable;
-            min_heap_sift_down(heap, 0, &funcs, NULL);
+            order_tree_update(main_dev, heap_event->time);
 
             if (unlikely(lost.lost)) {
                 if (mmap_event->event_mono_time/*lost_start*/ < main_dev->order.prev_lost_time)
@@ -908,7 +1040,7 @@ void order_process(struct prof_dev *dev, struct perf_mmap *target_map, perfclock
             }
         } else {
             perf_mmap__read_done(map);
-            min_heap_pop(heap, &funcs, NULL);
+            order_tree_pop(main_dev);
             prof_dev_put(dev);
         }
 
@@ -918,8 +1050,10 @@ void order_process(struct prof_dev *dev, struct perf_mmap *target_map, perfclock
 
 
 stream_stop:
-    while (heap->nr) {
-        heap_event = heap->data[--heap->nr];
+    for (i = 0; i < tree->nr; i++) {
+        heap_event = main_dev->order.data[i];
+        if (!heap_event)
+            continue;
         if (heap_event->type == PERF_MMAP_EVENT) {
             mmap_event = (struct perf_mmap_event *)heap_event;
             perf_mmap__unread_event(mmap_event->map, heap_event->event);
@@ -0,0 +1,542 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/prctl.h>
+#include <linux/kernel.h>
+#include <linux/log2.h>
+#include <asm/barrier.h>
+#include <monitor.h>
+#include <internal/mmap.h>
+
+/*
+ * --order-threads: drain the perf ringbuffers with a pool of worker threads.
+ *
+ * Each worker owns a contiguous subset of the perf_mmaps (i.e. a subset of CPUs).
+ * It copies the events into a per-mmap SPSC queue, converts the timestamp, and
+ * hands the queue to order_process() as a stream, see order_register(). The
+ * main thread only merges already-copied events, and the kernel ringbuffers are
+ * released quickly, even if the profiler is busy.
+ *
+ *   perf_mmap 0..k  ->  worker 0  ->  queue 0..k  -\
+ *   perf_mmap k..n  ->  worker 1  ->  queue k..n  --+->  order_process()  ->  profiler
+ *
+ * A stream must not be empty for the heap sort to continue. After a worker
+ * drains a perf_mmap, it assumes that no event earlier than `known_time' can
+ * still appear in it, see order_queue_drain(). This is published as a
+ * PERF_RECORD_ORDER_TIME event, so idle CPUs do not stall the merge.
+ *
+ * The kernel takes the sample time before it writes the record, another CPU
+ * may still publish an earlier event after the latest one is seen. So
+ * `known_time' is the latest time seen by all workers, minus
+ * ORDER_WORKER_MARGIN_NS.
+ *
+ * The userspace ftrace filter still runs on the main thread, because expr
+ * programs are not reentrant.
+ */
+
+#define ORDER_QUEUE_PAD 0 // Not a valid PERF_RECORD_* type.
+#define ORDER_WORKER_HEARTBEAT_MS 10
+#define ORDER_WORKER_MARGIN_NS (1 * NSEC_PER_MSEC)
+#define ALIGN_SIZE 64
+
+struct order_worker;
+
+// Single-producer (worker) single-consumer (main thread) event queue.
+struct order_queue {
+    // producer
+    u64 head __attribute__((aligned(ALIGN_SIZE)));
+    u64 tail_cache;
+    u64 last_time; // heapclock_t, the latest event or order_time pushed.
+    bool full;
+    bool paused; // full, its fd is removed from the worker epoll.
+    // consumer
+    u64 tail __attribute__((aligned(ALIGN_SIZE)));
+    u64 snap_head;
+    u32 consume; // The size of the previous event returned by read_event().
+    // const
+    char *buf __attribute__((aligned(ALIGN_SIZE)));
+    u64 size;
+    u64 mask;
+    int ins;
+    struct perf_mmap *map;
+    struct order_worker *worker;
+};
+
+struct order_worker {
+    struct order_worker_ctx *ctx;
+    pthread_t thread;
+    int epfd;
+    int first, nr; // queues[first, first+nr)
+    bool started;
+    u64 latest_time; // heapclock_t, read by other workers.
+    // stat
+    u64 nr_passes;
+    u64 nr_events;
+    u64 nr_order_time;
+    u64 nr_fixed_events;
+    u64 nr_lost;
+    u64 nr_full;
+} __attribute__((aligned(ALIGN_SIZE)));
+
+struct order_worker_ctx {
+    struct prof_dev *dev;
+    int nr_workers;
+    int nr_queues;
+    int notifyfd; // worker => main thread
+    int stopfd; // main thread => worker
+    bool running;
+    struct order_worker *workers;
+    struct order_queue *queues;
+};
+
+static void *order_queue_reserve(struct order_queue *q, u64 *head, u32 size)
+{
+    u64 off = *head & q->mask;
+    u64 contig = q->size - off;
+    u64 need = contig < size ? contig + size : size;
+    void *ptr;
+
+    if (*head + need - q->tail_cache > q->size) {
+        q->tail_cache = smp_load_acquire(&q->tail);
+        if (*head + need - q->tail_cache > q->size)
+            return NULL;
+    }
+
+    // The event is always contiguous, skip the end of the buffer.
+    if (contig < size) {
+        struct perf_event_header *pad = (void *)q->buf + off;
+        pad->type = ORDER_QUEUE_PAD;
+        pad->size = 0;
+        *head += contig;
+    }
+    ptr = (void *)q->buf + (*head & q->mask);
+    *head += size;
+    return ptr;
+}
+
+/*
+ * Copy all events in the perf_mmap to the queue.
+ *
+ * @known_time: ORDER_WORKER_MARGIN_NS before an event already seen by some
+ * worker before the perf_mmap is read. Events before it are assumed to have been
+ * written to this perf_mmap, and are all copied now. Unless the queue is full,
+ * and events are left in the perf_mmap.
+ *
+ * Return true if anything is pushed to the queue.
+ */
+static bool order_queue_drain(struct order_queue *q, u64 known_time)
+{
+    struct order_worker *w = q->worker;
+    struct prof_dev *dev = w->ctx->dev;
+    struct perf_mmap *map = q->map;
+    union perf_event *event, *copy;
+    bool writable;
+    u64 head = q->head;
+    u64 *time;
+
+    q->full = false;
+    if (perf_mmap__read_init(map) < 0)
+        goto order_time;
+
+    while ((event = perf_mmap__read_event(map, &writable)) != NULL) {
+        copy = order_queue_reserve(q, &head, event->header.size);
+        if (unlikely(!copy)) {
+            // Leave it in the perf_mmap. The main thread is too slow.
+            perf_mmap__unread_event(map, event);
+            q->full = true;
+            w->nr_full++;
+            break;
+        }
+        memcpy(copy, event, event->header.size);
+        perf_mmap__consume(map);
+
+        if (likely(copy->header.type == PERF_RECORD_SAMPLE)) {
+            copy = perf_event_convert(dev, copy, true);
+            time = (u64 *)((void *)copy->sample.array + dev->pos.time_pos);
+            // Keep order in queue, same as perf_mmap_fix_out_of_order().
+            if (unlikely(*time < q->last_time)) {
+                *time = q->last_time;
+                w->nr_fixed_events++;
+            } else
+                q->last_time = *time;
+            w->nr_events++;
+        } else if (copy->header.type == PERF_RECORD_LOST)
+            w->nr_lost++;
+    }
+    if (!event)
+        perf_mmap__read_done(map);
+
+order_time:
+    if (!q->full && known_time > q->last_time) {
+        struct perf_record_order_time *o = order_queue_reserve(q, &head, sizeof(*o));
+        if (o) {
+            o->header.type = PERF_RECORD_ORDER_TIME;
+            o->header.misc = 0;
+            o->header.size = sizeof(*o);
+            o->order_time = known_time;
+            q->last_time = known_time;
+            w->nr_order_time++;
+        }
+    }
+
+    if (head != q->head) {
+        smp_store_release(&q->head, head);
+        return true;
+    }
+    return false;
+}
+
+static u64 order_worker_known_time(struct order_worker_ctx *ctx)
+{
+    struct prof_dev *dev = ctx->dev;
+    u64 known_time = 0;
+    int i;
+
+    for (i = 0; i < ctx->nr_workers; i++) {
+        u64 time = READ_ONCE(ctx->workers[i].latest_time);
+        if (time > known_time)
+            known_time = time;
+    }
+    if (!known_time)
+        return 0;
+
+    // heapclock_t may be tsc, the margin is in ns.
+    known_time = heapclock_to_perfclock(dev, known_time);
+    if (known_time <= ORDER_WORKER_MARGIN_NS)
+        return 0;
+    return dev->convert.need_conv ? perfclock_to_evclock(dev, known_time - ORDER_WORKER_MARGIN_NS).clock :
+                                    known_time - ORDER_WORKER_MARGIN_NS;
+}
+
+/*
+ * A full queue leaves events in the perf_mmap, its fd stays readable and the
+ * level-triggered epoll_wait() would spin. Remove it until the queue drains,
+ * the heartbeat still drains it.
+ */
+static void order_queue_pause(struct order_queue *q, bool pause)
+{
+    struct epoll_event ev;
+
+    if (q->paused == pause)
+        return;
+    ev.events = pause ? 0 : EPOLLIN;
+    ev.data.fd = q->map->fd;
+    if (epoll_ctl(q->worker->epfd, EPOLL_CTL_MOD, q->map->fd, &ev) == 0)
+        q->paused = pause;
+}
+
+static bool order_worker_pass(struct order_worker *w, u64 known_time)
+{
+    struct order_worker_ctx *ctx = w->ctx;
+    u64 latest_time = w->latest_time;
+    bool pushed = false;
+    int i;
+
+    for (i = w->first; i < w->first + w->nr; i++) {
+        struct order_queue *q = &ctx->queues[i];
+        pushed |= order_queue_drain(q, known_time);
+        order_queue_pause(q, q->full);
+        if (q->last_time > latest_time)
+            latest_time = q->last_time;
+    }
+    WRITE_ONCE(w->latest_time, latest_time);
+    w->nr_passes++;
+    return pushed;
+}
+
+static void *order_worker_thread(void *arg)
+{
+    struct order_worker *w = arg;
+    struct order_worker_ctx *ctx = w->ctx;
+    struct epoll_event events[16];
+    char name[16];
+
+    snprintf(name, sizeof(name), "perf-order/%d", (int)(w - ctx->workers) % 1000);
+    prctl(PR_SET_NAME, name);
+
+    while (1) {
+        int n = epoll_wait(w->epfd, events, ARRAY_SIZE(events), ORDER_WORKER_HEARTBEAT_MS);
+        int i;
+
+        for (i = 0; i < n; i++)
+            if (events[i].data.fd == ctx->stopfd)
+                return NULL;
+
+        // Read `known_time' before draining any perf_mmap.
+        if (order_worker_pass(w, order_worker_known_time(ctx)))
+            eventfd_write(ctx->notifyfd, 1);
+    }
+    return NULL;
+}
+
+static void order_worker_notify(int fd, unsigned int revents, void *ptr)
+{
+    struct prof_dev *dev = ptr;
+    eventfd_t cnt;
+
+    if (eventfd_read(fd, &cnt) == 0)
+        order_stream(dev);
+}
+
+static union perf_event *order_queue_read_event(void *stream, bool init, int *ins, bool *writable, bool *converted)
+{
+    struct order_queue *q = stream;
+    union perf_event *event = NULL;
+    u64 tail = q->tail + q->consume;
+
+    q->consume = 0;
+    if (init)
+        q->snap_head = smp_load_acquire(&q->head);
+
+    while (tail != q->snap_head) {
+        event = (void *)q->buf + (tail & q->mask);
+        if (event->header.type == ORDER_QUEUE_PAD) {
+            tail += q->size - (tail & q->mask);
+            event = NULL;
+            continue;
+        }
+        q->consume = event->header.size;
+        *ins = q->ins;
+        *writable = true;
+        *converted = true;
+        break;
+    }
+    // The returned event is consumed on the next read.
+    smp_store_release(&q->tail, tail);
+    return event;
+}
+
+int order_worker_init(struct prof_dev *dev)
+{
+    struct env *env = dev->env;
+    struct order_worker_ctx *ctx;
+    struct perf_mmap *map;
+    int nr_mmaps = 0, nr_workers;
+    u64 size;
+    int i, w;
+
+    if (!env->order_threads || env->overwrite)
+        return 0;
+    /*
+     * Only the top device attached to CPUs. The events of the child devices
+     * and forwarding sources are still sorted by the perf_mmap heap_event.
+     */
+    if (prof_dev_has_parent(dev) || !prof_dev_ins_oncpu(dev))
+        return 0;
+    if (dev->convert.need_conv == CONVERT_TO_KVMCLOCK) {
+        fprintf(stderr, "--order-threads does not support --kvmclock.\n");
+        return -1;
+    }
+
+    perf_evlist__for_each_mmap(dev->evlist, map, env->overwrite)
+        nr_mmaps++;
+    if (nr_mmaps == 0)
+        return 0;
+    nr_workers = min(env->order_threads, nr_mmaps);
+
+    ctx = zalloc(sizeof(*ctx));
+    if (!ctx)
+        return -1;
+    ctx->dev = dev;
+    ctx->notifyfd = -1;
+    ctx->stopfd = -1;
+    ctx->nr_queues = nr_mmaps;
+    ctx->nr_workers = nr_workers;
+    dev->order.worker = ctx;
+
+    if (posix_memalign((void **)&ctx->workers, ALIGN_SIZE, nr_workers * sizeof(*ctx->workers)) ||
+        posix_memalign((void **)&ctx->queues, ALIGN_SIZE, nr_mmaps * sizeof(*ctx->queues)))
+        goto failed;
+    memset(ctx->workers, 0, nr_workers * sizeof(*ctx->workers));
+    memset(ctx->queues, 0, nr_mmaps * sizeof(*ctx->queues));
+
+    // Same size as the perf ringbuffer, and holds at least 2 max-sized events.
+    size = roundup_pow_of_two(max((u64)dev->pages * sysconf(_SC_PAGE_SIZE), (u64)PERF_SAMPLE_MAX_SIZE * 2));
+
+    for (w = 0; w < nr_workers; w++) {
+        ctx->workers[w].ctx = ctx;
+        ctx->workers[w].epfd = -1;
+        ctx->workers[w].first = w * nr_mmaps / nr_workers;
+        ctx->workers[w].nr = (w + 1) * nr_mmaps / nr_workers - ctx->workers[w].first;
+    }
+
+    w = 0;
+    perf_evlist__for_each_mmap(dev->evlist, map, env->overwrite) {
+        i = perf_mmap__idx(map);
+        ctx->queues[i].buf = malloc(size);
+        if (!ctx->queues[i].buf)
+            goto failed;
+        ctx->queues[i].size = size;
+        ctx->queues[i].mask = size - 1;
+        ctx->queues[i].ins = i;
+        ctx->queues[i].map = map;
+        while (i >= ctx->workers[w].first + ctx->workers[w].nr)
+            w++;
+        ctx->queues[i].worker = &ctx->workers[w];
+    }
+
+    for (i = 0; i < nr_mmaps; i++)
+        if (order_register(dev, order_queue_read_event, &ctx->queues[i]) < 0)
+            goto failed;
+
+    return 0;
+
+failed:
+    order_worker_deinit(dev);
+    return -1;
+}
+
+void order_worker_deinit(struct prof_dev *dev)
+{
+    struct order_worker_ctx *ctx = dev->order.worker;
+    int i;
+
+    if (!ctx)
+        return;
+
+    order_worker_stop(dev);
+    if (ctx->queues) {
+        for (i = 0; i < ctx->nr_queues; i++) {
+            order_unregister(dev, &ctx->queues[i]);
+            free(ctx->queues[i].buf);
+        }
+        free(ctx->queues);
+    }
+    free(ctx->workers);
+    free(ctx);
+    dev->order.worker = NULL;
+}
+
+int order_worker_start(struct prof_dev *dev)
+{
+    struct order_worker_ctx *ctx = dev->order.worker;
+    struct epoll_event ev;
+    int i, w;
+
+    if (!ctx || ctx->running)
+        return 0;
+
+    ctx->notifyfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    ctx->stopfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (ctx->notifyfd < 0 || ctx->stopfd < 0)
+        goto failed;
+    if (main_epoll_add(ctx->notifyfd, EPOLLIN, dev, order_worker_notify) < 0)
+        goto failed;
+    ctx->running = true;
+
+    for (w = 0; w < ctx->nr_workers; w++) {
+        struct order_worker *worker = &ctx->workers[w];
+
+        worker->epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (worker->epfd < 0)
+            goto failed;
+
+        ev.events = EPOLLIN;
+        ev.data.fd = ctx->stopfd;
+        if (epoll_ctl(worker->epfd, EPOLL_CTL_ADD, ctx->stopfd, &ev) < 0)
+            goto failed;
+        for (i = worker->first; i < worker->first + worker->nr; i++) {
+            ctx->queues[i].paused = false;
+            ev.events = EPOLLIN;
+            ev.data.fd = ctx->queues[i].map->fd;
+            if (epoll_ctl(worker->epfd, EPOLL_CTL_ADD, ev.data.fd, &ev) < 0)
+                goto failed;
+        }
+
+        if (pthread_create(&worker->thread, NULL, order_worker_thread, worker) != 0)
+            goto failed;
+        worker->started = true;
+    }
+    return 0;
+
+failed:
+    fprintf(stderr, "%s: failed to start order threads: %s\n", dev->prof->name, strerror(errno));
+    order_worker_stop(dev);
+    return -1;
+}
+
+void order_worker_stop(struct prof_dev *dev)
+{
+    struct order_worker_ctx *ctx = dev->order.worker;
+    int w;
+
+    if (!ctx || !ctx->running)
+        return;
+
+    eventfd_write(ctx->stopfd, 1);
+    for (w = 0; w < ctx->nr_workers; w++) {
+        struct order_worker *worker = &ctx->workers[w];
+        if (worker->started) {
+            pthread_join(worker->thread, NULL);
+            worker->started = false;
+        }
+        if (worker->epfd >= 0) {
+            close(worker->epfd);
+            worker->epfd = -1;
+        }
+    }
+    main_epoll_del(ctx->notifyfd);
+    close(ctx->notifyfd);
+    close(ctx->stopfd);
+    ctx->notifyfd = -1;
+    ctx->stopfd = -1;
+    ctx->running = false;
+}
+
+/*
+ * Called for each perf_mmap by interval and flush, merge once after the last one.
+ *
+ * While the workers are running, they own the perf_mmaps, just merge the queued
+ * events. After the workers stop, the main thread drains the perf_mmaps itself.
+ * All events are known at this time, order_time beyond the latest event allows
+ * the merge to process all queues completely.
+ */
+void order_worker_mmap(struct prof_dev *dev, struct perf_mmap *map)
+{
+    struct order_worker_ctx *ctx = dev->order.worker;
+    u64 known_time = 0;
+    int i;
+
+    if (perf_mmap__idx(map) != ctx->nr_queues - 1)
+        return;
+
+    if (!ctx->running) {
+        for (i = 0; i < ctx->nr_queues; i++) {
+            order_queue_drain(&ctx->queues[i], 0);
+            if (ctx->queues[i].last_time >= known_time)
+                known_time = ctx->queues[i].last_time + 1;
+        }
+        for (i = 0; i < ctx->nr_queues; i++)
+            order_queue_drain(&ctx->queues[i], known_time);
+    }
+    order_stream(dev);
+}
+
+void order_worker_print(struct prof_dev *dev, int indent)
+{
+    struct order_worker_ctx *ctx = dev->order.worker;
+    u64 passes = 0, events = 0, order_time = 0, fixed = 0, lost = 0, full = 0;
+    int w;
+
+    if (!ctx)
+        return;
+
+    for (w = 0; w < ctx->nr_workers; w++) {
+        struct order_worker *worker = &ctx->workers[w];
+        passes += worker->nr_passes;
+        events += worker->nr_events;
+        order_time += worker->nr_order_time;
+        fixed += worker->nr_fixed_events;
+        lost += worker->nr_lost;
+        full += worker->nr_full;
+    }
+    dev_printf("order: threads %d queues %d queue_size %lu\n", ctx->nr_workers, ctx->nr_queues,
+                ctx->queues[0].size);
+    dev_printf("order: threads passes %lu events %lu order_time %lu fixed %lu lost %lu full %lu\n",
+                passes, events, order_time, fixed, lost, full);
+}
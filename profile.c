@@ -92,6 +92,10 @@ static void monitor_ctx_exit(struct prof_dev *dev)
             callchain_ctx_free(ctx->cc);
         else {
             flame_graph_output(ctx->flame);
+            if (dev->env->verbose) {
+                stack_id_stat(stderr);
+                global_syms_stat(stderr);
+            }
             flame_graph_close(ctx->flame);
         }
     }
@@ -0,0 +1,241 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <linux/kernel.h>
+#include <linux/list.h>
+#include <linux/log2.h>
+#include <monitor.h>
+#include <slab_helpers.h>
+
+#define SLAB_PAGE_SHIFT 16
+#define SLAB_PAGE_SIZE (1UL << SLAB_PAGE_SHIFT)
+#define SLAB_MIN_SHIFT 6   // 64 bytes
+#define SLAB_MAX_SHIFT 13  // 8KB
+#define SLAB_NR_CLASS (SLAB_MAX_SHIFT - SLAB_MIN_SHIFT + 1)
+#define SLAB_KEEP_EMPTY 1  // empty pages kept per class by event_slab_shrink(slab, false)
+
+struct slab_obj {
+    struct slab_obj *next;
+};
+
+struct slab_page {
+    struct list_head link; // partial or empty list, self-linked when full
+    struct slab_class *class;
+    struct slab_obj *free;
+    unsigned int inuse;
+    unsigned int nr_objs;
+};
+
+struct slab_class {
+    unsigned int size;
+    struct list_head partial; // pages with both used and free objects
+    struct list_head empty;   // pages with no used objects
+    unsigned long nr_pages;
+    unsigned long nr_empty;
+    unsigned long inuse;
+};
+
+struct event_slab {
+    struct slab_class class[SLAB_NR_CLASS];
+    /* objects larger than the biggest class */
+    unsigned long large;
+    unsigned long large_bytes;
+    unsigned long pages_alloc;
+    unsigned long pages_free;
+};
+
+static inline int slab_class_index(unsigned int size)
+{
+    if (size <= (1U << SLAB_MIN_SHIFT))
+        return 0;
+    return ilog2(size - 1) + 1 - SLAB_MIN_SHIFT;
+}
+
+static inline struct slab_page *slab_page_of(void *obj)
+{
+    return (struct slab_page *)((unsigned long)obj & ~(SLAB_PAGE_SIZE - 1));
+}
+
+struct event_slab *event_slab_new(void)
+{
+    struct event_slab *slab = calloc(1, sizeof(*slab));
+    int i;
+
+    if (!slab)
+        return NULL;
+    for (i = 0; i < SLAB_NR_CLASS; i++) {
+        struct slab_class *class = &slab->class[i];
+        class->size = 1U << (SLAB_MIN_SHIFT + i);
+        INIT_LIST_HEAD(&class->partial);
+        INIT_LIST_HEAD(&class->empty);
+    }
+    return slab;
+}
+
+static struct slab_page *slab_page_new(struct event_slab *slab, struct slab_class *class)
+{
+    struct slab_page *page;
+    struct slab_obj *obj, **tail;
+    unsigned long off;
+
+    if (posix_memalign((void **)&page, SLAB_PAGE_SIZE, SLAB_PAGE_SIZE))
+        return NULL;
+
+    page->class = class;
+    page->inuse = 0;
+    page->nr_objs = 0;
+    tail = &page->free;
+    for (off = ALIGN(sizeof(*page), 64); off + class->size <= SLAB_PAGE_SIZE; off += class->size) {
+        obj = (void *)page + off;
+        *tail = obj;
+        tail = &obj->next;
+        page->nr_objs ++;
+    }
+    *tail = NULL;
+
+    list_add(&page->link, &class->empty);
+    class->nr_pages ++;
+    class->nr_empty ++;
+    slab->pages_alloc ++;
+    return page;
+}
+
+static void slab_page_free(struct event_slab *slab, struct slab_page *page)
+{
+    struct slab_class *class = page->class;
+
+    list_del(&page->link);
+    class->nr_pages --;
+    class->nr_empty --;
+    slab->pages_free ++;
+    free(page);
+}
+
+union perf_event *event_slab_dup(struct event_slab *slab, union perf_event *event)
+{
+    unsigned int size = perf_event_size(event);
+    struct slab_class *class;
+    struct slab_page *page;
+    struct slab_obj *obj;
+    int idx = slab_class_index(size);
+
+    if (idx >= SLAB_NR_CLASS) {
+        void *new = malloc(size);
+        if (new) {
+            perf_event_copy(new, event);
+            slab->large ++;
+            slab->large_bytes += size;
+        }
+        return new;
+    }
+
+    class = &slab->class[idx];
+    if (!list_empty(&class->partial))
+        page = list_first_entry(&class->partial, struct slab_page, link);
+    else {
+        if (list_empty(&class->empty) &&
+            !slab_page_new(slab, class))
+            return NULL;
+        page = list_first_entry(&class->empty, struct slab_page, link);
+        list_move(&page->link, &class->partial);
+        class->nr_empty --;
+    }
+
+    obj = page->free;
+    page->free = obj->next;
+    page->inuse ++;
+    class->inuse ++;
+    if (page->inuse == page->nr_objs)
+        list_del_init(&page->link);
+
+    perf_event_copy(obj, event);
+    return (union perf_event *)obj;
+}
+
+void event_slab_free(struct event_slab *slab, union perf_event *event)
+{
+    unsigned int size = event->header.size;
+    struct slab_class *class;
+    struct slab_page *page;
+    struct slab_obj *obj = (void *)event;
+
+    if (slab_class_index(size) >= SLAB_NR_CLASS) {
+        slab->large --;
+        slab->large_bytes -= size;
+        free(event);
+        return;
+    }
+
+    page = slab_page_of(obj);
+    class = page->class;
+    if (page->inuse == page->nr_objs)
+        list_add(&page->link, &class->partial);
+
+    obj->next = page->free;
+    page->free = obj;
+    page->inuse --;
+    class->inuse --;
+    if (page->inuse == 0) {
+        list_move(&page->link, &class->empty);
+        class->nr_empty ++;
+    }
+}
+
+void event_slab_shrink(struct event_slab *slab, bool all)
+{
+    unsigned long keep = all ? 0 : SLAB_KEEP_EMPTY;
+    int i;
+
+    if (!slab)
+        return;
+
+    for (i = 0; i < SLAB_NR_CLASS; i++) {
+        struct slab_class *class = &slab->class[i];
+        while (class->nr_empty > keep)
+            slab_page_free(slab, list_last_entry(&class->empty, struct slab_page, link));
+    }
+}
+
+void event_slab_delete(struct event_slab *slab)
+{
+    int i;
+
+    if (!slab)
+        return;
+
+    event_slab_shrink(slab, true);
+    for (i = 0; i < SLAB_NR_CLASS; i++) {
+        if (slab->class[i].nr_pages)
+            fprintf(stderr, "BUG: event slab %u: %lu objects still in use\n",
+                    slab->class[i].size, slab->class[i].inuse);
+    }
+    free(slab);
+}
+
+void event_slab_print(struct event_slab *slab, int indent)
+{
+    unsigned long pages = 0, inuse_bytes = 0;
+    int i;
+
+    if (!slab)
+        return;
+
+    for (i = 0; i < SLAB_NR_CLASS; i++) {
+        pages += slab->class[i].nr_pages;
+        inuse_bytes += slab->class[i].inuse * slab->class[i].size;
+    }
+
+    dev_printf("SLAB:\n");
+    dev_printf("    pages: %lu (%lu KB), alloc %lu free %lu\n", pages, pages * SLAB_PAGE_SIZE / 1024,
+                slab->pages_alloc, slab->pages_free);
+    dev_printf("    inuse_bytes: %lu\n", inuse_bytes);
+    for (i = 0; i < SLAB_NR_CLASS; i++) {
+        struct slab_class *class = &slab->class[i];
+        if (!class->nr_pages)
+            continue;
+        dev_printf("    %5u: pages %lu empty %lu objs %lu\n", class->size,
+                    class->nr_pages, class->nr_empty, class->inuse);
+    }
+    if (slab->large)
+        dev_printf("    large: objs %lu bytes %lu\n", slab->large, slab->large_bytes);
+}
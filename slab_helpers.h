@@ -0,0 +1,21 @@
+#ifndef __SLAB_HELPERS
+#define __SLAB_HELPERS
+
+/*
+ * Size-classed slab arena for copied perf events.
+ *
+ * Copies are carved out of 64KB pages grouped by power-of-two size classes,
+ * events larger than the biggest class fall back to malloc(). Pages that
+ * become completely free are kept on a per-class empty list and released in
+ * bulk by event_slab_shrink().
+ */
+struct event_slab;
+
+struct event_slab *event_slab_new(void);
+void event_slab_delete(struct event_slab *slab);
+union perf_event *event_slab_dup(struct event_slab *slab, union perf_event *event);
+void event_slab_free(struct event_slab *slab, union perf_event *event);
+void event_slab_shrink(struct event_slab *slab, bool all);
+void event_slab_print(struct event_slab *slab, int indent);
+
+#endif
@@ -8,6 +8,8 @@
 #include <linux/const.h>
 #include <linux/refcount.h>
 #include <linux/rblist.h>
+#include <linux/hash.h>
+#include <linux/hashtable.h>
 #include <monitor.h>
 #include <tep.h>
 #include <trace_helpers.h>
@@ -15,13 +17,99 @@
 
 #define ALIGN(x, a)  __ALIGN_KERNEL((x), (a))
 
+/*
+ * Direct-mapped ip->symbol caches in front of ksyms__map_addr() and
+ * syms__find_dso()/dso__find_sym(). Hot callchain frames repeat a lot, a hit
+ * costs one cache line instead of a full symbol table search.
+ *
+ * User entries are tagged with the syms they were resolved from and a
+ * generation that is bumped whenever any syms is freed, so a recycled syms
+ * pointer never returns stale results.
+ */
+#define SYM_CACHE_BITS 12
+#define SYM_CACHE_SIZE (1 << SYM_CACHE_BITS)
+
+struct ksym_cache_entry {
+    u64 ip;
+    const struct ksym *ksym;
+};
+
+struct usym_cache_entry {
+    u64 ip;
+    const struct syms *syms;
+    unsigned long gen;
+    struct dso *dso;
+    const struct sym *sym;
+    u64 offset;
+};
+
+struct sym_cache_stat {
+    u64 hit;
+    u64 miss;
+};
+
 static struct global_syms {
     struct ksyms *ksyms;
     struct syms_cache *syms_cache;
     refcount_t ksyms_ref;
     refcount_t syms_ref;
     struct comm_notify notify;
-} ctx;
+
+    struct ksym_cache_entry kcache[SYM_CACHE_SIZE];
+    struct usym_cache_entry ucache[SYM_CACHE_SIZE];
+    unsigned long ugen;
+    struct sym_cache_stat kstat, ustat;
+} ctx = {
+    .ugen = 1,
+};
+
+static inline unsigned int sym_cache_hash(u64 ip, const void *tag)
+{
+    return hash_64(ip ^ (unsigned long)tag, SYM_CACHE_BITS);
+}
+
+static const struct ksym *ksyms_cache_map_addr(u64 ip)
+{
+    struct ksym_cache_entry *e = &ctx.kcache[sym_cache_hash(ip, NULL)];
+
+    if (e->ip == ip && e->ksym) {
+        ctx.kstat.hit ++;
+        return e->ksym;
+    }
+    ctx.kstat.miss ++;
+    e->ip = ip;
+    e->ksym = ksyms__map_addr(ctx.ksyms, ip);
+    return e->ksym;
+}
+
+/*
+ * Returns the dso and sym of ip; *offset is the offset within the dso, or
+ * within the sym if sym is found.
+ */
+static struct dso *syms_cache_map_addr(struct syms *syms, u64 ip, const struct sym **sym, u64 *offset)
+{
+    struct usym_cache_entry *e = &ctx.ucache[sym_cache_hash(ip, syms)];
+
+    if (e->ip == ip && e->syms == syms && e->gen == ctx.ugen) {
+        ctx.ustat.hit ++;
+    } else {
+        ctx.ustat.miss ++;
+        e->ip = ip;
+        e->syms = syms;
+        e->gen = ctx.ugen;
+        e->sym = NULL;
+        e->offset = 0;
+        e->dso = syms__find_dso(syms, ip, &e->offset);
+        if (e->dso) {
+            e->sym = dso__find_sym(e->dso, e->offset);
+            if (e->sym)
+                e->offset -= e->sym->start;
+        }
+    }
+    *sym = e->sym;
+    *offset = e->offset;
+    return e->dso;
+}
 
 /*
  * ffffffff81ad6db9 system_call_fastpath+0x16 ([kernel.kallsyms])
@@ -53,6 +141,7 @@ static int task_exit_free_syms(struct comm_notify *notify, int pid, int state, u
     struct global_syms *g = container_of(notify, struct global_syms, notify);
     if (g->syms_cache) {
         syms_cache__free_syms(g->syms_cache, pid);
+        g->ugen ++;
     }
     return 0;
 }
@@ -87,16 +176,29 @@ static void global_syms_unref(bool kernel, bool user)
     if (kernel && ctx.ksyms && refcount_dec_and_test(&ctx.ksyms_ref)) {
         ksyms__free(ctx.ksyms);
         ctx.ksyms = NULL;
+        memset(ctx.kcache, 0, sizeof(ctx.kcache));
     }
     if (user && ctx.syms_cache && refcount_dec_and_test(&ctx.syms_ref)) {
         global_comm_unregister_notify(&ctx.notify);
         syms_cache__free(ctx.syms_cache);
         ctx.syms_cache = NULL;
+        ctx.ugen ++;
     }
 }
 
+static void sym_cache_stat(FILE *fp, const char *name, struct sym_cache_stat *stat)
+{
+    u64 total = stat->hit + stat->miss;
+
+    if (total)
+        fprintf(fp, "%s cache: hit %lu miss %lu (%.2f%%)\n", name, stat->hit, stat->miss,
+                stat->hit * 100.0 / total);
+}
+
 void global_syms_stat(FILE *fp)
 {
+    sym_cache_stat(fp, "KSYM", &ctx.kstat);
+    sym_cache_stat(fp, "USYM", &ctx.ustat);
     if (ctx.syms_cache) {
         obj__stat(fp);
         syms_cache__stat(ctx.syms_cache, fp);
@@ -202,7 +304,7 @@ static void __print_callchain_kernel(struct callchain_ctx *cc, u64 ip, bool *pri
     if (cc->print2string_kernel)
         len += fprintf(cc->fout, "%s", (char *)ip);
     else {
-        const struct ksym *ksym = cc->kernel ? ksyms__map_addr(ctx.ksyms, ip) : NULL;
+        const struct ksym *ksym = cc->kernel ? ksyms_cache_map_addr(ip) : NULL;
         len = 0;
         if (cc->addr)
             len += fprintf(cc->fout, "    %016lx", ip);
@@ -231,14 +333,10 @@ static void __print_callchain_user(struct callchain_ctx *cc, struct syms *syms,
     int len = 0;
 
     if (!cc->print2string_user && syms) {
-        dso = syms__find_dso(syms, ip, &offset);
-        if (dso) {
-            sym = dso__find_sym(dso, offset);
-            if (sym) {
-                symbol = sym->name;
-                offset = offset - sym->start;
-                dso_name = dso__name(dso)?:"Unknown";
-            }
+        dso = syms_cache_map_addr(syms, ip, &sym, &offset);
+        if (sym) {
+            symbol = sym->name;
+            dso_name = dso__name(dso)?:"Unknown";
         }
     }
     if (*printed)
@@ -411,91 +509,224 @@ void print_callchain_common(struct callchain_ctx *cc, struct callchain *callchai
     print_callchain_common_cbs(cc, callchain, pid, NULL, NULL, NULL);
 }
 
-static void print2string_callchain(struct callchain_ctx *cc, struct callchain *callchain, u32 pid,
-                                          int *context_kernel_num, int *context_user_num)
+static const char *kernel_frame_string(struct callchain_ctx *cc, u64 ip)
 {
-    __u64 i;
-    bool kernel = false, user = false;
-    struct syms *syms = NULL;
+    const struct ksym *ksym = cc->kernel ? ksyms_cache_map_addr(ip) : NULL;
     char buff[1024];
     int len = 0;
 
-    if (cc == NULL ||
-        callchain == NULL || callchain->nr == 0)
-        return ;
-    if (!cc->print2string_kernel && !cc->print2string_user)
-        return ;
-    if (ctx.ksyms == NULL &&
-        ctx.syms_cache == NULL)
-        return ;
+    if (cc->addr)
+        len += snprintf(buff+len, sizeof(buff)-len, "    %016lx", ip);
+    if (cc->symbol) {
+        len += snprintf(buff+len, sizeof(buff)-len, "%s%s", len ? " " : "", ksym ? ksym->name : "Unknown");
+        if (cc->offset)
+            len += snprintf(buff+len, sizeof(buff)-len, "+0x%lx", ksym ? ip - ksym->addr : 0L);
+    }
+    if (cc->dso)
+        len += snprintf(buff+len, sizeof(buff)-len, "%s([kernel.kallsyms])", len ? " " : "");
+    // Convert to unique string.
+    return unique_string(buff);
+}
 
-    *context_kernel_num = 0;
-    *context_user_num = 0;
-    for (i = 0; i < callchain->nr; i++) {
-        u64 ip = callchain->ips[i];
-        if (ip == PERF_CONTEXT_KERNEL) {
-            kernel = true;
-            user = false;
-            if (i + 1 < callchain->nr)
-                (*context_kernel_num) ++;
-            continue;
-        } else if (ip == PERF_CONTEXT_USER) {
-            kernel = false;
-            user = true;
-            if (ctx.syms_cache && cc->user) {
-                syms = syms_cache__get_syms(ctx.syms_cache, pid);
-            }
-            if (i + 1 < callchain->nr)
-                (*context_user_num) ++;
-            continue;
+static const char *user_frame_string(struct callchain_ctx *cc, u64 ip, const char *symbol,
+                                     u64 offset, const char *dso_name)
+{
+    char buff[1024];
+    int len = 0;
+
+    if (cc->addr)
+        len += snprintf(buff+len, sizeof(buff)-len, "    %016lx", ip);
+    if (cc->symbol) {
+        len += snprintf(buff+len, sizeof(buff)-len, "%s%s", len ? " " : "", symbol);
+        if (cc->offset)
+            len += snprintf(buff+len, sizeof(buff)-len, "+0x%lx", offset);
+    }
+    if (cc->dso)
+        len += snprintf(buff+len, sizeof(buff)-len, "%s(%s)", len ? " " : "", dso_name);
+    // Convert to unique string.
+    return unique_string(buff);
+}
+
+/*
+ * Stack-ID table.
+ *
+ * Callchains are interned once, globally: every unique stack is stored a
+ * single time and identified by a u32 id. Users hold a reference per id, so
+ * the memory is proportional to the number of unique stacks, no matter how
+ * many profilers or key-value pairs refer to them.
+ */
+struct stack_id_entry {
+    struct hlist_node node;
+    u64 hash;
+    unsigned int ref;
+    u32 id;
+    struct callchain callchain; // must be last
+};
+
+#define STACK_ID_INIT_BITS 10
+
+static struct stack_ids {
+    struct hlist_head *table;
+    unsigned int bits;
+    unsigned int nr_entries;
+    struct stack_id_entry **entries; // id -> entry
+    u32 nr_ids, max_ids;
+    u32 *free_ids;
+    u32 nr_free;
+    /* stat */
+    u64 refs;
+    u64 ref_bytes;   // bytes if each reference kept its own copy
+    u64 entry_bytes; // bytes actually stored
+} stack_ids;
+
+static inline u64 stack_hash(const struct callchain *callchain)
+{
+    u64 h = callchain->nr;
+    __u64 i;
+
+    for (i = 0; i < callchain->nr; i++)
+        h = (h ^ callchain->ips[i]) * 0x9E3779B97F4A7C15ULL;
+    return h ^ (h >> 32);
+}
+
+static inline size_t stack_bytes(const struct callchain *callchain)
+{
+    return sizeof(*callchain) + callchain->nr * sizeof(callchain->ips[0]);
+}
+
+static int stack_ids_grow(void)
+{
+    unsigned int bits = stack_ids.table ? stack_ids.bits + 1 : STACK_ID_INIT_BITS;
+    struct hlist_head *table = malloc(sizeof(*table) << bits);
+    unsigned int i;
+
+    if (!table)
+        return -1;
+    __hash_init(table, 1U << bits);
+    if (stack_ids.table) {
+        for (i = 0; i < (1U << stack_ids.bits); i++) {
+            struct stack_id_entry *e;
+            struct hlist_node *tmp;
+            hlist_for_each_entry_safe(e, tmp, &stack_ids.table[i], node)
+                hlist_add_head(&e->node, &table[hash_64(e->hash, bits)]);
         }
-        if (kernel && cc->print2string_kernel) {
-            const struct ksym *ksym = cc->kernel ? ksyms__map_addr(ctx.ksyms, ip) : NULL;
-            len = 0;
-            if (cc->addr)
-                len += snprintf(buff+len, sizeof(buff)-len, "    %016lx", ip);
-            if (cc->symbol) {
-                len += snprintf(buff+len, sizeof(buff)-len, "%s%s", len ? " " : "", ksym ? ksym->name : "Unknown");
-                if (cc->offset)
-                    len += snprintf(buff+len, sizeof(buff)-len, "+0x%lx", ksym ? ip - ksym->addr : 0L);
-            }
-            if (cc->dso)
-                len += snprintf(buff+len, sizeof(buff)-len, "%s([kernel.kallsyms])", len ? " " : "");
-            // Convert to unique string.
-            callchain->ips[i] = (__u64)(void *)unique_string(buff);
-        } else if (user && cc->print2string_user) {
-            struct dso *dso;
-            const char *symbol = "Unknown";
-            u64 offset = 0L;
-            const char *dso_name = "Unknown";
-
-            if (syms) {
-                dso = syms__find_dso(syms, ip, &offset);
-                if (dso) {
-                    const struct sym *sym = dso__find_sym(dso, offset);
-                    if (sym) {
-                        symbol = sym->name;
-                        offset = offset - sym->start;
-                        dso_name = dso__name(dso)?:"Unknown";
-                    }
-                }
-            }
-            len = 0;
-            if (cc->addr)
-                len += snprintf(buff+len, sizeof(buff)-len, "    %016lx", ip);
-            if (cc->symbol) {
-                len += snprintf(buff+len, sizeof(buff)-len, "%s%s", len ? " " : "", symbol);
-                if (cc->offset)
-                    len += snprintf(buff+len, sizeof(buff)-len, "+0x%lx", offset);
-            }
-            if (cc->dso)
-                len += snprintf(buff+len, sizeof(buff)-len, "%s(%s)", len ? " " : "", dso_name);
-            // Convert to unique string.
-            callchain->ips[i] = (__u64)(void *)unique_string(buff);
+        free(stack_ids.table);
+    }
+    stack_ids.table = table;
+    stack_ids.bits = bits;
+    return 0;
+}
+
+static int stack_id_alloc(struct stack_id_entry *e)
+{
+    if (stack_ids.nr_free) {
+        e->id = stack_ids.free_ids[--stack_ids.nr_free];
+    } else {
+        if (stack_ids.nr_ids == stack_ids.max_ids) {
+            u32 max = stack_ids.max_ids ? stack_ids.max_ids * 2 : 1024;
+            void *entries = realloc(stack_ids.entries, max * sizeof(*stack_ids.entries));
+            void *free_ids;
+
+            if (!entries)
+                return -1;
+            stack_ids.entries = entries;
+            free_ids = realloc(stack_ids.free_ids, max * sizeof(*stack_ids.free_ids));
+            if (!free_ids)
+                return -1;
+            stack_ids.free_ids = free_ids;
+            stack_ids.max_ids = max;
         }
+        e->id = stack_ids.nr_ids++;
     }
+    stack_ids.entries[e->id] = e;
+    return 0;
 }
 
+static struct stack_id_entry *stack_id_find(const struct callchain *callchain, u64 hash)
+{
+    struct stack_id_entry *e;
+
+    if (!stack_ids.table)
+        return NULL;
+    hlist_for_each_entry(e, &stack_ids.table[hash_64(hash, stack_ids.bits)], node) {
+        if (e->hash == hash && e->callchain.nr == callchain->nr &&
+            !memcmp(e->callchain.ips, callchain->ips, callchain->nr * sizeof(callchain->ips[0])))
+            return e;
+    }
+    return NULL;
+}
+
+int stack_id_get(struct callchain *callchain)
+{
+    u64 hash = stack_hash(callchain);
+    size_t bytes = stack_bytes(callchain);
+    struct stack_id_entry *e = stack_id_find(callchain, hash);
+
+    if (!e) {
+        if ((!stack_ids.table || stack_ids.nr_entries > (2U << stack_ids.bits)) &&
+            stack_ids_grow() < 0)
+            return -1;
+        e = malloc(offsetof(struct stack_id_entry, callchain) + bytes);
+        if (!e)
+            return -1;
+        if (stack_id_alloc(e) < 0) {
+            free(e);
+            return -1;
+        }
+        e->hash = hash;
+        e->ref = 0;
+        memcpy(&e->callchain, callchain, bytes);
+        hlist_add_head(&e->node, &stack_ids.table[hash_64(hash, stack_ids.bits)]);
+        stack_ids.nr_entries ++;
+        stack_ids.entry_bytes += bytes;
+    }
+    e->ref ++;
+    stack_ids.refs ++;
+    stack_ids.ref_bytes += bytes;
+    return e->id;
+}
+
+void stack_id_put(int id)
+{
+    struct stack_id_entry *e;
+    size_t bytes;
+
+    if (id < 0 || id >= stack_ids.nr_ids || !stack_ids.entries[id])
+        return;
+
+    e = stack_ids.entries[id];
+    bytes = stack_bytes(&e->callchain);
+    stack_ids.refs --;
+    stack_ids.ref_bytes -= bytes;
+    if (--e->ref == 0) {
+        hlist_del(&e->node);
+        stack_ids.entries[id] = NULL;
+        stack_ids.free_ids[stack_ids.nr_free++] = id;
+        stack_ids.nr_entries --;
+        stack_ids.entry_bytes -= bytes;
+        free(e);
+        if (stack_ids.nr_entries == 0) {
+            free(stack_ids.table);
+            free(stack_ids.entries);
+            free(stack_ids.free_ids);
+            memset(&stack_ids, 0, sizeof(stack_ids));
+        }
+    }
+}
+
+struct callchain *stack_id_callchain(int id)
+{
+    if (id < 0 || id >= stack_ids.nr_ids || !stack_ids.entries[id])
+        return NULL;
+    return &stack_ids.entries[id]->callchain;
+}
+
+void stack_id_stat(FILE *fp)
+{
+    fprintf(fp, "STACK ID STAT: unique %u, refs %lu, bytes %lu, saved %lu\n",
+            stack_ids.nr_entries, stack_ids.refs, stack_ids.entry_bytes,
+            stack_ids.ref_bytes - stack_ids.entry_bytes);
+}
 
 struct key_value {
     /* void *value;
@@ -505,58 +736,100 @@ struct key_value {
      *   void *value = (void *)(struct key_value *)kv - pairs->value_size;
      *   struct key_value *kv = (void *)value + pairs->value_size;
      */
-    struct rb_node rbnode;
+    struct hlist_node node;
     unsigned int n;
-    struct_key key;
+    int id;
+    struct_key *key; // interned, see stack_id_get()
 };
 
+#define KV_PAIRS_INIT_BITS 6
+
 struct key_value_paires {
-    struct rblist kv_pairs;
+    struct hlist_head *table; // indexed by stack id
+    unsigned int bits;
+    unsigned int nr_entries;
     int value_size;
 };
 
-static int key_value_node_cmp(struct rb_node *rbn, const void *entry)
+static int key_value_cmp(const void *p1, const void *p2)
 {
-    struct key_value *kv = container_of(rbn, struct key_value, rbnode);
-    const struct_key *key = entry;
+    const struct key_value *kv1 = *(const struct key_value **)p1;
+    const struct key_value *kv2 = *(const struct key_value **)p2;
+    const struct_key *k1 = kv1->key, *k2 = kv2->key;
     int i = 0, j = 0;
 
     /*
      * In the flame_graph_add_callchain function, the PERF_CONTEXT_FLAME_GRAPH
      * will be added, which can be sorted by time(ips[1]).
     **/
-    for (; i < (int)kv->key.nr && j < (int)key->nr; i++, j++) {
-        if (kv->key.ips[i] > key->ips[j])
+    for (; i < (int)k1->nr && j < (int)k2->nr; i++, j++) {
+        if (k1->ips[i] > k2->ips[j])
             return 1;
-        else if (kv->key.ips[i] < key->ips[j])
+        else if (k1->ips[i] < k2->ips[j])
             return -1;
     }
-    return (int)kv->key.nr - (int)key->nr;
-}
-
-static struct rb_node *key_value_node_new(struct rblist *rlist, const void *new_entry)
-{
-    struct key_value_paires *pairs = container_of(rlist, struct key_value_paires, kv_pairs);
-    const struct_key *key = new_entry;
-    void *value = malloc(pairs->value_size + sizeof(struct key_value) + key->nr * sizeof(key->ips[0]));
-    if (value) {
-        struct key_value *kv = value + pairs->value_size;
-        RB_CLEAR_NODE(&kv->rbnode);
-        kv->n = 0;
-        kv->key.nr = key->nr;
-        memcpy(kv->key.ips, key->ips, key->nr * sizeof(key->ips[0]));
-        memset(value, 0, pairs->value_size);
-        return &kv->rbnode;
-    } else
-        return NULL;
+    return (int)k1->nr - (int)k2->nr;
+}
+
+static int keyvalue_pairs_grow(struct key_value_paires *pairs)
+{
+    unsigned int bits = pairs->table ? pairs->bits + 1 : KV_PAIRS_INIT_BITS;
+    struct hlist_head *table = malloc(sizeof(*table) << bits);
+    unsigned int i;
+
+    if (!table)
+        return -1;
+    __hash_init(table, 1U << bits);
+    if (pairs->table) {
+        for (i = 0; i < (1U << pairs->bits); i++) {
+            struct key_value *kv;
+            struct hlist_node *tmp;
+            hlist_for_each_entry_safe(kv, tmp, &pairs->table[i], node)
+                hlist_add_head(&kv->node, &table[hash_32(kv->id, bits)]);
+        }
+        free(pairs->table);
+    }
+    pairs->table = table;
+    pairs->bits = bits;
+    return 0;
 }
 
-static void key_value_node_delete(struct rblist *rblist, struct rb_node *rb_node)
+static struct key_value *keyvalue_pairs_findnew(struct key_value_paires *pairs, struct_key *key)
 {
-    struct key_value_paires *pairs = container_of(rblist, struct key_value_paires, kv_pairs);
-    struct key_value *kv = container_of(rb_node, struct key_value, rbnode);
-    void *value = (void *)kv - pairs->value_size;
-    free(value);
+    struct key_value *kv;
+    void *value;
+    int id = stack_id_get(key);
+
+    if (id < 0)
+        return NULL;
+
+    hlist_for_each_entry(kv, &pairs->table[hash_32(id, pairs->bits)], node) {
+        if (kv->id == id) {
+            stack_id_put(id);
+            return kv;
+        }
+    }
+
+    if (pairs->nr_entries > (2U << pairs->bits) &&
+        keyvalue_pairs_grow(pairs) < 0)
+        goto failed;
+
+    value = malloc(pairs->value_size + sizeof(struct key_value));
+    if (!value)
+        goto failed;
+
+    kv = value + pairs->value_size;
+    kv->n = 0;
+    kv->id = id;
+    kv->key = stack_id_callchain(id);
+    memset(value, 0, pairs->value_size);
+    hlist_add_head(&kv->node, &pairs->table[hash_32(id, pairs->bits)]);
+    pairs->nr_entries ++;
+    return kv;
+
+failed:
+    stack_id_put(id);
+    return NULL;
 }
 
 struct key_value_paires *keyvalue_pairs_new(int value_size)
@@ -566,91 +839,127 @@ struct key_value_paires *keyvalue_pairs_new(int value_size)
     if (!pairs)
         return NULL;
 
-    rblist__init(&pairs->kv_pairs);
-    pairs->kv_pairs.node_cmp = key_value_node_cmp;
-    pairs->kv_pairs.node_new = key_value_node_new;
-    pairs->kv_pairs.node_delete = key_value_node_delete;
     pairs->value_size = ALIGN(value_size, 8);
+    if (keyvalue_pairs_grow(pairs) < 0) {
+        free(pairs);
+        return NULL;
+    }
     return pairs;
 }
 
+void keyvalue_pairs_reinit(struct key_value_paires *pairs)
+{
+    unsigned int i;
+
+    if (!pairs)
+        return ;
+
+    for (i = 0; i < (1U << pairs->bits); i++) {
+        struct key_value *kv;
+        struct hlist_node *tmp;
+        hlist_for_each_entry_safe(kv, tmp, &pairs->table[i], node) {
+            hlist_del(&kv->node);
+            stack_id_put(kv->id);
+            free((void *)kv - pairs->value_size);
+        }
+    }
+    pairs->nr_entries = 0;
+}
+
 void keyvalue_pairs_free(struct key_value_paires *pairs)
 {
     if (!pairs)
         return ;
-    rblist__exit(&pairs->kv_pairs);
+    keyvalue_pairs_reinit(pairs);
+    free(pairs->table);
     free(pairs);
 }
 
 void *keyvalue_pairs_add_key(struct key_value_paires *pairs, struct_key *key)
 {
-    struct rb_node *rbn;
-    struct key_value *kv = NULL;
+    struct key_value *kv;
     void *value = NULL;
 
     if (!pairs)
         return NULL;
 
-    rbn = rblist__findnew(&pairs->kv_pairs, key);
-    if (rbn) {
-        kv = container_of(rbn, struct key_value, rbnode);
+    kv = keyvalue_pairs_findnew(pairs, key);
+    if (kv) {
         kv->n ++;
         value = pairs->value_size ? (void *)kv - pairs->value_size : NULL;
     }
     return value;
 }
 
+/*
+ * Collect all key_value, optionally sorted by key. The hash table has no order,
+ * sorting by key keeps the output order of the callchains stable.
+ */
+static struct key_value **keyvalue_pairs_collect(struct key_value_paires *pairs, bool sort_by_key)
+{
+    struct key_value **kvs;
+    struct key_value *kv;
+    unsigned int i, nr = 0;
+
+    kvs = malloc(pairs->nr_entries * sizeof(*kvs));
+    if (!kvs)
+        return NULL;
+
+    for (i = 0; i < (1U << pairs->bits); i++)
+        hlist_for_each_entry(kv, &pairs->table[i], node)
+            kvs[nr++] = kv;
+
+    if (sort_by_key)
+        qsort(kvs, nr, sizeof(*kvs), key_value_cmp);
+    return kvs;
+}
+
 void keyvalue_pairs_foreach(struct key_value_paires *pairs, foreach_keyvalue f, void *opaque)
 {
-    struct rblist *rblist;
-    struct rb_node *pos, *next;
+    struct key_value **kvs;
     struct key_value *kv = NULL;
     void *value = NULL;
+    unsigned int i, nr;
 
-    if (!pairs)
+    if (!pairs || !pairs->nr_entries)
         return ;
 
-    rblist = &pairs->kv_pairs;
-    next = rb_first_cached(&rblist->entries);
+    nr = pairs->nr_entries;
+    kvs = keyvalue_pairs_collect(pairs, true);
+    if (!kvs)
+        return ;
 
-    while (next) {
-        pos = next;
-        next = rb_next(pos);
-        kv = container_of(pos, struct key_value, rbnode);
+    for (i = 0; i < nr; i++) {
+        kv = kvs[i];
         value = pairs->value_size ? (void *)kv - pairs->value_size : NULL;
-        f(opaque, &kv->key, value, kv->n);
+        f(opaque, kv->key, value, kv->n);
     }
+    free(kvs);
 }
 
 void keyvalue_pairs_sorted_firstn(struct key_value_paires *pairs, keyvalue_cmp cmp, foreach_keyvalue f, void *opaque, unsigned int n)
 {
-    struct rblist *rblist;
-    struct rb_node *pos, *next;
+    struct key_value **kvs;
     struct key_value *kv = NULL;
     void *value = NULL;
     void **sorted_values = NULL;
     unsigned int nr = 0, i;
 
-    if (!pairs || rblist__empty(&pairs->kv_pairs))
+    if (!pairs || !pairs->nr_entries)
         return;
 
     if (pairs->value_size == 0)
         return keyvalue_pairs_foreach(pairs, f, opaque);
 
-    rblist = &pairs->kv_pairs;
-    next = rb_first_cached(&rblist->entries);
-
-    sorted_values = calloc(rblist__nr_entries(rblist), sizeof(*sorted_values));
-    if (!sorted_values)
+    nr = pairs->nr_entries;
+    kvs = keyvalue_pairs_collect(pairs, true);
+    if (!kvs)
         return;
 
-    while (next) {
-        pos = next;
-        next = rb_next(pos);
-        kv = container_of(pos, struct key_value, rbnode);
-        value = (void *)kv - pairs->value_size;
-        sorted_values[nr++] = value;
-    }
+    /* The value pointers are stored in place of the key_value pointers. */
+    sorted_values = (void **)kvs;
+    for (i = 0; i < nr; i++)
+        sorted_values[i] = (void *)kvs[i] - pairs->value_size;
 
     qsort(sorted_values, nr, sizeof(*sorted_values), (__compar_fn_t)cmp);
 
@@ -659,7 +968,7 @@ void keyvalue_pairs_sorted_firstn(struct key_value_paires *pairs, keyvalue_cmp c
     for (i = 0; i < nr; i++) {
         value = sorted_values[i];
         kv = value + pairs->value_size;
-        f(opaque, &kv->key, value, kv->n);
+        f(opaque, kv->key, value, kv->n);
     }
     free(sorted_values);
 }
@@ -669,24 +978,17 @@ void keyvalue_pairs_sorted_foreach(struct key_value_paires *pairs, keyvalue_cmp
     keyvalue_pairs_sorted_firstn(pairs, cmp, f, opaque, 0);
 }
 
-void keyvalue_pairs_reinit(struct key_value_paires *pairs)
-{
-    if (pairs) {
-        rblist__exit(&pairs->kv_pairs);
-    }
-}
-
 unsigned int keyvalue_pairs_nr_entries(struct key_value_paires *pairs)
 {
     if (pairs)
-        return rblist__nr_entries(&pairs->kv_pairs);
+        return pairs->nr_entries;
     else
         return 0;
 }
 
 static bool keyvalue_pairs_empty(struct key_value_paires *pairs)
 {
-    return !pairs || rblist__empty(&pairs->kv_pairs);
+    return !pairs || !pairs->nr_entries;
 }
 
 struct unique_string {
@@ -761,13 +1063,184 @@ void unique_string_stat(FILE *fp)
 }
 
 
+/*
+ * Flame graph stacks are stored unsymbolized. Kernel frames stay raw ips,
+ * user frames are interned as (object, offset) so they remain resolvable
+ * after the process exits and its syms are freed. Each unique frame is
+ * symbolized only once, in flame_graph_output().
+ */
+enum fg_frame_type {
+    FG_FRAME_SYM,     // offset within obj
+    FG_FRAME_UNKNOWN, // ip not in any dso
+    FG_FRAME_STRING,  // comm or time string
+};
+
+struct fg_frame {
+    struct rb_node rbnode;
+    enum fg_frame_type type;
+    struct object *obj;
+    u64 offset; // FG_FRAME_SYM: offset within obj; FG_FRAME_UNKNOWN: ip; FG_FRAME_STRING: string
+    u64 ip;
+    const char *str; // symbolized string
+};
+
+#define FG_FRAME_CACHE_BITS 12
+#define FG_FRAME_CACHE_SIZE (1 << FG_FRAME_CACHE_BITS)
+
+struct fg_frame_cache {
+    u64 ip;
+    const struct syms *syms;
+    unsigned long gen;
+    struct fg_frame *frame;
+};
+
 struct flame_graph {
     struct callchain_ctx *cc;
     struct key_value_paires *kv_pairs;
+    struct rblist frames;
+    struct fg_frame_cache *frame_cache;
     char *filename;
     bool special;
 };
 
+static int fg_frame_node_cmp(struct rb_node *rbn, const void *entry)
+{
+    struct fg_frame *f = container_of(rbn, struct fg_frame, rbnode);
+    const struct fg_frame *e = entry;
+
+    if (f->type != e->type)
+        return (int)f->type - (int)e->type;
+    if (f->obj != e->obj)
+        return f->obj > e->obj ? 1 : -1;
+    if (f->offset != e->offset)
+        return f->offset > e->offset ? 1 : -1;
+    return 0;
+}
+
+static struct rb_node *fg_frame_node_new(struct rblist *rlist, const void *new_entry)
+{
+    const struct fg_frame *e = new_entry;
+    struct fg_frame *f = malloc(sizeof(*f));
+
+    if (f) {
+        RB_CLEAR_NODE(&f->rbnode);
+        f->type = e->type;
+        f->obj = object__get(e->obj);
+        f->offset = e->offset;
+        f->ip = e->ip;
+        f->str = e->str;
+        return &f->rbnode;
+    } else
+        return NULL;
+}
+
+static void fg_frame_node_delete(struct rblist *rblist, struct rb_node *rb_node)
+{
+    struct fg_frame *f = container_of(rb_node, struct fg_frame, rbnode);
+
+    object__put(f->obj);
+    free(f);
+}
+
+static struct fg_frame *fg_frame_findnew(struct flame_graph *fg, struct fg_frame *tmp)
+{
+    struct rb_node *rbn = rblist__findnew(&fg->frames, tmp);
+
+    return rbn ? container_of(rbn, struct fg_frame, rbnode) : NULL;
+}
+
+static struct fg_frame *fg_frame_user(struct flame_graph *fg, struct syms *syms, u64 ip)
+{
+    struct fg_frame_cache *c = &fg->frame_cache[hash_64(ip ^ (unsigned long)syms, FG_FRAME_CACHE_BITS)];
+    struct fg_frame tmp;
+    struct dso *dso = NULL;
+    u64 offset;
+
+    if (c->frame && c->ip == ip && c->syms == syms && c->gen == ctx.ugen)
+        return c->frame;
+
+    if (syms)
+        dso = syms__find_dso(syms, ip, &offset);
+    tmp.type = dso ? FG_FRAME_SYM : FG_FRAME_UNKNOWN;
+    tmp.obj = dso__object(dso);
+    tmp.offset = dso ? offset : ip;
+    tmp.ip = ip;
+    tmp.str = NULL;
+
+    c->ip = ip;
+    c->syms = syms;
+    c->gen = ctx.ugen;
+    c->frame = fg_frame_findnew(fg, &tmp);
+    return c->frame;
+}
+
+static struct fg_frame *fg_frame_string(struct flame_graph *fg, const char *str)
+{
+    struct fg_frame tmp;
+
+    tmp.type = FG_FRAME_STRING;
+    tmp.obj = NULL;
+    tmp.offset = (u64)(void *)str;
+    tmp.ip = 0;
+    tmp.str = str;
+    return fg_frame_findnew(fg, &tmp);
+}
+
+static const char *fg_frame_symbolize(struct flame_graph *fg, struct fg_frame *f)
+{
+    const char *symbol = "Unknown";
+    const char *dso_name = "Unknown";
+    u64 offset = 0L;
+
+    if (f->str)
+        return f->str;
+
+    if (f->type == FG_FRAME_SYM) {
+        const struct sym *sym = object__find_sym(f->obj, f->offset);
+        offset = f->offset;
+        if (sym) {
+            symbol = sym->name;
+            offset = offset - sym->start;
+            dso_name = object__name(f->obj)?:"Unknown";
+        }
+    }
+    f->str = user_frame_string(fg->cc, f->ip, symbol, offset, dso_name);
+    return f->str;
+}
+
+/*
+ * Replace user ips with interned frames, kernel ips are kept as is.
+ */
+static void flame_graph_defer_callchain(struct flame_graph *fg, struct callchain *callchain, u32 pid,
+                                          int *context_kernel_num, int *context_user_num)
+{
+    struct callchain_ctx *cc = fg->cc;
+    __u64 i;
+    bool user = false;
+    struct syms *syms = NULL;
+
+    *context_kernel_num = 0;
+    *context_user_num = 0;
+    for (i = 0; i < callchain->nr; i++) {
+        u64 ip = callchain->ips[i];
+        if (ip == PERF_CONTEXT_KERNEL) {
+            user = false;
+            if (i + 1 < callchain->nr)
+                (*context_kernel_num) ++;
+            continue;
+        } else if (ip == PERF_CONTEXT_USER) {
+            user = true;
+            if (ctx.syms_cache && cc->user)
+                syms = syms_cache__get_syms(ctx.syms_cache, pid);
+            if (i + 1 < callchain->nr)
+                (*context_user_num) ++;
+            continue;
+        }
+        if (user)
+            callchain->ips[i] = (__u64)(void *)fg_frame_user(fg, syms, ip);
+    }
+}
+
 static inline bool special_file(mode_t mode)
 {
     return S_ISCHR(mode) || S_ISBLK(mode) || S_ISFIFO(mode) || S_ISSOCK(mode);
@@ -778,10 +1251,12 @@ struct flame_graph *flame_graph_new(int flags, FILE *fout)
     struct flame_graph *fg = malloc(sizeof(*fg));
     struct callchain_ctx *cc = callchain_ctx_new(flags, fout);
     struct key_value_paires *kv_pairs = keyvalue_pairs_new(0);
+    struct fg_frame_cache *frame_cache = calloc(FG_FRAME_CACHE_SIZE, sizeof(*frame_cache));
     struct stat buf;
 
-    if (!fg || !cc || !kv_pairs) {
+    if (!fg || !cc || !kv_pairs || !frame_cache) {
         free(fg);
+        free(frame_cache);
         callchain_ctx_free(cc);
         keyvalue_pairs_free(kv_pairs);
         return NULL;
@@ -815,6 +1290,11 @@ struct flame_graph *flame_graph_new(int flags, FILE *fout)
 
     fg->cc = cc;
     fg->kv_pairs = kv_pairs;
+    fg->frame_cache = frame_cache;
+    rblist__init(&fg->frames);
+    fg->frames.node_cmp = fg_frame_node_cmp;
+    fg->frames.node_new = fg_frame_node_new;
+    fg->frames.node_delete = fg_frame_node_delete;
     return fg;
 }
 
@@ -823,8 +1303,10 @@ void flame_graph_free(struct flame_graph *fg)
     if (!fg)
         return ;
 
-    callchain_ctx_free(fg->cc);
     keyvalue_pairs_free(fg->kv_pairs);
+    rblist__exit(&fg->frames);
+    free(fg->frame_cache);
+    callchain_ctx_free(fg->cc);
     free(fg);
 }
 
@@ -857,11 +1339,11 @@ void flame_graph_add_callchain_at_time(struct flame_graph *fg, struct callchain
     memcpy(&key.ips[key.nr], callchain->ips, callchain->nr * sizeof(callchain->ips[0]));
     key.nr += callchain->nr;
     /*
-     * convert callchain to unique string.
      * For user-mode stacks, symbols are freed after the process exits. Therefore,
-     * the stack needs to be converted into a unique string first.
+     * user ips are converted to frames that keep the object alive. Symbolization
+     * is deferred to flame_graph_output().
     **/
-    print2string_callchain(fg->cc, (struct callchain *)&key, pid, &context_kernel_num, &context_user_num);
+    flame_graph_defer_callchain(fg, (struct callchain *)&key, pid, &context_kernel_num, &context_user_num);
     // callchain empty
     if (context_kernel_num + context_user_num == callchain->nr) {
         return;
@@ -892,14 +1374,14 @@ void flame_graph_add_callchain_at_time(struct flame_graph *fg, struct callchain
             snprintf(buff, sizeof(buff), "%s", comm);
         else
             snprintf(buff, sizeof(buff), "%d", pid);
-        key.ips[key.nr++] = (__u64)(void *)unique_string(buff);
+        key.ips[key.nr++] = (__u64)(void *)fg_frame_string(fg, unique_string(buff));
     }
     if (time && time_str) {
         if (!context_user_num) {
             key.ips[key.nr++] = PERF_CONTEXT_USER;
             context_user_num++;
         }
-        key.ips[key.nr++] = (__u64)(void *)unique_string(time_str);
+        key.ips[key.nr++] = (__u64)(void *)fg_frame_string(fg, unique_string(time_str));
     }
 
     /*
@@ -908,6 +1390,48 @@ void flame_graph_add_callchain_at_time(struct flame_graph *fg, struct callchain
     keyvalue_pairs_add_key(fg->kv_pairs, (struct_key *)&key);
 }
 
+struct flame_graph_fold {
+    struct flame_graph *fg;
+    struct key_value_paires *folded;
+};
+
+/*
+ * Symbolize a deferred stack and merge it into the folded stacks: different
+ * ips within the same symbol become the same string stack.
+ */
+static void __flame_graph_fold(void *opaque, struct_key *key, void *value, unsigned int n)
+{
+    struct flame_graph_fold *fold = opaque;
+    struct flame_graph *fg = fold->fg;
+    struct {
+        __u64   nr;
+        __u64   ips[PERF_MAX_STACK_DEPTH + PERF_MAX_CONTEXTS_PER_STACK + 5];
+    } str;
+    bool kernel = false, user = false;
+    struct key_value *kv;
+    __u64 i;
+
+    for (i = 0; i < key->nr; i++) {
+        u64 ip = key->ips[i];
+        if (ip == PERF_CONTEXT_KERNEL) {
+            kernel = true;
+            user = false;
+        } else if (ip == PERF_CONTEXT_USER) {
+            kernel = false;
+            user = true;
+        } else if (kernel)
+            ip = (__u64)(void *)kernel_frame_string(fg->cc, ip);
+        else if (user)
+            ip = (__u64)(void *)fg_frame_symbolize(fg, (struct fg_frame *)ip);
+        str.ips[i] = ip;
+    }
+    str.nr = key->nr;
+
+    kv = keyvalue_pairs_findnew(fold->folded, (struct_key *)&str);
+    if (kv)
+        kv->n += n;
+}
+
 static void __flame_graph_print(void *opaque, struct_key *key, void *value, unsigned int n)
 {
     struct flame_graph *fg = opaque;
@@ -917,10 +1441,19 @@ static void __flame_graph_print(void *opaque, struct_key *key, void *value, unsi
 
 void flame_graph_output(struct flame_graph *fg)
 {
+    struct flame_graph_fold fold;
+
     if (!fg)
         return ;
 
-    keyvalue_pairs_foreach(fg->kv_pairs, __flame_graph_print, fg);
+    fold.fg = fg;
+    fold.folded = keyvalue_pairs_new(0);
+    if (!fold.folded)
+        return ;
+
+    keyvalue_pairs_foreach(fg->kv_pairs, __flame_graph_fold, &fold);
+    keyvalue_pairs_foreach(fold.folded, __flame_graph_print, fg);
+    keyvalue_pairs_free(fold.folded);
 }
 
 struct flame_graph *flame_graph_open(int flags, const char *path)
@@ -980,7 +1513,9 @@ void flame_graph_reset(struct flame_graph *fg)
 {
     if (!fg)
         return ;
-    rblist__exit(&fg->kv_pairs->kv_pairs);
+    keyvalue_pairs_reinit(fg->kv_pairs);
+    rblist__exit(&fg->frames);
+    memset(fg->frame_cache, 0, FG_FRAME_CACHE_SIZE * sizeof(*fg->frame_cache));
 }
 
 
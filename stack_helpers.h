@@ -30,6 +30,11 @@ void print_callchain_common_cbs(struct callchain_ctx *cc, struct callchain *call
 void print_callchain_common(struct callchain_ctx *cc, struct callchain *callchain, u32 pid);
 
 
+int stack_id_get(struct callchain *callchain);
+void stack_id_put(int id);
+struct callchain *stack_id_callchain(int id);
+void stack_id_stat(FILE *fp);
+
 typedef struct callchain struct_key;
 struct key_value_paires;
 struct key_value_paires *keyvalue_pairs_new(int value_size);
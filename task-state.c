@@ -214,7 +214,8 @@ static int monitor_ctx_init(struct prof_dev *dev)
         struct task_state_ctx *pctx = prof_dev_is_cloned(dev)->private;
         ctx->lat_dist = latency_dist_ref(pctx->lat_dist);
     } else {
-        ctx->lat_dist = latency_dist_new_quantile(env->perins, true, 0);
+        ctx->lat_dist = env->hdr ? latency_dist_new_hdr(env->perins, true, 0) :
+                                   latency_dist_new_quantile(env->perins, true, 0);
         if (!ctx->lat_dist)
             goto failed;
     }
@@ -544,9 +545,9 @@ static void task_state_enabled(struct prof_dev *dev)
 static void task_print_node(void *opaque, struct latency_node *node)
 {
     struct prof_dev *dev = opaque;
-    double p50 = tdigest_quantile(node->td, 0.50);
-    double p95 = tdigest_quantile(node->td, 0.95);
-    double p99 = tdigest_quantile(node->td, 0.99);
+    double p50 = latency_node_quantile(node, 0.50);
+    double p95 = latency_node_quantile(node, 0.95);
+    double p99 = latency_node_quantile(node, 0.99);
     const char *state = NULL;
 
     switch (node->key) {
@@ -959,7 +960,7 @@ static void task_state_print_dev(struct prof_dev *dev, int indent)
 }
 
 static const char *task_state_desc[] = PROFILER_DESC("task-state",
-    "[OPTION...] [-S] [-D] [--than ns] [--filter comm] [--perins] [-g [--flame-graph file]]",
+    "[OPTION...] [-S] [-D] [--than ns] [--filter comm] [--perins] [--hdr] [-g [--flame-graph file]]",
     "Trace task state, wakeup, switch, INTERRUPTIBLE, UNINTERRUPTIBLE.", "",
     "TRACEPOINT",
     "    sched:sched_switch, sched:sched_wakeup, sched:sched_wakeup_new", "",
@@ -971,7 +972,7 @@ static const char *task_state_desc[] = PROFILER_DESC("task-state",
 static const char *task_state_argv[] = PROFILER_ARGV("task-state",
     PROFILER_ARGV_OPTION,
     PROFILER_ARGV_CALLCHAIN_FILTER,
-    PROFILER_ARGV_PROFILER, "interruptible", "uninterruptible", "than", "filter", "perins",
+    PROFILER_ARGV_PROFILER, "interruptible", "uninterruptible", "than", "filter", "perins", "hdr",
     "call-graph", "flame-graph", "ptrace");
 struct monitor task_state = {
     .name = "task-state",
@@ -1016,7 +1017,7 @@ static void task_state_matcher(struct tp *tp, void *raw, int size, struct matche
 
     if (event->header.type == PERF_RECORD_DEV) {
         struct perf_record_dev *event_dev = (void *)event;
-        event = &event_dev->event;
+        event = perf_record_dev_event(event_dev);
         dev = event_dev->dev;
     } else
         dev = tp->source_dev;
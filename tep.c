@@ -121,6 +121,17 @@ unref:
     return id;
 }
 
+/*
+ * Without the global comm service, each pid is read from /proc/<pid>/comm at most
+ * once per second, found or not. The samples of the same pid don't have to open,
+ * read and close it again.
+ */
+#define COMM_CACHE_SIZE 1024
+static struct {
+    int pid;
+    unsigned int sec; // seconds of ktime + 1, 0 is invalid.
+} comm_cache[COMM_CACHE_SIZE];
+
 void tep__update_comm(const char *comm, int pid)
 {
     char buff[16];
@@ -129,9 +140,16 @@ void tep__update_comm(const char *comm, int pid)
         return;
 
     if (comm == NULL) {
+        unsigned int idx = (unsigned int)pid % COMM_CACHE_SIZE;
+        unsigned int sec = get_ktime_ns() / NSEC_PER_SEC + 1;
         char path[64];
         int fd, len;
 
+        if (comm_cache[idx].pid == pid && comm_cache[idx].sec == sec)
+            return;
+        comm_cache[idx].pid = pid;
+        comm_cache[idx].sec = sec;
+
         snprintf(path, sizeof(path), "/proc/%d/comm", pid);
         fd = open(path, O_RDONLY);
         if (fd < 0)
@@ -168,7 +186,8 @@ const char *tep__pid_to_comm(int pid)
 void tep__print_event(unsigned long long ts, int cpu, void *data, int size)
 {
     struct tep_record record;
-    struct trace_seq s;
+    static struct trace_seq s;
+    static int inited = 0;
     struct tep_event *e;
 
     ts = (ts + 500) / 1000; // us
@@ -183,7 +202,12 @@ void tep__print_event(unsigned long long ts, int cpu, void *data, int size)
     // For KPROBE, common_type = 0, e = NULL.
     e = tep_find_event_by_record(tep, &record);
 
-    trace_seq_init(&s);
+    if (!inited) {
+        inited = 1;
+        trace_seq_init(&s);
+    } else
+        trace_seq_reset(&s);
+
     if (global_comm) {
         int pid = tep_data_pid(tep, &record);
         char *comm = global_comm_get(pid);
@@ -210,7 +234,6 @@ void tep__print_event(unsigned long long ts, int cpu, void *data, int size)
         trace_seq_printf(&s, "\n");
     tep__unref();
     trace_seq_do_fprintf(&s, stdout);
-    trace_seq_destroy(&s);
 }
 
 bool tep__event_has_field(int id, const char *field)
@@ -688,6 +711,8 @@ struct tp_list *tp_list_new(struct prof_dev *dev, char *event_str)
                     tp->trigger = true;
                 } else if (strcmp(attr, "push") == 0) {
                     if (id >= 0 && tp_broadcast_new(tp, value) < 0) goto err_out;
+                } else if (strcmp(attr, "zip") == 0) {
+                    tp->zip = true;
                 } else if (strcmp(attr, "pull") == 0) {
                     if (id >= 0 && tp_receive_new(tp, value) < 0) goto err_out;
                 } else if (strcmp(attr, "vm") == 0) {
@@ -850,12 +875,14 @@ struct expr_prog *tp_new_prog(struct tp *tp, char *expr_str)
 
 long tp_prog_run(struct tp *tp, struct expr_prog *prog, void *data, int size)
 {
-    if (expr_load_data(prog, data, size) != 0) {
+    long result;
+
+    if (expr_run_data(prog, data, size, &result) < 0) {
         expr_dump(prog);
         fprintf(stderr, "tp %s:%s prog load data failed!\n", tp->sys, tp->name);
         return -1;
     }
-    return expr_run(prog);
+    return result;
 }
 
 char *tp_get_comm(struct tp *tp, void *data, int size)
@@ -1071,6 +1098,7 @@ struct perf_evsel *tp_evsel_new(struct tp *tp, struct perf_event_attr *attr)
     }
 
     tp->evsel = evsel;
+    perf_evsel__set_priv(evsel, tp);
 
     if (!tp_kernel(tp))
         perf_evsel__keep_disable(evsel, true);
@@ -6,6 +6,7 @@
 #include <net.h>
 #include <vcpu_info.h>
 #include <tp_struct.h>
+#include <perf/evsel.h>
 
 void pr_stat(const char *fmt, ...);
 
@@ -87,6 +88,7 @@ struct tp {
     void *broadcast;
     void *receive;
     bool kernel; // event from kernel
+    bool zip; // push compressed frames, tcp and chardev only
 
     // vm
     struct vcpu_info *vcpu; // maybe NULL
@@ -129,10 +131,13 @@ struct perf_record_tp {
     u64 sample_period;
     u64 sample_type;
     u32 event_size;
-    u32 unused;
+    u32 flags;
     char str[];
 };
 
+// perf_record_tp.flags
+#define PERF_RECORD_TP_ZIP  (1 << 0) // the following events are pushed in PERF_RECORD_FRAME
+
 struct perf_record_dev {
     struct perf_event_header header;
 
@@ -143,18 +148,62 @@ struct perf_record_dev {
     u64 id;
     u32 cpu, instance;
     struct prof_dev *dev;
-    union perf_event event;
+    union {
+        union perf_event event;
+        union perf_event *ref; // PERF_RECORD_DEV_REF
+    };
 };
 
+/*
+ * perf_record_dev.header.misc
+ *
+ * The forwarded sample is not copied, perf_record_dev.ref points to it, in the
+ * ringbuffer of the source device. It is only valid until the forwarding returns.
+ * See perf_record_dev_event() and perf_event_copy().
+ */
+#define PERF_RECORD_DEV_REF  (1 << 0)
+
 struct perf_record_order_time {
     struct perf_event_header header;
     u64 order_time;
 };
 
+/*
+ * push=file, pull=file: the events are stored in chunks, each chunk starts
+ * with this record and is followed by `size' bytes of events.
+ */
+struct perf_record_file_chunk {
+    struct perf_event_header header;
+    u32 nr_events;
+    u32 size;
+    u64 start_time;
+    u64 end_time;
+};
+
+/*
+ * push=[IP:]PORT, push=chardev, with the zip attribute: a batch of events,
+ * lz-compressed. The time, pid/tid and cpu fields of the samples are delta
+ * encoded against the previous sample in the same frame before compression.
+ */
+struct perf_record_frame {
+    struct perf_event_header header;
+    u32 raw_size;   // decompressed size
+    u16 nr_events;
+    u8 codec;       // FRAME_CODEC_*
+    u8 unused;
+};
+
+enum frame_codec {
+    FRAME_CODEC_NONE,
+    FRAME_CODEC_LZ,
+};
+
 enum tp_event_type {
     PERF_RECORD_TP = PERF_RECORD_HEADER_MAX + 1,
     PERF_RECORD_DEV,
     PERF_RECORD_ORDER_TIME,
+    PERF_RECORD_FILE_CHUNK,
+    PERF_RECORD_FRAME,
 };
 
 #define TRACE_EVENT_TYPE_MAX \
@@ -190,6 +239,27 @@ static inline bool tp_is_dev(struct tp *tp)
          if (tp_is_dev(_tp))
 
 
+/*
+ * Sample dispatch without scanning the tp_list.
+ * tp_evsel_new() links the evsel back to its tp. Returns NULL if the evsel
+ * does not belong to this tp_list.
+ */
+static inline struct tp *tp_list_evsel_tp(struct tp_list *tp_list, struct perf_evsel *evsel)
+{
+    struct tp *tp = evsel ? perf_evsel__priv(evsel) : NULL;
+
+    if (tp && tp >= tp_list->tp && tp < tp_list->tp + tp_list->nr_tp)
+        return tp;
+    return NULL;
+}
+
+// columnar.c
+struct columnar;
+struct columnar *columnar_open(const char *path, struct tp_list *tp_list);
+void columnar_write(struct columnar *col, struct tp *tp, u64 time, u32 pid, u32 tid, u32 cpu, void *raw, int size);
+void columnar_flush(struct columnar *col);
+void columnar_close(struct columnar *col);
+
 struct tp_list *tp_list_new(struct prof_dev *dev, char *event_str);
 void tp_list_free(struct tp_list *tp_list);
 void tp_update_filter(struct tp *tp, const char *filter);
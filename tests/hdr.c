@@ -0,0 +1,140 @@
+/*
+ * Micro-benchmark of the two latency_dist quantile backends, hdr_histogram
+ * and tdigest, on synthetic latencies.
+ *
+ *   ./hdr [--nr N] [--exact]
+ *
+ * N defaults to 100M. With --exact, the values are also kept and sorted, the
+ * hdr quantiles must be within 1/128 of the exact ones (LATENCY_HDR_SUB_BITS).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+#include "../lib/hdr_histogram.c"
+#include "../lib/tdigest.c"
+
+#define SUB_BITS 7
+#define BATCH 65536
+
+static u64 seed = 0x9e3779b97f4a7c15ULL;
+
+static inline u64 xorshift64(void)
+{
+    seed ^= seed << 13;
+    seed ^= seed >> 7;
+    seed ^= seed << 17;
+    return seed;
+}
+
+// Log-uniform in [100ns, 10ms), 1/1000 of them 10x slower.
+static inline u64 latency(void)
+{
+    u64 r = xorshift64();
+    double u = (double)(r >> 11) / (1ULL << 53);
+    u64 lat = (u64)(100.0 * exp(u * 11.512925465)); // ln(1e5)
+
+    if ((r & 1023) == 0)
+        lat *= 10;
+    return lat;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int u64_cmp(const void *a, const void *b)
+{
+    u64 x = *(const u64 *)a, y = *(const u64 *)b;
+    return x < y ? -1 : x > y;
+}
+
+int main(int argc, char *argv[])
+{
+    static const double qs[] = {0.5, 0.9, 0.99, 0.999, 0.9999};
+    static struct option long_options[] = {
+        {"nr", required_argument, 0, 'n'},
+        {"exact", no_argument, 0, 'e'},
+        {0, 0, 0, 0}
+    };
+    struct hdr_histogram *hdr = hdr_histogram_new(SUB_BITS);
+    struct tdigest *td = tdigest_new(100);
+    u64 *values = NULL;
+    static u64 batch[BATCH];
+    u64 nr = 100000000, i, n, k;
+    int exact = 0, failed = 0;
+    double t0, t_hdr, t_td;
+    int opt, j;
+
+    while ((opt = getopt_long(argc, argv, "n:e", long_options, NULL)) != -1) {
+        if (opt == 'n')
+            nr = strtoull(optarg, NULL, 0);
+        else if (opt == 'e')
+            exact = 1;
+        else
+            return 1;
+    }
+    if (!hdr || !td || !nr)
+        return 1;
+    if (exact) {
+        values = malloc(nr * sizeof(*values));
+        if (!values)
+            return 1;
+    }
+
+    // The values are generated in batches, only the adds are timed.
+    t_hdr = t_td = 0;
+    for (i = 0; i < nr; i += n) {
+        n = min(nr - i, (u64)BATCH);
+        for (k = 0; k < n; k++)
+            batch[k] = latency();
+        if (values)
+            memcpy(values + i, batch, n * sizeof(*batch));
+
+        t0 = now();
+        for (k = 0; k < n; k++)
+            hdr_histogram_add(hdr, batch[k], 1);
+        t_hdr += now() - t0;
+
+        t0 = now();
+        for (k = 0; k < n; k++)
+            tdigest_add(td, batch[k], 1);
+        t_td += now() - t0;
+    }
+
+    printf("%lu latencies\n", nr);
+    printf("hdr      %8.2f ns/add  %8lu bytes\n", t_hdr * 1e9 / nr, hdr->nr * sizeof(u64));
+    printf("tdigest  %8.2f ns/add  %8lu bytes\n", t_td * 1e9 / nr, td->cap * sizeof(struct centroid));
+
+    if (exact)
+        qsort(values, nr, sizeof(*values), u64_cmp);
+
+    printf("%-8s %14s %14s %14s\n", "quantile", "hdr", "tdigest", exact ? "exact" : "");
+    for (j = 0; j < (int)(sizeof(qs) / sizeof(qs[0])); j++) {
+        double h = hdr_histogram_quantile(hdr, qs[j]);
+        double t = tdigest_quantile(td, qs[j]);
+
+        printf("%-8g %14.0f %14.0f", qs[j], h, t);
+        if (exact) {
+            // rank = ceil(q * nr), same as hdr_histogram_quantile().
+            u64 rank = (u64)ceil(qs[j] * nr);
+            double e = values[rank ? rank - 1 : 0];
+
+            printf(" %14.0f", e);
+            if (fabs(h - e) > e / (1 << SUB_BITS)) {
+                printf("  hdr error too large");
+                failed = 1;
+            }
+        }
+        printf("\n");
+    }
+
+    free(values);
+    hdr_histogram_free(hdr);
+    tdigest_free(td);
+    return failed;
+}
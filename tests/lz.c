@@ -0,0 +1,90 @@
+/*
+ * Round-trip check of the lz_helpers.c codec used by the zip transport.
+ *
+ *   ./lz [--seed N]
+ *
+ * Prints the compressed sizes, exits non-zero if any input does not round-trip.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include "../lz_helpers.c"
+
+static unsigned char src[LZ_MAX_BLOCK];
+static unsigned char zip[LZ_MAX_BLOCK + LZ_MAX_BLOCK / 255 + 16];
+static unsigned char out[LZ_MAX_BLOCK];
+static int failed = 0;
+
+static void check(const char *name, int len)
+{
+    int zlen, dlen;
+
+    zlen = lz_compress(src, len, zip, lz_compress_bound(len));
+    if (len && zlen <= 0) {
+        fprintf(stderr, "%s: len %d, compress failed\n", name, len);
+        failed = 1;
+        return;
+    }
+    dlen = lz_decompress(zip, zlen, out, sizeof(out));
+    if (dlen != len || memcmp(src, out, len)) {
+        fprintf(stderr, "%s: len %d, round-trip mismatch, got %d\n", name, len, dlen);
+        failed = 1;
+        return;
+    }
+    // A short dst must be refused, not overflowed.
+    if (len > 1 && lz_decompress(zip, zlen, out, len - 1) >= 0) {
+        fprintf(stderr, "%s: len %d, dst overflow not detected\n", name, len);
+        failed = 1;
+        return;
+    }
+    // Truncated input must not crash.
+    if (zlen > 1)
+        lz_decompress(zip, zlen / 2, out, sizeof(out));
+    printf("%-8s %6d => %6d\n", name, len, zlen);
+}
+
+// Like the samples of a frame: the same layout with small changes.
+static void fill_samples(int len)
+{
+    int i;
+
+    for (i = 0; i < len; i++)
+        src[i] = (i % 48) < 40 ? (unsigned char)(i % 48) : (unsigned char)rand();
+}
+
+int main(int argc, char *argv[])
+{
+    static const int lens[] = {0, 1, 4, 5, 13, 255, 256, 4096, 32768, LZ_MAX_BLOCK};
+    static struct option long_options[] = {
+        {"seed", required_argument, 0, 's'},
+        {0, 0, 0, 0}
+    };
+    int opt, i, j;
+
+    while ((opt = getopt_long(argc, argv, "s:", long_options, NULL)) != -1) {
+        if (opt == 's')
+            srand(atoi(optarg));
+        else
+            return 1;
+    }
+
+    for (i = 0; i < (int)(sizeof(lens) / sizeof(lens[0])); i++) {
+        int len = lens[i];
+
+        memset(src, 0, len);
+        check("zero", len);
+
+        for (j = 0; j < len; j++)
+            src[j] = (unsigned char)rand();
+        check("random", len);
+
+        for (j = 0; j < len; j++)
+            src[j] = "perf-prof lz "[j % 13];
+        check("text", len);
+
+        fill_samples(len);
+        check("samples", len);
+    }
+    return failed;
+}
@@ -0,0 +1,26 @@
+#!/usr/bin/env python3
+
+from PerfProf import PerfProf
+from conftest import result_check
+import subprocess
+import pytest
+
+def test_bench_top(runtime, memleak_check):
+    #perf-prof bench -e 'top -e sched:sched_wakeup -k pid' -C 0-3 -i 1000
+    prof = PerfProf(["bench", '-e', 'top -e sched:sched_wakeup -k pid', '-C', '0-3', '-i', '1000'])
+    for std, line in prof.run(runtime, memleak_check):
+        result_check(std, line, runtime, memleak_check)
+
+def test_bench_syscalls_order(runtime, memleak_check):
+    #perf-prof bench -e 'syscalls -e raw_syscalls:sys_enter -e raw_syscalls:sys_exit -k common_pid --order' --period 1us --jitter 5us -C 0-3 -i 1000
+    prof = PerfProf(["bench", '-e', 'syscalls -e raw_syscalls:sys_enter -e raw_syscalls:sys_exit -k common_pid --order',
+                     '--period', '1us', '--jitter', '5us', '-C', '0-3', '-i', '1000'])
+    for std, line in prof.run(runtime, memleak_check):
+        result_check(std, line, runtime, memleak_check)
+
+def test_bench_hdr_tdigest(runtime, memleak_check):
+    #./hdr --nr 1000000 --exact
+    hdr = subprocess.run(['./hdr', '--nr', '1000000', '--exact'], stdout=subprocess.PIPE, stderr=subprocess.PIPE, universal_newlines=True)
+    print(hdr.stdout, end='')
+    if hdr.returncode != 0:
+        pytest.fail(hdr.stdout + hdr.stderr)
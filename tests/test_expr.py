@@ -2,6 +2,7 @@
 
 from PerfProf import PerfProf
 from conftest import result_check
+import pytest
 
 def expr(args, runtime, memleak_check):
     cmdline = ["expr"]
@@ -9,6 +10,8 @@ def expr(args, runtime, memleak_check):
     expr = PerfProf(cmdline)
     for std, line in expr.run(runtime, memleak_check):
         result_check(std, line, runtime, memleak_check)
+        if 'MISMATCH' in line:
+            pytest.fail(line)
 
 
 def test_expr_sched_wakeup0(runtime, memleak_check):
@@ -57,3 +60,28 @@ def test_expr_workqueue_execute_start(runtime, memleak_check):
 
 def test_expr_sched_process_exec(runtime, memleak_check):
     expr(['-e', 'sched:sched_process_exec', 'printf("=%s=", (char *)&common_type + filename_offset)'], runtime, memleak_check)
+
+def test_expr_interpreted(runtime, memleak_check):
+    expr(['-e', 'sched:sched_wakeup', '(pid>100 && prio!=120) ? pid%7 : -(target_cpu<<2)'], runtime, memleak_check)
+
+def test_expr_jit(runtime, memleak_check):
+    expr(['-e', 'sched:sched_wakeup', '(pid>100 && prio!=120) ? pid%7 : -(target_cpu<<2)', '--expr-jit'], runtime, memleak_check)
+
+def test_expr_jit_compare(runtime, memleak_check):
+    expr(['-e', 'sched:sched_wakeup', '(pid>100 && prio!=120) ? pid%7 : -(target_cpu<<2)', '--expr-jit', '-v'], runtime, memleak_check)
+
+def test_expr_optimize(runtime, memleak_check):
+    expr(['-e', 'sched:sched_wakeup', '(1<<12) + pid*1 + (prio>100 && target_cpu!=0)', '-v'], runtime, memleak_check)
+
+def test_expr_shape_field(runtime, memleak_check):
+    expr(['-e', 'sched:sched_wakeup', 'pid', '-v'], runtime, memleak_check)
+    expr(['-e', 'sched:sched_wakeup', 'pid'], runtime, memleak_check)
+
+def test_expr_shape_field_cmp(runtime, memleak_check):
+    for op in ['==', '!=', '<', '>', '<=', '>=']:
+        expr(['-e', 'sched:sched_wakeup', 'prio' + op + '120', '-v'], runtime, memleak_check)
+    expr(['-e', 'sched:sched_wakeup', 'target_cpu>0'], runtime, memleak_check)
+
+def test_expr_shape_field_and(runtime, memleak_check):
+    expr(['-e', 'sched:sched_wakeup', 'pid&0xff', '-v'], runtime, memleak_check)
+    expr(['-e', 'sched:sched_wakeup', 'pid&0xff'], runtime, memleak_check)
@@ -12,6 +12,30 @@ def test_multi_trace_switch(runtime, memleak_check):
     for std, line in multi_trace.run(runtime, memleak_check, util_interval=5):
         result_check(std, line, runtime, memleak_check)
 
+def test_multi_trace_switch_window(runtime, memleak_check):
+    # perf-prof multi-trace -e sched:sched_switch --cycle -i 1000 --window 1,10,60
+    multi_trace = PerfProf(["multi-trace",
+                            '-e', 'sched:sched_switch', '--cycle', '-i', '1000', '--window', '1,10,60'])
+    for std, line in multi_trace.run(runtime, memleak_check, util_interval=5):
+        result_check(std, line, runtime, memleak_check)
+
+def test_multi_trace_switch_window_only_than(runtime, memleak_check):
+    # perf-prof multi-trace -e sched:sched_switch --cycle -i 500 --only-than 100ms --window 1,4
+    multi_trace = PerfProf(["multi-trace",
+                            '-e', 'sched:sched_switch', '--cycle', '-i', '500', '--only-than', '100ms', '--window', '1,4'])
+    for std, line in multi_trace.run(runtime, memleak_check, util_interval=5):
+        result_check(std, line, runtime, memleak_check)
+
+@pytest.mark.parametrize("window", ['abc', '0', '1,', '1,2,3,4,5', '5000'])
+def test_multi_trace_window_invalid(runtime, memleak_check, window):
+    # perf-prof multi-trace -e sched:sched_switch --cycle --window $window
+    multi_trace = PerfProf(["multi-trace", '-e', 'sched:sched_switch', '--cycle', '--window', window])
+    error = False
+    for std, line in multi_trace.run(runtime, memleak_check):
+        if std == PerfProf.STDERR and line.startswith('--window'):
+            error = True
+    assert error
+
 def test_multi_trace_userspace_ftrace_filter(runtime, memleak_check):
     # perf-prof multi-trace -e sched:sched_switch/prev_prio!=next_prio/ --cycle -i 1000 --perins
     multi_trace = PerfProf(["multi-trace",
@@ -4,8 +4,19 @@ from PerfProf import PerfProf
 from conftest import result_check
 import ctypes.util
 import os
+import re
+import signal
+import subprocess
+import time
 import pytest
 
+def pull_check(std, line, runtime, memleak_check):
+    # The replayed events of the exited tasks have no comm, '<...>' is expected.
+    if not memleak_check and std == PerfProf.STDOUT:
+        print(line, end='', flush=True)
+    else:
+        result_check(std, line, runtime, memleak_check)
+
 def test_sched_wakeup(runtime, memleak_check):
     #perf-prof trace -e sched:sched_wakeup -C 0
     prof = PerfProf(['trace', '-e', 'sched:sched_wakeup', '-C', '0', '-m', '64'])
@@ -18,12 +29,127 @@ def test_sched_wakeup_watermark(runtime, memleak_check):
     for std, line in prof.run(runtime, memleak_check):
         result_check(std, line, runtime, memleak_check)
 
+def test_sched_wakeup_columnar(runtime, memleak_check):
+    # (time, tp) of each event line, in both the trace and the columnar output.
+    event = re.compile(r' \[(\d{3})\] (\d+\.\d{6}): (sched:sched_\w+):')
+    rows = {}
+    for columnar in [False, True]:
+        rows[columnar] = []
+        #perf-prof trace -e sched:sched_wakeup,sched:sched_switch -N 200 [--columnar sched.col]
+        args = ['trace', '-e', 'sched:sched_wakeup,sched:sched_switch', '-N', '200']
+        if columnar:
+            args += ['--columnar', 'sched.col']
+        prof = PerfProf(args)
+        for std, line in prof.run(runtime, memleak_check):
+            result_check(std, line, runtime, memleak_check)
+            m = event.search(line)
+            if m:
+                rows[columnar].append(m.group(3))
+        if columnar:
+            assert len(rows[columnar]) == 0
+            #perf-prof columnar sched.col
+            prof = PerfProf(['columnar', 'sched.col'])
+            for std, line in prof.run(runtime, memleak_check):
+                result_check(std, line, runtime, memleak_check)
+                m = event.search(line)
+                if m:
+                    rows[columnar].append(m.group(3))
+            os.remove('sched.col')
+    if not memleak_check:
+        assert len(rows[False]) == 200
+        assert len(rows[True]) == 200
+        assert set(rows[False]) <= {'sched:sched_wakeup', 'sched:sched_switch'}
+        assert set(rows[True]) <= {'sched:sched_wakeup', 'sched:sched_switch'}
+
+@pytest.mark.parametrize("event,args", [('sched:sched_wakeup', ['-g']),
+                                        ('sched:sched_wakeup', ['--flame-graph', 'sched']),
+                                        ('sched:sched_wakeup//stack/', [])])
+def test_sched_wakeup_columnar_invalid(runtime, memleak_check, event, args):
+    #perf-prof trace -e $event --columnar sched.col $args
+    prof = PerfProf(['trace', '-e', event, '--columnar', 'sched.col'] + args)
+    error = False
+    for std, line in prof.run(runtime, memleak_check):
+        if std == PerfProf.STDERR and line.startswith('--columnar'):
+            error = True
+    assert error
+    assert not os.path.exists('sched.col')
+
+def test_sched_wakeup_push_file(runtime, memleak_check):
+    #perf-prof trace -e sched:sched_wakeup//push=wakeup.bin/
+    prof = PerfProf(['trace', '-e', 'sched:sched_wakeup//push=wakeup.bin/', '-m', '64'])
+    for std, line in prof.run(runtime, memleak_check):
+        result_check(std, line, runtime, memleak_check)
+    #perf-prof trace -e sched:sched_wakeup//pull=wakeup.bin/
+    prof = PerfProf(['trace', '-e', 'sched:sched_wakeup//pull=wakeup.bin/', '-N', '100'])
+    for std, line in prof.run(runtime, memleak_check):
+        pull_check(std, line, runtime, memleak_check)
+    #perf-prof trace -e sched:sched_wakeup//pull=wakeup.bin@1-/ --order
+    prof = PerfProf(['trace', '-e', 'sched:sched_wakeup//pull=wakeup.bin@1-/', '--order', '-N', '100'])
+    for std, line in prof.run(runtime, memleak_check):
+        pull_check(std, line, runtime, memleak_check)
+    #perf-prof trace -e sched:sched_wakeup//pull=wakeup.bin@-1.5/
+    prof = PerfProf(['trace', '-e', 'sched:sched_wakeup//pull=wakeup.bin@-1.5/'])
+    for std, line in prof.run(runtime, memleak_check):
+        pull_check(std, line, runtime, memleak_check)
+    os.remove('wakeup.bin')
+
+def test_sched_wakeup_push_zip(runtime, memleak_check):
+    #perf-prof trace -e sched:sched_wakeup//push=9903/zip/
+    push = PerfProf(['trace', '-e', 'sched:sched_wakeup//push=9903/zip/', '-m', '64'])
+    pusher = subprocess.Popen(push.args, stdout=subprocess.PIPE, stderr=subprocess.PIPE, universal_newlines=True)
+    time.sleep(0.5)
+    #perf-prof trace -e sched:sched_wakeup//pull=127.0.0.1:9903/
+    prof = PerfProf(['trace', '-e', 'sched:sched_wakeup//pull=127.0.0.1:9903/'])
+    events = 0
+    pull_stat = None
+    for std, line in prof.run(runtime, memleak_check):
+        pull_check(std, line, runtime, memleak_check)
+        if ' G ' in line and 'sched:sched_wakeup:' in line:
+            events += 1
+        if line.startswith('Pull '):
+            pull_stat = line
+    pusher.send_signal(signal.SIGINT)
+    out, err = pusher.communicate(timeout=10)
+    print(out, end='')
+    if err:
+        pytest.fail(err)
+    push_stat = [line for line in out.splitlines() if line.startswith('Push ')]
+    if not memleak_check:
+        assert events > 0
+        assert pull_stat and 'errors 0' in pull_stat
+        assert push_stat and 'errors 0' in push_stat[0]
+
+def test_lz_codec(runtime, memleak_check):
+    #./lz
+    lz = subprocess.run(['./lz'], stdout=subprocess.PIPE, stderr=subprocess.PIPE, universal_newlines=True)
+    print(lz.stdout, end='')
+    if lz.returncode != 0:
+        pytest.fail(lz.stderr)
+
+def test_sched_wakeup_mmap_budget(runtime, memleak_check):
+    #perf-prof trace -e sched:sched_wakeup,sched:sched_switch -m 1 --mmap-budget 64
+    prof = PerfProf(['trace', '-e', 'sched:sched_wakeup,sched:sched_switch', '-m', '1', '--mmap-budget', '64'])
+    for std, line in prof.run(runtime, memleak_check):
+        result_check(std, line, runtime, memleak_check)
+
+def test_sched_wakeup_mmap_budget_order(runtime, memleak_check):
+    #perf-prof trace -e sched:sched_wakeup,sched:sched_switch -m 1 --mmap-budget 64 --order
+    prof = PerfProf(['trace', '-e', 'sched:sched_wakeup,sched:sched_switch', '-m', '1', '--mmap-budget', '64', '--order'])
+    for std, line in prof.run(runtime, memleak_check):
+        result_check(std, line, runtime, memleak_check)
+
 def test_sched_wakeup_tsc(runtime, memleak_check):
     #perf-prof trace -e sched:sched_wakeup -C 0
     prof = PerfProf(['trace', '-e', 'sched:sched_wakeup', '-C', '0', '-m', '64', '--tsc', '-N', '20'])
     for std, line in prof.run(runtime, memleak_check):
         result_check(std, line, runtime, memleak_check)
 
+def test_sched_wakeup_tsc_order(runtime, memleak_check):
+    #perf-prof trace -e sched:sched_wakeup,sched:sched_switch --tsc --order
+    prof = PerfProf(['trace', '-e', 'sched:sched_wakeup,sched:sched_switch', '-m', '64', '--tsc', '--order', '-N', '20'])
+    for std, line in prof.run(runtime, memleak_check):
+        result_check(std, line, runtime, memleak_check)
+
 def test_sched_wakeup_clock_offset(runtime, memleak_check):
     #perf-prof trace -e sched:sched_wakeup -C 0
     prof = PerfProf(['trace', '-e', 'sched:sched_wakeup', '-C', '0', '-m', '64', '--clock-offset', '0xff', '-N', '20'])
@@ -72,6 +198,12 @@ def test_trace_profiler(runtime, memleak_check):
     for std, line in prof.run(runtime, memleak_check):
         result_check(std, line, runtime, memleak_check)
 
+def test_trace_order_threads(runtime, memleak_check):
+    #perf-prof trace -e sched:sched_wakeup,sched:sched_migrate_task --order --order-threads 2 -m 64
+    prof = PerfProf(['trace', '-e', 'sched:sched_wakeup,sched:sched_migrate_task', '--order', '--order-threads', '2', '-m', '64'])
+    for std, line in prof.run(runtime, memleak_check):
+        result_check(std, line, runtime, memleak_check)
+
 def test_trace_attr_cpus0(runtime, memleak_check):
     #perf-prof trace -e sched:sched_wakeup/target_cpu==0/,sched:sched_migrate_task/dest_cpu==0/,sched:sched_switch//cpus=0/ -m 128 --order -i 1000 -N 100000
     prof = PerfProf(['trace', '-e', 'sched:sched_wakeup/target_cpu==0/,sched:sched_migrate_task/dest_cpu==0/,sched:sched_switch//cpus=0/', '-m', '128', '--order', '-i', '1000', '-N', '100000'])
@@ -14,16 +14,42 @@
 #include <monitor.h>
 #include <dlfcn.h>
 #include <tep.h>
-#include <linux/rblist.h>
+#include <linux/hash.h>
+#include <linux/min_heap.h>
 #include <trace_helpers.h>
 #include <stack_helpers.h>
 
 #define TASK_COMM_LEN 16
 
+/*
+ * Per-instance open-addressed table, the sample path only touches the table
+ * of its own instance. Rows are fixed width, struct top_row followed by
+ * counter[nr_fields], and are merged into one table at top_interval().
+ */
+struct top_row {
+    unsigned long key;
+    u32 hash; // 0: empty row
+    char comm[TASK_COMM_LEN];
+    char *pcomm;
+    unsigned long counter[0];
+};
+
+struct top_table {
+    void *rows;
+    unsigned int size; // power of 2
+    unsigned int nr;
+};
+
+DEFINE_MIN_HEAP(struct top_row *, top_heap);
+
 struct top_ctx {
     struct tp_list *tp_list;
-    struct rblist top_list;
+    struct top_table merged; // rows of the current interval
+    struct top_heap heap;
     unsigned long nr_events;
+    int nr_ins;
+    struct top_table *tables; // indexed by instance
+    int row_size;
 
     char *EVENT; //toupper(env->event)
     int nr_fields;
@@ -33,6 +59,7 @@ struct top_ctx {
         int len;
         bool top_by;
     } *fields;
+    int *tp_field; // the first field of each tp, indexed by tp
     char *key_name;// toupper(env->key)
     int  key_len;
     char *comm;
@@ -42,77 +69,34 @@ struct top_ctx {
     bool altwin;
 };
 
-struct top_info {
-    struct rb_node rbnode;
-    unsigned long key;
-    char comm[TASK_COMM_LEN];
-    char *pcomm;
-    unsigned long counter[0];
-};
-
-struct tmp_entry {
-    struct top_ctx *ctx;
-    struct top_info *info;
-};
-
-static int top_info_node_cmp(struct rb_node *rbn, const void *entry)
+static char *top_comm_copy(char comm[TASK_COMM_LEN], const char *pcomm)
 {
-    struct top_info *t = container_of(rbn, struct top_info, rbnode);
-    const struct top_info *e = entry;
-
-    if (t->key > e->key)
-        return 1;
-    else if (t->key < e->key)
-        return -1;
-    else
-        return e->pcomm ? strcmp(t->pcomm, e->pcomm) : 0;
-}
+    char *copy;
+    int len;
 
-static struct rb_node *top_info_node_new(struct rblist *rlist, const void *new_entry)
-{
-    struct top_ctx *ctx = container_of(rlist, struct top_ctx, top_list);
-    int size = offsetof(struct top_info, counter[ctx->nr_fields]);
-    const struct top_info *e = new_entry;
-    struct top_info *t = malloc(size);
-    if (t) {
-        RB_CLEAR_NODE(&t->rbnode);
-        t->key = e->key;
-        if (e->pcomm) {
-            int len = strlen(e->pcomm);
-            if (len < TASK_COMM_LEN) {
-                t->pcomm = t->comm;
-                strcpy(t->pcomm, e->pcomm);
-            } else {
-                t->pcomm = strdup(e->pcomm);
-                if (!t->pcomm) {
-                    t->pcomm = t->comm;
-                    strncpy(t->pcomm, e->pcomm, TASK_COMM_LEN - 1);
-                    t->pcomm[TASK_COMM_LEN - 1] = '\0';
-                }
-            }
-        } else
-            t->pcomm = NULL;
-        memset((void *)t + sizeof(struct top_info), 0, size - sizeof(struct top_info));
-        return &t->rbnode;
-    } else
+    if (!pcomm)
         return NULL;
+
+    len = strlen(pcomm);
+    if (len < TASK_COMM_LEN) {
+        strcpy(comm, pcomm);
+        return comm;
+    }
+    copy = strdup(pcomm);
+    if (!copy) {
+        strncpy(comm, pcomm, TASK_COMM_LEN - 1);
+        comm[TASK_COMM_LEN - 1] = '\0';
+        copy = comm;
+    }
+    return copy;
 }
-static void top_info_node_delete(struct rblist *rblist, struct rb_node *rb_node)
-{
-    struct top_info *t = container_of(rb_node, struct top_info, rbnode);
-    if (t->pcomm && t->pcomm != t->comm)
-        free(t->pcomm);
-    free(t);
-}
-static void top_info_node_delete_empty(struct rblist *rblist, struct rb_node *rb_node)
-{
-}
-static int top_info_sorted_node_cmp(struct rb_node *rbn, const void *entry)
+
+/*
+ * The print order: top-by counters, other counters, descending; then key
+ * and comm, ascending.
+ */
+static int top_row_cmp(const struct top_ctx *ctx, const struct top_row *t, const struct top_row *e)
 {
-    struct top_info *t = container_of(rbn, struct top_info, rbnode);
-    const struct tmp_entry *tmp = entry;
-    const struct top_ctx *ctx = tmp->ctx;
-    const struct top_info *e = tmp->info;
     int i;
 
     if (ctx->nr_top_by)
@@ -132,15 +116,193 @@ static int top_info_sorted_node_cmp(struct rb_node *rbn, const void *entry)
         else if (t->counter[i] < e->counter[i])
             return 1;
     }
-    return top_info_node_cmp(rbn, entry);
+    if (t->key > e->key)
+        return 1;
+    else if (t->key < e->key)
+        return -1;
+    else
+        return e->pcomm ? strcmp(t->pcomm, e->pcomm) : 0;
+}
+
+// The heap root is the last row to print.
+static bool top_heap_less(const void *lhs, const void *rhs, void *args)
+{
+    return top_row_cmp(args, *(struct top_row **)lhs, *(struct top_row **)rhs) > 0;
+}
+
+static const struct min_heap_callbacks top_heap_callbacks = {
+    .less = top_heap_less,
+    .swp = NULL,
+};
+
+static inline u32 top_row_hash(unsigned long key, const char *pcomm)
+{
+    u64 h = key;
+
+    // FNV-1a
+    if (pcomm)
+        while (*pcomm)
+            h = (h ^ (unsigned char)*pcomm++) * 0x100000001b3ULL;
+    return hash_64(h, 32) | 1;
+}
+
+static inline struct top_row *top_table_row(struct top_ctx *ctx, void *rows, unsigned int i)
+{
+    return rows + (size_t)i * ctx->row_size;
+}
+
+static int top_table_grow(struct top_ctx *ctx, struct top_table *table)
+{
+    unsigned int size = table->size ? table->size * 2 : 64;
+    void *rows = calloc(size, ctx->row_size);
+    struct top_row *row, *new;
+    unsigned int i, j;
+
+    if (!rows)
+        return -1;
+
+    for (i = 0; i < table->size; i++) {
+        row = top_table_row(ctx, table->rows, i);
+        if (!row->hash)
+            continue;
+        for (j = row->hash & (size - 1); ; j = (j + 1) & (size - 1)) {
+            new = top_table_row(ctx, rows, j);
+            if (!new->hash)
+                break;
+        }
+        memcpy(new, row, ctx->row_size);
+        if (row->pcomm == row->comm)
+            new->pcomm = new->comm;
+    }
+    free(table->rows);
+    table->rows = rows;
+    table->size = size;
+    return 0;
+}
+
+static struct top_row *top_table_findnew(struct top_ctx *ctx, struct top_table *table,
+                                         unsigned long key, const char *pcomm)
+{
+    u32 hash = top_row_hash(key, pcomm);
+    struct top_row *row;
+    unsigned int i;
+
+    // Keep the load factor below 1/2.
+    if (unlikely((table->nr + 1) * 2 > table->size) &&
+        top_table_grow(ctx, table) < 0 && table->nr + 1 >= table->size)
+        return NULL;
+
+    for (i = hash & (table->size - 1); ; i = (i + 1) & (table->size - 1)) {
+        row = top_table_row(ctx, table->rows, i);
+        if (!row->hash)
+            break;
+        if (row->hash == hash && row->key == key &&
+            (!pcomm || strcmp(row->pcomm, pcomm) == 0))
+            return row;
+    }
+
+    row->hash = hash;
+    row->key = key;
+    row->pcomm = top_comm_copy(row->comm, pcomm);
+    table->nr ++;
+    return row;
+}
+
+static void top_table_reset(struct top_ctx *ctx, struct top_table *table)
+{
+    struct top_row *row;
+    unsigned int i;
+
+    if (!table->nr)
+        return;
+    for (i = 0; i < table->size; i++) {
+        row = top_table_row(ctx, table->rows, i);
+        if (row->hash && row->pcomm && row->pcomm != row->comm)
+            free(row->pcomm);
+    }
+    memset(table->rows, 0, (size_t)table->size * ctx->row_size);
+    table->nr = 0;
+}
+
+/*
+ * Merge all per-instance tables into ctx->merged, and reset them for the
+ * next interval.
+ */
+static void top_merge(struct top_ctx *ctx)
+{
+    struct top_table *table, tmp;
+    struct top_row *row, *p;
+    unsigned int i;
+    int ins, f;
+
+    for (ins = 0; ins < ctx->nr_ins; ins++) {
+        table = &ctx->tables[ins];
+        if (!table->nr)
+            continue;
+        // The first non-empty table is taken as a whole.
+        if (!ctx->merged.nr) {
+            tmp = ctx->merged;
+            ctx->merged = *table;
+            *table = tmp;
+            continue;
+        }
+        for (i = 0; i < table->size; i++) {
+            row = top_table_row(ctx, table->rows, i);
+            if (!row->hash)
+                continue;
+            p = top_table_findnew(ctx, &ctx->merged, row->key, row->pcomm);
+            if (!p)
+                continue;
+            for (f = 0; f < ctx->nr_fields; f++)
+                p->counter[f] += row->counter[f];
+        }
+        top_table_reset(ctx, table);
+    }
 }
-static struct rb_node *top_info_sorted_node_new(struct rblist *rlist, const void *new_entry)
+
+/*
+ * Select the first k rows of ctx->merged in print order into ctx->heap.data,
+ * O(N log k) instead of sorting all N rows.
+ */
+static int top_select(struct top_ctx *ctx, int k)
 {
-    struct tmp_entry *tmp = (void *)new_entry;
-    struct top_info *t = tmp->info;
-    RB_CLEAR_NODE(&t->rbnode);
-    return &t->rbnode;
+    struct top_table *table = &ctx->merged;
+    struct top_heap *heap = &ctx->heap;
+    struct top_row *row, **data;
+    unsigned int i;
+    int n;
+
+    if (k > heap->size) {
+        data = realloc(heap->size ? heap->data : NULL, k * sizeof(*data));
+        if (!data)
+            return 0;
+        heap->data = data;
+        heap->size = k;
+    }
+    heap->nr = 0;
+    if (k <= 0)
+        return 0;
+
+    for (i = 0; i < table->size; i++) {
+        row = top_table_row(ctx, table->rows, i);
+        if (!row->hash)
+            continue;
+        if (heap->nr < k)
+            min_heap_push(heap, &row, &top_heap_callbacks, ctx);
+        else if (top_row_cmp(ctx, row, heap->data[0]) < 0)
+            min_heap_pop_push(heap, &row, &top_heap_callbacks, ctx);
+    }
+
+    // Pop the last row first, data[] ends up in print order.
+    n = heap->nr;
+    while (heap->nr) {
+        row = heap->data[0];
+        min_heap_pop(heap, &top_heap_callbacks, ctx);
+        heap->data[heap->nr] = row;
+    }
+    return n;
 }
+
 static void set_term_quiet_input(struct termios *old)
 {
     struct termios tc;
@@ -227,9 +389,11 @@ static int monitor_ctx_init(struct prof_dev *dev)
 
     ctx->nr_fields = ctx->tp_list->nr_top;
     ctx->fields = calloc(ctx->nr_fields, sizeof(*ctx->fields));
-    if (!ctx->fields)
+    ctx->tp_field = calloc(ctx->tp_list->nr_tp, sizeof(*ctx->tp_field));
+    if (!ctx->fields || !ctx->tp_field)
         goto failed;
     for_each_real_tp(ctx->tp_list, tp, i) {
+        ctx->tp_field[i] = f;
         for (j = 0; j < tp->nr_top; j++) {
             char *field = (j == 0 && tp->alias) ? tp->alias : tp->top_add[j].field;
             ctx->fields[f].field = ctx->EVENT + (field - ctx->tp_list->event_str);
@@ -297,10 +461,13 @@ static int monitor_ctx_init(struct prof_dev *dev)
         goto failed;
     }
 
-    rblist__init(&ctx->top_list);
-    ctx->top_list.node_cmp = top_info_node_cmp;
-    ctx->top_list.node_new = top_info_node_new;
-    ctx->top_list.node_delete = top_info_node_delete;
+    ctx->nr_ins = prof_dev_nr_ins(dev);
+    ctx->tables = calloc(ctx->nr_ins, sizeof(*ctx->tables));
+    if (!ctx->tables)
+        goto failed;
+    ctx->row_size = ALIGN(offsetof(struct top_row, counter[ctx->nr_fields]), sizeof(unsigned long));
+
+    min_heap_init(&ctx->heap, NULL, 0);
 
     ctx->altwin = false;
 
@@ -317,9 +484,21 @@ failed:
 static void monitor_ctx_exit(struct prof_dev *dev)
 {
     struct top_ctx *ctx = dev->private;
+    int i;
+
     if (ctx->altwin) altwin_end();
-    rblist__exit(&ctx->top_list);
+    if (ctx->tables) {
+        for (i = 0; i < ctx->nr_ins; i++) {
+            top_table_reset(ctx, &ctx->tables[i]);
+            free(ctx->tables[i].rows);
+        }
+        free(ctx->tables);
+    }
+    top_table_reset(ctx, &ctx->merged);
+    free(ctx->merged.rows);
+    if (ctx->heap.size) free(ctx->heap.data);
     if (ctx->fields) free(ctx->fields);
+    if (ctx->tp_field) free(ctx->tp_field);
     if (ctx->EVENT) free(ctx->EVENT);
     if (ctx->key_name) free(ctx->key_name);
     if (ctx->comm) free(ctx->comm);
@@ -464,24 +643,17 @@ static void top_sample(struct prof_dev *dev, union perf_event *event, int instan
     void *data = raw->raw.data;
     int size = raw->raw.size;
     struct tp *tp = NULL;
-    struct tp *tmp;
     int field = 0;
     int i;
-    struct top_info info;
-    struct rb_node *rbn;
-    struct top_info *p;
+    unsigned long key;
+    const char *pcomm;
+    struct top_row *row;
 
     evsel = perf_evlist__id_to_evsel(dev->evlist, raw->id, NULL);
-    for_each_real_tp(ctx->tp_list, tmp, i) {
-        if (evsel == tmp->evsel) {
-            tp = tmp;
-            break;
-        } else
-            field += tmp->nr_top;
-    }
-
+    tp = tp_list_evsel_tp(ctx->tp_list, evsel);
     if (unlikely(tp == NULL))
         return;
+    field = ctx->tp_field[tp - ctx->tp_list->tp];
 
     if (dev->env->verbose >= VERBOSE_EVENT) {
         if (dev->print_title) {
@@ -547,38 +719,39 @@ static void top_sample(struct prof_dev *dev, union perf_event *event, int instan
      * commATTR/commATTR       commATTR has the same meaning.
      */
     if (tp->key_prog)
-        info.key = tp_get_key(tp, data, size);
+        key = tp_get_key(tp, data, size);
     else {
-        info.key = raw->tid_entry.tid;
+        key = raw->tid_entry.tid;
         // raw->tid_entry.pid may be -1, when process exits.
-        if (info.key == (u32)-1)
+        if (key == (u32)-1)
             return;
     }
 
     if (ctx->show_comm) {
         if (tp->comm_prog)
-            info.pcomm = tp_get_comm(tp, data, size);
+            pcomm = tp_get_comm(tp, data, size);
         else {
-            // !comm_prog: info.key has PID meaning.
-            tep__update_comm(NULL, (int)info.key);
-            info.pcomm = (void *)tep__pid_to_comm((int)info.key);
+            // !comm_prog: key has PID meaning.
+            tep__update_comm(NULL, (int)key);
+            pcomm = tep__pid_to_comm((int)key);
         }
     } else
-        info.pcomm = NULL;
+        pcomm = NULL;
 
     if (ctx->only_comm)
-        info.key = 0;
+        key = 0;
 
-    rbn = rblist__findnew(&ctx->top_list, &info);
-    if (!rbn)
+    if (unlikely(instance < 0 || instance >= ctx->nr_ins))
+        instance = 0;
+    row = top_table_findnew(ctx, &ctx->tables[instance], key, pcomm);
+    if (!row)
         return;
 
-    p = container_of(rbn, struct top_info, rbnode);
     for (i = 0; i < tp->nr_top; i++, field++) {
         if (!tp->top_add[i].event)
-            p->counter[field] += (unsigned long)tp_prog_run(tp, tp->top_add[i].field_prog, data, size);
+            row->counter[field] += (unsigned long)tp_prog_run(tp, tp->top_add[i].field_prog, data, size);
         else
-            p->counter[field] += 1;
+            row->counter[field] += 1;
     }
 
     ctx->nr_events ++;
@@ -599,7 +772,7 @@ static inline void top_print_title(struct prof_dev *dev)
     int printed;
     int i;
 
-    if (!ctx->altwin && rblist__empty(&ctx->top_list))
+    if (!ctx->altwin && !ctx->merged.nr)
         return;
 
     if (ctx->altwin) altwin_title_begin();
@@ -625,56 +798,39 @@ static inline void top_print_title(struct prof_dev *dev)
 static void top_interval(struct prof_dev *dev)
 {
     struct top_ctx *ctx = dev->private;
-    struct rb_node *rbn;
-    struct top_info *t;
-    struct rblist sorted;
-    struct tmp_entry tmp;
-    int row = 3;
+    struct top_row *t;
+    int k, n, r;
     int i;
 
+    top_merge(ctx);
     top_print_title(dev);
 
-    //pid_list is empty still print header
-    if (rblist__empty(&ctx->top_list))
+    //merged is empty still print header
+    if (!ctx->merged.nr)
         return;
 
-    rblist__init(&sorted);
-    sorted.node_cmp = top_info_sorted_node_cmp;
-    sorted.node_new = top_info_sorted_node_new;
-    sorted.node_delete = ctx->top_list.node_delete;
-    ctx->top_list.node_delete = top_info_node_delete_empty; //empty, not really delete
-
-    /* sort, remove from `ctx->pid_list', add to `sorted'. */
-    tmp.ctx = ctx;
-    do {
-        rbn = rblist__entry(&ctx->top_list, 0);
-        tmp.info = container_of(rbn, struct top_info, rbnode);
-        rblist__remove_node(&ctx->top_list, rbn);
-        rblist__add_node(&sorted, &tmp);
-    } while (!rblist__empty(&ctx->top_list));
-
-    do {
-        rbn = rblist__entry(&sorted, 0);
-
-        if (!ctx->altwin || !dev->tty.row || ++row < dev->tty.row) {
-            t = container_of(rbn, struct top_info, rbnode);
-            if (!ctx->only_comm) {
-                if (t->key < 100000000UL)
-                    printf("%*lu ", ctx->key_len, t->key);
-                else
-                    printf("0x%*lx ", ctx->key_len, t->key);
-            }
-            for (i = 0; i < ctx->nr_fields; i++)
-                printf("%*lu ", ctx->fields[i].len, t->counter[i]);
-            if (ctx->show_comm)
-                printf("%-s", t->pcomm);
-            printf("\n");
+    // The alternate window only shows the rows below the 3 title lines.
+    k = ctx->merged.nr;
+    if (ctx->altwin && dev->tty.row && k > dev->tty.row - 4)
+        k = dev->tty.row - 4;
+
+    n = top_select(ctx, k);
+    for (r = 0; r < n; r++) {
+        t = ctx->heap.data[r];
+        if (!ctx->only_comm) {
+            if (t->key < 100000000UL)
+                printf("%*lu ", ctx->key_len, t->key);
+            else
+                printf("0x%*lx ", ctx->key_len, t->key);
         }
+        for (i = 0; i < ctx->nr_fields; i++)
+            printf("%*lu ", ctx->fields[i].len, t->counter[i]);
+        if (ctx->show_comm)
+            printf("%-s", t->pcomm);
+        printf("\n");
+    }
 
-        rblist__remove_node(&sorted, rbn);
-    } while (!rblist__empty(&sorted));
-
-    ctx->top_list.node_delete = sorted.node_delete;
+    top_table_reset(ctx, &ctx->merged);
 }
 
 static void top_help(struct help_ctx *hctx)
@@ -15,6 +15,7 @@ struct trace_ctx {
     struct callchain_ctx *cc;
     struct flame_graph *flame;
     struct tp_list *tp_list;
+    struct columnar *col;
     time_t time;
     char time_str[32];
 };
@@ -38,6 +39,16 @@ static int monitor_ctx_init(struct prof_dev *dev)
     if (!ctx->tp_list)
         goto failed;
 
+    if (env->columnar) {
+        if (env->callchain || env->flame_graph) {
+            fprintf(stderr, "--columnar cannot be used with -g or --flame-graph\n");
+            goto failed;
+        }
+        ctx->col = columnar_open(env->columnar, ctx->tp_list);
+        if (!ctx->col)
+            goto failed;
+    }
+
     ctx->time = 0;
     ctx->time_str[0] = '\0';
     if (env->callchain || ctx->tp_list->nr_need_stack) {
@@ -56,6 +67,8 @@ static int monitor_ctx_init(struct prof_dev *dev)
     return 0;
 
 failed:
+    if (ctx->tp_list)
+        tp_list_free(ctx->tp_list);
     tep__unref();
     free(ctx);
     return -1;
@@ -73,6 +86,7 @@ static void monitor_ctx_exit(struct prof_dev *dev)
             flame_graph_close(ctx->flame);
         }
     }
+    columnar_close(ctx->col);
     tp_list_free(ctx->tp_list);
     tep__unref();
     free(ctx);
@@ -295,6 +309,13 @@ static void trace_sample(struct prof_dev *dev, union perf_event *event, int inst
     callchain = have_callchain(dev, event, evsel);
     __raw_size(event, &raw, &size, callchain);
 
+    if (ctx->col) {
+        if (tp)
+            columnar_write(ctx->col, tp, data->time, data->tid_entry.pid, data->tid_entry.tid,
+                           data->cpu_entry.cpu, raw, size);
+        return;
+    }
+
     if (dev->print_title) {
         prof_dev_print_time(dev, data->time, stdout);
         tp_print_marker(tp);
@@ -308,6 +329,7 @@ static void trace_sample(struct prof_dev *dev, union perf_event *event, int inst
 static void trace_interval(struct prof_dev *dev)
 {
     struct trace_ctx *ctx = dev->private;
+    columnar_flush(ctx->col);
     if (ctx->flame) {
         ctx->time = time(NULL);
         strftime(ctx->time_str, sizeof(ctx->time_str), "%Y-%m-%d;%H:%M:%S", localtime(&ctx->time));
@@ -351,7 +373,7 @@ static void trace_help(struct help_ctx *hctx)
 }
 
 static const char *trace_desc[] = PROFILER_DESC("trace",
-    "[OPTION...] -e EVENT [--overwrite] [-g [--flame-graph file [-i INT]]]",
+    "[OPTION...] -e EVENT [--overwrite] [-g [--flame-graph file [-i INT]]] [--columnar file]",
     "Trace events and print them directly.",
     "",
     "EXAMPLES",
@@ -360,7 +382,7 @@ static const char *trace_desc[] = PROFILER_DESC("trace",
 static const char *trace_argv[] = PROFILER_ARGV("trace",
     PROFILER_ARGV_OPTION, "inherit",
     PROFILER_ARGV_CALLCHAIN_FILTER,
-    PROFILER_ARGV_PROFILER, "event", "overwrite", "call-graph", "flame-graph", "ptrace");
+    PROFILER_ARGV_PROFILER, "event", "overwrite", "call-graph", "flame-graph", "columnar", "ptrace");
 static profiler trace = {
     .name = "trace",
     .desc = trace_desc,
@@ -10,6 +10,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
 #include <unistd.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -41,6 +42,74 @@
 
 #define MKDEV(ma, mi)   (((ma) << MINORBITS) | (mi))
 
+/*
+ * Address-only search index in Eytzinger (BFS) layout.
+ *
+ * keys[1..nr] hold the sorted symbol addresses laid out as an implicit binary
+ * tree, so the first levels of every lookup share the same few cache lines
+ * and the children of a node sit next to each other. sorted[k] maps a tree
+ * position back to the index in the sorted symbol array, whose name pointers
+ * are only touched once the symbol is found.
+ */
+struct addr_index {
+    unsigned long *keys;
+    int *sorted;
+    int nr;
+};
+
+static int addr_index__fill(struct addr_index *ai, const void *base, size_t stride,
+                            size_t off, int i, int k)
+{
+    if (k <= ai->nr) {
+        i = addr_index__fill(ai, base, stride, off, i, 2 * k);
+        ai->keys[k] = *(const unsigned long *)(base + i * stride + off);
+        ai->sorted[k] = i++;
+        i = addr_index__fill(ai, base, stride, off, i, 2 * k + 1);
+    }
+    return i;
+}
+
+static int addr_index__build(struct addr_index *ai, const void *base, int nr,
+                             size_t stride, size_t off)
+{
+    ai->nr = nr;
+    if (posix_memalign((void **)&ai->keys, 64, (nr + 1) * sizeof(*ai->keys)))
+        ai->keys = NULL;
+    ai->sorted = malloc((nr + 1) * sizeof(*ai->sorted));
+    if (!ai->keys || !ai->sorted) {
+        free(ai->keys);
+        free(ai->sorted);
+        memset(ai, 0, sizeof(*ai));
+        return -1;
+    }
+    addr_index__fill(ai, base, stride, off, 0, 1);
+    return 0;
+}
+
+static void addr_index__free(struct addr_index *ai)
+{
+    free(ai->keys);
+    free(ai->sorted);
+    memset(ai, 0, sizeof(*ai));
+}
+
+/* Return the sorted index of the largest key <= addr, or -1. */
+static inline int addr_index__find(const struct addr_index *ai, unsigned long addr)
+{
+    const unsigned long *keys = ai->keys;
+    int nr = ai->nr;
+    unsigned int k = 1;
+
+    while (k <= nr) {
+        /* 8 keys per cache line, fetch the great-grandchildren early. */
+        __builtin_prefetch(keys + 8 * k);
+        k = 2 * k + (keys[k] <= addr);
+    }
+    /* Undo the right turns: k becomes the first key > addr, 0 if none. */
+    k >>= __builtin_ffs(~k);
+    return k ? ai->sorted[k] - 1 : nr - 1;
+}
+
 struct ksyms {
     struct ksym *syms;
     int syms_sz;
@@ -48,6 +117,7 @@ struct ksyms {
     char *strs;
     int strs_sz;
     int strs_cap;
+    struct addr_index index;
 };
 
 static int ksyms__add_symbol(struct ksyms *ksyms, const char *name, unsigned long addr)
@@ -132,6 +202,9 @@ struct ksyms *ksyms__load(void)
         ksyms->syms[i].name += (unsigned long)ksyms->strs;
 
     qsort(ksyms->syms, ksyms->syms_sz, sizeof(*ksyms->syms), ksym_cmp);
+    if (addr_index__build(&ksyms->index, ksyms->syms, ksyms->syms_sz,
+                          sizeof(*ksyms->syms), offsetof(struct ksym, addr)) < 0)
+        goto err_out;
 
     fclose(f);
     return ksyms;
@@ -147,6 +220,7 @@ void ksyms__free(struct ksyms *ksyms)
     if (!ksyms)
         return;
 
+    addr_index__free(&ksyms->index);
     free(ksyms->syms);
     free(ksyms->strs);
     free(ksyms);
@@ -155,23 +229,9 @@ void ksyms__free(struct ksyms *ksyms)
 const struct ksym *ksyms__map_addr(const struct ksyms *ksyms,
                    unsigned long addr)
 {
-    int start = 0, end = ksyms->syms_sz - 1, mid;
-    unsigned long sym_addr;
-
-    /* find largest sym_addr <= addr using binary search */
-    while (start < end) {
-        mid = start + (end - start + 1) / 2;
-        sym_addr = ksyms->syms[mid].addr;
-
-        if (sym_addr <= addr)
-            start = mid;
-        else
-            end = mid - 1;
-    }
+    int i = addr_index__find(&ksyms->index, addr);
 
-    if (start == end && ksyms->syms[start].addr <= addr)
-        return &ksyms->syms[start];
-    return NULL;
+    return i >= 0 ? &ksyms->syms[i] : NULL;
 }
 
 const struct ksym *ksyms__get_symbol(const struct ksyms *ksyms,
@@ -313,6 +373,8 @@ struct object {
     char *strs;
     int strs_sz;
     int strs_cap;
+
+    struct addr_index index;
 };
 
 struct dso {
@@ -712,6 +774,7 @@ err_out:
 
 static void obj__free_fields(struct object *obj)
 {
+    addr_index__free(&obj->index);
     free(obj->syms);
     free(obj->strs);
     obj->syms_sz = 0;
@@ -963,6 +1026,9 @@ static int obj__load_sym_table_from_elf(struct object *obj, int fd)
         obj->syms[i].name += (unsigned long)obj->strs;
 
     qsort(obj->syms, obj->syms_sz, sizeof(*obj->syms), sym_cmp);
+    if (addr_index__build(&obj->index, obj->syms, obj->syms_sz,
+                          sizeof(*obj->syms), offsetof(struct sym, start)) < 0)
+        goto err_out;
 
     err = 0;
 
@@ -1086,32 +1152,17 @@ static const struct sym *obj__find_name(struct object *obj, const char *name)
 
 static const struct sym *obj__find_offset(struct object *obj, uint64_t offset)
 {
-    unsigned long sym_addr;
-    int start, end, mid;
+    int i;
 
     if (!obj)
         return NULL;
     if (!obj->syms && obj__load_sym_table(obj))
         return NULL;
 
-    start = 0;
-    end = obj->syms_sz - 1;
-
-    /* find largest sym_addr <= addr using binary search */
-    while (start < end) {
-        mid = start + (end - start + 1) / 2;
-        sym_addr = obj->syms[mid].start;
-
-        if (sym_addr <= offset)
-            start = mid;
-        else
-            end = mid - 1;
-    }
-
-    if (start == end &&
-        obj->syms[start].start <= offset &&
-        obj->syms[start].start + obj->syms[start].size >= offset)
-        return &obj->syms[start];
+    i = addr_index__find(&obj->index, offset);
+    if (i >= 0 &&
+        obj->syms[i].start + obj->syms[i].size >= offset)
+        return &obj->syms[i];
     return NULL;
 }
 
@@ -1125,6 +1176,33 @@ const char *dso__name(struct dso *dso)
     return dso ? (dso->obj->name_atmnt ? : dso->obj->name) : NULL;
 }
 
+struct object *dso__object(struct dso *dso)
+{
+    return dso ? dso->obj : NULL;
+}
+
+struct object *object__get(struct object *obj)
+{
+    if (obj)
+        refcount_inc(&obj->refcnt);
+    return obj;
+}
+
+void object__put(struct object *obj)
+{
+    obj__put(obj);
+}
+
+const struct sym *object__find_sym(struct object *obj, uint64_t offset)
+{
+    return obj__find_offset(obj, offset);
+}
+
+const char *object__name(struct object *obj)
+{
+    return obj ? (obj->name_atmnt ? : obj->name) : NULL;
+}
+
 static struct syms *__syms__load_file(FILE *f, char *line, int size, pid_t tgid)
 {
     char buf[PATH_MAX], perm[5];
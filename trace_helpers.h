@@ -38,6 +38,16 @@ struct dso *syms__find_dso(const struct syms *syms, unsigned long addr,
 				  uint64_t *offset);
 const struct sym *dso__find_sym(struct dso *dso, uint64_t offset);
 const char *dso__name(struct dso *dso);
+/*
+ * The object backing a dso outlives the process once referenced, so
+ * symbols can still be resolved after syms__free().
+ */
+struct object;
+struct object *dso__object(struct dso *dso);
+struct object *object__get(struct object *obj);
+void object__put(struct object *obj);
+const struct sym *object__find_sym(struct object *obj, uint64_t offset);
+const char *object__name(struct object *obj);
 void syms__convert(FILE *fin, FILE *fout, char *binpath);
 unsigned long syms__file_offset(const char *binpath, const char *func);
 
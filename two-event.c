@@ -234,8 +234,79 @@ struct delay_class {
     int max_len2;
     struct latency_dist *lat_dist;
     bool global_comm;
+    int nr_windows;
+    int windows[4]; // --window N,...
 };
 
+/*
+ * --window N,...: keep the last max(N) intervals of each node, and print
+ * the p99 over the last N intervals as extra columns.
+ */
+#define DELAY_WINDOW_MAX 4096
+
+static struct latency_dist *delay_class_lat_dist(struct delay_class *delay_class, struct two_event_options *options,
+                                                 bool quantile, int extra_size)
+{
+    struct latency_dist *lat_dist;
+    char *s = options->window, *end;
+    int max = 0;
+    long n;
+
+    while (s) {
+        n = strtol(s, &end, 10);
+        if (end == s || (*end && *end != ',') || n <= 0 || n > DELAY_WINDOW_MAX ||
+            delay_class->nr_windows == ARRAY_SIZE(delay_class->windows)) {
+            fprintf(stderr, "--window %s: expect at most %d intervals, each in 1..%d\n",
+                    options->window, (int)ARRAY_SIZE(delay_class->windows), DELAY_WINDOW_MAX);
+            return NULL;
+        }
+        delay_class->windows[delay_class->nr_windows++] = n;
+        if (n > max) max = n;
+        s = *end == ',' ? end + 1 : NULL;
+    }
+
+    if (delay_class->nr_windows || options->hdr)
+        lat_dist = latency_dist_new_hdr(options->perins, true, extra_size);
+    else if (quantile)
+        lat_dist = latency_dist_new_quantile(options->perins, true, extra_size);
+    else
+        lat_dist = latency_dist_new(options->perins, true, extra_size);
+
+    if (lat_dist && max && latency_dist_set_window(lat_dist, max) < 0) {
+        latency_dist_free(lat_dist);
+        return NULL;
+    }
+    return lat_dist;
+}
+
+static void delay_print_window_header(struct delay_class *delay_class, bool tsc)
+{
+    char buf[32];
+    int i;
+
+    for (i = 0; i < delay_class->nr_windows; i++) {
+        snprintf(buf, sizeof(buf), "p99@%d(%s)", delay_class->windows[i], tsc ? "kcyc" : "us");
+        printf(" %12s", buf);
+    }
+}
+
+static void delay_print_window_line(struct delay_class *delay_class)
+{
+    int i;
+
+    for (i = 0; i < delay_class->nr_windows; i++)
+        printf(" ------------");
+}
+
+static void delay_print_window(struct delay_class *delay_class, struct latency_node *node)
+{
+    int i;
+
+    for (i = 0; i < delay_class->nr_windows; i++)
+        printf(" %12.3f", latency_node_window_quantile(delay_class->lat_dist, node,
+                                                       delay_class->windows[i], 0.99)/1000.0);
+}
+
 static struct two_event *delay_new(struct two_event_class *class, struct tp *tp1, struct tp *tp2)
 {
     struct two_event *two = two_event_new(class, tp1, tp2);
@@ -537,9 +608,9 @@ static void delay_print_node(void *opaque, struct latency_node *node)
     struct delay_class *delay_class = opaque;
     struct two_event_options *opts = &delay_class->base.opts;
     struct two_event *two = two_event_find_byid(&delay_class->base, node->key);
-    double p50 = tdigest_quantile(node->td, 0.50);
-    double p95 = tdigest_quantile(node->td, 0.95);
-    double p99 = tdigest_quantile(node->td, 0.99);
+    double p50 = latency_node_quantile(node, 0.50);
+    double p95 = latency_node_quantile(node, 0.95);
+    double p99 = latency_node_quantile(node, 0.99);
     bool than = !!opts->greater_than;
 
     if (opts->perins) {
@@ -552,6 +623,7 @@ static void delay_print_node(void *opaque, struct latency_node *node)
     printf(" => %-*s", delay_class->max_len2, two->tp2->alias ?: two->tp2->name);
     printf(" %8lu %16.3f %12.3f %12.3f %12.3f %12.3f %12.3f",
         node->n, node->sum/1000.0, node->min/1000.0, p50/1000.0, p95/1000.0, p99/1000.0, node->max/1000.0);
+    delay_print_window(delay_class, node);
     if (than)
         if (node->than && isatty(1))
             printf(" \033[31;1m%6lu (%3lu%s)\033[0m\n", node->than, node->than * 100 / (node->n ? : 1), "%");
@@ -573,11 +645,12 @@ static int delay_print_header(struct two_event *two)
         opts = &two->class->opts;
         than = !!opts->greater_than;
 
-        if (latency_dist_empty(delay_class->lat_dist))
-            return 1;
-        if (opts->only_print_greater_than &&
-            !latency_dist_greater_than(delay_class->lat_dist, opts->greater_than))
+        if (latency_dist_empty(delay_class->lat_dist) ||
+            (opts->only_print_greater_than &&
+             !latency_dist_greater_than(delay_class->lat_dist, opts->greater_than))) {
+            latency_dist_window_skip(delay_class->lat_dist);
             return 1;
+        }
 
         print_time(stdout);
         printf("\n");
@@ -595,6 +668,7 @@ static int delay_print_header(struct two_event *two)
         else
             printf(" %8s %16s %12s %12s %12s %12s %12s", "calls", "total(kcyc)", "min(kcyc)", "p50(kcyc)",
                     "p95(kcyc)", "p99(kcyc)", "max(kcyc)");
+        delay_print_window_header(delay_class, opts->env->tsc);
 
         if (than)
             printf("    than(reqs)\n");
@@ -615,6 +689,7 @@ static int delay_print_header(struct two_event *two)
         printf(" %8s %16s %12s %12s %12s %12s %12s",
                         "--------", "----------------", "------------", "------------", "------------",
                         "------------", "------------");
+        delay_print_window_line(delay_class);
         if (than)
             printf(" --------------\n");
         else
@@ -650,7 +725,11 @@ static struct two_event_class *delay_class_new(struct two_event_impl *impl, stru
         delay_class = container_of(class, struct delay_class, base);
         delay_class->max_len1 = 5; // 5 is strlen("start")
         delay_class->max_len2 = 3; // 5 is strlen("end")
-        delay_class->lat_dist = latency_dist_new_quantile(options->perins, true, 0);
+        delay_class->lat_dist = delay_class_lat_dist(delay_class, options, true, 0);
+        if (!delay_class->lat_dist) {
+            two_event_class_delete(class);
+            return NULL;
+        }
         delay_class->global_comm = global_comm_ref() == 0;
     }
     return class;
@@ -845,6 +924,7 @@ static void syscalls_print_node(void *opaque, struct latency_node *node)
         printf("%-20lu", node->key);
     printf(" %8lu %16.3f %12.3f %12.3f %12.3f %6lu",
         node->n, node->sum/1000.0, node->min/1000.0, node->sum/node->n/1000.0, node->max/1000.0, node->extra[0]);
+    delay_print_window(delay_class, node);
     if (than)
         if (node->than && isatty(1))
             printf(" \033[31;1m%6lu (%3lu%s)\033[0m\n", node->than, node->than * 100 / (node->n ? : 1), "%");
@@ -866,8 +946,10 @@ static int syscalls_print_header(struct two_event *two)
         opts = &two->class->opts;
         than = !!opts->greater_than;
 
-        if (latency_dist_empty(delay_class->lat_dist))
+        if (latency_dist_empty(delay_class->lat_dist)) {
+            latency_dist_window_skip(delay_class->lat_dist);
             return 1;
+        }
 
         print_time(stdout);
         printf("\n");
@@ -883,6 +965,7 @@ static int syscalls_print_header(struct two_event *two)
             printf(" %8s %16s %12s %12s %12s %6s", "calls", "total(us)", "min(us)", "avg(us)", "max(us)", "err");
         else
             printf(" %8s %16s %12s %12s %12s %6s", "calls", "total(kcyc)", "min(kcyc)", "avg(kcyc)", "max(kcyc)", "err");
+        delay_print_window_header(delay_class, opts->env->tsc);
 
         if (than)
             printf("   than(reqs)\n");
@@ -899,6 +982,7 @@ static int syscalls_print_header(struct two_event *two)
         for (i=0; i<20; i++) printf("-");
         printf(" %8s %16s %12s %12s %12s %6s",
                         "--------", "----------------", "------------", "------------", "------------", "------");
+        delay_print_window_line(delay_class);
         if (than)
             printf(" --------------\n");
         else
@@ -926,7 +1010,11 @@ static struct two_event_class *syscalls_class_new(struct two_event_impl *impl, s
         class->print = delay_print;
 
         delay_class = container_of(class, struct delay_class, base);
-        delay_class->lat_dist = latency_dist_new(options->perins, true, sizeof(u64));
+        delay_class->lat_dist = delay_class_lat_dist(delay_class, options, false, sizeof(u64));
+        if (!delay_class->lat_dist) {
+            two_event_class_delete(class);
+            return NULL;
+        }
         delay_class->global_comm = global_comm_ref() == 0;
     }
     return class;
@@ -1680,9 +1768,9 @@ static void call_delay_iterator(struct caller_iterator *iter, struct two_event *
     printf("%-*s %s", flen-len, two->tp1->alias ?: two->tp1->name, caller->recursive ? "R" : " ");
 
     if (node) {
-        p50 = tdigest_quantile(node->td, 0.50);
-        p95 = tdigest_quantile(node->td, 0.95);
-        p99 = tdigest_quantile(node->td, 0.99);
+        p50 = latency_node_quantile(node, 0.50);
+        p95 = latency_node_quantile(node, 0.95);
+        p99 = latency_node_quantile(node, 0.99);
         printf(" %8lu %16.3f %12.3f %12.3f %12.3f %12.3f %12.3f\n",
             node->n, node->sum/1000.0, node->min/1000.0, p50/1000.0, p95/1000.0, p99/1000.0, node->max/1000.0);
     } else
@@ -1721,6 +1809,10 @@ static struct two_event_class *call_delay_class_new(struct two_event_impl *impl,
         **/
         class->opts.perins = false;
         call_delay_class->delay_class = delay_impl.class_new(&delay_impl, &class->opts);
+        if (!call_delay_class->delay_class) {
+            two_event_class_delete(class);
+            return NULL;
+        }
     }
     return class;
 }
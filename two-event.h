@@ -22,6 +22,7 @@ struct two_event_options {
     const char *keyname;
     int keylen;
     bool perins;
+    bool hdr;
     bool comm;
     bool rundelay;
     bool only_print_greater_than;
@@ -29,6 +30,7 @@ struct two_event_options {
     unsigned long lower_than;
     unsigned long hide_than; // hide<1ms
     char *heatmap;
+    char *window; // N,...: p99 over the last N intervals
     unsigned int first_n;
     bool sort_print;
     struct env *env;